@@ -279,6 +279,212 @@ decrypt_AES_CBC(const string &ctext, const AES_KEY * deckey, string salt, bool d
     }
 }
 
+static size_t
+unpad_len(const uint8_t *data, size_t len)
+{
+    const size_t pad_count = data[len-1];
+    if (false == ((pad_count > 0) && (pad_count <= AES_BLOCK_BYTES))) {
+        throw CryptoError("AES padding is wrong size!");
+    }
+    return len - pad_count;
+}
+
+/*
+ * The checks below avoid throw_c(), whose message argument would cost
+ * a string per call on the allocation-free paths.
+ */
+static void
+check_ctext_len(size_t len)
+{
+    if (false == ((len > 0) && ((len % AES_BLOCK_BYTES) == 0))) {
+        throw CryptoError("AES ciphertext is the wrong size!");
+    }
+}
+
+// getIVec() without the vector
+static void
+fill_ivec(const string &salt, uint8_t *ivec)
+{
+    memset(ivec, 0, AES_BLOCK_BYTES);
+    memcpy(ivec, salt.data(), min(salt.length(), (size_t) AES_BLOCK_BYTES));
+}
+
+/*
+ * Swaps the blocks of buf end for end, which is what reverse() does
+ * with a copy.  len is a multiple of AES_BLOCK_BYTES.
+ */
+static void
+reverse_blocks(uint8_t *buf, size_t len)
+{
+    const size_t noBlocks = len / AES_BLOCK_BYTES;
+    uint8_t tmp[AES_BLOCK_BYTES];
+    for (size_t i = 0; i < noBlocks / 2; i++) {
+        uint8_t *const a = buf + i * AES_BLOCK_BYTES;
+        uint8_t *const b = buf + (noBlocks-i-1) * AES_BLOCK_BYTES;
+        memcpy(tmp, a, AES_BLOCK_BYTES);
+        memcpy(a, b, AES_BLOCK_BYTES);
+        memcpy(b, tmp, AES_BLOCK_BYTES);
+    }
+}
+
+size_t
+decrypt_AES_CBC(const uint8_t *ctext, size_t len, const AES &key,
+                const uint8_t *iv, bool dounpad, uint8_t *out)
+{
+    check_ctext_len(len);
+    key.cbc_decrypt(iv, ctext, out, len / AES_BLOCK_BYTES);
+
+    return dounpad ? unpad_len(out, len) : len;
+}
+
+size_t
+decrypt_AES_CMC(const uint8_t *ctext, size_t len, const AES &key,
+                bool dopad, uint8_t *out)
+{
+    // the IV of both passes is getIVec("0")
+    const uint8_t iv[AES_BLOCK_BYTES] = { '0' };
+
+    decrypt_AES_CBC(ctext, len, key, iv, false, out);
+    reverse_blocks(out, len);
+    return decrypt_AES_CBC(out, len, key, iv, dopad, out);
+}
+
+// the padding of pad(): zeros, then the padding length
+static void
+append_padding(string *buf)
+{
+    const size_t padding = AES_BLOCK_BYTES - buf->size() % AES_BLOCK_BYTES;
+    buf->append(padding - 1, '\0');
+    buf->push_back((char) padding);
+}
+
+string
+encrypt_AES_CBC(const string &ptext, const AES &key, const string &salt,
+                bool dopad)
+{
+    throw_c(dopad || ((ptext.size() % AES_BLOCK_BYTES) == 0));
+
+    string buf(ptext);
+    if (dopad) {
+        append_padding(&buf);
+    }
+
+    uint8_t ivec[AES_BLOCK_BYTES];
+    fill_ivec(salt, ivec);
+    key.cbc_encrypt(ivec, buf.data(), &buf[0], buf.size() / AES_BLOCK_BYTES);
+    return buf;
+}
+
+string
+decrypt_AES_CBC(const string &ctext, const AES &key, const string &salt,
+                bool dounpad)
+{
+    uint8_t ivec[AES_BLOCK_BYTES];
+    fill_ivec(salt, ivec);
+
+    string buf(ctext);
+    buf.resize(decrypt_AES_CBC((const uint8_t *) ctext.data(), ctext.size(),
+                               key, ivec, dounpad, (uint8_t *) &buf[0]));
+    return buf;
+}
+
+string
+encrypt_AES_CMC(const string &ptext, const AES &key, bool dopad)
+{
+    const uint8_t iv[AES_BLOCK_BYTES] = { '0' };
+
+    string buf = encrypt_AES_CBC(ptext, key, "0", dopad);
+    reverse_blocks((uint8_t *) &buf[0], buf.size());
+    key.cbc_encrypt(iv, buf.data(), &buf[0], buf.size() / AES_BLOCK_BYTES);
+    return buf;
+}
+
+// encrypts every buf[i] in place under ivs[i]
+static void
+cbc_encrypt_column(vector<string> *bufs, const AES &key,
+                   const vector<const uint8_t *> &ivs)
+{
+    const size_t n = bufs->size();
+    vector<uint8_t *> data(n);
+    vector<size_t> nblocks(n);
+    for (size_t i = 0; i < n; i++) {
+        string &buf = (*bufs)[i];
+        data[i] = (uint8_t *) &buf[0];
+        nblocks[i] = buf.size() / AES_BLOCK_BYTES;
+    }
+
+    key.cbc_encrypt_batch(n, &ivs[0], &data[0], &data[0], &nblocks[0]);
+}
+
+// copies sized for their padding up front
+static vector<string>
+padded_copies(const vector<string> &ptexts, bool dopad)
+{
+    vector<string> bufs(ptexts.size());
+    for (size_t i = 0; i < ptexts.size(); i++) {
+        const string &ptext = ptexts[i];
+        throw_c(dopad || ((ptext.size() % AES_BLOCK_BYTES) == 0));
+
+        bufs[i].reserve(ptext.size() + AES_BLOCK_BYTES);
+        bufs[i].assign(ptext);
+        if (dopad) {
+            append_padding(&bufs[i]);
+        }
+    }
+    return bufs;
+}
+
+vector<string>
+encrypt_AES_CBC_batch(const vector<string> &ptexts, const AES &key,
+                      const vector<string> &salts, bool dopad)
+{
+    throw_c(ptexts.size() == salts.size());
+    if (ptexts.empty()) {
+        return vector<string>();
+    }
+
+    vector<string> bufs = padded_copies(ptexts, dopad);
+    vector<uint8_t> ivecs(ptexts.size() * AES_BLOCK_BYTES);
+    vector<const uint8_t *> ivs(ptexts.size());
+    for (size_t i = 0; i < bufs.size(); i++) {
+        fill_ivec(salts[i], &ivecs[i * AES_BLOCK_BYTES]);
+        ivs[i] = &ivecs[i * AES_BLOCK_BYTES];
+    }
+
+    cbc_encrypt_column(&bufs, key, ivs);
+    return bufs;
+}
+
+vector<string>
+encrypt_AES_CMC_batch(const vector<string> &ptexts, const AES &key,
+                      bool dopad)
+{
+    if (ptexts.empty()) {
+        return vector<string>();
+    }
+
+    // both passes of every value use getIVec("0")
+    const uint8_t iv[AES_BLOCK_BYTES] = { '0' };
+    const vector<const uint8_t *> ivs(ptexts.size(), iv);
+
+    vector<string> bufs = padded_copies(ptexts, dopad);
+    cbc_encrypt_column(&bufs, key, ivs);
+    for (auto &buf : bufs) {
+        reverse_blocks((uint8_t *) &buf[0], buf.size());
+    }
+    cbc_encrypt_column(&bufs, key, ivs);
+    return bufs;
+}
+
+string
+decrypt_AES_CMC(const string &ctext, const AES &key, bool dopad)
+{
+    string buf(ctext);
+    buf.resize(decrypt_AES_CMC((const uint8_t *) ctext.data(), ctext.size(),
+                               key, dopad, (uint8_t *) &buf[0]));
+    return buf;
+}
+
 //TODO: have some helpers that only manipulate unsigned char * and convert in string at the end
 
 static string
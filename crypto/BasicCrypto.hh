@@ -16,6 +16,7 @@
 #include <openssl/evp.h>
 #include <openssl/rsa.h>
 #include <crypto/prng.hh>
+#include <crypto/aes.hh>
 
 #include <util/onions.hh>
 
@@ -66,6 +67,54 @@ encrypt_AES_CMC(const std::string &ptext, const AES_KEY * enckey, bool dopad = t
 std::string
 decrypt_AES_CMC(const std::string &ctext, const AES_KEY * deckey, bool dopad = true);
 
+/*
+ * The same modes over the AES class, whose backend runs the independent
+ * blocks of CBC decryption (both passes of CMC decryption) together.
+ * Ciphertexts are identical to those of the AES_KEY forms.
+ */
+std::string
+encrypt_AES_CBC(const std::string &ptext, const AES &key,
+                const std::string &salt, bool pad = true);
+
+std::string
+decrypt_AES_CBC(const std::string &ctext, const AES &key,
+                const std::string &salt, bool pad = true);
+
+std::string
+encrypt_AES_CMC(const std::string &ptext, const AES &key, bool dopad = true);
+
+std::string
+decrypt_AES_CMC(const std::string &ctext, const AES &key, bool dopad = true);
+
+/*
+ * Column forms: element i is the string form's result for ptexts[i]
+ * (and salts[i]).  The serial CBC chains of different values go through
+ * AES::cbc_encrypt_batch together.
+ */
+std::vector<std::string>
+encrypt_AES_CBC_batch(const std::vector<std::string> &ptexts, const AES &key,
+                      const std::vector<std::string> &salts,
+                      bool pad = true);
+
+std::vector<std::string>
+encrypt_AES_CMC_batch(const std::vector<std::string> &ptexts, const AES &key,
+                      bool dopad = true);
+
+/*
+ * Buffer forms of the decryptions for callers that cannot afford
+ * temporaries (the UDFs): decrypt the len bytes at ctext into out, which
+ * holds at least len bytes and may be ctext itself, and return the
+ * plaintext length.  iv is the AES_BLOCK_BYTES IV that the string forms
+ * derive from their salt.
+ */
+size_t
+decrypt_AES_CBC(const uint8_t *ctext, size_t len, const AES &key,
+                const uint8_t *iv, bool dounpad, uint8_t *out);
+
+size_t
+decrypt_AES_CMC(const uint8_t *ctext, size_t len, const AES &key,
+                bool dopad, uint8_t *out);
+
 
 //**** Public Key Cryptosystem (PKCS) *****//
 
@@ -7,6 +7,10 @@
 
 #include <iostream>
 #include <fstream>
+#include <map>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <crypto/SWPSearch.hh>
 #include <util/util.hh>
@@ -199,26 +203,36 @@ SWP::SWPencrypt(const string & key, string word, unsigned int index)
 {
 
     if (DEBUG) {cerr << "encrypting " << word << "\n "; }
-    string ciph, wordKey;
+    Token t;
 
-    SWPHalfEncrypt(key, word, ciph, wordKey);
+    SWPHalfEncrypt(key, word, t.ciph, t.wordKey);
 
-    //S_i
-    string salt;
+    return SWPencrypt(t, SWPsalt(key, index));
+}
+
+//S_i
+string
+SWP::SWPsalt(const string & key, unsigned int index)
+{
     if (SWP::canDecrypt) {
-        salt = PRP(key, strFromVal(index));
-        salt = salt.substr(salt.length() - SWPr, SWPr);
+        const string salt = PRP(key, strFromVal(index));
+        return salt.substr(salt.length() - SWPr, SWPr);
     } else {
-        salt = random(SWPr);
+        return random(SWPr);
     }
+}
+
+string
+SWP::SWPencrypt(const Token & t, const string & salt)
+{
     //F_{k_i} (S_i)
-    string func = PRP(wordKey, salt);
+    string func = PRP(t.wordKey, salt);
 
     if (SWP::canDecrypt) {
         func = func.substr(SWPr, SWPm);
     }
 
-    return bytewise_xor(ciph, salt + func);
+    return bytewise_xor(t.ciph, salt + func);
 
 }
 
@@ -282,6 +296,47 @@ SWP::encrypt(const string & key, const list<string> & words)
     return result;
 }
 
+vector<list<string> >
+SWP::encryptBatch(const string & key, const vector<list<string> > & texts)
+{
+    map<string, Token> tokens;
+    vector<string> salts;
+
+    vector<list<string> > result(texts.size());
+    for (size_t i = 0; i < texts.size(); i++) {
+        unsigned int index = 0;
+        for (const string &word : texts[i]) {
+            index++;
+
+            throw_c(word.length() < SWPCiphSize, string(
+                         " given word ") + word +
+                     " is longer than SWPCiphSize");
+
+            auto it = tokens.find(word);
+            if (tokens.end() == it) {
+                it = tokens.insert(make_pair(word, Token())).first;
+                SWPHalfEncrypt(key, word, it->second.ciph,
+                               it->second.wordKey);
+            }
+
+            // random salts cannot be shared
+            string salt;
+            if (SWP::canDecrypt) {
+                while (salts.size() < index) {
+                    salts.push_back(SWPsalt(key, salts.size() + 1));
+                }
+                salt = salts[index - 1];
+            } else {
+                salt = SWPsalt(key, index);
+            }
+
+            result[i].push_back(SWPencrypt(it->second, salt));
+        }
+    }
+
+    return result;
+}
+
 string
 SWP::SWPdecrypt(const string & key, const string & word, unsigned int index)
 {
@@ -363,3 +418,107 @@ SWP::searchExists(const Token & token, const list<string> & ciphs)
     return false;
 }
 
+
+/*
+ * SWPsearch() unrolled for SWPCiphSize == AES_BLOCK_SIZE: with
+ * x = ciph ^ E[W], a word matches iff the SWPm bytes at offset SWPr of
+ * AES_{wordKey}(pad(x[0..SWPr)) ^ wordKey) equal x[SWPr..SWPCiphSize),
+ * PRP() being one CBC block whose IV is the key itself.
+ */
+static_assert(SWPCiphSize == AES_BLOCK_SIZE,
+              "SWPMatcher needs one AES block per word");
+
+SWPMatcher::SWPMatcher(const Token &token)
+    : ctx(NULL)
+{
+    throw_c(token.ciph.length() == SWPCiphSize,
+            "token ciphertext has incorrect length");
+    throw_c(token.wordKey.length() == AES_BLOCK_SIZE,
+            "token word key has incorrect length");
+
+    memcpy(tciph, token.ciph.data(), SWPCiphSize);
+
+    // pad() of an SWPr-byte salt appends 1 and zeros
+    memcpy(kpad, token.wordKey.data(), AES_BLOCK_SIZE);
+    kpad[SWPr] ^= 1;
+
+    ctx = EVP_CIPHER_CTX_new();
+    throw_c(ctx != NULL, "cannot allocate cipher context");
+    if (1 != EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), NULL,
+                                (const uint8_t *) token.wordKey.data(),
+                                NULL)) {
+        EVP_CIPHER_CTX_free(ctx);
+        throw_c(false, "cannot set up word key");
+    }
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+}
+
+SWPMatcher::~SWPMatcher()
+{
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+bool
+SWPMatcher::exists(const uint8_t *ciphs, size_t len)
+{
+    // no throw_c(): its message would cost a string per row
+    if (len % SWPCiphSize != 0)
+        throw CryptoError("SWP ciphertext has invalid length");
+
+    uint8_t x[batch * SWPCiphSize];
+    uint8_t in[batch * AES_BLOCK_SIZE];
+    uint8_t out[batch * AES_BLOCK_SIZE];
+
+    const size_t nwords = len / SWPCiphSize;
+    for (size_t w = 0; w < nwords; w += batch) {
+        const unsigned int n = std::min<size_t>(batch, nwords - w);
+        const uint8_t *const c = ciphs + w * SWPCiphSize;
+
+#ifdef __SSE2__
+        const __m128i t = _mm_loadu_si128((const __m128i *) tciph);
+        const __m128i k = _mm_loadu_si128((const __m128i *) kpad);
+        const __m128i lo = _mm_srli_si128(_mm_set1_epi8(-1), SWPm);
+        for (unsigned int i = 0; i < n; i++) {
+            const __m128i xi = _mm_xor_si128(
+                _mm_loadu_si128((const __m128i *) (c + i * SWPCiphSize)), t);
+            _mm_storeu_si128((__m128i *) (x + i * SWPCiphSize), xi);
+            _mm_storeu_si128((__m128i *) (in + i * AES_BLOCK_SIZE),
+                             _mm_xor_si128(_mm_and_si128(xi, lo), k));
+        }
+#else
+        for (unsigned int i = 0; i < n; i++) {
+            uint8_t *const xi = x + i * SWPCiphSize;
+            uint8_t *const ii = in + i * AES_BLOCK_SIZE;
+            for (unsigned int j = 0; j < SWPCiphSize; j++) {
+                xi[j] = c[i * SWPCiphSize + j] ^ tciph[j];
+                ii[j] = (j < SWPr ? xi[j] : 0) ^ kpad[j];
+            }
+        }
+#endif
+
+        int outl;
+        if (1 != EVP_EncryptUpdate(ctx, out, &outl, in, n * AES_BLOCK_SIZE)
+            || outl != (int) (n * AES_BLOCK_SIZE))
+            throw CryptoError("SWP word PRP failed");
+
+#ifdef __SSE2__
+        // the check field is the top SWPm bytes of each block
+        const int want = ((1 << SWPm) - 1) << SWPr;
+        for (unsigned int i = 0; i < n; i++) {
+            const __m128i eq = _mm_cmpeq_epi8(
+                _mm_loadu_si128((const __m128i *) (out + i * AES_BLOCK_SIZE)),
+                _mm_loadu_si128((const __m128i *) (x + i * SWPCiphSize)));
+            if ((_mm_movemask_epi8(eq) & want) == want)
+                return true;
+        }
+#else
+        for (unsigned int i = 0; i < n; i++) {
+            if (0 == memcmp(out + i * AES_BLOCK_SIZE + SWPr,
+                            x + i * SWPCiphSize + SWPr, SWPm))
+                return true;
+        }
+#endif
+    }
+
+    return false;
+}
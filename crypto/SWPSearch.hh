@@ -19,8 +19,12 @@
  */
 
 #include <openssl/aes.h>
+#include <openssl/evp.h>
 #include <openssl/rand.h>
 #include <list>
+#include <string>
+#include <vector>
+#include <stdint.h>
 
 
 // for all following constants unit is bytes
@@ -49,6 +53,15 @@ class SWP {
     static std::list<std::string> * encrypt(const std::string & key,
                                   const std::list<std::string> & words);
 
+    /*
+     * encrypt() of many word lists under one key.  The deterministic
+     * half of each distinct word, and the salt of each index, are
+     * computed once for the whole batch.
+     */
+    static std::vector<std::list<std::string> >
+        encryptBatch(const std::string & key,
+                     const std::vector<std::list<std::string> > & texts);
+
     /*
      * Decrypts each word in the list ciphs.
      *
@@ -110,6 +123,8 @@ class SWP {
 
     static std::string SWPencrypt(const std::string & key, std::string word,
                              unsigned int index);
+    static std::string SWPencrypt(const Token & t, const std::string & salt);
+    static std::string SWPsalt(const std::string & key, unsigned int index);
     static std::string SWPdecrypt(const std::string & key, const std::string & word,
                              unsigned int index);
 
@@ -119,3 +134,29 @@ class SWP {
                                std::string & wordKey);
 
 };
+
+/*
+ * Tests SWP ciphertexts against one token in place: the words of a
+ * field are read straight out of the concatenated ciphertext, and the
+ * per-word PRP is computed a batch of words at a time with one EVP call
+ * (which uses AES-NI where the CPU has it).  Matches SWP::searchExists
+ * for the canDecrypt layout.
+ */
+class SWPMatcher {
+ public:
+    explicit SWPMatcher(const Token &token);
+    ~SWPMatcher();
+
+    // len must be a multiple of SWPCiphSize
+    bool exists(const uint8_t *ciphs, size_t len);
+
+ private:
+    SWPMatcher(const SWPMatcher &other);
+    SWPMatcher &operator=(const SWPMatcher &rhs);
+
+    static const unsigned int batch = 16;   /* words per EVP call */
+
+    uint8_t tciph[SWPCiphSize];     /* E[W] of the token */
+    uint8_t kpad[AES_BLOCK_SIZE];   /* PRP padding ^ PRP IV */
+    EVP_CIPHER_CTX *ctx;            /* ECB under the token's word key */
+};
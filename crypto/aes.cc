@@ -0,0 +1,424 @@
+#include <algorithm>
+#include <stdlib.h>
+#include <crypto/aes.hh>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#define HAVE_AESNI 1
+#define AESNI_FN __attribute__((target("aes,sse2")))
+#endif
+
+using namespace std;
+
+// blocks in flight at once; AES-NI has a latency of several rounds
+static const size_t lanes = 8;
+
+/*
+ * The per-lane loops must be unrolled for the lanes to live in
+ * registers, which -O2 alone does not do.
+ */
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 8
+#define FOR_LANES(j) _Pragma("GCC unroll 8") for (size_t j = 0; j < lanes; j++)
+#else
+#define FOR_LANES(j) for (size_t j = 0; j < lanes; j++)
+#endif
+
+#ifdef HAVE_AESNI
+
+static AESNI_FN uint32_t
+ni_subword(uint32_t w)
+{
+    // aeskeygenassist puts SubWord of dword 1 in dword 0
+    const __m128i x = _mm_aeskeygenassist_si128(_mm_set_epi32(0, 0, w, 0), 0);
+    return _mm_cvtsi128_si32(x);
+}
+
+/*
+ * FIPS-197 key expansion, with the S-box lookups done by the CPU.
+ * Words are little-endian, so byte 0 of a word is its low byte.
+ */
+static AESNI_FN void
+ni_expand(const uint8_t *key, size_t keylen, unsigned int rounds,
+          uint8_t (*enc)[16], uint8_t (*dec)[16])
+{
+    const size_t nk = keylen / 4;
+    const size_t nw = 4 * (rounds + 1);
+    uint32_t w[4 * 15];
+
+    memcpy(w, key, keylen);
+    uint32_t rcon = 1;
+    for (size_t i = nk; i < nw; i++) {
+        uint32_t t = w[i - 1];
+        if (i % nk == 0) {
+            t = ni_subword((t >> 8) | (t << 24)) ^ rcon;
+            rcon = ((rcon << 1) ^ ((rcon & 0x80) ? 0x1b : 0)) & 0xff;
+        } else if (nk > 6 && i % nk == 4) {
+            t = ni_subword(t);
+        }
+        w[i] = w[i - nk] ^ t;
+    }
+    memcpy(enc, w, nw * 4);
+
+    // the equivalent inverse cipher runs the schedule backwards
+    memcpy(dec[0], enc[rounds], 16);
+    for (unsigned int r = 1; r < rounds; r++)
+        _mm_storeu_si128((__m128i *) dec[r],
+                         _mm_aesimc_si128(
+                             _mm_loadu_si128((const __m128i *) enc[rounds - r])));
+    memcpy(dec[rounds], enc[0], 16);
+}
+
+static AESNI_FN void
+ni_load_keys(const uint8_t (*rk)[16], unsigned int rounds, __m128i *k)
+{
+    for (unsigned int r = 0; r <= rounds; r++)
+        k[r] = _mm_loadu_si128((const __m128i *) rk[r]);
+}
+
+/*
+ * The batch functions always run `lanes` blocks through the rounds,
+ * whether or not the last chunk fills them, so the compiler can keep
+ * the whole chunk in registers.
+ */
+static AESNI_FN void
+ni_encrypt(const uint8_t (*rk)[16], unsigned int rounds,
+           const uint8_t *in, uint8_t *out, size_t n)
+{
+    __m128i k[15];
+    ni_load_keys(rk, rounds, k);
+
+    for (size_t i = 0; i < n; i += lanes) {
+        const size_t m = min(lanes, n - i);
+        __m128i b[lanes];
+
+        FOR_LANES(j)
+            b[j] = j < m ? _mm_loadu_si128((const __m128i *) (in + 16 * (i + j)))
+                         : _mm_setzero_si128();
+        FOR_LANES(j)
+            b[j] = _mm_xor_si128(b[j], k[0]);
+        for (unsigned int r = 1; r < rounds; r++)
+            FOR_LANES(j)
+                b[j] = _mm_aesenc_si128(b[j], k[r]);
+        FOR_LANES(j)
+            b[j] = _mm_aesenclast_si128(b[j], k[rounds]);
+        for (size_t j = 0; j < m; j++)
+            _mm_storeu_si128((__m128i *) (out + 16 * (i + j)), b[j]);
+    }
+}
+
+static AESNI_FN void
+ni_decrypt_lanes(const __m128i *k, unsigned int rounds, __m128i *b)
+{
+    FOR_LANES(j)
+        b[j] = _mm_xor_si128(b[j], k[0]);
+    for (unsigned int r = 1; r < rounds; r++)
+        FOR_LANES(j)
+            b[j] = _mm_aesdec_si128(b[j], k[r]);
+    FOR_LANES(j)
+        b[j] = _mm_aesdeclast_si128(b[j], k[rounds]);
+}
+
+static AESNI_FN void
+ni_decrypt(const uint8_t (*rk)[16], unsigned int rounds,
+           const uint8_t *in, uint8_t *out, size_t n)
+{
+    __m128i k[15];
+    ni_load_keys(rk, rounds, k);
+
+    for (size_t i = 0; i < n; i += lanes) {
+        const size_t m = min(lanes, n - i);
+        __m128i b[lanes];
+
+        FOR_LANES(j)
+            b[j] = j < m ? _mm_loadu_si128((const __m128i *) (in + 16 * (i + j)))
+                         : _mm_setzero_si128();
+        ni_decrypt_lanes(k, rounds, b);
+        for (size_t j = 0; j < m; j++)
+            _mm_storeu_si128((__m128i *) (out + 16 * (i + j)), b[j]);
+    }
+}
+
+static AESNI_FN void
+ni_cbc_encrypt(const uint8_t (*rk)[16], unsigned int rounds,
+               const uint8_t *iv, const uint8_t *in, uint8_t *out, size_t n)
+{
+    __m128i k[15];
+    ni_load_keys(rk, rounds, k);
+
+    __m128i x = _mm_loadu_si128((const __m128i *) iv);
+    for (size_t i = 0; i < n; i++) {
+        x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i *) (in + 16 * i)));
+        x = _mm_xor_si128(x, k[0]);
+        for (unsigned int r = 1; r < rounds; r++)
+            x = _mm_aesenc_si128(x, k[r]);
+        x = _mm_aesenclast_si128(x, k[rounds]);
+        _mm_storeu_si128((__m128i *) (out + 16 * i), x);
+    }
+}
+
+static AESNI_FN void
+ni_cbc_decrypt(const uint8_t (*rk)[16], unsigned int rounds,
+               const uint8_t *iv, const uint8_t *in, uint8_t *out, size_t n)
+{
+    __m128i k[15];
+    ni_load_keys(rk, rounds, k);
+
+    __m128i prev = _mm_loadu_si128((const __m128i *) iv);
+    for (size_t i = 0; i < n; i += lanes) {
+        const size_t m = min(lanes, n - i);
+        __m128i c[lanes], b[lanes];
+
+        // all of the chunk is read before any of it is written
+        FOR_LANES(j) {
+            c[j] = j < m ? _mm_loadu_si128((const __m128i *) (in + 16 * (i + j)))
+                         : _mm_setzero_si128();
+            b[j] = c[j];
+        }
+        ni_decrypt_lanes(k, rounds, b);
+        for (size_t j = 0; j < m; j++)
+            _mm_storeu_si128((__m128i *) (out + 16 * (i + j)),
+                             _mm_xor_si128(b[j], j ? c[j - 1] : prev));
+        prev = c[m - 1];
+    }
+}
+
+/*
+ * One group of at most `lanes` messages, each lane carrying its CBC
+ * chain in a register.  Lanes whose message has ended run idle.
+ */
+static AESNI_FN void
+ni_cbc_encrypt_lanes(const uint8_t (*rk)[16], unsigned int rounds, size_t m,
+                     const uint8_t *const *ivs, const uint8_t *const *ptexts,
+                     uint8_t *const *ctexts, const size_t *nblocks)
+{
+    __m128i k[15];
+    ni_load_keys(rk, rounds, k);
+
+    __m128i x[lanes];
+    size_t maxb = 0;
+    FOR_LANES(j) {
+        x[j] = j < m ? _mm_loadu_si128((const __m128i *) ivs[j])
+                     : _mm_setzero_si128();
+        if (j < m)
+            maxb = max(maxb, nblocks[j]);
+    }
+
+    for (size_t b = 0; b < maxb; b++) {
+        FOR_LANES(j) {
+            if (j < m && b < nblocks[j])
+                x[j] = _mm_xor_si128(x[j], _mm_loadu_si128(
+                           (const __m128i *) (ptexts[j] + 16 * b)));
+            x[j] = _mm_xor_si128(x[j], k[0]);
+        }
+        for (unsigned int r = 1; r < rounds; r++)
+            FOR_LANES(j)
+                x[j] = _mm_aesenc_si128(x[j], k[r]);
+        FOR_LANES(j) {
+            x[j] = _mm_aesenclast_si128(x[j], k[rounds]);
+            if (j < m && b < nblocks[j])
+                _mm_storeu_si128((__m128i *) (ctexts[j] + 16 * b), x[j]);
+        }
+    }
+}
+
+#endif  /* HAVE_AESNI */
+
+AES::AES(const string &key)
+    : be(default_backend())
+{
+    init(key);
+}
+
+AES::AES(const string &key, aes_backend be)
+    : be(supported(be) ? be : aes_backend::TABLE)
+{
+    init(key);
+}
+
+void
+AES::init(const string &key)
+{
+    throw_c(key.size() == 16 || key.size() == 24 || key.size() == 32);
+    rounds = key.size() / 4 + 6;
+
+    if (be == aes_backend::TABLE) {
+        AES_set_encrypt_key((const uint8_t*) key.data(), key.size() * 8, &enc);
+        AES_set_decrypt_key((const uint8_t*) key.data(), key.size() * 8, &dec);
+        return;
+    }
+
+#ifdef HAVE_AESNI
+    ni_expand((const uint8_t*) key.data(), key.size(), rounds,
+              ni_enc, ni_dec);
+#endif
+}
+
+void
+AES::blocks_encrypt(const void *ptext, void *ctext, size_t n) const
+{
+    const uint8_t *const in = (const uint8_t*) ptext;
+    uint8_t *const out = (uint8_t*) ctext;
+
+#ifdef HAVE_AESNI
+    if (be == aes_backend::AESNI) {
+        ni_encrypt(ni_enc, rounds, in, out, n);
+        return;
+    }
+#endif
+
+    for (size_t i = 0; i < n; i++)
+        AES_encrypt(in + i * blocksize, out + i * blocksize, &enc);
+}
+
+void
+AES::blocks_decrypt(const void *ctext, void *ptext, size_t n) const
+{
+    const uint8_t *const in = (const uint8_t*) ctext;
+    uint8_t *const out = (uint8_t*) ptext;
+
+#ifdef HAVE_AESNI
+    if (be == aes_backend::AESNI) {
+        ni_decrypt(ni_dec, rounds, in, out, n);
+        return;
+    }
+#endif
+
+    for (size_t i = 0; i < n; i++)
+        AES_decrypt(in + i * blocksize, out + i * blocksize, &dec);
+}
+
+void
+AES::cbc_encrypt(const void *iv, const void *ptext, void *ctext,
+                 size_t n) const
+{
+#ifdef HAVE_AESNI
+    if (be == aes_backend::AESNI) {
+        ni_cbc_encrypt(ni_enc, rounds, (const uint8_t*) iv,
+                       (const uint8_t*) ptext, (uint8_t*) ctext, n);
+        return;
+    }
+#endif
+
+    // AES_cbc_encrypt advances the IV it is given
+    uint8_t ivec[blocksize];
+    memcpy(ivec, iv, blocksize);
+    AES_cbc_encrypt((const uint8_t*) ptext, (uint8_t*) ctext, n * blocksize,
+                    &enc, ivec, AES_ENCRYPT);
+}
+
+void
+AES::cbc_decrypt(const void *iv, const void *ctext, void *ptext,
+                 size_t n) const
+{
+#ifdef HAVE_AESNI
+    if (be == aes_backend::AESNI) {
+        ni_cbc_decrypt(ni_dec, rounds, (const uint8_t*) iv,
+                       (const uint8_t*) ctext, (uint8_t*) ptext, n);
+        return;
+    }
+#endif
+
+    uint8_t ivec[blocksize];
+    memcpy(ivec, iv, blocksize);
+    AES_cbc_encrypt((const uint8_t*) ctext, (uint8_t*) ptext, n * blocksize,
+                    &dec, ivec, AES_DECRYPT);
+}
+
+/*
+ * Up to `lanes` messages advance one block per step: the chained
+ * inputs of all live messages go through the cipher together.
+ */
+void
+AES::cbc_encrypt_batch(size_t nmsg, const uint8_t *const *ivs,
+                       const uint8_t *const *ptexts, uint8_t *const *ctexts,
+                       const size_t *nblocks) const
+{
+#ifdef HAVE_AESNI
+    if (be == aes_backend::AESNI) {
+        for (size_t g = 0; g < nmsg; g += lanes)
+            ni_cbc_encrypt_lanes(ni_enc, rounds, min(lanes, nmsg - g),
+                                 ivs + g, ptexts + g, ctexts + g,
+                                 nblocks + g);
+        return;
+    }
+#endif
+
+    for (size_t g = 0; g < nmsg; g += lanes) {
+        const size_t m = min(lanes, nmsg - g);
+
+        uint8_t chain[lanes][blocksize];
+        size_t maxb = 0;
+        for (size_t j = 0; j < m; j++) {
+            memcpy(chain[j], ivs[g + j], blocksize);
+            maxb = max(maxb, nblocks[g + j]);
+        }
+
+        for (size_t b = 0; b < maxb; b++) {
+            uint8_t x[lanes * blocksize];
+            size_t live[lanes];
+            size_t k = 0;
+            for (size_t j = 0; j < m; j++) {
+                if (b >= nblocks[g + j])
+                    continue;
+                const uint8_t *const p = ptexts[g + j] + b * blocksize;
+                for (size_t i = 0; i < blocksize; i++)
+                    x[k * blocksize + i] = p[i] ^ chain[j][i];
+                live[k++] = j;
+            }
+
+            blocks_encrypt(x, x, k);
+
+            for (size_t i = 0; i < k; i++) {
+                const size_t j = live[i];
+                memcpy(chain[j], x + i * blocksize, blocksize);
+                memcpy(ctexts[g + j] + b * blocksize, chain[j], blocksize);
+            }
+        }
+    }
+}
+
+bool
+AES::supported(aes_backend be)
+{
+    if (be == aes_backend::TABLE)
+        return true;
+
+#ifdef HAVE_AESNI
+    unsigned int a, b, c, d;
+    return __get_cpuid(1, &a, &b, &c, &d) && (c & bit_AES);
+#else
+    return false;
+#endif
+}
+
+static aes_backend
+pick_backend()
+{
+    const char *const ev = getenv("AES_BACKEND");
+    if (ev && string(ev) == "table")
+        return aes_backend::TABLE;
+
+    return AES::supported(aes_backend::AESNI) ? aes_backend::AESNI
+                                              : aes_backend::TABLE;
+}
+
+aes_backend
+AES::default_backend()
+{
+    static const aes_backend be = pick_backend();
+    return be;
+}
+
+const char *
+AES::backend_name(aes_backend be)
+{
+    switch (be) {
+    case aes_backend::TABLE:
+        return "table";
+    case aes_backend::AESNI:
+        return "aesni";
+    }
+    return "?";
+}
@@ -7,26 +7,93 @@
 
 #include <util/errstream.hh>
 
+/*
+ * Implementations of the AES block function.  AESNI pipelines up to
+ * eight independent blocks through the CPU's AES instructions; TABLE is
+ * the portable OpenSSL AES_* code.
+ */
+enum class aes_backend { TABLE, AESNI };
+
 class AES {
  public:
-    AES(const std::string &key) {
-        throw_c(key.size() == 16 || key.size() == 24 || key.size() == 32);
-        AES_set_encrypt_key((const uint8_t*) key.data(), key.size() * 8, &enc);
-        AES_set_decrypt_key((const uint8_t*) key.data(), key.size() * 8, &dec);
-    }
+    /*
+     * Uses default_backend() unless told otherwise; asking for a
+     * backend the CPU lacks falls back to TABLE.
+     */
+    AES(const std::string &key);
+    AES(const std::string &key, aes_backend be);
 
     void block_encrypt(const void *ptext, void *ctext) const {
-        AES_encrypt((const uint8_t*) ptext, (uint8_t*) ctext, &enc);
+        blocks_encrypt(ptext, ctext, 1);
     }
 
     void block_decrypt(const void *ctext, void *ptext) const {
-        AES_decrypt((const uint8_t*) ctext, (uint8_t*) ptext, &dec);
+        blocks_decrypt(ctext, ptext, 1);
     }
 
+    // n independent blocks (ECB); in and out may be the same buffer
+    void blocks_encrypt(const void *ptext, void *ctext, size_t n) const;
+    void blocks_decrypt(const void *ctext, void *ptext, size_t n) const;
+
+    /*
+     * CBC over n whole blocks, without padding.  Decryption runs
+     * several blocks at a time; in and out may be the same buffer.
+     */
+    void cbc_encrypt(const void *iv, const void *ptext, void *ctext,
+                     size_t n) const;
+    void cbc_decrypt(const void *iv, const void *ctext, void *ptext,
+                     size_t n) const;
+
+    /*
+     * CBC-encrypts nmsg independent messages, interleaving them so the
+     * serial chains of several messages share the pipeline.  Message i
+     * has nblocks[i] whole blocks at ptexts[i] and goes to ctexts[i],
+     * which may be ptexts[i].
+     */
+    void cbc_encrypt_batch(size_t nmsg, const uint8_t *const *ivs,
+                           const uint8_t *const *ptexts,
+                           uint8_t *const *ctexts,
+                           const size_t *nblocks) const;
+
+    aes_backend backend() const { return be; }
+
     static const size_t blocksize = 16;
 
+    /*
+     * AESNI when the CPU has it, else TABLE; AES_BACKEND=table in the
+     * environment forces the portable code.  Decided once per process.
+     */
+    static aes_backend default_backend();
+    static bool supported(aes_backend be);
+    static const char *backend_name(aes_backend be);
+
  private:
+    void init(const std::string &key);
+
+    aes_backend be;
+
+    // TABLE
     AES_KEY enc;
     AES_KEY dec;
+
+    // AESNI: round keys, the decryption ones for the equivalent inverse
+    unsigned int rounds;
+    uint8_t ni_enc[15][16];
+    uint8_t ni_dec[15][16];
 };
 
+/*
+ * Batch hooks for the generic modes in cbc.hh and cmc.hh, which call
+ * these for their parallel passes.
+ */
+inline void
+blocks_encrypt(const AES *c, const void *ptext, void *ctext, size_t n)
+{
+    c->blocks_encrypt(ptext, ctext, n);
+}
+
+inline void
+blocks_decrypt(const AES *c, const void *ctext, void *ptext, size_t n)
+{
+    c->blocks_decrypt(ctext, ptext, n);
+}
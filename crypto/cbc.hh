@@ -16,6 +16,28 @@ xor_block(void *dstv, const void *av, const void *bv)
         dst[j] = a[j] ^ b[j];
 }
 
+/*
+ * n independent blocks.  Ciphers with a batch interface (AES) overload
+ * these so the parallel passes of the modes below pipeline.
+ */
+template<class BlockCipher>
+void
+blocks_encrypt(const BlockCipher *c, const void *ptext, void *ctext, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        c->block_encrypt((const uint8_t*) ptext + i * BlockCipher::blocksize,
+                         (uint8_t*) ctext + i * BlockCipher::blocksize);
+}
+
+template<class BlockCipher>
+void
+blocks_decrypt(const BlockCipher *c, const void *ctext, void *ptext, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        c->block_decrypt((const uint8_t*) ctext + i * BlockCipher::blocksize,
+                         (uint8_t*) ptext + i * BlockCipher::blocksize);
+}
+
 template<class BlockCipher>
 void
 cbc_encrypt(const BlockCipher *c,
@@ -74,14 +96,15 @@ cbc_decrypt(const BlockCipher *c,
     const uint8_t *ct = (const uint8_t*) ctext.data();
     uint8_t *pt = (uint8_t*) ptext->data();
 
+    // the whole blocks decrypt independently of each other
+    size_t nblocks = ctsize / BlockCipher::blocksize;
+    blocks_decrypt(c, ct, pt, nblocks);
     for (size_t i = 0;
-         i <= ctsize - BlockCipher::blocksize;
+         i < nblocks * BlockCipher::blocksize;
          i += BlockCipher::blocksize)
     {
-        uint8_t x[BlockCipher::blocksize];
-        c->block_decrypt(&ct[i], x);
         const uint8_t *y = (i == 0) ? &iv[0] : &ct[i-BlockCipher::blocksize];
-        xor_block<BlockCipher>(&pt[i], x, y);
+        xor_block<BlockCipher>(&pt[i], &pt[i], y);
     }
 
     // Ciphertext stealing (CTS)
@@ -37,17 +37,15 @@ cmc_encrypt(const BlockCipher *c,
         for (size_t j = 0; j < BlockCipher::blocksize; j++)
             (*ctext)[i+j] ^= m[j];
 
-    memset(x, 0, BlockCipher::blocksize);
-    for (size_t i = ptext.size(); i != 0; i -= BlockCipher::blocksize) {
-        uint8_t y[BlockCipher::blocksize];
-        c->block_encrypt(&(*ctext)[i - BlockCipher::blocksize], y);
-
-        uint8_t z[BlockCipher::blocksize];
-        xor_block<BlockCipher>(z, y, x);
-
-        memcpy(x, &(*ctext)[i - BlockCipher::blocksize], BlockCipher::blocksize);
-        memcpy(&(*ctext)[i - BlockCipher::blocksize], z, BlockCipher::blocksize);
-    }
+    // last pass: block i is E(block i) ^ old block i+1, all independent
+    const std::string mixed(*ctext);
+    blocks_encrypt(c, &mixed[0], &(*ctext)[0],
+                   ptext.size() / BlockCipher::blocksize);
+    for (size_t i = 0;
+         i + BlockCipher::blocksize < ptext.size();
+         i += BlockCipher::blocksize)
+        xor_block<BlockCipher>(&(*ctext)[i], &(*ctext)[i],
+                               &mixed[i + BlockCipher::blocksize]);
 }
 
 template<class BlockCipher>
@@ -82,16 +80,14 @@ cmc_decrypt(const BlockCipher *c,
         for (size_t j = 0; j < BlockCipher::blocksize; j++)
             (*ptext)[i+j] ^= m[j];
     }
-    memset(x, 0, BlockCipher::blocksize);
 
-    for (size_t i = 0; i < ctext.size(); i += BlockCipher::blocksize) {
-        uint8_t y[BlockCipher::blocksize];
-        c->block_decrypt(&(*ptext)[i], y);
-
-        uint8_t z[BlockCipher::blocksize];
-        xor_block<BlockCipher>(z, y, x);
-
-        memcpy(x, &(*ptext)[i], BlockCipher::blocksize);
-        memcpy(&(*ptext)[i], z, BlockCipher::blocksize);
-    }
+    // last pass: block i is D(block i) ^ old block i-1, all independent
+    const std::string mixed(*ptext);
+    blocks_decrypt(c, &mixed[0], &(*ptext)[0],
+                   ctext.size() / BlockCipher::blocksize);
+    for (size_t i = BlockCipher::blocksize;
+         i < ctext.size();
+         i += BlockCipher::blocksize)
+        xor_block<BlockCipher>(&(*ptext)[i], &(*ptext)[i],
+                               &mixed[i - BlockCipher::blocksize]);
 }
@@ -2,6 +2,7 @@
 #include <crypto/mont.hh>
 
 #include <gmp.h>
+#include <util/errstream.hh>
 
 using namespace std;
 using namespace NTL;
@@ -45,3 +46,120 @@ montgomery::mmul(const ZZ &a, const ZZ &b)
         ab = ab - _m;
     return ab;
 }
+
+mont_mpn::mont_mpn(const uint8_t *mbytes, size_t mlen)
+{
+    static_assert(0 == GMP_NAIL_BITS, "gmp nails not supported");
+
+    while (mlen > 0 && 0 == mbytes[mlen - 1])
+        mlen--;
+    throw_c(mlen > 0 && (mbytes[0] & 1), "mont_mpn: modulus must be odd");
+
+    k = (mlen + sizeof(mp_limb_t) - 1) / sizeof(mp_limb_t);
+    m.resize(k);
+    r1.resize(k);
+    r2.resize(k);
+    t.resize(2*k);
+    b.resize(k);
+    z.resize(k);
+    load_bytes(m.data(), mbytes, mlen);
+
+    /* Newton iteration; each step doubles the correct low bits */
+    mp_limb_t inv = m[0];           /* right mod 2^3 */
+    for (int i = 0; i < 6; i++)
+        inv *= 2 - m[0] * inv;
+    minv = -inv;
+
+    vector<mp_limb_t> rr(2*k + 1, 0), q(k + 2);
+    rr[k] = 1;
+    mpn_tdiv_qr(q.data(), r1.data(), 0, rr.data(), k + 1, m.data(), k);
+    rr[k] = 0;
+    rr[2*k] = 1;
+    mpn_tdiv_qr(q.data(), r2.data(), 0, rr.data(), 2*k + 1, m.data(), k);
+}
+
+void
+mont_mpn::load_bytes(mp_limb_t *out, const uint8_t *buf, size_t len) const
+{
+    while (len > k * sizeof(mp_limb_t) && 0 == buf[len - 1])
+        len--;
+    throw_c(len <= k * sizeof(mp_limb_t), "mont_mpn: operand too large");
+
+    for (size_t i = 0; i < k; i++)
+        out[i] = 0;
+    for (size_t i = 0; i < len; i++)
+        out[i / sizeof(mp_limb_t)] |=
+            static_cast<mp_limb_t>(buf[i]) << (8 * (i % sizeof(mp_limb_t)));
+}
+
+void
+mont_mpn::to_bytes(const mp_limb_t *a, uint8_t *buf, size_t len) const
+{
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = i < k * sizeof(mp_limb_t)
+                 ? static_cast<uint8_t>(a[i / sizeof(mp_limb_t)]
+                                        >> (8 * (i % sizeof(mp_limb_t))))
+                 : 0;
+    }
+}
+
+void
+mont_mpn::one(mp_limb_t *r) const
+{
+    mpn_copyi(r, r1.data(), k);
+}
+
+void
+mont_mpn::redc(mp_limb_t *out)
+{
+    /*
+     * Each step clears t[i]; its carry belongs at t[i+k], which no
+     * later step reads, so park it in t[i] and add them all at the end.
+     */
+    for (size_t i = 0; i < k; i++) {
+        const mp_limb_t u = t[i] * minv;
+        t[i] = mpn_addmul_1(&t[i], m.data(), k, u);
+    }
+    const mp_limb_t top = mpn_add_n(&t[k], &t[k], t.data(), k);
+
+    /* top:t[k..2k-1] < 2m */
+    if (top || mpn_cmp(&t[k], m.data(), k) >= 0)
+        mpn_sub_n(out, &t[k], m.data(), k);
+    else
+        mpn_copyi(out, &t[k], k);
+}
+
+void
+mont_mpn::mul(mp_limb_t *a, const mp_limb_t *bl)
+{
+    if (a == bl)
+        mpn_sqr(t.data(), a, k);
+    else
+        mpn_mul_n(t.data(), a, bl, k);
+    redc(a);
+}
+
+void
+mont_mpn::mul_bytes(mp_limb_t *a, const uint8_t *bbytes, size_t blen)
+{
+    load_bytes(b.data(), bbytes, blen);
+    mul(a, b.data());
+}
+
+void
+mont_mpn::from_mont(mp_limb_t *a, uint64_t nmul)
+{
+    /* z = R^nmul in Montgomery form: (R^2)^nmul / R^(nmul-1) */
+    one(z.data());
+    for (int i = 63; i >= 0; i--) {
+        mul(z.data(), z.data());
+        if ((nmul >> i) & 1)
+            mul(z.data(), r2.data());
+    }
+
+    /* a * R^(nmul+1) / R / R */
+    mul(a, z.data());
+    mpn_copyi(t.data(), a, k);
+    mpn_zero(&t[k], k);
+    redc(a);
+}
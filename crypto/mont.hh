@@ -1,5 +1,8 @@
 #pragma once
 
+#include <vector>
+#include <stdint.h>
+#include <gmp.h>
 #include <NTL/ZZ.h>
 
 class montgomery {
@@ -20,3 +23,50 @@ class montgomery {
     NTL::ZZ from_mont(const NTL::ZZ &a);
     NTL::ZZ mmul(const NTL::ZZ &a, const NTL::ZZ &b);
 };
+
+/*
+ * Montgomery multiplication on GMP limb arrays, for hot loops that must
+ * not allocate: all scratch space is sized once, in the constructor.
+ * Values are k-limb arrays (see nlimbs()); R = 2^(k * GMP_NUMB_BITS).
+ *
+ * A running product starts at one() and takes plain operands through
+ * mul_bytes(), each of which also divides by R; from_mont() settles
+ * all of those factors at once at the end.
+ */
+class mont_mpn {
+ public:
+    // @m is the odd modulus as little-endian bytes (as ZZFromBytes)
+    mont_mpn(const uint8_t *m, size_t mlen);
+
+    size_t nlimbs() const { return k; }
+
+    // r = R mod m, the Montgomery form of 1
+    void one(mp_limb_t *r) const;
+
+    /*
+     * a = a * b / R mod m, with b as little-endian bytes; a must be
+     * reduced, b need only fit in k limbs.
+     */
+    void mul_bytes(mp_limb_t *a, const uint8_t *b, size_t blen);
+
+    /*
+     * a = a * R^(nmul-1) mod m: the plain value of a running product
+     * after nmul calls to mul_bytes().
+     */
+    void from_mont(mp_limb_t *a, uint64_t nmul);
+
+    // little-endian bytes of the k-limb value a, zero-padded to len
+    void to_bytes(const mp_limb_t *a, uint8_t *buf, size_t len) const;
+
+ private:
+    size_t k;
+    mp_limb_t minv;                 /* -m^-1 mod 2^GMP_NUMB_BITS */
+    std::vector<mp_limb_t> m;
+    std::vector<mp_limb_t> r1, r2;  /* R and R^2 mod m */
+    std::vector<mp_limb_t> t;       /* 2k limbs of product */
+    std::vector<mp_limb_t> b, z;    /* k-limb scratch */
+
+    void load_bytes(mp_limb_t *out, const uint8_t *buf, size_t len) const;
+    void mul(mp_limb_t *a, const mp_limb_t *b);
+    void redc(mp_limb_t *out);
+};
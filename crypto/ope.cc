@@ -5,6 +5,7 @@
 #include <crypto/sha.hh>
 #include <crypto/hmac.hh>
 #include <util/zz.hh>
+#include <algorithm>
 
 using namespace std;
 using namespace NTL;
@@ -18,18 +19,16 @@ domain_gap(const ZZ &ndomain, const ZZ &nrange, const ZZ &rgap, PRNG *prng)
     return HGD(rgap, ndomain, nrange-ndomain, prng);
 }
 
-template<class CB>
-ope_domain_range
-OPE::lazy_sample(const ZZ &d_lo, const ZZ &d_hi,
-                 const ZZ &r_lo, const ZZ &r_hi,
-                 CB go_low, blockrng<AES> *prng)
+/*
+ * Draws the domain gap for the tree node [d_lo, d_hi] -> [r_lo, r_hi].
+ */
+ZZ
+OPE::node_gap(const ZZ &d_lo, const ZZ &d_hi,
+              const ZZ &r_lo, const ZZ &r_hi,
+              blockrng<AES> *prng) const
 {
     ZZ ndomain = d_hi - d_lo + 1;
     ZZ nrange  = r_hi - r_lo + 1;
-    throw_c(nrange >= ndomain);
-
-    if (ndomain == 1)
-        return ope_domain_range(d_lo, r_lo, r_hi);
 
     /*
      * Deterministically reset the PRNG counter, regardless of
@@ -45,14 +44,31 @@ OPE::lazy_sample(const ZZ &d_lo, const ZZ &d_hi,
     ZZ rgap = nrange/2;
     ZZ dgap;
 
-    auto ci = dgap_cache.find(r_lo + rgap);
-    if (ci == dgap_cache.end()) {
+    if (!cache || !cache->lookup(ope_cache::DGAP, r_lo + rgap, &dgap)) {
         dgap = domain_gap(ndomain, nrange, nrange / 2, prng);
-        dgap_cache[r_lo + rgap] = dgap;
-    } else {
-        dgap = ci->second;
+        if (cache)
+            cache->insert(ope_cache::DGAP, r_lo + rgap, dgap);
     }
 
+    return dgap;
+}
+
+template<class CB>
+ope_domain_range
+OPE::lazy_sample(const ZZ &d_lo, const ZZ &d_hi,
+                 const ZZ &r_lo, const ZZ &r_hi,
+                 CB go_low, blockrng<AES> *prng) const
+{
+    ZZ ndomain = d_hi - d_lo + 1;
+    ZZ nrange  = r_hi - r_lo + 1;
+    throw_c(nrange >= ndomain);
+
+    if (ndomain == 1)
+        return ope_domain_range(d_lo, r_lo, r_hi);
+
+    ZZ rgap = nrange/2;
+    ZZ dgap = node_gap(d_lo, d_hi, r_lo, r_hi, prng);
+
     if (go_low(d_lo + dgap, r_lo + rgap))
         return lazy_sample(d_lo, d_lo + dgap - 1, r_lo, r_lo + rgap - 1, go_low, prng);
     else
@@ -61,7 +77,7 @@ OPE::lazy_sample(const ZZ &d_lo, const ZZ &d_hi,
 
 template<class CB>
 ope_domain_range
-OPE::search(CB go_low)
+OPE::search(CB go_low) const
 {
     blockrng<AES> r(aesk);
 
@@ -70,12 +86,182 @@ OPE::search(CB go_low)
                        go_low, &r);
 }
 
-ZZ
-OPE::encrypt(const ZZ &ptext)
+/*
+ * Narrow (<= 64-bit ciphertext) path.  Every step mirrors the ZZ code
+ * above byte for byte: the HMAC input uses the same minimal
+ * little-endian encoding as StringFromZZ, and random values are drawn
+ * with the same number of PRNG bytes as PRNG::rand_zz_mod.
+ */
+
+static size_t
+u128_nbits(ope_u128 v)
 {
-    ope_domain_range dr =
-        search([&ptext](const ZZ &d, const ZZ &) { return ptext < d; });
+    const uint64_t hi = static_cast<uint64_t>(v >> 64);
+    const uint64_t lo = static_cast<uint64_t>(v);
+    if (hi)
+        return 128 - __builtin_clzll(hi);
+    if (lo)
+        return 64 - __builtin_clzll(lo);
+    return 0;
+}
+
+// same bytes as StringFromZZ(v); returns the length written
+static size_t
+u128_le_bytes(ope_u128 v, uint8_t *buf)
+{
+    size_t n = 0;
+    while (v) {
+        buf[n++] = static_cast<uint8_t>(v);
+        v >>= 8;
+    }
+    return n;
+}
+
+static ope_u128
+u128_from_le_bytes(const uint8_t *buf, size_t len)
+{
+    throw_c(len <= sizeof(ope_u128));
+
+    ope_u128 v = 0;
+    for (size_t i = len; i > 0; i--)
+        v = (v << 8) | buf[i - 1];
+    return v;
+}
+
+static ope_u128
+u128FromZZ(const ZZ &z)
+{
+    throw_c(z >= 0 && NumBytes(z) <= static_cast<long>(sizeof(ope_u128)));
+
+    uint8_t buf[sizeof(ope_u128)];
+    BytesFromZZ(buf, z, sizeof(buf));
+    return u128_from_le_bytes(buf, sizeof(buf));
+}
+
+static ZZ
+ZZFromU128(ope_u128 v)
+{
+    uint8_t buf[sizeof(ope_u128)];
+    return ZZFromBytes(buf, u128_le_bytes(v, buf));
+}
+
+static ope_u128
+rand_u128_mod(PRNG *prng, ope_u128 max)
+{
+    uint8_t buf[u128_nbits(max)/8 + 1];
+    prng->rand_bytes(sizeof(buf), buf);
+    return u128_from_le_bytes(buf, sizeof(buf)) % max;
+}
+
+ope_u128
+OPE::narrow_gap(ope_u128 d_lo, ope_u128 d_hi, ope_u128 r_lo, ope_u128 r_hi,
+                blockrng<AES> *prng) const
+{
+    const ope_u128 ndomain = d_hi - d_lo + 1;
+    const ope_u128 nrange  = r_hi - r_lo + 1;
+
+    uint8_t msg[4 * (sizeof(ope_u128) + 1)];
+    size_t len = 0;
+    len += u128_le_bytes(d_lo, &msg[len]);
+    msg[len++] = '/';
+    len += u128_le_bytes(d_hi, &msg[len]);
+    msg[len++] = '/';
+    len += u128_le_bytes(r_lo, &msg[len]);
+    msg[len++] = '/';
+    len += u128_le_bytes(r_hi, &msg[len]);
+
+    hmac<sha256> mac(keyed_mac);
+    mac.update(msg, len);
+    uint8_t v[sha256::hashsize];
+    mac.final(v);
+    prng->set_ctr(v, AES::blocksize);
+
+    const ope_u128 rgap = nrange/2;
+
+    ZZ dgap_zz;
+    if (cache
+        && cache->lookup(ope_cache::DGAP, ZZFromU128(r_lo + rgap),
+                         &dgap_zz)) {
+        return u128FromZZ(dgap_zz);
+    }
+
+    dgap_zz = domain_gap(ZZFromU128(ndomain), ZZFromU128(nrange),
+                         ZZFromU128(rgap), prng);
+    if (cache)
+        cache->insert(ope_cache::DGAP, ZZFromU128(r_lo + rgap), dgap_zz);
+
+    return u128FromZZ(dgap_zz);
+}
+
+template<class CB>
+ope_narrow_range
+OPE::narrow_search(CB go_low) const
+{
+    blockrng<AES> prng(aesk);
+
+    ope_u128 d_lo = 0, d_hi = static_cast<ope_u128>(1) << pbits;
+    ope_u128 r_lo = 0, r_hi = static_cast<ope_u128>(1) << cbits;
+
+    for (;;) {
+        const ope_u128 ndomain = d_hi - d_lo + 1;
+        const ope_u128 nrange  = r_hi - r_lo + 1;
+        throw_c(nrange >= ndomain);
+
+        if (ndomain == 1)
+            return ope_narrow_range(d_lo, r_lo, r_hi);
+
+        const ope_u128 rgap = nrange/2;
+        const ope_u128 dgap = narrow_gap(d_lo, d_hi, r_lo, r_hi, &prng);
+
+        if (go_low(d_lo + dgap, r_lo + rgap)) {
+            d_hi = d_lo + dgap - 1;
+            r_hi = r_lo + rgap - 1;
+        } else {
+            d_lo = d_lo + dgap;
+            r_lo = r_lo + rgap;
+        }
+    }
+}
+
+ope_u128
+OPE::narrow_leaf(ope_u128 ptext, const ope_narrow_range &dr) const
+{
+    uint8_t pbuf[sizeof(ope_u128)];
+    sha256 h;
+    h.update(pbuf, u128_le_bytes(ptext, pbuf));
+    uint8_t v[sha256::hashsize];
+    h.final(v);
+
+    blockrng<AES> aesrand(aesk);
+    aesrand.set_ctr(v, AES::blocksize);
+
+    const ope_u128 nrange = dr.r_hi - dr.r_lo + 1;
+    return dr.r_lo + rand_u128_mod(&aesrand, nrange);
+}
+
+ope_u128
+OPE::narrow_encrypt(ope_u128 ptext) const
+{
+    const ope_narrow_range dr =
+        narrow_search([ptext](ope_u128 d, ope_u128) { return ptext < d; });
+    return narrow_leaf(ptext, dr);
+}
 
+ope_u128
+OPE::narrow_decrypt(ope_u128 ctext) const
+{
+    const ope_narrow_range dr =
+        narrow_search([ctext](ope_u128, ope_u128 r) { return ctext < r; });
+    return dr.d;
+}
+
+/*
+ * Picks the ciphertext of @ptext inside the range of its leaf; the
+ * randomness depends only on the plaintext.
+ */
+ZZ
+OPE::leaf_ctext(const ZZ &ptext, const ope_domain_range &dr) const
+{
     auto v = sha256::hash(StringFromZZ(ptext));
     v.resize(16);
 
@@ -87,9 +273,171 @@ OPE::encrypt(const ZZ &ptext)
 }
 
 ZZ
-OPE::decrypt(const ZZ &ctext)
+OPE::encrypt(const ZZ &ptext) const
+{
+    ZZ ctext;
+    if (cache && cache->lookup(ope_cache::ENC, ptext, &ctext))
+        return ctext;
+
+    if (narrow) {
+        ctext = ZZFromU128(narrow_encrypt(u128FromZZ(ptext)));
+        if (cache) {
+            cache->insert(ope_cache::ENC, ptext, ctext);
+            cache->insert(ope_cache::DEC, ctext, ptext);
+        }
+        return ctext;
+    }
+
+    ope_domain_range dr =
+        search([&ptext](const ZZ &d, const ZZ &) { return ptext < d; });
+    ctext = leaf_ctext(ptext, dr);
+
+    if (cache) {
+        cache->insert(ope_cache::ENC, ptext, ctext);
+        cache->insert(ope_cache::DEC, ctext, ptext);
+    }
+    return ctext;
+}
+
+ZZ
+OPE::decrypt(const ZZ &ctext) const
 {
+    ZZ ptext;
+    if (cache && cache->lookup(ope_cache::DEC, ctext, &ptext))
+        return ptext;
+
+    if (narrow) {
+        ptext = ZZFromU128(narrow_decrypt(u128FromZZ(ctext)));
+        if (cache)
+            cache->insert(ope_cache::DEC, ctext, ptext);
+        return ptext;
+    }
+
     ope_domain_range dr =
         search([&ctext](const ZZ &, const ZZ &r) { return ctext < r; });
+
+    if (cache)
+        cache->insert(ope_cache::DEC, ctext, dr.d);
     return dr.d;
 }
+
+/*
+ * Batch encryption.  The plaintexts are sorted and walked down the tree
+ * together: each node is sampled once for all the values below it, and
+ * the batch splits where the values part ways.  Sorted neighbours share
+ * most of their path, so a bulk load samples roughly one node per value
+ * instead of one per value and tree level.  Ciphertexts are the same as
+ * encrypt()'s.
+ */
+void
+OPE::batch_sample(const ZZ &d_lo, const ZZ &d_hi,
+                  const ZZ &r_lo, const ZZ &r_hi,
+                  const ZZ *ptexts, ZZ *ctexts, size_t n,
+                  blockrng<AES> *prng) const
+{
+    if (0 == n)
+        return;
+
+    ZZ ndomain = d_hi - d_lo + 1;
+    ZZ nrange  = r_hi - r_lo + 1;
+    throw_c(nrange >= ndomain);
+
+    if (ndomain == 1) {
+        // duplicates of one plaintext
+        const ZZ ctext = leaf_ctext(d_lo, ope_domain_range(d_lo, r_lo, r_hi));
+        for (size_t i = 0; i < n; i++)
+            ctexts[i] = ctext;
+        return;
+    }
+
+    ZZ rgap = nrange/2;
+    ZZ d_mid = d_lo + node_gap(d_lo, d_hi, r_lo, r_hi, prng);
+    const size_t nlow = lower_bound(ptexts, ptexts + n, d_mid) - ptexts;
+
+    batch_sample(d_lo, d_mid - 1, r_lo, r_lo + rgap - 1,
+                 ptexts, ctexts, nlow, prng);
+    batch_sample(d_mid, d_hi, r_lo + rgap, r_hi,
+                 ptexts + nlow, ctexts + nlow, n - nlow, prng);
+}
+
+void
+OPE::narrow_batch_sample(ope_u128 d_lo, ope_u128 d_hi,
+                         ope_u128 r_lo, ope_u128 r_hi,
+                         const ope_u128 *ptexts, ope_u128 *ctexts, size_t n,
+                         blockrng<AES> *prng) const
+{
+    if (0 == n)
+        return;
+
+    const ope_u128 ndomain = d_hi - d_lo + 1;
+    const ope_u128 nrange  = r_hi - r_lo + 1;
+    throw_c(nrange >= ndomain);
+
+    if (ndomain == 1) {
+        const ope_u128 ctext =
+            narrow_leaf(d_lo, ope_narrow_range(d_lo, r_lo, r_hi));
+        for (size_t i = 0; i < n; i++)
+            ctexts[i] = ctext;
+        return;
+    }
+
+    const ope_u128 rgap = nrange/2;
+    const ope_u128 d_mid = d_lo + narrow_gap(d_lo, d_hi, r_lo, r_hi, prng);
+    const size_t nlow = lower_bound(ptexts, ptexts + n, d_mid) - ptexts;
+
+    narrow_batch_sample(d_lo, d_mid - 1, r_lo, r_lo + rgap - 1,
+                        ptexts, ctexts, nlow, prng);
+    narrow_batch_sample(d_mid, d_hi, r_lo + rgap, r_hi,
+                        ptexts + nlow, ctexts + nlow, n - nlow, prng);
+}
+
+vector<ZZ>
+OPE::encrypt_batch(const vector<ZZ> &ptexts) const
+{
+    vector<ZZ> ctexts(ptexts.size());
+
+    // positions still to encrypt, in plaintext order
+    vector<size_t> todo;
+    for (size_t i = 0; i < ptexts.size(); i++) {
+        if (!cache || !cache->lookup(ope_cache::ENC, ptexts[i], &ctexts[i]))
+            todo.push_back(i);
+    }
+    if (todo.empty())
+        return ctexts;
+
+    sort(todo.begin(), todo.end(),
+         [&ptexts](size_t a, size_t b) { return ptexts[a] < ptexts[b]; });
+
+    blockrng<AES> prng(aesk);
+    if (narrow) {
+        vector<ope_u128> pv(todo.size()), cv(todo.size());
+        for (size_t j = 0; j < todo.size(); j++)
+            pv[j] = u128FromZZ(ptexts[todo[j]]);
+
+        narrow_batch_sample(0, static_cast<ope_u128>(1) << pbits,
+                            0, static_cast<ope_u128>(1) << cbits,
+                            pv.data(), cv.data(), todo.size(), &prng);
+
+        for (size_t j = 0; j < todo.size(); j++)
+            ctexts[todo[j]] = ZZFromU128(cv[j]);
+    } else {
+        vector<ZZ> pv(todo.size()), cv(todo.size());
+        for (size_t j = 0; j < todo.size(); j++)
+            pv[j] = ptexts[todo[j]];
+
+        batch_sample(to_ZZ(0), to_ZZ(1) << pbits,
+                     to_ZZ(0), to_ZZ(1) << cbits,
+                     pv.data(), cv.data(), todo.size(), &prng);
+
+        for (size_t j = 0; j < todo.size(); j++)
+            ctexts[todo[j]] = cv[j];
+    }
+
+    if (cache) {
+        for (size_t i : todo) {
+            cache->insert(ope_cache::ENC, ptexts[i], ctexts[i]);
+            cache->insert(ope_cache::DEC, ctexts[i], ptexts[i]);
+        }
+    }
+    return ctexts;
+}
@@ -1,10 +1,13 @@
 #pragma once
 
 #include <string>
-#include <map>
+#include <vector>
+#include <memory>
 #include <crypto/prng.hh>
 #include <crypto/aes.hh>
 #include <crypto/sha.hh>
+#include <crypto/hmac.hh>
+#include <crypto/ope_cache.hh>
 #include <NTL/ZZ.h>
 
 class ope_domain_range {
@@ -16,13 +19,43 @@ class ope_domain_range {
     NTL::ZZ d, r_lo, r_hi;
 };
 
+/*
+ * Machine-word version of ope_domain_range for OPE instances whose
+ * ciphertexts fit in 64 bits; the upper bound itself can be 2^64.
+ */
+typedef unsigned __int128 ope_u128;
+
+class ope_narrow_range {
+ public:
+    ope_narrow_range(ope_u128 d_arg, ope_u128 r_lo_arg, ope_u128 r_hi_arg)
+        : d(d_arg), r_lo(r_lo_arg), r_hi(r_hi_arg) {}
+    ope_u128 d, r_lo, r_hi;
+};
+
 class OPE {
  public:
-    OPE(const std::string &keyarg, size_t plainbits, size_t cipherbits)
-    : key(keyarg), pbits(plainbits), cbits(cipherbits), aesk(aeskey(key)) {}
+    /*
+     * When the ciphertext space fits in 64 bits the search runs on
+     * machine integers instead of NTL::ZZ; both paths produce identical
+     * ciphertexts.  @allow_narrow = false forces the ZZ path.
+     */
+    OPE(const std::string &keyarg, size_t plainbits, size_t cipherbits,
+        bool allow_narrow = true)
+    : key(keyarg), pbits(plainbits), cbits(cipherbits),
+      narrow(allow_narrow && cipherbits <= 64 && plainbits <= cipherbits),
+      aesk(aeskey(key)), keyed_mac(key.data(), key.size()),
+      cache(ope_cache::shared(key, plainbits, cipherbits)) {}
+
+    NTL::ZZ encrypt(const NTL::ZZ &ptext) const;
+    NTL::ZZ decrypt(const NTL::ZZ &ctext) const;
+
+    // same as encrypt() on each value, sharing tree nodes between them
+    std::vector<NTL::ZZ>
+        encrypt_batch(const std::vector<NTL::ZZ> &ptexts) const;
 
-    NTL::ZZ encrypt(const NTL::ZZ &ptext);
-    NTL::ZZ decrypt(const NTL::ZZ &ctext);
+    // NULL if caching is disabled
+    const std::shared_ptr<ope_cache> &get_cache() const { return cache; }
+    bool is_narrow() const { return narrow; }
 
  private:
     static std::string aeskey(const std::string &key) {
@@ -33,15 +66,44 @@ class OPE {
 
     std::string key;
     size_t pbits, cbits;
+    bool narrow;
 
     AES aesk;
-    std::map<NTL::ZZ, NTL::ZZ> dgap_cache;
+    hmac<sha256> keyed_mac;         // copied, not re-keyed, per tree node
+    std::shared_ptr<ope_cache> cache;
+
+    NTL::ZZ node_gap(const NTL::ZZ &d_lo, const NTL::ZZ &d_hi,
+                     const NTL::ZZ &r_lo, const NTL::ZZ &r_hi,
+                     blockrng<AES> *prng) const;
+    NTL::ZZ leaf_ctext(const NTL::ZZ &ptext,
+                       const ope_domain_range &dr) const;
 
     template<class CB>
-    ope_domain_range search(CB go_low);
+    ope_domain_range search(CB go_low) const;
 
     template<class CB>
     ope_domain_range lazy_sample(const NTL::ZZ &d_lo, const NTL::ZZ &d_hi,
                                  const NTL::ZZ &r_lo, const NTL::ZZ &r_hi,
-                                 CB go_low, blockrng<AES> *prng);
+                                 CB go_low, blockrng<AES> *prng) const;
+
+    void batch_sample(const NTL::ZZ &d_lo, const NTL::ZZ &d_hi,
+                      const NTL::ZZ &r_lo, const NTL::ZZ &r_hi,
+                      const NTL::ZZ *ptexts, NTL::ZZ *ctexts, size_t n,
+                      blockrng<AES> *prng) const;
+
+    ope_u128 narrow_gap(ope_u128 d_lo, ope_u128 d_hi,
+                        ope_u128 r_lo, ope_u128 r_hi,
+                        blockrng<AES> *prng) const;
+    ope_u128 narrow_leaf(ope_u128 ptext, const ope_narrow_range &dr) const;
+
+    template<class CB>
+    ope_narrow_range narrow_search(CB go_low) const;
+
+    void narrow_batch_sample(ope_u128 d_lo, ope_u128 d_hi,
+                             ope_u128 r_lo, ope_u128 r_hi,
+                             const ope_u128 *ptexts, ope_u128 *ctexts,
+                             size_t n, blockrng<AES> *prng) const;
+
+    ope_u128 narrow_encrypt(ope_u128 ptext) const;
+    ope_u128 narrow_decrypt(ope_u128 ctext) const;
 };
@@ -0,0 +1,220 @@
+#include <crypto/ope_cache.hh>
+#include <crypto/sha.hh>
+#include <util/scoped_lock.hh>
+
+using namespace std;
+using namespace NTL;
+
+/*
+ * Rough per-entry bookkeeping cost: one list node, one map node and the
+ * heap headers of two ZZs.  Only used to keep the budget honest, so it
+ * need not be exact.
+ */
+static const size_t entry_overhead = 128;
+
+static size_t
+entry_bytes(const ZZ &key, const ZZ &val)
+{
+    return entry_overhead + NumBytes(key) + NumBytes(val);
+}
+
+ope_cache::ope_cache(size_t budget_bytes)
+    : budget_bytes(budget_bytes)
+{
+    for (size_t i = 0; i < nshards; i++) {
+        pthread_mutex_init(&shards[i].mu, NULL);
+        shards[i].bytes = 0;
+        shards[i].hits = shards[i].misses = shards[i].evictions = 0;
+    }
+}
+
+ope_cache::~ope_cache()
+{
+    for (size_t i = 0; i < nshards; i++)
+        pthread_mutex_destroy(&shards[i].mu);
+}
+
+ope_cache::shard &
+ope_cache::shard_for(kind k, const ZZ &key)
+{
+    // low bits of the value, mixed so neighbouring plaintexts spread out
+    const uint64_t h =
+        (static_cast<uint64_t>(trunc_long(key, 64)) + k)
+        * 0x9E3779B97F4A7C15ULL;
+    return shards[(h >> 32) % nshards];
+}
+
+bool
+ope_cache::lookup(kind k, const ZZ &key, ZZ *val)
+{
+    shard &s = shard_for(k, key);
+    scoped_lock l(&s.mu);
+
+    auto it = s.index[k].find(key);
+    if (it == s.index[k].end()) {
+        s.misses++;
+        return false;
+    }
+
+    s.hits++;
+    s.lru.splice(s.lru.begin(), s.lru, it->second);
+    *val = it->second->val;
+    return true;
+}
+
+void
+ope_cache::insert(kind k, const ZZ &key, const ZZ &val)
+{
+    shard &s = shard_for(k, key);
+    const size_t shard_budget = budget_bytes / nshards;
+    const size_t nbytes = entry_bytes(key, val);
+    if (nbytes > shard_budget)
+        return;
+
+    scoped_lock l(&s.mu);
+
+    auto it = s.index[k].find(key);
+    if (it != s.index[k].end()) {
+        // another thread computed the same value first
+        s.lru.splice(s.lru.begin(), s.lru, it->second);
+        return;
+    }
+
+    trim(&s, shard_budget - nbytes);
+
+    s.lru.push_front(entry());
+    entry &e = s.lru.front();
+    e.k = k;
+    e.key = key;
+    e.val = val;
+    e.bytes = nbytes;
+    s.index[k][key] = s.lru.begin();
+    s.bytes += nbytes;
+}
+
+void
+ope_cache::trim(shard *s, size_t bytes)
+{
+    while (s->bytes > bytes) {
+        const entry &victim = s->lru.back();
+        s->index[victim.k].erase(victim.key);
+        s->bytes -= victim.bytes;
+        s->evictions++;
+        s->lru.pop_back();
+    }
+}
+
+void
+ope_cache::resize(size_t bytes)
+{
+    budget_bytes = bytes;
+    for (size_t i = 0; i < nshards; i++) {
+        scoped_lock l(&shards[i].mu);
+        trim(&shards[i], bytes / nshards);
+    }
+}
+
+ope_cache::stats
+ope_cache::get_stats() const
+{
+    stats st;
+    for (size_t i = 0; i < nshards; i++) {
+        const shard &s = shards[i];
+        scoped_lock l(&s.mu);
+
+        st.hits      += s.hits;
+        st.misses    += s.misses;
+        st.evictions += s.evictions;
+        st.entries   += s.lru.size();
+        st.bytes     += s.bytes;
+    }
+
+    return st;
+}
+
+/*
+ * Registry of shared caches.  It only holds weak references so a cache
+ * goes away with the last OPE object using its key; a schema reload
+ * builds the new layers before dropping the old ones, so the cache
+ * survives it.
+ */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static map<string, weak_ptr<ope_cache> > registry;
+static size_t registry_budget = 8 * 1024 * 1024;
+
+// gives each live cache an even share; the registry lock is held
+void
+ope_cache::share_budget()
+{
+    for (auto it = registry.begin(); it != registry.end(); ) {
+        if (it->second.expired())
+            registry.erase(it++);
+        else
+            it++;
+    }
+
+    for (auto it : registry) {
+        const shared_ptr<ope_cache> c = it.second.lock();
+        if (c)
+            c->resize(registry_budget / registry.size());
+    }
+}
+
+shared_ptr<ope_cache>
+ope_cache::shared(const string &key, size_t pbits, size_t cbits)
+{
+    scoped_lock l(&registry_lock);
+
+    if (0 == registry_budget)
+        return shared_ptr<ope_cache>();
+
+    // don't keep the raw key around as a map key
+    const string id = sha256::hash(key) + "/" + to_string(pbits)
+                      + "/" + to_string(cbits);
+
+    shared_ptr<ope_cache> c = registry[id].lock();
+    if (!c) {
+        c = shared_ptr<ope_cache>(new ope_cache(registry_budget));
+        registry[id] = c;
+        share_budget();
+    }
+
+    return c;
+}
+
+void
+ope_cache::set_global_budget(size_t bytes)
+{
+    scoped_lock l(&registry_lock);
+    registry_budget = bytes;
+    share_budget();
+}
+
+size_t
+ope_cache::global_budget()
+{
+    scoped_lock l(&registry_lock);
+    return registry_budget;
+}
+
+ope_cache::stats
+ope_cache::global_stats()
+{
+    scoped_lock l(&registry_lock);
+
+    stats total;
+    for (auto it : registry) {
+        const shared_ptr<ope_cache> c = it.second.lock();
+        if (!c)
+            continue;
+
+        const stats st = c->get_stats();
+        total.hits      += st.hits;
+        total.misses    += st.misses;
+        total.evictions += st.evictions;
+        total.entries   += st.entries;
+        total.bytes     += st.bytes;
+    }
+
+    return total;
+}
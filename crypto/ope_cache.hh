@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <stdint.h>
+#include <pthread.h>
+#include <NTL/ZZ.h>
+
+/*
+ * Size-bounded cache of OPE results for one key.  It is shared by every
+ * OPE object built with the same key and sizes, so all connections (and
+ * successive schema reloads) hit the same entries.
+ *
+ * Three kinds of mappings are kept: plaintext -> ciphertext,
+ * ciphertext -> plaintext and the domain gap that lazy_sample() draws
+ * with HGD for each node of the search tree.  Entries are spread over
+ * independently locked shards; each shard evicts its least recently
+ * used entries once it exceeds its share of the byte budget.
+ *
+ * The shared caches split one process-wide budget evenly; when a cache
+ * is added, or the budget changes, the caches are cut down to their new
+ * share at once.  The share of a cache that goes away is handed out
+ * when the next one is added.
+ */
+class ope_cache {
+ public:
+    enum kind { ENC, DEC, DGAP, NKINDS };
+
+    struct stats {
+        stats() : hits(0), misses(0), evictions(0), entries(0), bytes(0) {}
+
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        size_t entries;
+        size_t bytes;
+    };
+
+    explicit ope_cache(size_t budget_bytes);
+    ~ope_cache();
+
+    bool lookup(kind k, const NTL::ZZ &key, NTL::ZZ *val);
+    void insert(kind k, const NTL::ZZ &key, const NTL::ZZ &val);
+
+    stats get_stats() const;
+    size_t budget() const { return budget_bytes; }
+
+    /*
+     * Returns the cache for this key and OPE sizes, creating it if no
+     * live OPE object holds it.  Returns NULL when caching is disabled
+     * (a global budget of 0).
+     */
+    static std::shared_ptr<ope_cache>
+        shared(const std::string &key, size_t pbits, size_t cbits);
+
+    // bytes for all shared caches together
+    static void set_global_budget(size_t bytes);
+    static size_t global_budget();
+
+    // totals over all live shared caches
+    static stats global_stats();
+
+ private:
+    ope_cache(const ope_cache &other);
+    ope_cache &operator=(const ope_cache &rhs);
+
+    struct entry {
+        kind k;
+        NTL::ZZ key;
+        NTL::ZZ val;
+        size_t bytes;
+    };
+
+    struct shard {
+        mutable pthread_mutex_t mu;
+        std::list<entry> lru;       // most recently used first
+        std::map<NTL::ZZ, std::list<entry>::iterator> index[NKINDS];
+        size_t bytes;
+        uint64_t hits, misses, evictions;
+    };
+
+    static const size_t nshards = 16;
+
+    // changes for shared caches only
+    std::atomic<size_t> budget_bytes;
+    shard shards[nshards];
+
+    shard &shard_for(kind k, const NTL::ZZ &key);
+    // evicts down to @bytes; the caller holds the shard lock
+    static void trim(shard *s, size_t bytes);
+    void resize(size_t bytes);
+    static void share_budget();
+};
@@ -1,9 +1,46 @@
 #include <crypto/paillier.hh>
+#include <util/scoped_lock.hh>
 #include <sstream>
 
 using namespace std;
 using namespace NTL;
 
+/*
+ * Fixed-base exponentiation
+ */
+
+fixed_base_pow::fixed_base_pow(const ZZ &base, const ZZ &mod, uint expbitsarg)
+    : m(mod), expbits(expbitsarg), table(((expbitsarg + w - 1) / w) << w)
+{
+    const uint ndigits = (expbits + w - 1) / w;
+
+    ZZ row = base % m;                  /* base^(2^(w*i)) */
+    for (uint i = 0; i < ndigits; i++) {
+        table[i << w] = 1;
+        for (uint j = 1; j < (1U << w); j++)
+            MulMod(table[(i << w) | j], table[(i << w) | (j-1)], row, m);
+        MulMod(row, table[(i << w) | ((1U << w) - 1)], row, m);
+    }
+}
+
+ZZ
+fixed_base_pow::pow(const ZZ &e) const
+{
+    throw_c(e >= 0 && NumBits(e) <= (long) expbits);
+
+    const uint ndigits = (NumBits(e) + w - 1) / w;
+
+    ZZ r = to_ZZ(1);
+    for (uint i = 0; i < ndigits; i++) {
+        uint d = 0;
+        for (uint b = 0; b < w; b++)
+            d |= bit(e, i*w + b) << b;
+        if (d)
+            MulMod(r, r, table[(i << w) | d], m);
+    }
+    return r;
+}
+
 /*
  * Public-key operations
  */
@@ -94,9 +131,17 @@ Paillier_priv::Paillier_priv(const vector<ZZ> &sk)
       hp(InvMod(Lfast(PowerMod(g % p2, fast ? a : (p-1), p2),
                       pinv, two_p, p), p)),
       hq(InvMod(Lfast(PowerMod(g % q2, fast ? a : (q-1), q2),
-                      qinv, two_q, q), q))
+                      qinv, two_q, q), q)),
+      /*
+       * In fast mode g^a = 1 mod n, so g^(a*p) = 1 mod p^2; otherwise
+       * use the group order p(p-1).
+       */
+      ordp(fast ? a * p : p * (p-1)),
+      ordq(fast ? a * q : q * (q-1)),
+      p2inv(InvMod(p2 % q2, q2))
 {
     throw_c(sk.size() == 4);
+    pthread_mutex_init(&bases_lock, NULL);
 }
 
 std::vector<NTL::ZZ>
@@ -158,3 +203,45 @@ Paillier_priv::decrypt(const ZZ &ciphertext) const
 
     return m;
 }
+
+ZZ
+Paillier_priv::crt2(const ZZ &cp, const ZZ &cq) const
+{
+    return cp + p2 * MulMod((cq - cp) % q2, p2inv, q2);
+}
+
+ZZ
+Paillier_priv::gpow(const ZZ &e) const
+{
+    const fixed_base_pow *bp, *bq;
+    {
+        scoped_lock l(&bases_lock);
+        if (!gp) {
+            gp.reset(new fixed_base_pow(g % p2, p2, NumBits(ordp)));
+            gq.reset(new fixed_base_pow(g % q2, q2, NumBits(ordq)));
+        }
+        bp = gp.get();
+        bq = gq.get();
+    }
+
+    return crt2(bp->pow(e % ordp), bq->pow(e % ordq));
+}
+
+ZZ
+Paillier_priv::rand_crt(const ZZ &r) const
+{
+    return gpow(n*r);
+}
+
+ZZ
+Paillier_priv::encrypt_crt(const ZZ &plaintext, const ZZ &rn) const
+{
+    return MulMod(gpow(plaintext), rn, n2);
+}
+
+ZZ
+Paillier_priv::encrypt_crt(const ZZ &plaintext) const
+{
+    ZZ r = RandomLen_ZZ(nbits) % n;
+    return gpow(plaintext + n*r);
+}
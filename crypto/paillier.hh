@@ -1,7 +1,9 @@
 #pragma once
 
 #include <list>
+#include <memory>
 #include <vector>
+#include <pthread.h>
 #include <NTL/ZZ.h>
 #include <crypto/prng.hh>
 
@@ -9,6 +11,26 @@
 const unsigned int Paillier_len_bytes = PAILLIER_LEN_BYTES;
 const unsigned int Paillier_len_bits = Paillier_len_bytes * 8;
 
+/*
+ * Exponentiation of a fixed base modulo m.  base^(j << w*i) is
+ * precomputed for every w-bit digit position i of the exponent, so pow()
+ * costs one modular multiplication per digit and no squarings.
+ */
+class fixed_base_pow {
+ public:
+    fixed_base_pow(const NTL::ZZ &base, const NTL::ZZ &mod, uint expbits);
+
+    // e must be in [0, 2^expbits)
+    NTL::ZZ pow(const NTL::ZZ &e) const;
+
+ private:
+    static const uint w = 4;
+
+    NTL::ZZ m;
+    uint expbits;
+    std::vector<NTL::ZZ> table;     /* table[i<<w | j] = base^(j << w*i) */
+};
+
 
 class Paillier {
  public:
@@ -107,12 +129,29 @@ class Paillier {
 
 class Paillier_priv : public Paillier {
  public:
-    Paillier_priv() : fast(false) {} //HACK: should not need this
+    Paillier_priv() : fast(false) { //HACK: should not need this
+        pthread_mutex_init(&bases_lock, NULL);
+    }
     Paillier_priv(const std::vector<NTL::ZZ> &sk);
+    ~Paillier_priv() { pthread_mutex_destroy(&bases_lock); }
     std::vector<NTL::ZZ> privkey() const { return { p, q, g, a }; }
 
     NTL::ZZ decrypt(const NTL::ZZ &ciphertext) const;
 
+    /*
+     * Owner-side encryption, computed mod p^2 and q^2 and joined by
+     * CRT.  The ciphertexts decrypt like those of Paillier::encrypt.
+     */
+    NTL::ZZ encrypt_crt(const NTL::ZZ &plaintext) const;
+
+    /*
+     * Split form of encrypt_crt for precomputed randomness: rand_crt
+     * turns a random r in [0, n) into the randomizing factor of a
+     * ciphertext, encrypt_crt(m, rn) applies it to a plaintext.
+     */
+    NTL::ZZ rand_crt(const NTL::ZZ &r) const;
+    NTL::ZZ encrypt_crt(const NTL::ZZ &plaintext, const NTL::ZZ &rn) const;
+
     static std::vector<NTL::ZZ> keygen(PRNG*, uint nbits = 1024, uint abits = 256);
 
     template<class PackT>
@@ -146,4 +185,20 @@ class Paillier_priv : public Paillier {
     const NTL::ZZ two_p, two_q;
     const NTL::ZZ pinv, qinv;
     const NTL::ZZ hp, hq;
+
+    /* For encrypt_crt */
+    const NTL::ZZ ordp, ordq;       /* multiples of g's order mod p^2, q^2 */
+    const NTL::ZZ p2inv;            /* p^2^-1 mod q^2 */
+
+    /* ~0.4MB each, built on the first encryption: keys that only
+     * decrypt never have them */
+    mutable pthread_mutex_t bases_lock;
+    mutable std::unique_ptr<const fixed_base_pow> gp, gq;
+
+    Paillier_priv(const Paillier_priv &other);
+    Paillier_priv &operator=(const Paillier_priv &rhs);
+
+    NTL::ZZ crt2(const NTL::ZZ &cp, const NTL::ZZ &cq) const;
+    /* g^e mod n^2, joined by CRT */
+    NTL::ZZ gpow(const NTL::ZZ &e) const;
 };
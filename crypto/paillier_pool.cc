@@ -0,0 +1,278 @@
+#include <crypto/paillier_pool.hh>
+#include <util/scoped_lock.hh>
+#include <util/errstream.hh>
+
+using namespace std;
+using namespace NTL;
+
+/*
+ * Shared state of the refill threads.  Allocated once and never freed,
+ * so detached workers never see it destroyed at exit.
+ */
+struct pool_workers {
+#ifdef NTL_THREADS
+    pool_workers() : low(32), high(128), nthreads(1), running(0) {
+#else
+    pool_workers() : low(0), high(0), nthreads(0), running(0) {
+#endif
+        pthread_mutex_init(&mu, NULL);
+        pthread_cond_init(&cond, NULL);
+    }
+
+    pthread_mutex_t mu;
+    pthread_cond_t cond;
+
+    size_t low, high;
+    uint nthreads;
+    uint running;
+
+    // a pool is dropped from the work list when its owners go
+    list<weak_ptr<paillier_pool> > work;
+    list<weak_ptr<paillier_pool> > pools;
+};
+
+static pool_workers *
+workers()
+{
+    static pool_workers *w = new pool_workers();
+    return w;
+}
+
+paillier_pool::paillier_pool(const shared_ptr<const Paillier_priv> &sk,
+                             size_t low, size_t high)
+    : sk(sk), n(sk->pubkey()[0]), low(low), high(high), queued(false)
+{
+    pthread_mutex_init(&mu, NULL);
+    pthread_mutex_init(&rng_mu, NULL);
+}
+
+paillier_pool::~paillier_pool()
+{
+    pthread_mutex_destroy(&mu);
+    pthread_mutex_destroy(&rng_mu);
+}
+
+shared_ptr<paillier_pool>
+paillier_pool::create(const shared_ptr<const Paillier_priv> &sk)
+{
+    pool_workers *const w = workers();
+    scoped_lock l(&w->mu);
+
+    if (0 == w->high)
+        return shared_ptr<paillier_pool>();
+
+    shared_ptr<paillier_pool> p(new paillier_pool(sk, w->low, w->high));
+
+    for (auto it = w->pools.begin(); it != w->pools.end(); ) {
+        if (it->expired())
+            w->pools.erase(it++);
+        else
+            it++;
+    }
+    w->pools.push_back(p);
+
+    while (w->running < w->nthreads) {
+        pthread_t t;
+        throw_c(0 == pthread_create(&t, NULL, worker, w),
+                "cannot start paillier pool thread");
+        pthread_detach(t);
+        w->running++;
+    }
+
+    // start filling right away
+    p->queued = true;
+    w->work.push_back(p);
+    pthread_cond_signal(&w->cond);
+
+    return p;
+}
+
+ZZ
+paillier_pool::compute()
+{
+    ZZ r;
+    {
+        scoped_lock l(&rng_mu);
+        r = rng.rand_zz_mod(n);
+    }
+    return sk->rand_crt(r);
+}
+
+void
+paillier_pool::enqueue()
+{
+    pool_workers *const w = workers();
+    scoped_lock l(&w->mu);
+    w->work.push_back(shared_from_this());
+    pthread_cond_signal(&w->cond);
+}
+
+ZZ
+paillier_pool::take()
+{
+    ZZ rn;
+    bool stall = false;
+    bool enqueue = false;
+    {
+        scoped_lock l(&mu);
+
+        if (values.empty()) {
+            stall = true;
+            st.stalls++;
+        } else {
+            rn = values.front();
+            values.pop_front();
+        }
+        st.taken++;
+
+        if (values.size() < low && !queued) {
+            queued = true;
+            enqueue = true;
+        }
+    }
+
+    if (enqueue)
+        this->enqueue();
+
+    if (stall)
+        return compute();
+    return rn;
+}
+
+vector<ZZ>
+paillier_pool::take(size_t n)
+{
+    vector<ZZ> out;
+    out.reserve(n);
+    bool enqueue = false;
+    {
+        scoped_lock l(&mu);
+
+        while (out.size() < n && !values.empty()) {
+            out.push_back(values.front());
+            values.pop_front();
+        }
+        if (out.size() < n) {
+            st.stalls += n - out.size();
+        }
+        st.taken += n;
+
+        if (values.size() < low && !queued) {
+            queued = true;
+            enqueue = true;
+        }
+    }
+
+    if (enqueue)
+        this->enqueue();
+
+    while (out.size() < n) {
+        out.push_back(compute());
+    }
+    return out;
+}
+
+bool
+paillier_pool::refill_one()
+{
+    {
+        scoped_lock l(&mu);
+        if (values.size() >= high) {
+            queued = false;
+            return false;
+        }
+    }
+
+    // the expensive part runs without the pool lock
+    ZZ rn = compute();
+
+    scoped_lock l(&mu);
+    values.push_back(rn);
+    st.produced++;
+    return true;
+}
+
+paillier_pool::stats
+paillier_pool::get_stats() const
+{
+    scoped_lock l(&mu);
+
+    stats s = st;
+    s.depth = values.size();
+    return s;
+}
+
+void *
+paillier_pool::worker(void *arg)
+{
+    pool_workers *const w = static_cast<pool_workers *>(arg);
+
+    for (;;) {
+        weak_ptr<paillier_pool> wp;
+        {
+            scoped_lock l(&w->mu);
+            while (w->work.empty())
+                pthread_cond_wait(&w->cond, &w->mu);
+
+            wp = w->work.front();
+            w->work.pop_front();
+        }
+
+        // a value at a time, so that a pool is let go with its layer
+        for (;;) {
+            const shared_ptr<paillier_pool> p = wp.lock();
+            if (!p)
+                break;
+
+            try {
+                if (!p->refill_one())
+                    break;
+            } catch (...) {
+                // take() falls back to computing inline
+                scoped_lock l(&p->mu);
+                p->queued = false;
+                break;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+void
+paillier_pool::configure(size_t low, size_t high, uint nthreads)
+{
+    throw_c(low <= high, "paillier pool: low watermark above high");
+#ifndef NTL_THREADS
+    throw_c(0 == high, "paillier pool: NTL built without NTL_THREADS");
+#endif
+
+    pool_workers *const w = workers();
+    scoped_lock l(&w->mu);
+
+    w->low = low;
+    w->high = high;
+    w->nthreads = nthreads;
+}
+
+paillier_pool::stats
+paillier_pool::global_stats()
+{
+    pool_workers *const w = workers();
+    scoped_lock l(&w->mu);
+
+    stats total;
+    for (auto it : w->pools) {
+        const shared_ptr<paillier_pool> p = it.lock();
+        if (!p)
+            continue;
+
+        const stats s = p->get_stats();
+        total.depth    += s.depth;
+        total.produced += s.produced;
+        total.taken    += s.taken;
+        total.stalls   += s.stalls;
+    }
+
+    return total;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+#include <NTL/ZZ.h>
+#include <crypto/paillier.hh>
+#include <crypto/prng.hh>
+
+/*
+ * Pool of precomputed Paillier randomness for one key: the factor that
+ * Paillier_priv::rand_crt() derives from a random r.  A set of
+ * background threads shared by all pools refills a pool to its high
+ * watermark once it drops below its low watermark.  take() pops a
+ * value, or computes one inline when the pool is empty (a stall).
+ * A pool whose last owner drops it is not refilled any further.
+ *
+ * The refill threads run NTL next to the threads that own the pools,
+ * which only an NTL built with NTL_THREADS allows; without it there
+ * are no pools.
+ */
+class paillier_pool : public std::enable_shared_from_this<paillier_pool> {
+ public:
+    struct stats {
+        stats() : depth(0), produced(0), taken(0), stalls(0) {}
+
+        size_t depth;
+        uint64_t produced;
+        uint64_t taken;
+        uint64_t stalls;
+    };
+
+    /*
+     * Returns a new pool using the current configuration, or NULL when
+     * pools are disabled (a high watermark of 0, or no NTL_THREADS).
+     */
+    static std::shared_ptr<paillier_pool>
+        create(const std::shared_ptr<const Paillier_priv> &sk);
+
+    NTL::ZZ take();
+    // n values under one lock; the shortfall is computed inline
+    std::vector<NTL::ZZ> take(size_t n);
+    stats get_stats() const;
+
+    /*
+     * Watermarks for pools created afterwards, and the number of
+     * refill threads (started on first use, never shrunk).
+     */
+    static void configure(size_t low, size_t high, uint nthreads);
+
+    // totals over all live pools
+    static stats global_stats();
+
+    ~paillier_pool();
+
+ private:
+    paillier_pool(const std::shared_ptr<const Paillier_priv> &sk,
+                  size_t low, size_t high);
+    paillier_pool(const paillier_pool &other);
+    paillier_pool &operator=(const paillier_pool &rhs);
+
+    NTL::ZZ compute();
+    // adds one value; false once the pool is full
+    bool refill_one();
+    void enqueue();
+
+    static void *worker(void *arg);
+
+    const std::shared_ptr<const Paillier_priv> sk;
+    const NTL::ZZ n;
+    const size_t low, high;
+
+    mutable pthread_mutex_t mu;
+    std::list<NTL::ZZ> values;
+    bool queued;                    /* waiting for or being refilled */
+    stats st;
+
+    pthread_mutex_t rng_mu;
+    urandom rng;
+};
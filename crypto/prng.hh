@@ -103,8 +103,12 @@ class blockrng : public PRNG {
     }
 
     void set_ctr(const std::string &v) {
-        throw_c(v.size() == BlockCipher::blocksize);
-        memcpy(ctr, v.data(), BlockCipher::blocksize);
+        set_ctr(v.data(), v.size());
+    }
+
+    void set_ctr(const void *v, size_t len) {
+        throw_c(len == BlockCipher::blocksize);
+        memcpy(ctr, v, BlockCipher::blocksize);
     }
 
  private:
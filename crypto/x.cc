@@ -1,19 +1,24 @@
 #include <vector>
 #include <iomanip>
+#include <unistd.h>
 #include <crypto/cbc.hh>
 #include <crypto/cmc.hh>
 #include <crypto/prng.hh>
 #include <crypto/aes.hh>
+#include <crypto/BasicCrypto.hh>
 #include <crypto/blowfish.hh>
 #include <crypto/ope.hh>
+#include <crypto/ope_cache.hh>
 #include <crypto/arc4.hh>
 #include <crypto/hgd.hh>
 #include <crypto/sha.hh>
 #include <crypto/hmac.hh>
 #include <crypto/paillier.hh>
+#include <crypto/paillier_pool.hh>
 #include <crypto/bn.hh>
 #include <crypto/ecjoin.hh>
 #include <crypto/search.hh>
+#include <crypto/SWPSearch.hh>
 #include <crypto/skip32.hh>
 #include <crypto/cbcmac.hh>
 #include <crypto/ffx.hh>
@@ -22,6 +27,7 @@
 #include <crypto/mont.hh>
 #include <crypto/gfe.hh>
 #include <util/timer.hh>
+#include <util/util.hh>
 #include <NTL/ZZ.h>
 #include <NTL/RR.h>
 
@@ -120,6 +126,142 @@ test_ope(int pbits, int cbits)
                                                        : NumBits(to_ZZ(1/maxerr))) << endl;
 }
 
+static void
+test_ope_cache()
+{
+    urandom u;
+    const OPE o("ope cache", 32, 64);
+    throw_c(o.get_cache() != NULL);
+
+    // a second object with the same key and sizes shares the cache
+    const OPE o2("ope cache", 32, 64);
+    throw_c(o.get_cache() == o2.get_cache());
+
+    std::vector<ZZ> pts;
+    for (uint i = 0; i < 100; i++)
+        pts.push_back(u.rand_zz_mod(to_ZZ(1) << 32));
+
+    timer cold;
+    std::vector<ZZ> cts;
+    for (auto &pt: pts)
+        cts.push_back(o.encrypt(pt));
+    uint64_t cold_usec = cold.lap();
+
+    const ope_cache::stats before = o.get_cache()->get_stats();
+    for (uint i = 0; i < pts.size(); i++) {
+        throw_c(o2.encrypt(pts[i]) == cts[i]);
+        throw_c(o2.decrypt(cts[i]) == pts[i]);
+    }
+    uint64_t warm_usec = cold.lap();
+    const ope_cache::stats after = o.get_cache()->get_stats();
+    throw_c(after.hits - before.hits == 2 * pts.size());
+
+    // a tiny budget must evict rather than grow
+    ope_cache small(4096);
+    for (uint i = 0; i < 1000; i++)
+        small.insert(ope_cache::ENC, to_ZZ(i), to_ZZ(i) << 32);
+    const ope_cache::stats sst = small.get_stats();
+    throw_c(sst.bytes <= 4096);
+    throw_c(sst.evictions > 0);
+
+    // shared caches split one budget, however many keys there are
+    const size_t budget = ope_cache::global_budget();
+    ope_cache::set_global_budget(64 * 1024);
+    {
+        std::vector<std::unique_ptr<OPE> > opes;
+        for (uint k = 0; k < 4; k++) {
+            opes.emplace_back(new OPE("ope cache " + std::to_string(k),
+                                      32, 64));
+            for (uint i = 0; i < 200; i++)
+                opes.back()->encrypt(u.rand_zz_mod(to_ZZ(1) << 32));
+        }
+        const ope_cache::stats gst = ope_cache::global_stats();
+        throw_c(gst.bytes <= 64 * 1024);
+        throw_c(gst.evictions > 0);
+    }
+    ope_cache::set_global_budget(budget);
+
+    cout << "ope cache: " << cold_usec / pts.size() << " usec cold, "
+         << warm_usec / (2 * pts.size()) << " usec cached; "
+         << after.entries << " entries, " << after.bytes << " bytes" << endl;
+}
+
+static void
+test_ope_narrow(int pbits, int cbits)
+{
+    // measure the search itself, not the cache
+    const size_t budget = ope_cache::global_budget();
+    ope_cache::set_global_budget(0);
+    const OPE zzope("narrow ope", pbits, cbits, false);
+    const OPE nope("narrow ope", pbits, cbits);
+    ope_cache::set_global_budget(budget);
+    throw_c(!zzope.is_narrow() && nope.is_narrow());
+
+    urandom u;
+    enum { niter = 200 };
+    std::vector<ZZ> pts, cts;
+    for (uint i = 0; i < niter; i++)
+        pts.push_back(u.rand_zz_mod(to_ZZ(1) << pbits));
+
+    timer tzz;
+    for (auto &pt: pts)
+        cts.push_back(zzope.encrypt(pt));
+    uint64_t zz_enc = tzz.lap();
+    for (uint i = 0; i < niter; i++)
+        throw_c(zzope.decrypt(cts[i]) == pts[i]);
+    uint64_t zz_dec = tzz.lap();
+
+    timer tn;
+    for (uint i = 0; i < niter; i++)
+        throw_c(nope.encrypt(pts[i]) == cts[i]);
+    uint64_t n_enc = tn.lap();
+    for (uint i = 0; i < niter; i++)
+        throw_c(nope.decrypt(cts[i]) == pts[i]);
+    uint64_t n_dec = tn.lap();
+
+    cout << "--- ope narrow: " << pbits << "-bit plaintext, "
+         << cbits << "-bit ciphertext" << endl
+         << "  ZZ:     " << niter * 1000000 / zz_enc << " enc/sec, "
+         << niter * 1000000 / zz_dec << " dec/sec" << endl
+         << "  native: " << niter * 1000000 / n_enc << " enc/sec, "
+         << niter * 1000000 / n_dec << " dec/sec" << endl;
+}
+
+static void
+test_ope_batch(int pbits, int cbits, bool allow_narrow)
+{
+    const size_t budget = ope_cache::global_budget();
+    ope_cache::set_global_budget(0);
+    const OPE o("batch ope", pbits, cbits, allow_narrow);
+    ope_cache::set_global_budget(budget);
+
+    // a sorted bulk load: dense, with duplicates
+    urandom u;
+    enum { niter = 2000 };
+    const ZZ base = u.rand_zz_mod(to_ZZ(1) << (pbits - 1));
+    std::vector<ZZ> pts;
+    for (uint i = 0; i < niter; i++)
+        pts.push_back(base + u.rand_zz_mod(to_ZZ(niter)));
+
+    timer t;
+    std::vector<ZZ> cts;
+    for (auto &pt: pts)
+        cts.push_back(o.encrypt(pt));
+    uint64_t single = t.lap();
+
+    const std::vector<ZZ> bcts = o.encrypt_batch(pts);
+    uint64_t batch = t.lap();
+
+    throw_c(bcts == cts);
+    throw_c(o.encrypt_batch(std::vector<ZZ>()).empty());
+
+    cout << "--- ope batch: " << pbits << "-bit plaintext, "
+         << cbits << "-bit ciphertext" << (o.is_narrow() ? " (narrow)" : "")
+         << endl
+         << "  single: " << niter * 1000000 / single << " enc/sec" << endl
+         << "  batch:  " << niter * 1000000 / batch << " enc/sec" << endl;
+}
+
 static void
 test_hgd()
 {
@@ -169,6 +311,21 @@ test_paillier()
     cout << "paillier add: "
          << ((double) sumperf.lap()) / 1000 << " usec" << endl;
 
+    ZZ c = pp.encrypt_crt(pt0);
+    throw_c(pp.decrypt(c) == pt0);
+    throw_c(pp.decrypt(p.add(c, pp.encrypt_crt(pt1))) == (pt0 + pt1));
+
+    enum { nenc = 100 };
+    timer encperf;
+    for (int i = 0; i < nenc; i++)
+        p.encrypt(pt0);
+    double pub_usec = ((double) encperf.lap()) / nenc;
+    for (int i = 0; i < nenc; i++)
+        pp.encrypt_crt(pt0);
+    double crt_usec = ((double) encperf.lap()) / nenc;
+    cout << "paillier encrypt: " << pub_usec << " usec public, "
+         << crt_usec << " usec crt" << endl;
+
     for (int i = 0; i < 10; i++) {
         blockrng<AES> br(u.rand_string(16));
         auto v = u.rand_string(AES::blocksize);
@@ -182,6 +339,57 @@ test_paillier()
     }
 }
 
+static void
+test_paillier_pool()
+{
+    urandom u;
+    auto sk = std::make_shared<Paillier_priv>(Paillier_priv::keygen(&u));
+
+#ifndef NTL_THREADS
+    // the refill threads need a thread-safe NTL
+    throw_c(paillier_pool::create(sk) == NULL);
+#else
+
+    enum { low = 8, high = 32 };
+    paillier_pool::configure(low, high, 2);
+    auto pool = paillier_pool::create(sk);
+    throw_c(pool != NULL);
+
+    while (pool->get_stats().depth < high)
+        usleep(1000);
+
+    ZZ pt = u.rand_zz_mod(to_ZZ(1) << 64);
+    std::vector<ZZ> cts;
+    timer t;
+    for (uint i = 0; i < high; i++)
+        cts.push_back(sk->encrypt_crt(pt, pool->take()));
+    double pooled = ((double) t.lap()) / high;
+    for (uint i = 0; i < high; i++)
+        cts.push_back(sk->encrypt_crt(pt));
+    double inline_usec = ((double) t.lap()) / high;
+
+    for (auto &ct: cts)
+        throw_c(sk->decrypt(ct) == pt);
+
+    paillier_pool::stats st = pool->get_stats();
+    throw_c(st.taken == high);
+    cout << "paillier pool: encrypt " << pooled << " usec pooled, "
+         << inline_usec << " usec inline; " << st.stalls << " stalls" << endl;
+
+    // a dropped pool is let go by the refill threads too
+    pool->take(high);
+    std::weak_ptr<paillier_pool> dropped(pool);
+    pool.reset();
+    while (!dropped.expired())
+        usleep(1000);
+
+    // disabled pools
+    paillier_pool::configure(0, 0, 0);
+    throw_c(paillier_pool::create(sk) == NULL);
+    paillier_pool::configure(32, 128, 1);
+#endif
+}
+
 static void
 test_paillier_packing()
 {
@@ -281,6 +489,47 @@ test_montgomery()
     for (int i = 0; i < 100000; i++)
         mp = mm.mmul(mp, mx);
     cout << "montgomery multiply: " << tmont.lap() << " usec for 100k" << endl;
+
+    // limb-array version, fed bytes the way cryptdb_agg gets them
+    const size_t mlen = NumBytes(m);
+    std::vector<uint8_t> mbytes(mlen), cbytes(mlen), obytes(mlen);
+    BytesFromZZ(mbytes.data(), m, mlen);
+    mont_mpn mn(mbytes.data(), mlen);
+    std::vector<mp_limb_t> acc(mn.nlimbs());
+
+    for (uint nmul = 0; nmul < 50; nmul++) {
+        ZZ prod = to_ZZ(1);
+        mn.one(acc.data());
+        for (uint i = 0; i < nmul; i++) {
+            ZZ c = u.rand_zz_mod(m);
+            BytesFromZZ(cbytes.data(), c, mlen);
+            mn.mul_bytes(acc.data(), cbytes.data(), mlen);
+            MulMod(prod, prod, c, m);
+        }
+        mn.from_mont(acc.data(), nmul);
+        mn.to_bytes(acc.data(), obytes.data(), mlen);
+        throw_c(prod == ZZFromBytes(obytes.data(), mlen));
+    }
+
+    cout << "mont_mpn ok" << endl;
+
+    BytesFromZZ(cbytes.data(), x, mlen);
+    timer tbytes;
+    ZZ q = to_ZZ(1);
+    for (int i = 0; i < 100000; i++) {
+        ZZ c = ZZFromBytes(cbytes.data(), mlen);
+        MulMod(q, q, c, m);
+    }
+    cout << "bytes + regular multiply: " << tbytes.lap()
+         << " usec for 100k" << endl;
+
+    timer tmpn;
+    mn.one(acc.data());
+    for (int i = 0; i < 100000; i++)
+        mn.mul_bytes(acc.data(), cbytes.data(), mlen);
+    mn.from_mont(acc.data(), 100000);
+    cout << "bytes + mont_mpn multiply: " << tmpn.lap()
+         << " usec for 100k" << endl;
 }
 
 static void
@@ -334,6 +583,198 @@ test_search()
     throw_c(s.match(cl, s.wordkey("world")));
 }
 
+static void
+test_swp_matcher()
+{
+    urandom u;
+    const string key = u.rand_string(AES_BLOCK_SIZE);
+
+    list<string> words;
+    for (int i = 0; i < 200; i++)
+        words.push_back("word" + to_string(i));
+
+    const unique_ptr<list<string> > ciphs(SWP::encrypt(key, words));
+    string field;
+    for (auto &c: *ciphs)
+        field += c;
+    const uint8_t *const fp = (const uint8_t *) field.data();
+
+    // hits at every position of a batch, and misses
+    for (int i = 0; i < 250; i++) {
+        const Token t = SWP::token(key, "word" + to_string(i));
+        SWPMatcher m(t);
+        throw_c(m.exists(fp, field.size()) == SWP::searchExists(t, *ciphs));
+        throw_c(m.exists(fp, field.size()) == (i < 200));
+    }
+
+    const Token t = SWP::token(key, "missing");
+    SWPMatcher m(t);
+
+    timer tlist;
+    for (int i = 0; i < 100; i++)
+        SWP::searchExists(t, *ciphs);
+    const double list_ns = tlist.lap() * 1000.0 / (100 * words.size());
+
+    timer tmatch;
+    for (int i = 0; i < 10000; i++)
+        m.exists(fp, field.size());
+    const double match_ns = tmatch.lap() * 1000.0 / (10000 * words.size());
+
+    cout << "swp search: list " << list_ns << " ns/word, in place "
+         << match_ns << " ns/word" << endl;
+}
+
+/*
+ * The AES modes behind the string layers, on each backend: RND_str is
+ * CBC under a salt IV, DET_str and DETJOIN_str are CMC.  Each is
+ * checked against the AES_KEY code and timed on short and long values.
+ */
+static void
+test_aes_layers()
+{
+    urandom u;
+    const string key = u.rand_string(AES_KEY_BYTES);
+    const unique_ptr<AES_KEY> ek(get_AES_enc_key(key));
+    const string salt = BytesFromInt(u.rand<uint64_t>(), SALT_LEN_BYTES);
+
+    for (auto be: {aes_backend::TABLE, aes_backend::AESNI}) {
+        if (!AES::supported(be))
+            continue;
+
+        const AES aes(key, be);
+        const string bname = AES::backend_name(be);
+
+        for (uint len = 0; len < 100; len++) {
+            const string pt = u.rand_string(len);
+            const string rnd = encrypt_AES_CBC(pt, aes, salt);
+            throw_c(rnd == encrypt_AES_CBC(pt, ek.get(), salt));
+            throw_c(pt == decrypt_AES_CBC(rnd, aes, salt));
+
+            const string det = encrypt_AES_CMC(pt, aes);
+            throw_c(det == encrypt_AES_CMC(pt, ek.get()));
+            throw_c(pt == decrypt_AES_CMC(det, aes));
+        }
+
+        for (uint len: {32, 1024}) {
+            const string pt = u.rand_string(len);
+            const string rnd = encrypt_AES_CBC(pt, aes, salt);
+            const string det = encrypt_AES_CMC(pt, aes);
+            enum { nperf = 20000 };
+
+            timer t;
+            for (uint i = 0; i < nperf; i++)
+                encrypt_AES_CBC(pt, aes, salt);
+            const uint64_t rnd_enc = t.lap();
+            for (uint i = 0; i < nperf; i++)
+                decrypt_AES_CBC(rnd, aes, salt);
+            const uint64_t rnd_dec = t.lap();
+            for (uint i = 0; i < nperf; i++)
+                encrypt_AES_CMC(pt, aes);
+            const uint64_t det_enc = t.lap();
+            for (uint i = 0; i < nperf; i++)
+                decrypt_AES_CMC(det, aes);
+            const uint64_t det_dec = t.lap();
+
+            // bytes per usec is MB/s
+            cout << bname << " " << len << "-byte values, MB/s:"
+                 << " RND_str enc " << len * nperf / rnd_enc
+                 << " dec " << len * nperf / rnd_dec
+                 << ", DET_str enc " << len * nperf / det_enc
+                 << " dec " << len * nperf / det_dec << endl;
+        }
+
+        // independent messages: one at a time vs. interleaved
+        enum { nmsg = 64, nblocks = 4, nrounds = 2000 };
+        const string pts = u.rand_string(nmsg * nblocks * AES::blocksize);
+        const string ivs = u.rand_string(nmsg * AES::blocksize);
+        string one(pts.size(), 0), batch(pts.size(), 0);
+        const uint8_t *pp[nmsg], *ip[nmsg];
+        uint8_t *cp[nmsg];
+        size_t nb[nmsg];
+        for (uint i = 0; i < nmsg; i++) {
+            pp[i] = (const uint8_t *) &pts[i * nblocks * AES::blocksize];
+            ip[i] = (const uint8_t *) &ivs[i * AES::blocksize];
+            cp[i] = (uint8_t *) &batch[i * nblocks * AES::blocksize];
+            nb[i] = nblocks;
+        }
+
+        timer tb;
+        for (uint r = 0; r < nrounds; r++)
+            for (uint i = 0; i < nmsg; i++)
+                aes.cbc_encrypt(ip[i], pp[i],
+                                &one[i * nblocks * AES::blocksize], nblocks);
+        const uint64_t serial = tb.lap();
+        for (uint r = 0; r < nrounds; r++)
+            aes.cbc_encrypt_batch(nmsg, ip, pp, cp, nb);
+        const uint64_t interleaved = tb.lap();
+        throw_c(one == batch);
+
+        cout << bname << " cbc of " << nmsg << " messages, MB/s: one at a time "
+             << pts.size() * nrounds / serial << ", batched "
+             << pts.size() * nrounds / interleaved << endl;
+    }
+}
+
+/*
+ * Column encryption as an INSERT of many rows does it: the batch forms
+ * must match one-at-a-time encryption value for value.
+ */
+static void
+test_column_encrypt()
+{
+    urandom u;
+    const string key = u.rand_string(AES_KEY_BYTES);
+    const AES aes(key);
+
+    enum { nvals = 1000, nrounds = 20 };
+    vector<string> pts, salts;
+    for (uint i = 0; i < nvals; i++) {
+        pts.push_back(u.rand_string(i % 40));
+        salts.push_back(BytesFromInt(u.rand<uint64_t>(), SALT_LEN_BYTES));
+    }
+
+    const vector<string> rnd = encrypt_AES_CBC_batch(pts, aes, salts);
+    const vector<string> det = encrypt_AES_CMC_batch(pts, aes);
+    throw_c(rnd.size() == nvals && det.size() == nvals);
+    for (uint i = 0; i < nvals; i++) {
+        throw_c(rnd[i] == encrypt_AES_CBC(pts[i], aes, salts[i]));
+        throw_c(det[i] == encrypt_AES_CMC(pts[i], aes));
+    }
+
+    timer t;
+    for (uint r = 0; r < nrounds; r++)
+        for (uint i = 0; i < nvals; i++)
+            encrypt_AES_CMC(pts[i], aes);
+    const uint64_t one = t.lap();
+    for (uint r = 0; r < nrounds; r++)
+        encrypt_AES_CMC_batch(pts, aes);
+    const uint64_t batch = t.lap();
+    cout << "DET_str column of " << nvals << ": one at a time "
+         << one / nrounds << " usec, batched " << batch / nrounds
+         << " usec" << endl;
+
+    // SWP: rows of text sharing a vocabulary
+    const string swpkey = u.rand_string(AES_BLOCK_SIZE);
+    vector<list<string> > texts(200);
+    for (uint i = 0; i < texts.size(); i++)
+        for (uint j = 0; j < 10; j++)
+            texts[i].push_back("word" + to_string((i * 7 + j * 13) % 50));
+
+    timer ts;
+    vector<unique_ptr<list<string> > > swp_one;
+    for (auto &words: texts)
+        swp_one.emplace_back(SWP::encrypt(swpkey, words));
+    const uint64_t swp_serial = ts.lap();
+    const vector<list<string> > swp_batch = SWP::encryptBatch(swpkey, texts);
+    const uint64_t swp_batched = ts.lap();
+
+    for (uint i = 0; i < texts.size(); i++)
+        throw_c(*swp_one[i] == swp_batch[i]);
+    cout << "SEARCH column of " << texts.size() << ": one at a time "
+         << swp_serial << " usec, batched " << swp_batched << " usec"
+         << endl;
+}
+
 static void
 test_skip32(void)
 {
@@ -615,16 +1056,24 @@ main(int ac, char **av)
     test_bn();
     test_ecjoin();
     test_search();
+    test_swp_matcher();
     test_paillier();
     test_paillier_packing();
+    test_paillier_pool();
     test_montgomery();
     test_skip32();
     test_online_ope();
     test_ffx();
 
+    test_aes_layers();
+    test_column_encrypt();
+
     AES aes128(u.rand_string(16));
     test_block_cipher(&aes128, &u, "aes-128");
 
+    AES aes128t(u.rand_string(16), aes_backend::TABLE);
+    test_block_cipher(&aes128t, &u, "aes-128-table");
+
     AES aes256(u.rand_string(32));
     test_block_cipher(&aes256, &u, "aes-256");
 
@@ -651,6 +1100,13 @@ main(int ac, char **av)
     cout << dec << endl;
 
     test_hgd();
+    test_ope_cache();
+    test_ope_narrow(8, 16);
+    test_ope_narrow(16, 32);
+    test_ope_narrow(32, 64);
+    test_ope_batch(32, 64, true);
+    test_ope_batch(32, 64, false);
+    test_ope_batch(64, 128, true);
 
     for (int pbits = 32; pbits <= 128; pbits += 32)
         for (int cbits = pbits; cbits <= pbits + 128; cbits += 32)
@@ -453,19 +453,18 @@ static void
 embeddedTHDCleanup(THD *thd)
 {
     thd->clear_data_list();
-    --thread_count;
     // thd->unlink() is called in by THD destructor
     // > THD::~THD()
     //     ilink::~ilink()
     //       ilink::unlink()
     // free_root(thd->main_mem_root, 0) is called in THD::~THD
-    delete thd;
+    deleteEmbeddedTHD(thd);
 }
 
 void
 ProxyState::safeCreateEmbeddedTHD()
 {
-    THD *thd = static_cast<THD *>(create_embedded_thd(0));
+    THD *const thd = createEmbeddedTHD();
     assert(thd);
     thds.push_back(std::unique_ptr<THD,
                                    void (*)(THD *)>(thd,
@@ -549,9 +548,10 @@ bool CreateDelta::apply(const std::unique_ptr<Connect> &e_conn,
             " '" + esc_serial_key + "',"
             " " + std::to_string(parent_id) + ","
             " " + std::to_string(old_object_id.get()) + ");";
-        RETURN_FALSE_IF_FALSE(e_conn->execute(query));
+        Connect::Outcome outcome;
+        RETURN_FALSE_IF_FALSE(e_conn->execute(query, &outcome));
 
-        const unsigned int object_id = e_conn->last_insert_id();
+        const unsigned int object_id = outcome.insert_id;
 
         if (BLEEDING_TABLE == table_type) {
             assert(this->id_cache.find(&object) == this->id_cache.end());
@@ -560,6 +560,9 @@ bool CreateDelta::apply(const std::unique_ptr<Connect> &e_conn,
             assert(REGULAR_TABLE == table_type);
             // should only be used one time
             this->id_cache.erase(&object);
+            if (meta.get() == &object) {
+                this->created_id = object_id;
+            }
         }
 
         std::function<bool(const DBMeta &)> localCreateHandler =
@@ -584,8 +587,17 @@ bool CreateDelta::apply(const std::unique_ptr<Connect> &e_conn,
     return b;
 }
 
-// FIXME: used incorrectly, as we should be doing copy construction
-// on the original object; not modifying it in place
+// The new objects only get their ids from the database, so they are
+// read back from it.
+bool CreateDelta::update(SchemaUpdate *const update,
+                         const std::unique_ptr<Connect> &e_conn) const
+{
+    DBMeta *const parent = update->writable(parent_meta);
+    RFIF(parent && 0 != this->created_id);
+
+    return NULL != parent->fetchChild(e_conn, this->created_id);
+}
+
 bool ReplaceDelta::apply(const std::unique_ptr<Connect> &e_conn,
                          TableType table_type)
 {
@@ -593,9 +605,7 @@ bool ReplaceDelta::apply(const std::unique_ptr<Connect> &e_conn,
 
     const unsigned int child_id = meta.getDatabaseID();
 
-    const std::string child_serial = meta.serialize(parent_meta);
-    const std::string esc_child_serial =
-        escapeString(e_conn, child_serial);
+    const std::string esc_child_serial = escapeString(e_conn, serial);
     const std::string serial_key = key.getSerial();
     const std::string esc_serial_key = escapeString(e_conn, serial_key);
 
@@ -609,6 +619,16 @@ bool ReplaceDelta::apply(const std::unique_ptr<Connect> &e_conn,
     return true;
 }
 
+bool ReplaceDelta::update(SchemaUpdate *const update,
+                          const std::unique_ptr<Connect> &e_conn) const
+{
+    DBMeta *const copy = update->writable(meta);
+    RFIF(copy);
+
+    change(copy);
+    return true;
+}
+
 bool DeleteDelta::apply(const std::unique_ptr<Connect> &e_conn,
                         TableType table_type)
 {
@@ -640,6 +660,12 @@ bool DeleteDelta::apply(const std::unique_ptr<Connect> &e_conn,
     return helper(meta, parent_meta);
 }
 
+bool DeleteDelta::update(SchemaUpdate *const update,
+                         const std::unique_ptr<Connect> &e_conn) const
+{
+    return update->drop(meta, parent_meta);
+}
+
 bool
 writeDeltas(const std::unique_ptr<Connect> &e_conn,
             const std::vector<std::unique_ptr<Delta> > &deltas,
@@ -681,8 +707,9 @@ deltaOutputBeforeQuery(const std::unique_ptr<Connect> &e_conn,
         "           (SELECT DATABASE()),  FALSE,"
         "           '" + TypeText<CompletionType>::toText(completion_type) + "'"
         "          );";
-    ROLLBACK_AND_RFIF(e_conn->execute(q_completion), e_conn);
-    *embedded_completion_id = e_conn->last_insert_id();
+    Connect::Outcome outcome;
+    ROLLBACK_AND_RFIF(e_conn->execute(q_completion, &outcome), e_conn);
+    *embedded_completion_id = outcome.insert_id;
     assert(*embedded_completion_id);
 
     ROLLBACK_AND_RFIF(writeDeltas(e_conn, deltas, Delta::BLEEDING_TABLE), e_conn);
@@ -936,7 +963,7 @@ SECLEVEL Analysis::getOnionLevel(const FieldMeta &fm, onion o)
     return Analysis::getOnionLevel(this->getOnionMeta(fm, o));
 }
 
-const std::vector<std::unique_ptr<EncLayer> > &
+const std::vector<std::shared_ptr<EncLayer> > &
 Analysis::getEncLayers(const OnionMeta &om)
 {
     return om.getLayers();
@@ -5,6 +5,9 @@
 #include <util/cryptdb_log.hh>
 #include <main/schema.hh>
 #include <main/rewrite_ds.hh>
+#include <main/crypto_pool.hh>
+#include <main/arena_alloc.hh>
+#include <main/rewrite_cache.hh>
 #include <parser/embedmysql.hh>
 #include <parser/stringify.hh>
 
@@ -15,14 +18,15 @@ extern "C" void *create_embedded_thd(int client_flag);
 class ReturnField {
 public:
     ReturnField(bool is_salt, const std::string &field_called,
-                const OLK &olk, int salt_pos)
+                const OLK &olk, int salt_pos, int value_pos = -1)
         : is_salt(is_salt), field_called(field_called), olk(olk),
-          salt_pos(salt_pos) {}
+          salt_pos(salt_pos), value_pos(value_pos) {}
 
     bool getIsSalt() const {return is_salt;}
     std::string fieldCalled() const {return field_called;}
     const OLK getOLK() const {return olk;}
     int getSaltPosition() const {return salt_pos;}
+    int getValuePosition() const {return value_pos;}
     std::string stringify();
 
 private:
@@ -32,6 +36,9 @@ private:
     const int salt_pos; // position of salt of this field in
                         // the query results, or -1 if such
                         // salt was not requested
+    const int value_pos; // position of the column to decrypt for
+                         // this field (a shared packed HOM sum), or
+                         // -1 for its own
 };
 
 typedef struct ReturnMeta {
@@ -95,6 +102,7 @@ private:
     const std::unique_ptr<Connect> conn;
     const SECURITY_RATING default_sec_rating;
     const SchemaCache cache;
+    const RewriteCache rewrite_cache;
 } SharedProxyState;
 
 class ProxyState {
@@ -111,6 +119,8 @@ public:
     void safeCreateEmbeddedTHD();
     void dumpTHDs();
     const SchemaCache &getSchemaCache() const {return shared.cache;}
+    const RewriteCache &getRewriteCache() const
+        {return shared.rewrite_cache;}
     std::shared_ptr<const SchemaInfo> getSchemaInfo() const
         {return shared.cache.getSchema(this->getConn(), this->getEConn());}
 
@@ -137,6 +147,13 @@ public:
     virtual bool apply(const std::unique_ptr<Connect> &e_conn,
                        TableType table_type) = 0;
 
+    /*
+     * Make the same change to a copy of the schema the Delta was built
+     * against; only after apply() to the REGULAR_TABLE.
+     */
+    virtual bool update(SchemaUpdate *const update,
+                        const std::unique_ptr<Connect> &e_conn) const = 0;
+
 protected:
     const DBMeta &parent_meta;
 
@@ -162,14 +179,19 @@ public:
     CreateDelta(std::unique_ptr<DBMeta> &&meta,
                 const DBMeta &parent_meta,
                 IdentityMetaKey key)
-        : AbstractCreateDelta(parent_meta, key), meta(std::move(meta)) {}
+        : AbstractCreateDelta(parent_meta, key), meta(std::move(meta)),
+          created_id(0) {}
 
     bool apply(const std::unique_ptr<Connect> &e_conn,
                TableType table_type);
+    bool update(SchemaUpdate *const update,
+                const std::unique_ptr<Connect> &e_conn) const;
 
 private:
     const std::unique_ptr<DBMeta> meta;
     std::map<const DBMeta *, unsigned int> id_cache;
+    // the id of meta in the REGULAR_TABLE
+    unsigned int created_id;
 };
 
 class DerivedKeyDelta : public Delta {
@@ -185,13 +207,27 @@ protected:
     const AbstractMetaKey &key;
 };
 
+/*
+ * @changed is the query's own copy of @meta, with @change made to it;
+ * see Analysis::writable().  update() makes @change again to the
+ * cache's copy, as @meta itself is shared and never changes.
+ */
 class ReplaceDelta : public DerivedKeyDelta {
 public:
-    ReplaceDelta(const DBMeta &meta, const DBMeta &parent_meta)
-        : DerivedKeyDelta(meta, parent_meta) {}
+    ReplaceDelta(const DBMeta &meta, const DBMeta &parent_meta,
+                 const DBMeta &changed,
+                 std::function<void(DBMeta *)> change)
+        : DerivedKeyDelta(meta, parent_meta),
+          serial(changed.serialize(parent_meta)), change(change) {}
 
     bool apply(const std::unique_ptr<Connect> &e_conn,
                TableType table_type);
+    bool update(SchemaUpdate *const update,
+                const std::unique_ptr<Connect> &e_conn) const;
+
+private:
+    const std::string serial;
+    const std::function<void(DBMeta *)> change;
 };
 
 class DeleteDelta : public DerivedKeyDelta {
@@ -201,6 +237,8 @@ public:
 
     bool apply(const std::unique_ptr<Connect> &e_conn,
                TableType table_type);
+    bool update(SchemaUpdate *const update,
+                const std::unique_ptr<Connect> &e_conn) const;
 };
 
 class Rewriter;
@@ -266,30 +304,56 @@ public:
     Analysis(const std::string &default_db, const SchemaInfo &schema,
              const std::unique_ptr<AES_KEY> &master_key,
              SECURITY_RATING default_sec_rating)
-        : pos(0), inject_alias(false), summation_hack(false),
+        : pos(0), salts(&query_arena), rewritePlans(&query_arena),
+          item_cache(&query_arena),
+          inject_alias(false), summation_hack(false),
+          trace_constants(false),
           db_name(default_db), schema(schema), master_key(master_key),
           default_sec_rating(default_sec_rating) {}
     Analysis(const Analysis &analysis)
-        : pos(0), inject_alias(false), summation_hack(false),
+        : pos(0), salts(&query_arena), rewritePlans(&query_arena),
+          item_cache(&query_arena),
+          inject_alias(false), summation_hack(false),
+          trace_constants(false),
           db_name(analysis.getDatabaseName()), schema(analysis.getSchema()),
           master_key(analysis.getMasterKey()),
           default_sec_rating(analysis.getDefaultSecurityRating()) {}
 
     unsigned int pos; // > a counter indicating how many projection
                       // fields have been analyzed so far
-    std::map<const FieldMeta *, const salt_type> salts;
-    std::map<const Item *, std::unique_ptr<RewritePlan> > rewritePlans;
+    // the lookups of the rewrite passes; their nodes are freed with
+    // the Analysis, in one go
+    CryptoPool::Arena query_arena;
+    ArenaHashMap<const FieldMeta *, const salt_type> salts;
+    ArenaHashMap<const Item *, std::unique_ptr<RewritePlan> > rewritePlans;
     std::map<std::string, std::map<const std::string, const std::string>>
         table_aliases;
-    std::map<const Item_field *, std::pair<Item_field *, OLK>> item_cache;
+    ArenaHashMap<const Item_field *, std::pair<Item_field *, OLK> >
+        item_cache;
 
     // information for decrypting results
     ReturnMeta rmeta;
+    // projected SUMs over packed HOM columns -> their position
+    std::map<std::string, unsigned int> packed_sums;
+    // Items that CryptoPool threads built for this query
+    std::list<std::unique_ptr<CryptoPool::Arena> > arenas;
 
     bool inject_alias;
     bool summation_hack;
     KillZone kill_zone;
 
+    // The constants encrypt_item() rewrote, in order, if
+    // trace_constants is set; RewriteCache makes plans of them.
+    struct Constant {
+        const Item *plain;
+        const Item *rewritten;
+        // empty for a constant that was copied
+        std::vector<std::shared_ptr<EncLayer> > layers;
+        uint64_t IV;
+    };
+    bool trace_constants;
+    std::vector<Constant> constants;
+
     // These functions are prefered to their lower level counterparts.
     bool addAlias(const std::string &alias, const std::string &db,
                   const std::string &table);
@@ -327,9 +391,13 @@ public:
     static const EncLayer &getBackEncLayer(const OnionMeta &om);
     static SECLEVEL getOnionLevel(const OnionMeta &om);
     SECLEVEL getOnionLevel(const FieldMeta &fm, onion o);
-    static const std::vector<std::unique_ptr<EncLayer> > &
+    static const std::vector<std::shared_ptr<EncLayer> > &
         getEncLayers(const OnionMeta &om);
     const SchemaInfo &getSchema() const {return schema;}
+    // This query's copy of @meta, for changes that go out in a
+    // ReplaceDelta; the schema itself is shared by every client.
+    template <typename Type>
+    Type &writable(const Type &meta);
 
     std::vector<std::unique_ptr<Delta> > deltas;
 
@@ -346,6 +414,8 @@ private:
     const SchemaInfo &schema;
     const std::unique_ptr<AES_KEY> &master_key;
     const SECURITY_RATING default_sec_rating;
+    // copies of the objects this query changed; NULL until writable()
+    std::unique_ptr<SchemaUpdate> draft;
 
     bool isAlias(const std::string &db,
                  const std::string &table) const;
@@ -353,6 +423,19 @@ private:
                              const std::string &table) const;
 };
 
+template <typename Type>
+Type &
+Analysis::writable(const Type &meta)
+{
+    if (!this->draft) {
+        this->draft.reset(new SchemaUpdate(this->schema));
+    }
+    DBMeta *const copy = this->draft->writable(meta);
+    TEST_Text(copy, "object is not part of the schema");
+
+    return *static_cast<Type *>(copy);
+}
+
 bool
 lowLevelGetCurrentDatabase(const std::unique_ptr<Connect> &c,
                            std::string *const out_db);
@@ -13,6 +13,7 @@
 #include <memory>
 
 #include <util/cryptdb_log.hh>
+#include <util/scoped_lock.hh>
 #include <main/Connect.hh>
 #include <main/macro_util.hh>
 #include <main/Analysis.hh>
@@ -24,6 +25,7 @@ Connect::Connect(const std::string &server, const std::string &user,
                  const std::string &passwd, uint port)
     : conn(nullptr), close_on_destroy(true)
 {
+    pthread_mutex_init(&lock, NULL);
     do_connect(server, user, passwd, port);
 }
 
@@ -99,7 +101,7 @@ Connect *Connect::getEmbedded(const std::string &embed_db)
 //   sets returned when CALLing a stored procedure.
 bool
 Connect::execute(const std::string &query, std::unique_ptr<DBResult> *res,
-                 bool multiple_resultsets)
+                 bool multiple_resultsets, Outcome *outcome)
 {
     //silently ignore empty queries
     if (query.length() == 0) {
@@ -108,48 +110,57 @@ Connect::execute(const std::string &query, std::unique_ptr<DBResult> *res,
         return true;
     }
     bool success = true;
-    if (mysql_query(conn, query.c_str())) {
-        LOG(warn) << "mysql_query: " << mysql_error(conn);
-        LOG(warn) << "on query: " << query;
-        *res = nullptr;
-        success = false;
-    } else {
-        if (false == multiple_resultsets) {
-            *res = std::unique_ptr<DBResult>(DBResult::store(conn));
+    {
+        scoped_lock l(&lock);
+        if (mysql_query(conn, query.c_str())) {
+            LOG(warn) << "mysql_query: " << mysql_error(conn);
+            LOG(warn) << "on query: " << query;
+            *res = nullptr;
+            success = false;
         } else {
-            // iterate through each result set; if a query leading to
-            // one of the resultsets failed, it will be the last resultset,
-            // so get the error value
-            const bool errno_success = 0 == mysql_errno(conn);
-            while (true) {
-                DBResult_native *const res_native =
-                    mysql_store_result(conn);
-
-                const int status = mysql_next_result(conn);
-                if (0 == status) {                  // another result
-                    if (res_native) {
-                        mysql_free_result(res_native);
+            if (false == multiple_resultsets) {
+                *res = std::unique_ptr<DBResult>(DBResult::store(conn));
+            } else {
+                // iterate through each result set; if a query leading to
+                // one of the resultsets failed, it will be the last resultset,
+                // so get the error value
+                const bool errno_success = 0 == mysql_errno(conn);
+                while (true) {
+                    DBResult_native *const res_native =
+                        mysql_store_result(conn);
+
+                    const int status = mysql_next_result(conn);
+                    if (0 == status) {                  // another result
+                        if (res_native) {
+                            mysql_free_result(res_native);
+                        }
+                    } else if (-1 == status) {          // last result
+                        *res = std::unique_ptr<DBResult>(
+                            new DBResult(res_native, errno_success,
+                                         mysql_affected_rows(conn),
+                                         mysql_insert_id(conn)));
+                        break;
+                    } else {                            // error
+                        thrower() << "error occurred processing multiple"
+                                     " query results";
                     }
-                } else if (-1 == status) {          // last result
-                    *res = std::unique_ptr<DBResult>(
-                        new DBResult(res_native, errno_success,
-                                     mysql_affected_rows(conn),
-                                     mysql_insert_id(conn)));
-                    break;
-                } else {                            // error
-                    thrower() << "error occurred processing multiple"
-                                 " query results";
                 }
+
+                *res = nullptr;
             }
+        }
 
-            *res = nullptr;
+        if (outcome) {
+            outcome->insert_id = mysql_insert_id(conn);
+            outcome->err = mysql_errno(conn);
+            outcome->error = mysql_error(conn);
         }
     }
 
     if (thread_ps) {
         thread_ps->safeCreateEmbeddedTHD();
     } else {
-        assert(create_embedded_thd(0));
+        assert(createEmbeddedTHD());
     }
 
     return success;
@@ -166,15 +177,19 @@ Connect::execute(const std::string &query, bool multiple_resultsets)
     return r && aux->getSuccess();
 }
 
-std::string
-Connect::getError()
+bool
+Connect::execute(const std::string &query, Outcome *const outcome,
+                 bool multiple_resultsets)
 {
-    return mysql_error(conn);
+    std::unique_ptr<DBResult> aux;
+    const bool r = execute(query, &aux, multiple_resultsets, outcome);
+    return r && aux->getSuccess();
 }
 
 my_ulonglong
 Connect::last_insert_id()
 {
+    scoped_lock l(&lock);
     return mysql_insert_id(conn);
 }
 
@@ -182,20 +197,16 @@ unsigned long
 Connect::real_escape_string(char *const to, const char *const from,
                             unsigned long length)
 {
+    scoped_lock l(&lock);
     return mysql_real_escape_string(conn, to, from, length);
 }
 
-unsigned int
-Connect::get_mysql_errno()
-{
-    return mysql_errno(conn);
-}
-
 Connect::~Connect()
 {
     if (close_on_destroy) {
         mysql_close(conn);
     }
+    pthread_mutex_destroy(&lock);
 }
 
 DBResult *
@@ -8,6 +8,7 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <pthread.h>
 
 #include <util/util.hh>
 #include <parser/sql_utils.hh>
@@ -45,24 +46,36 @@ class Connect {
     Connect(const std::string &server, const std::string &user,
             const std::string &passwd, uint port = 0);
 
-    Connect(MYSQL *const _conn) : conn(_conn), close_on_destroy(true) { }
+    Connect(MYSQL *const _conn) : conn(_conn), close_on_destroy(true) {
+        pthread_mutex_init(&lock, NULL);
+    }
 
     //returns Connect for the embedded server
     static Connect *getEmbedded(const std::string &embed_dir);
 
+    // what a statement left in the MYSQL handle; read under the lock the
+    // statement ran under, as other clients may run theirs right after
+    struct Outcome {
+        Outcome() : insert_id(0), err(0) {}
+
+        my_ulonglong insert_id;
+        unsigned int err;
+        std::string error;
+    };
+
     // returns true if execution was ok; caller must delete DBResult
     bool execute(const std::string &query, std::unique_ptr<DBResult> *res,
-                 bool multiple_resultsets=false);
+                 bool multiple_resultsets=false, Outcome *outcome=NULL);
     bool execute(const std::string &query, bool multiple_resultsets=false);
+    bool execute(const std::string &query, Outcome *outcome,
+                 bool multiple_resultsets=false);
 
-    // returns error message if a query caused error
-    std::string getError();
-
+    // of the last statement on the handle, whoever ran it; a Connect
+    // that several threads use must ask execute() for an Outcome
     my_ulonglong last_insert_id();
     unsigned long real_escape_string(char *const to,
                                      const char *const from,
                                      unsigned long length);
-    unsigned int get_mysql_errno();
 
     ~Connect();
 
@@ -73,6 +86,9 @@ class Connect {
                     const std::string &passwd, uint port);
 
     bool close_on_destroy;
+    // a MYSQL handle takes one call at a time; the remote Connect is
+    // shared by every client of the proxy
+    pthread_mutex_t lock;
 };
 
 bool strictMode(Connect *const c);
@@ -7,12 +7,22 @@
 #include <crypto/BasicCrypto.hh>
 #include <crypto/SWPSearch.hh>
 #include <crypto/arc4.hh>
+#include <crypto/sha.hh>
 #include <util/util.hh>
 #include <util/cryptdb_log.hh>
 #include <util/zz.hh>
+#include <util/scoped_lock.hh>
 
+#include <cerrno>
 #include <cmath>
+#include <cstdio>
+#include <fstream>
 #include <memory>
+#include <set>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define LEXSTRING(cstr) { (char*) cstr, sizeof(cstr) }
 #define BITS_PER_BYTE 8
@@ -186,6 +196,14 @@ EncLayerFactory::encLayer(onion o, SECLEVEL sl, const Create_field &cf,
     FAIL_TextMessageError("unknown or unimplemented security level");
 }
 
+std::unique_ptr<EncLayer>
+EncLayerFactory::packedHOMLayer(const Create_field &cf,
+                                const std::string &key, uint slot)
+{
+    TEST_Text(slot < HOMPacked::pack_slots, "bad packed HOM slot");
+    return std::unique_ptr<EncLayer>(new HOMPacked(cf, key, slot));
+}
+
 std::unique_ptr<EncLayer>
 EncLayerFactory::deserializeLayer(unsigned int id,
                                   const std::string &serial)
@@ -207,6 +225,9 @@ EncLayerFactory::deserializeLayer(unsigned int id,
             return OPEFactory::deserialize(id, li);
 
         case SECLEVEL::HOM:
+            if (li.name == "HOM_packed") {
+                return std::unique_ptr<EncLayer>(new HOMPacked(id, serial));
+            }
             return std::unique_ptr<EncLayer>(new HOM(id, serial));
 
         case SECLEVEL::SEARCH:
@@ -426,6 +447,9 @@ public:
     Item *encrypt(const Item &ptext, uint64_t IV) const;
     Item *decrypt(const Item &ctext, uint64_t IV) const;
     Item * decryptUDF(Item * const col, Item * const ivcol) const;
+    std::vector<Item *>
+        encryptBatch(const std::vector<const Item *> &ptexts,
+                     const std::vector<uint64_t> &IVs) const;
 
 private:
     const CryptedInteger cinteger;
@@ -450,13 +474,15 @@ public:
     Item * encrypt(const Item &ptext, uint64_t IV) const;
     Item * decrypt(const Item &ctext, uint64_t IV) const;
     Item * decryptUDF(Item * const col, Item * const ivcol) const;
+    std::vector<Item *>
+        encryptBatch(const std::vector<const Item *> &ptexts,
+                     const std::vector<uint64_t> &IVs) const;
 
 private:
     const std::string rawkey;
     static const int key_bytes = 16;
     static const bool do_pad   = true;
-    const std::unique_ptr<const AES_KEY> enckey;
-    const std::unique_ptr<const AES_KEY> deckey;
+    const AES aes;
 
 };
 
@@ -546,6 +572,27 @@ RND_int::decrypt(const Item &ctext, uint64_t IV) const
                Item_int(static_cast<ulonglong>(p));
 }
 
+std::vector<Item *>
+RND_int::encryptBatch(const std::vector<const Item *> &ptexts,
+                      const std::vector<uint64_t> &IVs) const
+{
+    assert(ptexts.size() == IVs.size());
+
+    MEM_ROOT *const mem_root = current_thd->mem_root;
+    std::vector<Item *> out;
+    out.reserve(ptexts.size());
+    for (size_t i = 0; i < ptexts.size(); i++) {
+        const uint64_t p = RiboldMYSQL::val_uint(*ptexts[i]);
+        cinteger.checkValue(p);
+
+        const uint64_t c = bf.encrypt(p ^ IVs[i]);
+        out.push_back(new (mem_root) Item_int(static_cast<ulonglong>(c)));
+    }
+
+    LOG(encl) << "RND_int encrypt batch of " << out.size();
+    return out;
+}
+
 static udf_func u_decRNDInt = {
     LEXSTRING("cryptdb_decrypt_int_sem"),
     INT_RESULT,
@@ -586,13 +633,11 @@ RND_int::decryptUDF(Item * const col, Item * const ivcol) const
 ///////////////////////////////////////////////
 
 RND_str::RND_str(const Create_field &f, const std::string &seed_key)
-    : EncLayer(), rawkey(prng_expand(seed_key, key_bytes)),
-      enckey(get_AES_enc_key(rawkey)), deckey(get_AES_dec_key(rawkey))
+    : EncLayer(), rawkey(prng_expand(seed_key, key_bytes)), aes(rawkey)
 {}
 
 RND_str::RND_str(unsigned int id, const std::string &serial)
-    : EncLayer(id), rawkey(serial), enckey(get_AES_enc_key(rawkey)),
-      deckey(get_AES_dec_key(rawkey))
+    : EncLayer(id), rawkey(serial), aes(rawkey)
 {}
 
 
@@ -609,7 +654,7 @@ Item *
 RND_str::encrypt(const Item &ptext, uint64_t IV) const
 {
     const std::string &enc =
-        encrypt_AES_CBC(ItemToString(ptext), enckey.get(),
+        encrypt_AES_CBC(ItemToString(ptext), aes,
                         BytesFromInt(IV, SALT_LEN_BYTES), do_pad);
 
     LOG(encl) << "RND_str encrypt " << ItemToString(ptext) << " IV "
@@ -625,7 +670,7 @@ Item *
 RND_str::decrypt(const Item &ctext, uint64_t IV) const
 {
     const std::string &dec =
-        decrypt_AES_CBC(ItemToString(ctext), deckey.get(),
+        decrypt_AES_CBC(ItemToString(ctext), aes,
                         BytesFromInt(IV, SALT_LEN_BYTES), do_pad);
     LOG(encl) << "RND_str decrypt " << ItemToString(ctext) << " IV "
               << IV << "-->" << "len of dec " << dec.length()
@@ -636,6 +681,40 @@ RND_str::decrypt(const Item &ctext, uint64_t IV) const
                                                    &my_charset_bin);
 }
 
+// wraps each ciphertext in a binary Item_string
+static std::vector<Item *>
+binaryStringItems(const std::vector<std::string> &encs)
+{
+    MEM_ROOT *const mem_root = current_thd->mem_root;
+    std::vector<Item *> out;
+    out.reserve(encs.size());
+    for (const auto &it : encs) {
+        out.push_back(new (mem_root) Item_string(make_thd_string(it),
+                                                 it.length(),
+                                                 &my_charset_bin));
+    }
+    return out;
+}
+
+std::vector<Item *>
+RND_str::encryptBatch(const std::vector<const Item *> &ptexts,
+                      const std::vector<uint64_t> &IVs) const
+{
+    assert(ptexts.size() == IVs.size());
+
+    std::vector<std::string> plains, salts;
+    plains.reserve(ptexts.size());
+    salts.reserve(ptexts.size());
+    for (size_t i = 0; i < ptexts.size(); i++) {
+        plains.push_back(ItemToString(*ptexts[i]));
+        salts.push_back(BytesFromInt(IVs[i], SALT_LEN_BYTES));
+    }
+
+    LOG(encl) << "RND_str encrypt batch of " << plains.size();
+    return binaryStringItems(encrypt_AES_CBC_batch(plains, aes, salts,
+                                                   do_pad));
+}
+
 
 //TODO; make edb.cc udf naming consistent with these handlers
 static udf_func u_decRNDString = {
@@ -691,6 +770,9 @@ public:
     Item *encrypt(const Item &ptext, uint64_t IV) const;
     Item *decrypt(const Item &ctext, uint64_t IV) const;
     Item *decryptUDF(Item *const col, Item *const ivcol = NULL) const;
+    std::vector<Item *>
+        encryptBatch(const std::vector<const Item *> &ptexts,
+                     const std::vector<uint64_t> &IVs) const;
 
 protected:
     static const int bf_key_size = 16;
@@ -790,13 +872,15 @@ public:
     Item *encrypt(const Item &ptext, uint64_t IV) const;
     Item *decrypt(const Item &ctext, uint64_t IV) const;
     Item * decryptUDF(Item * const col, Item * const ivcol = NULL) const;
+    std::vector<Item *>
+        encryptBatch(const std::vector<const Item *> &ptexts,
+                     const std::vector<uint64_t> &IVs) const;
 
 protected:
     const std::string rawkey;
     static const int key_bytes = 16;
     static const bool do_pad   = true;
-    const std::unique_ptr<const AES_KEY> enckey;
-    const std::unique_ptr<const AES_KEY> deckey;
+    const AES aes;
 
 };
 
@@ -878,6 +962,30 @@ DET_abstract_integer::decrypt(const Item &ctext, uint64_t IV) const
     return new (current_thd->mem_root) Item_int(retdec);
 }
 
+std::vector<Item *>
+DET_abstract_integer::encryptBatch(const std::vector<const Item *> &ptexts,
+                                   const std::vector<uint64_t> &IVs) const
+{
+    assert(ptexts.size() == IVs.size());
+
+    const CryptedInteger &cinteger = getCInteger_();
+    const blowfish &bf = getBlowfish_();
+    MEM_ROOT *const mem_root = current_thd->mem_root;
+
+    std::vector<Item *> out;
+    out.reserve(ptexts.size());
+    for (auto it : ptexts) {
+        const ulonglong value = RiboldMYSQL::val_uint(*it);
+        cinteger.checkValue(value);
+
+        const ulonglong res = static_cast<ulonglong>(bf.encrypt(value));
+        out.push_back(new (mem_root) Item_int(res));
+    }
+
+    LOG(encl) << "DET_int enc batch of " << out.size();
+    return out;
+}
+
 Item *
 DET_abstract_integer::decryptUDF(Item *const col, Item *const ivcol)
     const
@@ -974,13 +1082,11 @@ DET_dec::DET_dec(unsigned int id, const std::string &serial)
 */
 
 DET_str::DET_str(const Create_field &f, const std::string &seed_key)
-    : rawkey(prng_expand(seed_key, key_bytes)),
-      enckey(get_AES_enc_key(rawkey)), deckey(get_AES_dec_key(rawkey))
+    : rawkey(prng_expand(seed_key, key_bytes)), aes(rawkey)
 {}
 
 DET_str::DET_str(unsigned int id, const std::string &serial)
-    : EncLayer(id), rawkey(serial), enckey(get_AES_enc_key(rawkey)),
-    deckey(get_AES_dec_key(rawkey))
+    : EncLayer(id), rawkey(serial), aes(rawkey)
 {}
 
 
@@ -997,7 +1103,7 @@ Item *
 DET_str::encrypt(const Item &ptext, uint64_t IV) const
 {
     const std::string plain = ItemToString(ptext);
-    const std::string enc = encrypt_AES_CMC(plain, enckey.get(), do_pad);
+    const std::string enc = encrypt_AES_CMC(plain, aes, do_pad);
     LOG(encl) << " DET_str encrypt " << plain  << " IV " << IV << " ---> "
               << " enc len " << enc.length() << " enc " << enc;
 
@@ -1010,7 +1116,7 @@ Item *
 DET_str::decrypt(const Item &ctext, uint64_t IV) const
 {
     const std::string enc = ItemToString(ctext);
-    const std::string dec = decrypt_AES_CMC(enc, deckey.get(), do_pad);
+    const std::string dec = decrypt_AES_CMC(enc, aes, do_pad);
     LOG(encl) << " DET_str decrypt enc len " << enc.length()
               << " enc " << enc << " IV " << IV << " ---> "
               << " dec len " << dec.length() << " dec " << dec;
@@ -1020,6 +1126,22 @@ DET_str::decrypt(const Item &ctext, uint64_t IV) const
                                                    &my_charset_bin);
 }
 
+std::vector<Item *>
+DET_str::encryptBatch(const std::vector<const Item *> &ptexts,
+                      const std::vector<uint64_t> &IVs) const
+{
+    assert(ptexts.size() == IVs.size());
+
+    std::vector<std::string> plains;
+    plains.reserve(ptexts.size());
+    for (auto it : ptexts) {
+        plains.push_back(ItemToString(*it));
+    }
+
+    LOG(encl) << " DET_str encrypt batch of " << plains.size();
+    return binaryStringItems(encrypt_AES_CMC_batch(plains, aes, do_pad));
+}
+
 static udf_func u_decDETStr = {
     LEXSTRING("cryptdb_decrypt_text_det"),
     STRING_RESULT,
@@ -1164,13 +1286,19 @@ public:
 
     Item *encrypt(const Item &p, uint64_t IV) const;
     Item *decrypt(const Item &c, uint64_t IV) const;
+    std::vector<Item *>
+        encryptBatch(const std::vector<const Item *> &ptexts,
+                     const std::vector<uint64_t> &IVs) const;
 
 private:
+    NTL::ZZ plainValue(const Item &ptext) const;
+    Item *ciphItem(const NTL::ZZ &enc) const;
+
     const CryptedInteger cinteger;
     static const size_t key_bytes = 16;
     const size_t plain_size;
     const size_t ciph_size;
-    mutable OPE ope;                      // HACK
+    const OPE ope;
 };
 
 class OPE_str : public EncLayer {
@@ -1190,11 +1318,15 @@ public:
     Item *encrypt(const Item &p, uint64_t IV) const;
     Item *decrypt(const Item &c, uint64_t IV) const
         __attribute__((noreturn));
+    std::vector<Item *>
+        encryptBatch(const std::vector<const Item *> &ptexts,
+                     const std::vector<uint64_t> &IVs) const;
 
 private:
+    NTL::ZZ plainValue(const Item &ptext) const;
+
     const std::string key;
-    // HACK.
-    mutable OPE ope;
+    const OPE ope;
     static const size_t key_bytes = 16;
     static const size_t plain_size = 4;
     static const size_t ciph_size = 8;
@@ -1410,17 +1542,20 @@ reverse(const std::string &s)
     return std::string(s.rbegin(), s.rend());
 }
 
-Item *
-OPE_int::encrypt(const Item &ptext, uint64_t IV) const
+NTL::ZZ
+OPE_int::plainValue(const Item &ptext) const
 {
     const uint64_t pval = RiboldMYSQL::val_uint(ptext);
     cinteger.checkValue(pval);
 
-    LOG(encl) << "OPE_int encrypt " << pval << " IV " << IV << std::endl;
+    return ZZFromUint64(pval);
+}
 
+Item *
+OPE_int::ciphItem(const NTL::ZZ &enc) const
+{
     if (MYSQL_TYPE_VARCHAR != this->cinteger.getFieldType()) {
-        const ulonglong enc = uint64FromZZ(ope.encrypt(ZZFromUint64(pval)));
-        return new Item_int(enc);
+        return new Item_int(static_cast<ulonglong>(uint64FromZZ(enc)));
     }
 
     // > the result of the encryption could be larger than 64 bits so
@@ -1430,8 +1565,7 @@ OPE_int::encrypt(const Item &ptext, uint64_t IV) const
     // > leading zeros must be added because not all numbers will span the
     //   allotted bytes and we don't want mysql to do a misaligned comparison
     const std::string &enc_string =
-        leadingZeros(reverse(StringFromZZ(ope.encrypt(ZZFromUint64(pval)))),
-                     this->ciph_size);
+        leadingZeros(reverse(StringFromZZ(enc)), this->ciph_size);
 
 
     return new Item_string(make_thd_string(enc_string),
@@ -1439,6 +1573,39 @@ OPE_int::encrypt(const Item &ptext, uint64_t IV) const
                            &my_charset_bin);
 }
 
+Item *
+OPE_int::encrypt(const Item &ptext, uint64_t IV) const
+{
+    const NTL::ZZ pval = plainValue(ptext);
+
+    LOG(encl) << "OPE_int encrypt " << pval << " IV " << IV << std::endl;
+
+    return ciphItem(ope.encrypt(pval));
+}
+
+std::vector<Item *>
+OPE_int::encryptBatch(const std::vector<const Item *> &ptexts,
+                      const std::vector<uint64_t> &IVs) const
+{
+    assert(ptexts.size() == IVs.size());
+
+    std::vector<NTL::ZZ> pvals;
+    pvals.reserve(ptexts.size());
+    for (auto it : ptexts) {
+        pvals.push_back(plainValue(*it));
+    }
+
+    LOG(encl) << "OPE_int encrypt batch of " << pvals.size() << std::endl;
+
+    const std::vector<NTL::ZZ> encs = ope.encrypt_batch(pvals);
+    std::vector<Item *> out;
+    out.reserve(encs.size());
+    for (const auto &it : encs) {
+        out.push_back(ciphItem(it));
+    }
+    return out;
+}
+
 Item *
 OPE_int::decrypt(const Item &ctext, uint64_t IV) const
 {
@@ -1462,7 +1629,7 @@ OPE_str::OPE_str(const Create_field &f, const std::string &seed_key)
 
 OPE_str::OPE_str(unsigned int id, const std::string &serial)
     : EncLayer(id), key(serial),
-    ope(OPE(key, plain_size * BITS_PER_BYTE, ciph_size * BITS_PER_BYTE))
+      ope(OPE(key, plain_size * BITS_PER_BYTE, ciph_size * BITS_PER_BYTE))
 {}
 
 Create_field *
@@ -1484,8 +1651,8 @@ OPE_str::newCreateField(const Create_field &cf,
  * |         1 |         1 |         1 |         1 |
  * +-----------+-----------+-----------+-----------+
  */
-Item *
-OPE_str::encrypt(const Item &ptext, uint64_t IV) const
+NTL::ZZ
+OPE_str::plainValue(const Item &ptext) const
 {
     std::string ps = toUpperCase(ItemToString(ptext));
     if (ps.size() < plain_size)
@@ -1497,12 +1664,40 @@ OPE_str::encrypt(const Item &ptext, uint64_t IV) const
         pv = pv * 256 + static_cast<int>(ps[i]);
     }
 
-    const ZZ enc = ope.encrypt(to_ZZ(pv));
+    return to_ZZ(pv);
+}
+
+Item *
+OPE_str::encrypt(const Item &ptext, uint64_t IV) const
+{
+    const ZZ enc = ope.encrypt(plainValue(ptext));
 
     return new (current_thd->mem_root)
                Item_int(static_cast<ulonglong>(uint64FromZZ(enc)));
 }
 
+std::vector<Item *>
+OPE_str::encryptBatch(const std::vector<const Item *> &ptexts,
+                      const std::vector<uint64_t> &IVs) const
+{
+    assert(ptexts.size() == IVs.size());
+
+    std::vector<NTL::ZZ> pvals;
+    pvals.reserve(ptexts.size());
+    for (auto it : ptexts) {
+        pvals.push_back(plainValue(*it));
+    }
+
+    const std::vector<NTL::ZZ> encs = ope.encrypt_batch(pvals);
+    std::vector<Item *> out;
+    out.reserve(encs.size());
+    for (const auto &it : encs) {
+        out.push_back(new (current_thd->mem_root)
+                          Item_int(static_cast<ulonglong>(uint64FromZZ(it))));
+    }
+    return out;
+}
+
 Item *
 OPE_str::decrypt(const Item &ctext, uint64_t IV) const
 {
@@ -1659,7 +1854,7 @@ ZZToItemDec(const ZZ &val, const ZZ &shift)
 Item *
 HOM_dec::encrypt(const Item &ptext, uint64_t IV) const
 {
-    const ZZ enc = sk->encrypt(ItemDecToZZ(ptext, shift, decimals));
+    const ZZ enc = sk->encrypt_crt(ItemDecToZZ(ptext, shift, decimals));
 
     return ZZToItemStr(enc);
 }
@@ -1676,13 +1871,293 @@ HOM_dec::decrypt(Item * const ctext, uint64_t IV) const
 
 
 
+/*
+ * Layers serialize their Paillier key next to the seed so that a
+ * restarted proxy need not search for primes again.  A layer whose key
+ * was not generated yet when it was serialized writes its seed alone,
+ * behind hom_seed_tag; its key goes to the key store once generated
+ * (see HOM::setKeyStore).  Older layers serialized only the seed; they
+ * were keyed from their whole serial and still are.
+ */
+static const std::string hom_key_tag = "PAILLIER_KEY ";
+static const std::string hom_seed_tag = "PAILLIER_SEED ";
+
+static bool
+hasTag(const std::string &serial, const std::string &tag)
+{
+    const std::string &info = serial_unpack(serial).layer_info;
+    return 0 == info.compare(0, tag.length(), tag);
+}
+
+static std::vector<std::string>
+unserializeHOMKey(const std::string &serial)
+{
+    const std::string &info = serial_unpack(serial).layer_info;
+    const std::vector<std::string> &vec =
+        unserialize_string(info.substr(hom_key_tag.length()));
+    TEST_Text(5 == vec.size(), "malformed HOM layer serial");
+
+    return vec;
+}
+
+static std::string
+homSeedFromSerial(const std::string &serial)
+{
+    if (hasTag(serial, hom_seed_tag)) {
+        return serial_unpack(serial).layer_info.substr(
+                    hom_seed_tag.length());
+    }
+    if (false == hasTag(serial, hom_key_tag)) {
+        return serial;
+    }
+
+    return unserializeHOMKey(serial)[0];
+}
+
+static std::vector<ZZ>
+homKeyFromSerial(const std::string &serial)
+{
+    if (false == hasTag(serial, hom_key_tag)) {
+        return std::vector<ZZ>();
+    }
+
+    const std::vector<std::string> &vec = unserializeHOMKey(serial);
+    std::vector<ZZ> key;
+    for (auto it = vec.begin() + 1; it != vec.end(); ++it) {
+        key.push_back(ZZFromString(*it));
+    }
+    return key;
+}
+
+/*
+ * Keys in use, by the hash of their seed.  The layers rebuilt by a
+ * schema reload take over the keys of the layers they replace; a key
+ * goes once no layer holds it, so dropped columns do not keep theirs.
+ *
+ * Keys generated from a seed are also kept in the key store, a file
+ * next to the embedded database that holds a
+ * "<hash in hex> <p> <q> <g> <a>" line per key.  It is as secret as
+ * the metadata, which has the seeds, so only its owner may read it.
+ */
+static pthread_mutex_t hom_keys_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, std::weak_ptr<Paillier_priv> > hom_keys;
+static std::string hom_store_path;
+static std::map<std::string, std::vector<ZZ> > hom_stored;
+
+// the caller holds hom_keys_lock
+static std::shared_ptr<Paillier_priv>
+liveHOMKey(const std::string &id)
+{
+    const auto it = hom_keys.find(id);
+    if (hom_keys.end() == it) {
+        return std::shared_ptr<Paillier_priv>();
+    }
+
+    return it->second.lock();
+}
+
+static std::string
+homKeyLine(const std::string &id, const std::vector<ZZ> &key)
+{
+    std::string line = toHex(id);
+    for (const auto &it : key) {
+        line += " " + DecStringFromZZ(it);
+    }
+    return line + "\n";
+}
+
+/*
+ * Writes @data to the key store at @path, opened with @flags; the file
+ * is made, or made again, readable and writable by its owner alone.
+ */
+static bool
+writeKeyStore(const std::string &path, int flags, const std::string &data)
+{
+    const int fd = open(path.c_str(), O_WRONLY | O_CREAT | flags, 0600);
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = 0 == fchmod(fd, 0600);
+    for (size_t done = 0; ok && done < data.size(); ) {
+        const ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if (n > 0) {
+            done += n;
+        } else if (n < 0 && EINTR == errno) {
+            continue;
+        } else {
+            ok = false;
+        }
+    }
+
+    return 0 == close(fd) && ok;
+}
+
+// the caller holds hom_keys_lock
+static void
+storeHOMKey(const std::string &id, const std::vector<ZZ> &key)
+{
+    hom_stored[id] = key;
+    if (hom_store_path.empty()) {
+        return;
+    }
+
+    if (!writeKeyStore(hom_store_path, O_APPEND, homKeyLine(id, key))) {
+        LOG(warn) << "cannot write the HOM key store " << hom_store_path;
+    }
+}
+
+static std::shared_ptr<Paillier_priv>
+getHOMKey(const std::string &seed_key, const std::vector<ZZ> &stored_key,
+          uint nbits)
+{
+    const std::string &id = sha256::hash(seed_key);
+    std::vector<ZZ> key = stored_key;
+    {
+        scoped_lock l(&hom_keys_lock);
+        const std::shared_ptr<Paillier_priv> &live = liveHOMKey(id);
+        if (live) {
+            return live;
+        }
+        if (key.empty()) {
+            const auto it = hom_stored.find(id);
+            if (hom_stored.end() != it) {
+                key = it->second;
+            }
+        }
+    }
+
+    // without the lock, so that warmKeys() threads run in parallel
+    std::shared_ptr<Paillier_priv> sk;
+    if (key.empty()) {
+        const std::unique_ptr<streamrng<arc4>>
+            prng(new streamrng<arc4>(seed_key));
+        sk = std::make_shared<Paillier_priv>(
+                Paillier_priv::keygen(prng.get(), nbits));
+    } else {
+        sk = std::make_shared<Paillier_priv>(key);
+    }
+
+    scoped_lock l(&hom_keys_lock);
+    const std::shared_ptr<Paillier_priv> &live = liveHOMKey(id);
+    if (live) {
+        return live;
+    }
+    for (auto it = hom_keys.begin(); it != hom_keys.end(); ) {
+        if (it->second.expired()) {
+            it = hom_keys.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    hom_keys[id] = sk;
+    if (key.empty()) {
+        storeHOMKey(id, sk->privkey());
+    }
+    return sk;
+}
+
+void
+HOM::setKeyStore(const std::string &path)
+{
+    scoped_lock l(&hom_keys_lock);
+    hom_store_path = path;
+    hom_stored.clear();
+
+    std::ifstream f(path);
+    std::string line;
+    while (std::getline(f, line)) {
+        std::istringstream ss(line);
+        std::string id;
+        std::vector<std::string> fields(4);
+        ss >> id >> fields[0] >> fields[1] >> fields[2] >> fields[3];
+        if (!ss) {
+            LOG(warn) << "skipping a malformed line of " << path;
+            continue;
+        }
+
+        std::vector<ZZ> key;
+        for (const auto &it : fields) {
+            key.push_back(ZZFromDecString(it));
+        }
+        hom_stored[fromHex(id)] = key;
+    }
+}
+
+void
+HOM::pruneKeyStore(const std::vector<const HOM *> &layers)
+{
+    std::set<std::string> ids;
+    for (auto it : layers) {
+        ids.insert(sha256::hash(it->seed_key));
+    }
+
+    scoped_lock l(&hom_keys_lock);
+    std::map<std::string, std::vector<ZZ> > keep;
+    for (const auto &it : hom_stored) {
+        if (ids.count(it.first) || liveHOMKey(it.first)) {
+            keep.insert(it);
+        }
+    }
+    if (keep.size() == hom_stored.size()) {
+        return;
+    }
+
+    hom_stored.swap(keep);
+    if (hom_store_path.empty()) {
+        return;
+    }
+    const std::string tmp = hom_store_path + ".tmp";
+    std::string lines;
+    for (const auto &it : hom_stored) {
+        lines += homKeyLine(it.first, it.second);
+    }
+    if (!writeKeyStore(tmp, O_TRUNC, lines)) {
+        LOG(warn) << "cannot write the HOM key store " << tmp;
+        return;
+    }
+    if (0 != rename(tmp.c_str(), hom_store_path.c_str())) {
+        LOG(warn) << "cannot replace the HOM key store "
+                  << hom_store_path;
+    }
+}
+
 HOM::HOM(const Create_field &f, const std::string &seed_key)
-    : seed_key(seed_key), sk(NULL), waiting(true)
-{}
+    : seed_key(seed_key), waiting(true)
+{
+    pthread_mutex_init(&key_lock, NULL);
+}
 
 HOM::HOM(unsigned int id, const std::string &serial)
-    : EncLayer(id), seed_key(serial), sk(NULL), waiting(true)
-{}
+    : EncLayer(id), seed_key(homSeedFromSerial(serial)),
+      stored_key(homKeyFromSerial(serial)), waiting(true)
+{
+    pthread_mutex_init(&key_lock, NULL);
+
+    // take over the key of the layer this one replaces
+    scoped_lock l(&hom_keys_lock);
+    sk = liveHOMKey(sha256::hash(seed_key));
+    waiting = !sk;
+}
+
+/*
+ * Writes what the layer was made from: the seed alone, or the seed and
+ * the key of older metadata.  Keys generated since are in the key
+ * store, so the serial does not depend on whether keygen has run; it
+ * is left to the first use of the layer, not to CREATE TABLE.
+ */
+std::string
+HOM::doSerialize() const
+{
+    if (stored_key.empty()) {
+        return hom_seed_tag + seed_key;
+    }
+    return hom_key_tag +
+           serializeStrings({seed_key, StringFromZZ(stored_key[0]),
+                             StringFromZZ(stored_key[1]),
+                             StringFromZZ(stored_key[2]),
+                             StringFromZZ(stored_key[3])});
+}
 
 Create_field *
 HOM::newCreateField(const Create_field &cf,
@@ -1696,33 +2171,161 @@ HOM::newCreateField(const Create_field &cf,
 void
 HOM::unwait() const
 {
-    const std::unique_ptr<streamrng<arc4>>
-        prng(new streamrng<arc4>(seed_key));
-    sk = new Paillier_priv(Paillier_priv::keygen(prng.get(), nbits));
+    sk = getHOMKey(seed_key, stored_key, nbits);
     waiting = false;
 }
 
-Item *
-HOM::encrypt(const Item &ptext, uint64_t IV) const
+struct HOMWarmup {
+    const std::vector<const HOM *> &layers;
+    size_t next;
+    pthread_mutex_t lock;
+};
+
+void *
+HOM::warmThread(void *arg)
+{
+    HOMWarmup *const w = static_cast<HOMWarmup *>(arg);
+    for (;;) {
+        const HOM *layer;
+        {
+            scoped_lock l(&w->lock);
+            if (w->next == w->layers.size()) {
+                return NULL;
+            }
+            layer = w->layers[w->next++];
+        }
+
+        layer->prepareDecrypt();
+    }
+}
+
+void
+HOM::warmKeys(const std::vector<const HOM *> &layers, uint nthreads)
 {
+#ifndef NTL_THREADS
+    // ProbPrime() draws from NTL's random stream, which only an NTL
+    // built with NTL_THREADS keeps per thread
+    nthreads = 1;
+#endif
+
+    HOMWarmup w = {layers, 0, PTHREAD_MUTEX_INITIALIZER};
+
+    std::vector<pthread_t> threads;
+    for (uint i = 1; i < nthreads; ++i) {
+        pthread_t t;
+        if (0 != pthread_create(&t, NULL, warmThread, &w)) {
+            break;
+        }
+        threads.push_back(t);
+    }
+
+    warmThread(&w);
+    for (auto it : threads) {
+        pthread_join(it, NULL);
+    }
+}
+
+void
+HOM::prepareDecrypt() const
+{
+    scoped_lock l(&key_lock);
     if (true == waiting) {
         this->unwait();
     }
-
-    const ZZ enc = sk->encrypt(ItemIntToZZ(ptext));
-    return ZZToItemStr(enc);
 }
 
-Item *
-HOM::decrypt(const Item &ctext, uint64_t IV) const
+void
+HOM::prepareEncrypt() const
 {
+    scoped_lock l(&key_lock);
     if (true == waiting) {
         this->unwait();
     }
 
+    if (!rpool) {
+        rpool = paillier_pool::create(sk);
+    }
+}
+
+bool
+HOM::concurrentEncrypt() const
+{
+    prepareEncrypt();
+
+#ifdef NTL_THREADS
+    return true;
+#else
+    // NTL keeps its scratch space and its random stream in globals
+    // unless it was built with NTL_THREADS
+    return false;
+#endif
+}
+
+ZZ
+HOM::encryptZZ(const ZZ &m) const
+{
+    prepareEncrypt();
+
+    return rpool ? sk->encrypt_crt(m, rpool->take())
+                 : sk->encrypt_crt(m);
+}
+
+ZZ
+HOM::decryptZZ(const Item &ctext) const
+{
+    prepareDecrypt();
+
     const ZZ enc = ItemStrToZZ(ctext);
     const ZZ dec = sk->decrypt(enc);
     LOG(encl) << "HOM ciph " << enc << "---->" << dec;
+    return dec;
+}
+
+std::vector<Item *>
+HOM::encryptZZBatch(const std::vector<ZZ> &ms) const
+{
+    prepareEncrypt();
+
+    std::vector<Item *> out;
+    out.reserve(ms.size());
+    if (!rpool) {
+        for (const auto &it : ms) {
+            out.push_back(ZZToItemStr(sk->encrypt_crt(it)));
+        }
+        return out;
+    }
+
+    const std::vector<ZZ> rns = rpool->take(ms.size());
+    for (size_t i = 0; i < ms.size(); i++) {
+        out.push_back(ZZToItemStr(sk->encrypt_crt(ms[i], rns[i])));
+    }
+    return out;
+}
+
+Item *
+HOM::encrypt(const Item &ptext, uint64_t IV) const
+{
+    return ZZToItemStr(encryptZZ(ItemIntToZZ(ptext)));
+}
+
+std::vector<Item *>
+HOM::encryptBatch(const std::vector<const Item *> &ptexts,
+                  const std::vector<uint64_t> &IVs) const
+{
+    assert(ptexts.size() == IVs.size());
+
+    std::vector<ZZ> ms;
+    ms.reserve(ptexts.size());
+    for (auto it : ptexts) {
+        ms.push_back(ItemIntToZZ(*it));
+    }
+    return encryptZZBatch(ms);
+}
+
+Item *
+HOM::decrypt(const Item &ctext, uint64_t IV) const
+{
+    const ZZ dec = decryptZZ(ctext);
     TEST_Text(NumBytes(dec) <= 8,
               "Summation produced an integer larger than 64 bits");
     return ZZToItemInt(dec);
@@ -1759,9 +2362,7 @@ static udf_func u_sum_f = {
 Item *
 HOM::sumUDA(Item *const expr) const
 {
-    if (true == waiting) {
-        this->unwait();
-    }
+    prepareDecrypt();
 
     List<Item> l;
     l.push_back(expr);
@@ -1772,9 +2373,7 @@ HOM::sumUDA(Item *const expr) const
 Item *
 HOM::sumUDF(Item *const i1, Item *const i2) const
 {
-    if (true == waiting) {
-        this->unwait();
-    }
+    prepareDecrypt();
 
     List<Item> l;
     l.push_back(i1);
@@ -1784,8 +2383,94 @@ HOM::sumUDF(Item *const i1, Item *const i2) const
     return new (current_thd->mem_root) Item_func_udf_str(&u_sum_f, l);
 }
 
-HOM::~HOM() {
-    delete sk;
+HOM::~HOM()
+{
+    pthread_mutex_destroy(&key_lock);
+}
+
+/*
+ * A packed layer serializes its slot in front of the HOM serial; the
+ * HOM part is handed to the HOM constructor in the form it expects.
+ */
+static std::string
+packedHOMSerial(const std::string &serial)
+{
+    const std::string &info = serial_unpack(serial).layer_info;
+    const size_t pos = info.find(' ');
+    TEST_Text(std::string::npos != pos, "malformed HOM_packed serial");
+
+    return serial_pack(SECLEVEL::HOM, "HOM", info.substr(pos + 1));
+}
+
+static uint
+packedHOMSlot(const std::string &serial)
+{
+    const std::string &info = serial_unpack(serial).layer_info;
+    const uint slot = atoi(info.substr(0, info.find(' ')).c_str());
+    TEST_Text(slot < HOMPacked::pack_slots, "bad packed HOM slot");
+
+    return slot;
+}
+
+HOMPacked::HOMPacked(const Create_field &cf, const std::string &seed_key,
+                     uint slot)
+    : HOM(cf, seed_key), slot(slot)
+{}
+
+HOMPacked::HOMPacked(unsigned int id, const std::string &serial)
+    : HOM(id, packedHOMSerial(serial)), slot(packedHOMSlot(serial))
+{}
+
+std::string
+HOMPacked::doSerialize() const
+{
+    return std::to_string(slot) + " " + HOM::doSerialize();
+}
+
+Item *
+HOMPacked::encrypt(const Item &ptext, uint64_t IV) const
+{
+    return ZZToItemStr(encryptZZ(ItemIntToZZ(ptext) << (slot * slot_bits)));
+}
+
+std::vector<Item *>
+HOMPacked::encryptBatch(const std::vector<const Item *> &ptexts,
+                        const std::vector<uint64_t> &IVs) const
+{
+    assert(ptexts.size() == IVs.size());
+
+    std::vector<ZZ> ms;
+    ms.reserve(ptexts.size());
+    for (auto it : ptexts) {
+        ms.push_back(ItemIntToZZ(*it) << (slot * slot_bits));
+    }
+    return encryptZZBatch(ms);
+}
+
+Item *
+HOMPacked::decrypt(const Item &ctext, uint64_t IV) const
+{
+    const ZZ dec = trunc_ZZ(decryptZZ(ctext) >> (slot * slot_bits),
+                            slot_bits);
+    TEST_Text(NumBytes(dec) <= 8,
+              "Summation produced an integer larger than 64 bits");
+    return ZZToItemInt(dec);
+}
+
+Item *
+HOMPacked::encryptPack(const std::vector<const Item *> &ptexts) const
+{
+    TEST_Text(ptexts.size() <= pack_slots, "too many values for a pack");
+
+    ZZ m = to_ZZ(0);
+    for (uint i = 0; i < ptexts.size(); ++i) {
+        if (NULL == ptexts[i] || RiboldMYSQL::is_null(*ptexts[i])) {
+            continue;
+        }
+        m += ItemIntToZZ(*ptexts[i]) << (i * slot_bits);
+    }
+
+    return ZZToItemStr(encryptZZ(m));
 }
 
 /******* SEARCH **************************/
@@ -1888,6 +2573,38 @@ Search::encrypt(const Item &ptext, uint64_t IV) const
     return new Item_string(newmem(ciph), ciph.length(), &my_charset_bin);
 }
 
+std::vector<Item *>
+Search::encryptBatch(const std::vector<const Item *> &ptexts,
+                     const std::vector<uint64_t> &IVs) const
+{
+    assert(ptexts.size() == IVs.size());
+
+    std::vector<std::list<std::string> > texts;
+    texts.reserve(ptexts.size());
+    for (auto it : ptexts) {
+        const std::unique_ptr<std::list<std::string> >
+            tokens(tokenize(ItemToString(*it)));
+        texts.push_back(*tokens);
+    }
+
+    const std::vector<std::list<std::string> > &ciphs =
+        SWP::encryptBatch(key, texts);
+
+    std::vector<Item *> out;
+    out.reserve(ciphs.size());
+    for (const auto &it : ciphs) {
+        std::string ciph;
+        for (const auto &word : it) {
+            ciph += word;
+        }
+        out.push_back(new Item_string(newmem(ciph), ciph.length(),
+                                      &my_charset_bin));
+    }
+
+    LOG(encl) << "SEARCH encrypt batch of " << out.size();
+    return out;
+}
+
 Item *
 Search::decrypt(const Item &ctext, uint64_t IV) const
 {
@@ -6,6 +6,7 @@
 #include <crypto/prng.hh>
 #include <crypto/BasicCrypto.hh>
 #include <crypto/paillier.hh>
+#include <crypto/paillier_pool.hh>
 #include <crypto/ope.hh>
 #include <crypto/blowfish.hh>
 #include <parser/sql_utils.hh>
@@ -65,6 +66,29 @@ public:
     virtual Item *encrypt(const Item &ptext, uint64_t IV) const = 0;
     virtual Item *decrypt(const Item &ctext, uint64_t IV) const = 0;
 
+    // encrypts a column of values, @ptexts[i] under @IVs[i]; layers that
+    // can share work between values override this
+    virtual std::vector<Item *>
+        encryptBatch(const std::vector<const Item *> &ptexts,
+                     const std::vector<uint64_t> &IVs) const
+    {
+        assert(ptexts.size() == IVs.size());
+
+        std::vector<Item *> out;
+        out.reserve(ptexts.size());
+        for (size_t i = 0; i < ptexts.size(); i++) {
+            out.push_back(this->encrypt(*ptexts[i], IVs[i]));
+        }
+        return out;
+    }
+
+    // whether encryptBatch may run on CryptoPool threads next to other
+    // batches of this layer
+    virtual bool concurrentEncrypt() const {return true;}
+
+    // whether a plaintext and IV always encrypt to the same ciphertext
+    virtual bool deterministicEncrypt() const {return true;}
+
     // returns the decryptUDF to remove the onion layer
     virtual Item *decryptUDF(Item * const col, Item * const ivcol = NULL)
         const
@@ -88,33 +112,101 @@ public:
     HOM(const Create_field &cf, const std::string &seed_key);
 
     // serialize and deserialize
-    std::string doSerialize() const {return seed_key;}
+    std::string doSerialize() const;
     HOM(unsigned int id, const std::string &serial);
     ~HOM();
 
+    // generates or loads the keys of @layers on @nthreads threads
+    static void warmKeys(const std::vector<const HOM *> &layers,
+                         uint nthreads);
+    // keeps the keys generated from seeds in the file at @path, and
+    // loads those already there
+    static void setKeyStore(const std::string &path);
+    // drops the stored keys of layers other than @layers
+    static void pruneKeyStore(const std::vector<const HOM *> &layers);
+
     SECLEVEL level() const {return SECLEVEL::HOM;}
     std::string name() const {return "HOM";}
     Create_field * newCreateField(const Create_field &cf,
                                   const std::string &anonname = "")
         const;
 
-    //TODO needs multi encrypt and decrypt
+    //TODO needs multi decrypt
     Item *encrypt(const Item &p, uint64_t IV) const;
     Item * decrypt(const Item &c, uint64_t IV) const;
+    // takes the randomness of the whole column from the pool at once
+    std::vector<Item *>
+        encryptBatch(const std::vector<const Item *> &ptexts,
+                     const std::vector<uint64_t> &IVs) const;
+    // without rpool, encrypt draws from NTL's random stream
+    bool concurrentEncrypt() const;
+    bool deterministicEncrypt() const {return false;}
 
     //expr is the expression (e.g. a field) over which to sum
     Item *sumUDA(Item *const expr) const;
     Item *sumUDF(Item *const i1, Item *const i2) const;
 
 protected:
+    NTL::ZZ encryptZZ(const NTL::ZZ &m) const;
+    std::vector<Item *> encryptZZBatch(const std::vector<NTL::ZZ> &ms) const;
+    NTL::ZZ decryptZZ(const Item &ctext) const;
+
     std::string const seed_key;
+    // p, q, g, a from the serial; empty for layers that predate it
+    std::vector<NTL::ZZ> const stored_key;
     static const uint nbits = 1024;
-    mutable Paillier_priv * sk;
+    mutable std::shared_ptr<Paillier_priv> sk;
+    // precomputed randomness for encrypt; NULL until the first encrypt
+    mutable std::shared_ptr<paillier_pool> rpool;
 
 private:
     void unwait() const;
+    // load the key, and create rpool, under key_lock; CryptoPool
+    // and warm-up threads share layers
+    void prepareDecrypt() const;
+    void prepareEncrypt() const;
+    static void *warmThread(void *arg);
 
     mutable bool waiting;
+    mutable pthread_mutex_t key_lock;
+};
+
+/*
+ * HOM layer of a field that shares its Paillier ciphertexts with other
+ * fields of its table.  Each field owns a slot of slot_bits bits in the
+ * plaintext, so one cryptdb_agg pass over the shared column sums every
+ * field of the pack.  The fields of a pack share the onion name, and
+ * thereby the column and the key.
+ */
+class HOMPacked : public HOM {
+public:
+    HOMPacked(const Create_field &cf, const std::string &seed_key,
+              uint slot);
+
+    // serialize and deserialize
+    std::string doSerialize() const;
+    HOMPacked(unsigned int id, const std::string &serial);
+
+    std::string name() const {return "HOM_packed";}
+    uint getSlot() const {return slot;}
+
+    // the value shifted into this field's slot, for increments
+    Item *encrypt(const Item &p, uint64_t IV) const;
+    std::vector<Item *>
+        encryptBatch(const std::vector<const Item *> &ptexts,
+                     const std::vector<uint64_t> &IVs) const;
+    // this field's slot of a row or of a sum of rows
+    Item *decrypt(const Item &c, uint64_t IV) const;
+
+    // one row of the pack: @ptexts[i] in slot i, NULL entries count as 0
+    Item *encryptPack(const std::vector<const Item *> &ptexts) const;
+
+    // 64-bit values leave 2^32 rows of headroom per slot
+    static const uint slot_bits = 96;
+    static const uint pack_slots = (nbits - 1) / slot_bits;
+
+private:
+    const uint slot;
 };
 
 class Search : public EncLayer {
@@ -134,6 +226,12 @@ public:
     Item *encrypt(const Item &ptext, uint64_t IV) const;
     Item * decrypt(const Item &ctext, uint64_t IV) const
         __attribute__((noreturn));
+    // words repeated across the column are prepared once
+    std::vector<Item *>
+        encryptBatch(const std::vector<const Item *> &ptexts,
+                     const std::vector<uint64_t> &IVs) const;
+    // every word gets a salt of its own
+    bool deterministicEncrypt() const {return false;}
 
     //expr is the expression (e.g. a field) over which to sum
     Item * searchUDF(Item * const field, Item * const expr) const;
@@ -151,6 +249,11 @@ public:
         encLayer(onion o, SECLEVEL sl, const Create_field &cf,
                  const std::string &key);
 
+    // the HOM layer for @slot of a packed HOM column
+    static std::unique_ptr<EncLayer>
+        packedHOMLayer(const Create_field &cf, const std::string &key,
+                       uint slot);
+
     // creates EncLayer from its serialization
     static std::unique_ptr<EncLayer>
         deserializeLayer(unsigned int id, const std::string &serial);
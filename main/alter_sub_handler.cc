@@ -79,8 +79,13 @@ class DropColumnSubHandler : public AlterSubHandler {
 
         // Rewrite each onion column.
         for (const auto &om_it : fm.getChildren()) {
-            Alter_drop * const new_adrop = adrop->clone(thd->mem_root);
             OnionMeta *const om = om_it.second.get();
+            // the rest of the pack still uses a packed HOM column; the
+            // dropped field's slot just goes unused
+            if (om->getPackedHOM()) {
+                continue;
+            }
+            Alter_drop * const new_adrop = adrop->clone(thd->mem_root);
             new_adrop->name =
                 thd->strdup(om->getAnonOnionName().c_str());
             out_list.push_back(new_adrop);
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <unordered_map>
+#include <utility>
+
+#include <main/crypto_pool.hh>
+
+/*
+ * An allocator over a CryptoPool::Arena.  Memory is only given back
+ * when the arena goes, all of it at once, so a container that uses
+ * one costs a malloc per arena block rather than one per node; it
+ * must not outlive the arena.
+ */
+template <typename T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+    typedef T *pointer;
+    typedef const T *const_pointer;
+    typedef T &reference;
+    typedef const T &const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <typename U>
+    struct rebind {
+        typedef ArenaAllocator<U> other;
+    };
+
+    explicit ArenaAllocator(CryptoPool::Arena *const arena)
+        : arena(arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+    pointer allocate(size_type n, const void * = 0) {
+        void *const p = alloc_root(arena->get(), n * sizeof(T));
+        if (NULL == p) {
+            throw std::bad_alloc();
+        }
+        return static_cast<pointer>(p);
+    }
+    void deallocate(pointer, size_type) {}
+
+    size_type max_size() const {return static_cast<size_t>(-1) / sizeof(T);}
+    pointer address(reference x) const {return &x;}
+    const_pointer address(const_reference x) const {return &x;}
+
+    template <typename U, typename... Args>
+    void construct(U *const p, Args &&... args) {
+        ::new (static_cast<void *>(p)) U(std::forward<Args>(args)...);
+    }
+    template <typename U>
+    void destroy(U *const p) {p->~U();}
+
+    CryptoPool::Arena *arena;
+};
+
+template <typename T, typename U>
+bool
+operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b)
+{
+    return a.arena == b.arena;
+}
+
+template <typename T, typename U>
+bool
+operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b)
+{
+    return a.arena != b.arena;
+}
+
+// a hash map whose nodes and buckets come from @arena
+template <typename K, typename V>
+class ArenaHashMap
+    : public std::unordered_map<K, V, std::hash<K>, std::equal_to<K>,
+                                ArenaAllocator<std::pair<const K, V> > > {
+    typedef std::unordered_map<K, V, std::hash<K>, std::equal_to<K>,
+                               ArenaAllocator<std::pair<const K, V> > >
+        Base;
+
+public:
+    explicit ArenaHashMap(CryptoPool::Arena *const arena,
+                          size_t buckets = 16)
+        : Base(buckets, std::hash<K>(), std::equal_to<K>(),
+               ArenaAllocator<std::pair<const K, V> >(arena)) {}
+};
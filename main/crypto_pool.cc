@@ -0,0 +1,227 @@
+#include <algorithm>
+#include <exception>
+#include <unistd.h>
+
+#include <main/crypto_pool.hh>
+#include <util/scoped_lock.hh>
+#include <util/errstream.hh>
+
+struct CryptoPool::Batch {
+    Batch(const std::vector<std::pair<size_t, size_t> > &shards,
+          const std::function<void(size_t, size_t)> &f,
+          std::list<std::unique_ptr<Arena> > *arenas)
+        : shards(shards), f(f), arenas(arenas), next(0), done(0) {}
+
+    const std::vector<std::pair<size_t, size_t> > &shards;
+    const std::function<void(size_t, size_t)> &f;
+    std::list<std::unique_ptr<Arena> > *const arenas;
+
+    // guarded by the pool lock
+    size_t next;
+    size_t done;
+    std::exception_ptr error;
+};
+
+/*
+ * Shared by all callers.  Allocated once and never freed, so detached
+ * workers never see it destroyed at exit.
+ */
+struct crypto_workers {
+    crypto_workers() : nthreads(defaultThreads()), running(0) {
+        pthread_mutex_init(&mu, NULL);
+        pthread_cond_init(&work_cond, NULL);
+        pthread_cond_init(&done_cond, NULL);
+    }
+
+    // one thread less than the CPUs; the caller is the last one
+    static uint defaultThreads() {
+#ifdef NTL_THREADS
+        const long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        return ncpus > 1 ? ncpus - 1 : 0;
+#else
+        return 0;
+#endif
+    }
+
+    pthread_mutex_t mu;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+
+    uint nthreads;
+    uint running;
+
+    // batches with shards nobody has taken yet
+    std::list<CryptoPool::Batch *> work;
+};
+
+static crypto_workers *
+workers()
+{
+    static crypto_workers *w = new crypto_workers();
+    return w;
+}
+
+void
+CryptoPool::runTask(Batch *b, size_t i, bool on_pool)
+{
+    std::exception_ptr error;
+    std::unique_ptr<Arena> arena;
+
+    if (on_pool) {
+        // the Items of this shard go to an arena that the caller keeps
+        arena.reset(new Arena());
+        THD *const thd = current_thd;
+        MEM_ROOT *const saved_root = thd->mem_root;
+        Item *const saved_items = thd->free_list;
+
+        thd->mem_root = arena->get();
+        try {
+            b->f(b->shards[i].first, b->shards[i].second);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        thd->mem_root = saved_root;
+        thd->free_list = saved_items;
+    } else {
+        try {
+            b->f(b->shards[i].first, b->shards[i].second);
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+
+    crypto_workers *const w = workers();
+    scoped_lock l(&w->mu);
+    if (arena) {
+        b->arenas->push_back(std::move(arena));
+    }
+    if (error && !b->error) {
+        b->error = error;
+    }
+    if (++b->done == b->shards.size()) {
+        pthread_cond_broadcast(&w->done_cond);
+    }
+}
+
+void *
+CryptoPool::worker(void *arg)
+{
+    crypto_workers *const w = static_cast<crypto_workers *>(arg);
+
+    mysql_thread_init();
+    if (!createEmbeddedTHD()) {
+        scoped_lock l(&w->mu);
+        w->running--;
+        return NULL;
+    }
+
+    for (;;) {
+        Batch *b;
+        size_t i;
+        {
+            scoped_lock l(&w->mu);
+            while (w->work.empty()) {
+                pthread_cond_wait(&w->work_cond, &w->mu);
+            }
+
+            b = w->work.front();
+            i = b->next++;
+            if (b->next == b->shards.size()) {
+                w->work.pop_front();
+            }
+        }
+
+        runTask(b, i, true);
+    }
+
+    return NULL;
+}
+
+void
+CryptoPool::forEachShard(size_t n,
+                         const std::function<void(size_t, size_t)> &f,
+                         std::list<std::unique_ptr<Arena> > *arenas,
+                         size_t min)
+{
+    crypto_workers *const w = workers();
+
+    size_t nshards;
+    {
+        scoped_lock l(&w->mu);
+        nshards = std::min<size_t>(w->nthreads + 1,
+                                   n / std::max<size_t>(min, 1));
+
+        while (nshards > 1 && w->running < w->nthreads) {
+            pthread_t t;
+            if (0 != pthread_create(&t, NULL, worker, w)) {
+                break;
+            }
+            pthread_detach(t);
+            w->running++;
+        }
+    }
+
+    if (nshards <= 1) {
+        f(0, n);
+        return;
+    }
+
+    std::vector<std::pair<size_t, size_t> > shards;
+    for (size_t i = 0; i < nshards; ++i) {
+        shards.push_back(std::make_pair(n * i / nshards,
+                                        n * (i + 1) / nshards));
+    }
+
+    Batch b(shards, f, arenas);
+    {
+        scoped_lock l(&w->mu);
+        w->work.push_back(&b);
+        pthread_cond_broadcast(&w->work_cond);
+    }
+
+    // take shards until none are left, then wait for the pool's
+    for (;;) {
+        size_t i;
+        {
+            scoped_lock l(&w->mu);
+            if (b.next == shards.size()) {
+                while (b.done < shards.size()) {
+                    pthread_cond_wait(&w->done_cond, &w->mu);
+                }
+                break;
+            }
+            i = b.next++;
+            if (b.next == shards.size()) {
+                w->work.remove(&b);
+            }
+        }
+
+        runTask(&b, i, false);
+    }
+
+    if (b.error) {
+        std::rethrow_exception(b.error);
+    }
+}
+
+void
+CryptoPool::configure(uint nthreads)
+{
+    crypto_workers *const w = workers();
+    scoped_lock l(&w->mu);
+
+#ifdef NTL_THREADS
+    w->nthreads = nthreads;
+#else
+    w->nthreads = 0;
+#endif
+}
+
+uint
+CryptoPool::threads()
+{
+    crypto_workers *const w = workers();
+    scoped_lock l(&w->mu);
+
+    return w->nthreads;
+}
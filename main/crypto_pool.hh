@@ -0,0 +1,62 @@
+#pragma once
+
+#include <functional>
+#include <list>
+#include <memory>
+#include <vector>
+#include <pthread.h>
+
+#include <parser/embedmysql.hh>
+
+/*
+ * Threads that share the encryption of a large INSERT with the thread
+ * rewriting it.  Each pool thread owns an embedded THD, so the Item
+ * constructors find a current_thd; while it runs a task, that THD
+ * allocates from an Arena which the caller keeps, so the Items outlive
+ * the task.  Threads start on first use and are never stopped.
+ *
+ * The shards run NTL side by side, so an NTL built without NTL_THREADS
+ * gets no pool threads and every shard runs on the caller.
+ */
+class CryptoPool {
+public:
+    class Arena {
+    public:
+        Arena() {init_alloc_root(&root, 8192, 0);}
+        ~Arena() {free_root(&root, MYF(0));}
+        MEM_ROOT *get() {return &root;}
+
+    private:
+        Arena(const Arena &other);
+        Arena &operator=(const Arena &rhs);
+
+        MEM_ROOT root;
+    };
+
+    /*
+     * Splits [0, n) into contiguous shards of at least @min rows and
+     * runs @f on each, the calling thread included; returns once all
+     * are done.  The first exception of a shard is rethrown.  The
+     * shards do not depend on timing, so neither does the output.
+     */
+    static void
+        forEachShard(size_t n,
+                     const std::function<void(size_t, size_t)> &f,
+                     std::list<std::unique_ptr<Arena> > *arenas,
+                     size_t min = min_shard);
+
+    // pool threads used by later calls; 0 keeps all work on the caller,
+    // as does an NTL built without NTL_THREADS
+    static void configure(uint nthreads);
+    static uint threads();
+
+    // values per shard that make up for handing it to another thread
+    static const size_t min_shard = 64;
+
+private:
+    friend struct crypto_workers;
+
+    struct Batch;
+    static void runTask(Batch *b, size_t i, bool on_pool);
+    static void *worker(void *arg);
+};
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <functional>
+#include <map>
 #include <memory>
+#include <vector>
 
 #include <util/enum_text.hh>
 #include <main/serializers.hh>
@@ -137,6 +139,8 @@ class Connect;
  *  read SchemaInfo from database.
  *  > Logic is in SQL.
  */
+class MetaRows;
+
 class DBMeta : public DBObject, public NormalAlloc {
 public:
     DBMeta() {}
@@ -145,8 +149,8 @@ public:
 
     // FIXME: Use rtti.
     virtual std::string typeName() const = 0;
-    virtual std::vector<DBMeta *>
-        fetchChildren(const std::unique_ptr<Connect> &e_conn) = 0;
+    // Builds the children found in @rows and returns them.
+    virtual std::vector<DBMeta *> fetchChildren(MetaRows *const rows) = 0;
     // Stops processing on error.
     virtual bool
         applyToChildren(std::function<bool(const DBMeta &)>)
@@ -154,22 +158,74 @@ public:
     virtual AbstractMetaKey const &getKey(const DBMeta &child)
         const = 0;
 
+    // Copy-on-write updates of a schema; see SchemaCache::updateSchema.
+    // Replaces the child with a copy that shares the child's own
+    // children, and returns the copy; NULL if @child is not ours.
+    virtual DBMeta *copyChild(const DBMeta &child) = 0;
+    virtual bool dropChild(const DBMeta &child) = 0;
+    // Loads the child with this database id, and everything below it.
+    virtual DBMeta *
+        fetchChild(const std::unique_ptr<Connect> &e_conn,
+                   unsigned int id) = 0;
+
 protected:
     std::vector<DBMeta*>
-        doFetchChildren(const std::unique_ptr<Connect> &e_conn,
+        doFetchChildren(const MetaRows &rows,
                         std::function<DBMeta*
                             (const std::string &, const std::string &,
-                             const std::string &)>
+                             unsigned int)>
                             deserialHandler);
 };
 
+/*
+ * Rows of the metadata table grouped by parent id, so that a tree is
+ * built from a few scans rather than a query per node.  Deserializing
+ * the encryption layers is the costly part; layers are queued while the
+ * tree is built and finish() deserializes all of them on the
+ * CryptoPool.
+ */
+class MetaRows {
+public:
+    struct Row {
+        std::string serial_object;
+        std::string serial_key;
+        unsigned int id;
+    };
+
+    MetaRows() {}
+
+    // Adds the rows matching @where; an empty @where reads the table.
+    bool read(const std::unique_ptr<Connect> &e_conn,
+              const std::string &where);
+    // Adds the rows of every descendant of the @ids, one scan per level.
+    bool readBelow(const std::unique_ptr<Connect> &e_conn,
+                   std::vector<unsigned int> ids);
+    const std::vector<Row> &children(unsigned int parent_id) const;
+
+    // Builds everything below @parent, then runs finish().
+    void build(DBMeta *const parent);
+    void deferLayer(std::function<void()> deserialize);
+    void finish();
+
+    // layers per shard worth handing to a pool thread
+    static const size_t min_layer_shard = 16;
+
+private:
+    MetaRows(const MetaRows &other);
+    MetaRows &operator=(const MetaRows &rhs);
+
+    void buildChildren(DBMeta *const parent);
+
+    std::map<unsigned int, std::vector<Row> > rows;
+    std::vector<std::function<void()> > deferred;
+};
+
 class LeafDBMeta : public DBMeta {
 public:
     LeafDBMeta() {}
     LeafDBMeta(unsigned int id) : DBMeta(id) {}
 
-    std::vector<DBMeta *>
-        fetchChildren(const std::unique_ptr<Connect> &e_conn)
+    std::vector<DBMeta *> fetchChildren(MetaRows *const rows)
     {
         return std::vector<DBMeta *>();
     }
@@ -185,6 +241,14 @@ public:
         // FIXME:
         assert(false);
     }
+
+    DBMeta *copyChild(const DBMeta &child) {return NULL;}
+    bool dropChild(const DBMeta &child) {return false;}
+    DBMeta *fetchChild(const std::unique_ptr<Connect> &e_conn,
+                       unsigned int id)
+    {
+        return NULL;
+    }
 };
 
 // > TODO: Use static deserialization functions for the derived types so we
@@ -192,6 +256,8 @@ public:
 //   'const' back on the members.
 // > FIXME: The key in children is a pointer so this means our lookup is
 //   slow. Use std::reference_wrapper.
+// > Children are shared so that an updated copy of a schema can keep
+//   the subtrees that did not change.
 template <typename ChildType, typename KeyType>
 class MappedDBMeta : public DBMeta {
 public:
@@ -202,16 +268,19 @@ public:
     virtual bool childExists(const KeyType &key) const;
     virtual ChildType * getChild(const KeyType &key) const;
     KeyType const &getKey(const DBMeta &child) const;
-    virtual std::vector<DBMeta *>
-        fetchChildren(const std::unique_ptr<Connect> &e_conn);
+    virtual std::vector<DBMeta *> fetchChildren(MetaRows *const rows);
     bool applyToChildren(std::function<bool(const DBMeta &)> fn) const;
-    const std::map<KeyType, std::unique_ptr<ChildType> > &
+    const std::map<KeyType, std::shared_ptr<ChildType> > &
         getChildren() const {return children;}
     virtual const ChildType *
         getChildWithGChild(const DBMeta &gchild) const;
+    DBMeta *copyChild(const DBMeta &child);
+    bool dropChild(const DBMeta &child);
+    DBMeta *fetchChild(const std::unique_ptr<Connect> &e_conn,
+                       unsigned int id);
 
 private:
-    std::map<KeyType, std::unique_ptr<ChildType> > children;
+    std::map<KeyType, std::shared_ptr<ChildType> > children;
 };
 
 #include <main/dbobject.tt>
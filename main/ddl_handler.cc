@@ -67,14 +67,21 @@ class CreateTableHandler : public DDLHandler {
             // layout we use
             const auto &key_data = collectKeyData(*lex);
 
+            // fields added later by ALTER TABLE are never packed
+            HOMPacker packer;
+            HOMPacker *const p_packer =
+                determinePackedHOM() ? &packer : NULL;
+
             auto it =
                 List_iterator<Create_field>(lex->alter_info.create_list);
             new_lex->alter_info.create_list =
                 accumList<Create_field>(it,
-                    [&a, &tm, &key_data] (List<Create_field> out_list,
-                                          Create_field *const cf) {
+                    [&a, &tm, &key_data, p_packer]
+                        (List<Create_field> out_list,
+                         Create_field *const cf) {
                         return createAndRewriteField(a, cf, tm.get(),
-                                                     true, key_data, out_list);
+                                                     true, key_data, out_list,
+                                                     p_packer);
                 });
 
             // -----------------------------
@@ -405,6 +412,7 @@ nextImpl(const ResType &res, const NextParams &nparams)
         TEST_ErrPkt(deltaOutputAfterQuery(nparams.ps.getEConn(), this->deltas,
                                           this->embedded_completion_id.get()),
                    "deltaOuputAfterQuery failed for DDL");
+        this->publishDeltas(nparams, this->deltas);
 
         yield return CR_RESULTS(this->ddl_res.get());
     }
@@ -59,6 +59,40 @@ void rewriteInsertHelper(const Item &i, const FieldMeta &fm, Analysis &a,
     }
 }
 
+// A packed HOM column of a table and its fields by slot.
+struct HOMPackColumn {
+    const HOMPacked *layer;         // any slot's; they share the key
+    std::string anon_name;
+    std::vector<const FieldMeta *> fields;  // NULL for dropped fields
+};
+
+static std::vector<HOMPackColumn>
+collectHOMPacks(const TableMeta &tm)
+{
+    std::map<std::string, HOMPackColumn> packs;
+    for (auto it : tm.orderedFieldMetas()) {
+        const OnionMeta *const om = it->getOnionMeta(oAGG);
+        const HOMPacked *const layer = om ? om->getPackedHOM() : NULL;
+        if (!layer) {
+            continue;
+        }
+
+        HOMPackColumn &pack = packs[om->getAnonOnionName()];
+        pack.layer = layer;
+        pack.anon_name = om->getAnonOnionName();
+        if (pack.fields.size() <= layer->getSlot()) {
+            pack.fields.resize(layer->getSlot() + 1, NULL);
+        }
+        pack.fields[layer->getSlot()] = it;
+    }
+
+    std::vector<HOMPackColumn> out;
+    for (auto it : packs) {
+        out.push_back(it.second);
+    }
+    return out;
+}
+
 class InsertHandler : public DMLHandler {
     virtual void gather(Analysis &a, LEX *const lex) const
     {
@@ -90,6 +124,12 @@ class InsertHandler : public DMLHandler {
         new_lex->select_lex.table_list.first =
             rewrite_table_list(lex->select_lex.table_list.first, a);
 
+        // Packed HOM columns hold several fields, so they are written
+        // once per row after the fields themselves.
+        const std::vector<HOMPackColumn> &packs = collectHOMPacks(tm);
+        const std::string &anon_table = a.getAnonTableName(db_name, table);
+        std::map<const FieldMeta *, const Item *> pack_defaults;
+
         // -------------------------
         // Fields (and default data)
         // -------------------------
@@ -136,8 +176,16 @@ class InsertHandler : public DMLHandler {
 
                 // Get default values.
                 const std::string def_value = implicit_it->defaultValue();
-                rewriteInsertHelper(*make_item_string(def_value),
-                                    *implicit_it, a, &implicit_defaults);
+                Item *const def_item = make_item_string(def_value);
+                rewriteInsertHelper(*def_item, *implicit_it, a,
+                                    &implicit_defaults);
+                pack_defaults[implicit_it] = def_item;
+            }
+
+            for (const auto &pack : packs) {
+                newList.push_back(make_item_field(*seed_item_field,
+                                                  anon_table,
+                                                  pack.anon_name));
             }
 
             new_lex->field_list = newList;
@@ -149,20 +197,42 @@ class InsertHandler : public DMLHandler {
             assert(fmVec.empty());
             std::vector<FieldMeta *> fmetas = tm.orderedFieldMetas();
             fmVec.assign(fmetas.begin(), fmetas.end());
+
+            // The packed columns do not sit where the fields do, so
+            // name every column.
+            if (false == packs.empty()) {
+                THD *const thd = current_thd;
+                List<Item> newList;
+                Item_field *field = NULL;
+                for (auto it : fmVec) {
+                    field = new (thd->mem_root)
+                        Item_field(&new_lex->select_lex.context, NULL,
+                                   thd->strdup(table.c_str()),
+                                   thd->strdup(it->getFieldName().c_str()));
+                    rewriteInsertHelper(*field, *it, a, &newList);
+                }
+                assert(field);
+                for (const auto &pack : packs) {
+                    newList.push_back(make_item_field(*field, anon_table,
+                                                      pack.anon_name));
+                }
+                new_lex->field_list = newList;
+            }
         }
 
         // -----------------
         //      Values
         // -----------------
         if (lex->many_values.head()) {
+            // Rows that supply every field; empty rows stay empty.
+            std::vector<std::vector<const Item *> > rows;
             auto it = List_iterator<List_item>(lex->many_values);
-            List<List_item> newList;
             for (;;) {
                 List_item *const li = it++;
                 if (!li) {
                     break;
                 }
-                List<Item> *const newList0 = new List<Item>();
+                rows.push_back(std::vector<const Item *>());
                 if (li->elements != fmVec.size()) {
                     TEST_TextMessageError(0 == li->elements
                                          && NULL == lex->field_list.head(),
@@ -171,21 +241,80 @@ class InsertHandler : public DMLHandler {
                     // Query such as this.
                     // > INSERT INTO <table> () VALUES ();
                     // > INSERT INTO <table> VALUES ();
+                    TEST_TextMessageError(packs.empty(),
+                                          "empty rows are not supported"
+                                          " with packed HOM columns!");
                 } else {
                     auto it0 = List_iterator<Item>(*li);
-                    auto fmVecIt = fmVec.begin();
                     for (;;) {
                         const Item *const i = it0++;
-                        assert(!!i == (fmVec.end() != fmVecIt));
                         if (!i) {
                             break;
                         }
-                        rewriteInsertHelper(*i, **fmVecIt, a, newList0);
-                        ++fmVecIt;
+                        rows.back().push_back(i);
+                    }
+                }
+            }
+
+            // Rewrite a column at a time, so that each layer encrypts
+            // the constants of a column in one encryptBatch() call;
+            // other values go through their own rewrite.
+            std::vector<std::vector<std::vector<Item *> > >
+                cells(rows.size());
+            for (size_t r = 0; r < rows.size(); ++r) {
+                cells[r].resize(rows[r].size());
+            }
+            for (size_t c = 0; c < fmVec.size(); ++c) {
+                std::vector<const Item *> column;
+                std::vector<size_t> column_rows;
+                for (size_t r = 0; r < rows.size(); ++r) {
+                    if (rows[r].empty()) {
+                        continue;
+                    }
+                    const Item &i = *rows[r][c];
+                    if (is_typical_insert_constant(i)) {
+                        column.push_back(&i);
+                        column_rows.push_back(r);
+                    } else {
+                        rewriteInsertHelper(i, *fmVec[c], a, &cells[r][c]);
+                    }
+                }
+                if (column.empty()) {
+                    continue;
+                }
+
+                std::vector<std::vector<Item *> > encs;
+                typical_rewrite_insert_column(column, *fmVec[c], a, &encs);
+                for (size_t k = 0; k < column_rows.size(); ++k) {
+                    cells[column_rows[k]][c] = encs[k];
+                }
+            }
+
+            List<List_item> newList;
+            for (size_t r = 0; r < rows.size(); ++r) {
+                List<Item> *const newList0 = new List<Item>();
+                if (false == rows[r].empty()) {
+                    std::map<const FieldMeta *, const Item *>
+                        row(pack_defaults);
+                    for (size_t c = 0; c < fmVec.size(); ++c) {
+                        for (auto enc : cells[r][c]) {
+                            newList0->push_back(enc);
+                        }
+                        row[fmVec[c]] = rows[r][c];
                     }
                     for (auto def_it : implicit_defaults) {
                         newList0->push_back(def_it);
                     }
+
+                    for (const auto &pack : packs) {
+                        std::vector<const Item *> slots;
+                        for (auto fm : pack.fields) {
+                            const auto it_row = row.find(fm);
+                            slots.push_back(row.end() != it_row
+                                              ? it_row->second : NULL);
+                        }
+                        newList0->push_back(pack.layer->encryptPack(slots));
+                    }
                 }
                 newList.push_back(newList0);
             }
@@ -618,7 +747,7 @@ rewrite_field_value_pairs(List_iterator<Item> fd_it,
 
 static void
 addToReturn(ReturnMeta *const rm, int pos, const OLK &constr,
-            bool has_salt, const std::string &name)
+            bool has_salt, const std::string &name, int value_pos = -1)
 {
     const bool test = static_cast<unsigned int>(pos) == rm->rfmeta.size();
     TEST_TextMessageError(test, "ReturnMeta has badly ordered"
@@ -626,7 +755,7 @@ addToReturn(ReturnMeta *const rm, int pos, const OLK &constr,
 
     const int salt_pos = has_salt ? pos + 1 : -1;
     std::pair<int, ReturnField>
-        pair(pos, ReturnField(false, name, constr, salt_pos));
+        pair(pos, ReturnField(false, name, constr, salt_pos, value_pos));
     rm->rfmeta.insert(pair);
 }
 
@@ -642,6 +771,35 @@ addSaltToReturn(ReturnMeta *const rm, int pos)
     rm->rfmeta.insert(pair);
 }
 
+// the column under a projected SUM over a packed HOM onion, or ""
+static std::string
+packedSumColumn(const Item &i, const OLK &olk, const Item &rewritten)
+{
+    if (oAGG != olk.o || !olk.key
+        || Item::Type::SUM_FUNC_ITEM != i.type()
+        || Item_sum::SUM_FUNC != static_cast<const Item_sum &>(i).sum_func()
+        || Item::Type::FUNC_ITEM != rewritten.type()) {
+        return "";
+    }
+
+    const OnionMeta *const om = olk.key->getOnionMeta(oAGG);
+    if (!om || !om->getPackedHOM()) {
+        return "";
+    }
+
+    // cryptdb_agg(column, pubkey)
+    const Item_func &uda = static_cast<const Item_func &>(rewritten);
+    if (uda.argument_count() < 1
+        || Item::Type::FIELD_ITEM != uda.arguments()[0]->type()) {
+        return "";
+    }
+
+    const Item_field &col =
+        static_cast<const Item_field &>(*uda.arguments()[0]);
+    return std::string(col.table_name ? col.table_name : "") + "."
+           + col.field_name;
+}
+
 static void
 rewrite_proj(const Item &i, const RewritePlan &rp, Analysis &a,
              List<Item> *const newList)
@@ -663,12 +821,30 @@ rewrite_proj(const Item &i, const RewritePlan &rp, Analysis &a,
         olk = rp.es_out.chooseOne();
     }
     assert(ir.assigned() && ir.get());
-    newList->push_back(ir.get());
     const bool use_salt = needsSalt(olk.get());
 
+    // Every SUM over the fields of one packed HOM column is read from
+    // the first one's result, so the server aggregates the column once.
+    int value_pos = -1;
+    const std::string &packed_col = packedSumColumn(i, olk.get(), *ir.get());
+    if (false == packed_col.empty()) {
+        const auto it = a.packed_sums.find(packed_col);
+        if (a.packed_sums.end() != it) {
+            value_pos = it->second;
+        } else {
+            a.packed_sums[packed_col] = a.pos;
+        }
+    }
+
+    if (value_pos < 0) {
+        newList->push_back(ir.get());
+    } else {
+        newList->push_back(new (current_thd->mem_root) Item_null());
+    }
+
     // This line implicity handles field aliasing for at least some cases.
     // As i->name can/will be the alias.
-    addToReturn(&a.rmeta, a.pos++, olk.get(), use_salt, i.name);
+    addToReturn(&a.rmeta, a.pos++, olk.get(), use_salt, i.name, value_pos);
 
     if (use_salt) {
         TEST_TextMessageError(Item::Type::FIELD_ITEM == ir.get()->type(),
@@ -808,6 +984,15 @@ determineUpdateType(const Item &value_item, const FieldMeta &fm,
         return SIMPLE_UPDATE_TYPE::UNSUPPORTED;
     }
 
+    // Writing a packed HOM column would clobber the other fields of the
+    // pack; such updates go through SpecialUpdateExecutor.
+    const OnionMeta *const om = fm.getOnionMeta(oAGG);
+    if (om && om->getPackedHOM()
+        && (value_item.type() != Item::Type::FIELD_ITEM
+            || isItem_insert_value(value_item))) {
+        return SIMPLE_UPDATE_TYPE::UNSUPPORTED;
+    }
+
     if (value_item.type() == Item::Type::FIELD_ITEM) {
         if (true == isItem_insert_value(value_item)) {
             return SIMPLE_UPDATE_TYPE::ON_DUPLICATE_VALUE;
@@ -1090,14 +1275,20 @@ private:
         for (const auto &it : params.onions) {
             OnionMeta &om = a.getOnionMeta(params.fm, it.first);
             const SECLEVEL current_level = a.getOnionLevel(om);
-            if (it.second <= current_level) {
-                om.setMinimumSecLevel(it.second);
-            } else {
+            if (it.second > current_level) {
                 FAIL_TextMessageError("it is not possible to set a minimum level"
                                       " above the current level!");
             }
-            a.deltas.push_back(std::unique_ptr<Delta>(new ReplaceDelta(om,
-                                                                     params.fm)));
+            const SECLEVEL level = it.second;
+            const std::function<void(DBMeta *)> change =
+                [level] (DBMeta *const meta)
+                {
+                    static_cast<OnionMeta *>(meta)->setMinimumSecLevel(level);
+                };
+            OnionMeta &changed = a.writable(om);
+            change(&changed);
+            a.deltas.push_back(std::unique_ptr<Delta>(
+                new ReplaceDelta(om, params.fm, changed, change)));
         }
 
         return new SensitiveDirectiveExecutor(std::move(a.deltas));
@@ -1267,7 +1458,8 @@ nextImpl(const ResType &res, const NextParams &nparams)
 
         yield {
             try {
-                return CR_RESULTS(Rewriter::decryptResults(res, this->rmeta));
+                return CR_RESULTS(Rewriter::decryptResults(res, this->rmeta,
+                                                            &this->arenas));
             } catch (...) {
                 FAIL_GenericPacketException("error decrypting dml results");
             }
@@ -1339,7 +1531,8 @@ nextImpl(const ResType &res, const NextParams &nparams)
 
         try {
             this->dec_res =
-                Rewriter::decryptResults(res, this->select_rmeta.get());
+                Rewriter::decryptResults(res, this->select_rmeta.get(),
+                                         &this->dec_arenas);
         } catch (...) {
             TEST_ErrPkt(res.success(),
                         "decrypting initial SELECT failed for SpecialUpdate");
@@ -1604,6 +1797,7 @@ nextImpl(const ResType &res, const NextParams &nparams)
                                          Delta::REGULAR_TABLE));
 
             SPECIALIZED_SYNC(nparams.ps.getEConn()->execute("COMMIT"));
+            this->publishDeltas(nparams, this->deltas);
 
             return CR_QUERY_RESULTS("DO 0;");
         }
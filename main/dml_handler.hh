@@ -12,13 +12,19 @@ class DMLQueryExecutor : public AbstractQueryExecutor {
 public:
     DMLQueryExecutor(const LEX &lex, const ReturnMeta &rmeta)
         : query(lexToQuery(lex)), rmeta(rmeta) {}
+    // from a RewriteCache plan
+    DMLQueryExecutor(const std::string &query, const ReturnMeta &rmeta)
+        : query(query), rmeta(rmeta) {}
     ~DMLQueryExecutor() {}
     std::pair<ResultType, AbstractAnything *>
         nextImpl(const ResType &res, const NextParams &nparams);
+    const std::string *cacheableQuery() const {return &query;}
 
 private:
     const std::string query;
     const ReturnMeta rmeta;
+    // the decrypted results, if the CryptoPool built them
+    std::list<std::unique_ptr<CryptoPool::Arena> > arenas;
 };
 
 class SpecialUpdateExecutor : public AbstractQueryExecutor {
@@ -33,6 +39,8 @@ class SpecialUpdateExecutor : public AbstractQueryExecutor {
     AssignOnce<std::string> escaped_output_values;
     AssignOnce<ReturnMeta> select_rmeta;
     AssignOnce<bool> in_trx;
+    // keeps the Items of dec_res if the CryptoPool built them
+    std::list<std::unique_ptr<CryptoPool::Arena> > dec_arenas;
 
 public:
     SpecialUpdateExecutor(const std::string &plain_table,
@@ -0,0 +1,764 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <sstream>
+
+#include <main/rewrite_cache.hh>
+#include <main/rewrite_main.hh>
+#include <main/dml_handler.hh>
+#include <main/CryptoHandlers.hh>
+#include <parser/embedmysql.hh>
+#include <parser/sql_utils.hh>
+#include <parser/stringify.hh>
+#include <util/scoped_lock.hh>
+
+static size_t max_plans = 1024;
+// lookups per shape kept that an unverified plan lasts for
+static const uint64_t unverified_age = 4;
+
+// the THD of this thread's hits; the parse THDs go back to their pool
+// and the caller's THD may be gone, so hits keep one of their own
+static __thread THD *hit_thd = NULL;
+
+namespace {
+/*
+ * Makes the hit THD current for a hit.  The Items of the literals and
+ * of their encryptions are freed, and the mem_root cut back, on the way
+ * out, so a hit leaves nothing behind.
+ */
+class HitTHD {
+public:
+    HitTHD() : thd(hit_thd) {
+        if (thd) {
+            thd->thread_stack = reinterpret_cast<char *>(&thd);
+            if (thd->store_globals()) {
+                hit_thd = NULL;
+                deleteEmbeddedTHD(thd);
+                thd = NULL;
+            }
+        }
+        if (!thd) {
+            thd = createEmbeddedTHD();
+            TEST_Text(thd, "no THD for a cached rewrite");
+            hit_thd = thd;
+        }
+        release();
+    }
+    ~HitTHD() {release();}
+
+private:
+    HitTHD(const HitTHD &other);
+    HitTHD &operator=(const HitTHD &rhs);
+
+    void release() {
+        thd->free_items();
+        free_root(thd->mem_root, MYF(MY_KEEP_PREALLOC));
+    }
+
+    THD *thd;
+};
+}
+
+struct RewriteCache::Plan {
+    enum class State {PENDING, ACTIVE, UNCACHEABLE};
+
+    Plan(State state, const std::string &key, uint64_t schema_version)
+        : state(state), key(key), schema_version(schema_version),
+          salts(0) {}
+
+    // changes under the cache lock; everything else is set once
+    State state;
+
+    // the shape and the schema the plan was made for
+    const std::string key;
+    const uint64_t schema_version;
+
+    // the literals of the query the plan was made from
+    std::vector<std::string> made_from;
+
+    // a slot without a literal, or one not encrypted under a salt
+    static const size_t none;
+
+    // a literal encrypted with these layers under a salt, or as is if
+    // there are none; a slot without a literal is the salt itself
+    struct Slot {
+        size_t literal;
+        std::vector<std::shared_ptr<EncLayer> > layers;
+        size_t salt;
+    };
+    std::vector<Slot> slots;
+    // a hit draws this many fresh salts
+    size_t salts;
+
+    // the rewritten query is pieces[0], then the slot gap[0] takes,
+    // then pieces[1] and so on
+    std::vector<std::string> pieces;
+    std::vector<size_t> gaps;
+
+    ReturnMeta rmeta;
+};
+
+const size_t RewriteCache::Plan::none = static_cast<size_t>(-1);
+
+static bool
+isWordChar(char c)
+{
+    return isalnum(static_cast<unsigned char>(c)) || '_' == c || '$' == c;
+}
+
+// the characters a backslash escape in a string literal stands for
+static std::string
+unescapeChar(char c)
+{
+    switch (c) {
+    case '0':   return std::string(1, '\0');
+    case 'b':   return "\b";
+    case 'n':   return "\n";
+    case 'r':   return "\r";
+    case 't':   return "\t";
+    case 'Z':   return "\032";
+    // kept for LIKE
+    case '%':   return "\\%";
+    case '_':   return "\\_";
+    default:    return std::string(1, c);
+    }
+}
+
+RewriteCache::Shape::Shape(const std::string &query,
+                           const std::string &default_db)
+    : ok(false), key(default_db + std::string(1, '\0'))
+{
+    ok = max_plans > 0 && normalize(query);
+}
+
+bool
+RewriteCache::Shape::normalize(const std::string &q)
+{
+    size_t i = 0;
+    while (i < q.size()) {
+        const char c = q[i];
+        if ('\'' == c || '"' == c) {
+            // X'', N'', _utf8'' and the like are not plain strings
+            if (i > 0 && isWordChar(q[i - 1])) {
+                return false;
+            }
+
+            std::string value;
+            size_t j = i + 1;
+            for (;;) {
+                if (j >= q.size()) {
+                    return false;
+                }
+                if (c == q[j]) {
+                    if (j + 1 < q.size() && c == q[j + 1]) {
+                        value += c;
+                        j += 2;
+                        continue;
+                    }
+                    break;
+                }
+                if ('\\' == q[j]) {
+                    if (j + 1 >= q.size()) {
+                        return false;
+                    }
+                    value += unescapeChar(q[j + 1]);
+                    j += 2;
+                    continue;
+                }
+                value += q[j++];
+            }
+
+            literals.push_back(Literal({Kind::STRING,
+                                        q.substr(i, j + 1 - i), value}));
+            key += "?s";
+            i = j + 1;
+        } else if ('`' == c) {
+            const size_t end = q.find('`', i + 1);
+            if (std::string::npos == end) {
+                return false;
+            }
+            key.append(q, i, end + 1 - i);
+            i = end + 1;
+        } else if (isdigit(static_cast<unsigned char>(c))) {
+            size_t j = i;
+            while (j < q.size() && isdigit(static_cast<unsigned char>(q[j]))) {
+                ++j;
+            }
+            Kind kind = Kind::INT;
+            if (j < q.size() && '.' == q[j]) {
+                kind = Kind::DECIMAL;
+                ++j;
+                while (j < q.size()
+                       && isdigit(static_cast<unsigned char>(q[j]))) {
+                    ++j;
+                }
+            }
+            // 1e5, 0x1f and names such as 1abc; the parser makes
+            // other Items of long numbers
+            if ((j < q.size() && (isWordChar(q[j]) || '.' == q[j]))
+                || (Kind::INT == kind && j - i > 18)
+                || (Kind::DECIMAL == kind && j - i > 30)) {
+                return false;
+            }
+
+            const std::string text = q.substr(i, j - i);
+            literals.push_back(Literal({kind, text, text}));
+            key += Kind::INT == kind ? "?n" : "?d";
+            i = j;
+        } else if (isWordChar(c)) {
+            size_t j = i;
+            while (j < q.size() && isWordChar(q[j])) {
+                ++j;
+            }
+            key.append(q, i, j - i);
+            i = j;
+        } else {
+            const char next = i + 1 < q.size() ? q[i + 1] : '\0';
+            if ('#' == c || '?' == c || ('-' == c && '-' == next)
+                || ('/' == c && '*' == next)
+                || ('.' == c && isdigit(static_cast<unsigned char>(next)))) {
+                return false;
+            }
+            key += c;
+            ++i;
+        }
+    }
+
+    return true;
+}
+
+// the Item the parser makes of the literal
+static Item *
+literalItem(const RewriteCache::Shape::Literal &l)
+{
+    THD *const thd = current_thd;
+    switch (l.kind) {
+    case RewriteCache::Shape::Kind::INT:
+        return new (thd->mem_root)
+            Item_int(make_thd_string(l.text),
+                     static_cast<longlong>(strtoll(l.text.c_str(), NULL, 10)),
+                     l.text.size());
+    case RewriteCache::Shape::Kind::DECIMAL:
+        return new (thd->mem_root)
+            Item_decimal(make_thd_string(l.text), l.text.size(),
+                         thd->charset());
+    case RewriteCache::Shape::Kind::STRING:
+        return new (thd->mem_root)
+            Item_string(make_thd_string(l.value), l.value.size(),
+                        thd->variables.collation_connection);
+    }
+
+    assert(false);
+}
+
+static std::string
+printItem(const Item &i)
+{
+    std::ostringstream o;
+    o << i;
+    return o.str();
+}
+
+// as the rewrite puts a salt in a query
+static std::string
+saltText(uint64_t salt)
+{
+    return printItem(*new (current_thd->mem_root)
+                         Item_int(static_cast<ulonglong>(salt)));
+}
+
+// the salts @a encrypted under, in the order its constants used them
+static std::vector<uint64_t>
+saltsOf(const Analysis &a)
+{
+    std::vector<uint64_t> out;
+    for (const auto &c : a.constants) {
+        if (0 != c.IV
+            && out.end() == std::find(out.begin(), out.end(), c.IV)) {
+            out.push_back(c.IV);
+        }
+    }
+
+    return out;
+}
+
+static std::string
+fillSlot(const RewriteCache::Plan::Slot &slot,
+         const std::vector<RewriteCache::Shape::Literal> &literals,
+         const std::vector<uint64_t> &salts)
+{
+    typedef RewriteCache::Plan Plan;
+    const uint64_t IV = Plan::none == slot.salt ? 0 : salts[slot.salt];
+    if (Plan::none == slot.literal) {
+        return saltText(IV);
+    }
+
+    const Item *enc = literalItem(literals[slot.literal]);
+    for (const auto &it : slot.layers) {
+        enc = it->encrypt(*enc, IV);
+        assert(enc);
+    }
+
+    return printItem(*enc);
+}
+
+static std::string
+splice(const RewriteCache::Plan &plan, const std::vector<std::string> &texts)
+{
+    std::string out = plan.pieces[0];
+    for (size_t i = 0; i < plan.gaps.size(); ++i) {
+        out += texts[plan.gaps[i]];
+        out += plan.pieces[i + 1];
+    }
+
+    return out;
+}
+
+static std::string
+instantiate(const RewriteCache::Plan &plan,
+            const std::vector<RewriteCache::Shape::Literal> &literals)
+{
+    std::vector<uint64_t> salts;
+    for (size_t i = 0; i < plan.salts; ++i) {
+        salts.push_back(randomValue());
+    }
+
+    std::vector<std::string> texts;
+    for (const auto &it : plan.slots) {
+        texts.push_back(fillSlot(it, literals, salts));
+    }
+
+    return splice(plan, texts);
+}
+
+/*
+ * What the slots of @plan were filled with in the rewrite @a, for
+ * checking the plan against it.  The salts are @a's; layers that
+ * encrypt alike each time are run again, and what the others gave is
+ * taken from @a's constants.  False if @a has no such constant.
+ */
+static bool
+rewrittenTexts(const RewriteCache::Plan &plan,
+               const std::vector<RewriteCache::Shape::Literal> &literals,
+               const Analysis &a, std::vector<std::string> *const texts)
+{
+    typedef RewriteCache::Plan Plan;
+    const std::vector<uint64_t> &salts = saltsOf(a);
+    if (salts.size() != plan.salts) {
+        return false;
+    }
+
+    for (const auto &slot : plan.slots) {
+        bool deterministic = true;
+        for (const auto &it : slot.layers) {
+            deterministic = deterministic && it->deterministicEncrypt();
+        }
+        if (deterministic) {
+            texts->push_back(fillSlot(slot, literals, salts));
+            continue;
+        }
+
+        const uint64_t IV = Plan::none == slot.salt ? 0 : salts[slot.salt];
+        const std::string &plain =
+            printItem(*literalItem(literals[slot.literal]));
+        const auto it =
+            std::find_if(a.constants.begin(), a.constants.end(),
+                [&](const Analysis::Constant &c) {
+                    return c.IV == IV && c.layers == slot.layers
+                           && printItem(*c.plain) == plain;
+                });
+        if (a.constants.end() == it) {
+            return false;
+        }
+        texts->push_back(printItem(*it->rewritten));
+    }
+
+    return true;
+}
+
+static bool
+sameReturnMeta(const ReturnMeta &a, const ReturnMeta &b)
+{
+    if (a.rfmeta.size() != b.rfmeta.size()) {
+        return false;
+    }
+
+    for (auto ait = a.rfmeta.begin(), bit = b.rfmeta.begin();
+         ait != a.rfmeta.end(); ++ait, ++bit) {
+        const ReturnField &af = ait->second;
+        const ReturnField &bf = bit->second;
+        if (ait->first != bit->first
+            || af.getIsSalt() != bf.getIsSalt()
+            || af.fieldCalled() != bf.fieldCalled()
+            || !(af.getOLK() == bf.getOLK())
+            || af.getOLK().key != bf.getOLK().key
+            || af.getSaltPosition() != bf.getSaltPosition()
+            || af.getValuePosition() != bf.getValuePosition()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Cuts @query around the literals, or what @a encrypted them to.
+ * Returns NULL when this query can not tell where the literals went,
+ * but one of the same shape may; an UNCACHEABLE plan when none can.
+ */
+static std::shared_ptr<RewriteCache::Plan>
+makePlan(const RewriteCache::Shape &shape, uint64_t schema_version,
+         const Analysis &a, const std::string &query,
+         const ReturnMeta &rmeta)
+{
+    typedef RewriteCache::Plan Plan;
+    const std::shared_ptr<Plan>
+        uncacheable(new Plan(Plan::State::UNCACHEABLE, shape.getKey(),
+                             schema_version));
+
+    const std::vector<RewriteCache::Shape::Literal> &literals =
+        shape.getLiterals();
+    std::vector<const Item *> items;
+    std::vector<std::string> printed;
+    for (const auto &it : literals) {
+        items.push_back(literalItem(it));
+        printed.push_back(printItem(*items.back()));
+    }
+
+    // with equal literals we could not tell which went where
+    {
+        std::vector<std::string> sorted(printed);
+        std::sort(sorted.begin(), sorted.end());
+        if (sorted.end() != std::adjacent_find(sorted.begin(), sorted.end())) {
+            return nullptr;
+        }
+    }
+
+    std::shared_ptr<Plan> plan(new Plan(Plan::State::PENDING,
+                                        shape.getKey(), schema_version));
+    const std::vector<uint64_t> &salts = saltsOf(a);
+    plan->salts = salts.size();
+    std::vector<std::string> needles;
+    std::vector<bool> traced(literals.size(), false);
+    for (const auto &c : a.constants) {
+        const std::string &plain = printItem(*c.plain);
+        const auto it = std::find(printed.begin(), printed.end(), plain);
+        if (printed.end() == it) {
+            return uncacheable;
+        }
+        const size_t k = it - printed.begin();
+        if (items[k]->type() != c.plain->type()
+            || items[k]->field_type() != c.plain->field_type()
+            || items[k]->collation.collation != c.plain->collation.collation) {
+            return uncacheable;
+        }
+
+        traced[k] = true;
+        const size_t salt =
+            0 == c.IV ? Plan::none
+                      : std::find(salts.begin(), salts.end(), c.IV)
+                        - salts.begin();
+        bool seen = false;
+        for (const auto &s : plan->slots) {
+            seen = seen || (s.literal == k && s.layers == c.layers
+                            && s.salt == salt);
+        }
+        if (!seen) {
+            plan->slots.push_back(Plan::Slot({k, c.layers, salt}));
+            needles.push_back(printItem(*c.rewritten));
+        }
+    }
+    for (size_t k = 0; k < literals.size(); ++k) {
+        if (!traced[k]) {
+            plan->slots.push_back(Plan::Slot({k, {}, Plan::none}));
+            needles.push_back(printed[k]);
+        }
+    }
+    // a hit makes up new salts, so the old ones must all be found
+    for (size_t i = 0; i < salts.size(); ++i) {
+        plan->slots.push_back(Plan::Slot({Plan::none, {}, i}));
+        needles.push_back(saltText(salts[i]));
+    }
+
+    // where each slot shows up in the query; the literals, then the
+    // salts, must each be somewhere
+    std::vector<std::pair<size_t, size_t> > found;     // position, slot
+    std::vector<bool> placed(literals.size() + salts.size(), false);
+    for (size_t s = 0; s < needles.size(); ++s) {
+        const std::string &n = needles[s];
+        if (n.empty()) {
+            return uncacheable;
+        }
+        for (size_t pos = query.find(n); std::string::npos != pos;
+             pos = query.find(n, pos + 1)) {
+            const size_t end = pos + n.size();
+            if ((isWordChar(n.front()) && pos > 0
+                 && isWordChar(query[pos - 1]))
+                || (isWordChar(n.back()) && end < query.size()
+                    && isWordChar(query[end]))) {
+                continue;
+            }
+            found.push_back(std::make_pair(pos, s));
+            const Plan::Slot &slot = plan->slots[s];
+            placed[Plan::none == slot.literal
+                       ? literals.size() + slot.salt : slot.literal] = true;
+        }
+    }
+    if (placed.end() != std::find(placed.begin(), placed.end(), false)) {
+        return uncacheable;
+    }
+
+    std::sort(found.begin(), found.end());
+    size_t at = 0;
+    for (const auto &it : found) {
+        if (it.first < at) {
+            return uncacheable;
+        }
+        plan->pieces.push_back(query.substr(at, it.first - at));
+        plan->gaps.push_back(it.second);
+        at = it.first + needles[it.second].size();
+    }
+    plan->pieces.push_back(query.substr(at));
+
+    for (const auto &it : literals) {
+        plan->made_from.push_back(it.text);
+    }
+    plan->rmeta = rmeta;
+
+    return plan;
+}
+
+RewriteCache::RewriteCache() : schema_version(0), clock(0)
+{
+    pthread_mutex_init(&lock, NULL);
+}
+
+RewriteCache::~RewriteCache()
+{
+    pthread_mutex_destroy(&lock);
+}
+
+std::shared_ptr<RewriteCache::Plan>
+RewriteCache::find(const std::string &key) const
+{
+    const auto it = plans.find(key);
+    if (plans.end() == it) {
+        return nullptr;
+    }
+
+    Entry &e = it->second;
+    if (Plan::State::ACTIVE != e.plan->state
+        && clock - e.made > unverified_age * max_plans) {
+        stats.expired++;
+        erase(key);
+        return nullptr;
+    }
+
+    used.splice(used.begin(), used, e.used);
+    return e.plan;
+}
+
+void
+RewriteCache::insert(const std::string &key,
+                     const std::shared_ptr<Plan> &plan) const
+{
+    if (0 == max_plans || plans.end() != plans.find(key)) {
+        return;
+    }
+
+    while (plans.size() >= max_plans) {
+        stats.evicted++;
+        erase(used.back());
+    }
+
+    used.push_front(key);
+    plans.insert(std::make_pair(key, Entry({plan, used.begin(), clock})));
+}
+
+void
+RewriteCache::erase(const std::string &key) const
+{
+    const auto it = plans.find(key);
+    assert(plans.end() != it);
+    used.erase(it->second.used);
+    plans.erase(it);
+}
+
+// whether @kept holds a plan for @shape against @schema
+static bool
+keptFor(const std::shared_ptr<RewriteCache::Plan> *const kept,
+        const RewriteCache::Shape &shape, const SchemaInfo &schema)
+{
+    return kept && *kept && (*kept)->key == shape.getKey()
+           && (*kept)->schema_version == schema.getVersion();
+}
+
+QueryRewrite *
+RewriteCache::lookup(const Shape &shape, const SchemaInfo &schema,
+                     std::shared_ptr<Plan> *kept, bool shared) const
+{
+    std::shared_ptr<Plan> plan;
+    {
+        scoped_lock l(&lock);
+        if (!shape.cacheable()) {
+            stats.uncacheable++;
+            return NULL;
+        }
+
+        // plans hold FieldMetas of the schema they were made with
+        if (schema.getVersion() > schema_version) {
+            plans.clear();
+            used.clear();
+            schema_version = schema.getVersion();
+        }
+
+        if (keptFor(kept, shape, schema)) {
+            plan = *kept;
+        } else if (shared && schema.getVersion() == schema_version) {
+            clock++;
+            plan = find(shape.getKey());
+            if (!plan) {
+                return NULL;
+            }
+            if (kept) {
+                *kept = plan;
+            }
+        } else {
+            return NULL;
+        }
+
+        if (Plan::State::UNCACHEABLE == plan->state) {
+            stats.uncacheable++;
+            return NULL;
+        }
+        if (Plan::State::ACTIVE != plan->state) {
+            return NULL;
+        }
+    }
+
+    // a literal the layers refuse gets the usual rewrite, and its error
+    std::string query;
+    try {
+        const HitTHD thd;
+        query = instantiate(*plan, shape.getLiterals());
+    } catch (...) {
+        return NULL;
+    }
+
+    return new QueryRewrite(true, plan->rmeta, KillZone(),
+                            new DMLQueryExecutor(query, plan->rmeta));
+}
+
+void
+RewriteCache::learn(const Shape &shape, const SchemaInfo &schema,
+                    const Analysis &a, const QueryRewrite &qr,
+                    std::shared_ptr<Plan> *kept, bool shared) const
+{
+    assert(shared || kept);
+    if (!shape.cacheable()) {
+        return;
+    }
+
+    const std::string *const query = qr.executor->cacheableQuery();
+    std::shared_ptr<Plan> plan;
+    {
+        scoped_lock l(&lock);
+        if (keptFor(kept, shape, schema)) {
+            plan = *kept;
+        } else if (shared) {
+            if (schema.getVersion() != schema_version) {
+                return;
+            }
+
+            plan = find(shape.getKey());
+            if (plan && kept) {
+                *kept = plan;
+            }
+        }
+
+        if (plan && Plan::State::PENDING != plan->state) {
+            return;
+        }
+    }
+
+    if (!plan) {
+        const std::shared_ptr<Plan> &made =
+            query ? makePlan(shape, schema.getVersion(), a, *query,
+                             qr.rmeta)
+                  : std::make_shared<Plan>(Plan::State::UNCACHEABLE,
+                                           shape.getKey(),
+                                           schema.getVersion());
+        if (!made) {
+            return;
+        }
+        if (kept) {
+            *kept = made;
+        }
+
+        scoped_lock l(&lock);
+        if (shared && schema.getVersion() == schema_version) {
+            insert(shape.getKey(), made);
+        }
+        return;
+    }
+
+    // the plan must give what a rewrite with other literals gave
+    std::vector<std::string> texts;
+    for (const auto &it : shape.getLiterals()) {
+        texts.push_back(it.text);
+    }
+    if (texts == plan->made_from) {
+        return;
+    }
+
+    bool same = false;
+    if (query && sameReturnMeta(plan->rmeta, qr.rmeta)) {
+        try {
+            std::vector<std::string> texts;
+            same = rewrittenTexts(*plan, shape.getLiterals(), a, &texts)
+                   && splice(*plan, texts) == *query;
+        } catch (...) {
+            same = false;
+        }
+    }
+
+    scoped_lock l(&lock);
+    if (Plan::State::PENDING == plan->state) {
+        plan->state = same ? Plan::State::ACTIVE
+                           : Plan::State::UNCACHEABLE;
+    }
+}
+
+void
+RewriteCache::countRewrite(bool hit, uint64_t usec) const
+{
+    scoped_lock l(&lock);
+    stats.lookups++;
+    if (hit) {
+        stats.hits++;
+        stats.hit_usec += usec;
+    } else {
+        stats.miss_usec += usec;
+    }
+}
+
+RewriteCache::Stats
+RewriteCache::getStats() const
+{
+    scoped_lock l(&lock);
+    Stats s = stats;
+    s.entries = plans.size();
+    return s;
+}
+
+void
+RewriteCache::setCapacity(size_t entries)
+{
+    max_plans = entries;
+}
+
+size_t
+RewriteCache::capacity()
+{
+    return max_plans;
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+
+class Analysis;
+class QueryRewrite;
+class SchemaInfo;
+
+/*
+ * Rewrite plans of queries that differ only in their literals.
+ *
+ * A query is keyed on its text with the literals taken out, the default
+ * database and the version of the schema it was rewritten against.  The
+ * plan is the rewritten query cut around the places where the literals
+ * went, with the layers each literal was encrypted with; a hit encrypts
+ * the new literals and splices them in, skipping the parser and the
+ * rewrite passes.
+ *
+ * Plans are only made for queries that rewrite to a single query whose
+ * literals all show up in it, and they are only used after a second
+ * query of the same shape, with other literals, rewrote to what the
+ * plan gives.  Literals encrypted under a fresh salt, as INSERT and
+ * UPDATE SET do, are encrypted under a new salt on each hit, which goes
+ * where the salt went; the query must carry every such salt.
+ *
+ * A full cache drops the shape used least recently.  Shapes still
+ * waiting for their second query, and those found to have no plan,
+ * are dropped after four lookups per shape the cache holds, so that
+ * they are tried again.
+ */
+class RewriteCache {
+public:
+    struct Stats {
+        Stats() : lookups(0), hits(0), uncacheable(0), entries(0),
+                  evicted(0), expired(0), hit_usec(0), miss_usec(0) {}
+
+        uint64_t lookups;
+        uint64_t hits;
+        // lookups of shapes that can have no plan
+        uint64_t uncacheable;
+        size_t entries;
+        // shapes dropped for room, and unverified ones that aged out
+        uint64_t evicted;
+        uint64_t expired;
+        // time spent in Rewriter::rewrite
+        uint64_t hit_usec;
+        uint64_t miss_usec;
+    };
+
+    // A query split into its shape and its literals.
+    class Shape {
+    public:
+        Shape(const std::string &query, const std::string &default_db);
+
+        enum class Kind {INT, DECIMAL, STRING};
+        struct Literal {
+            Kind kind;
+            std::string text;   // as written, quotes included
+            std::string value;  // unescaped
+        };
+
+        // false for queries with comments, placeholders or literals
+        // that plans do not handle
+        bool cacheable() const {return ok;}
+        const std::string &getKey() const {return key;}
+        const std::vector<Literal> &getLiterals() const {return literals;}
+
+    private:
+        bool normalize(const std::string &query);
+
+        bool ok;
+        std::string key;
+        std::vector<Literal> literals;
+    };
+
+    RewriteCache();
+    ~RewriteCache();
+
+    struct Plan;
+
+    // NULL on a miss; the caller then rewrites the query and learn()s.
+    // A caller that gives @kept holds on to the plan of the shape in
+    // it, and is served from that one while it fits, whether or not
+    // the cache still keeps it; prepared statements do so.  With
+    // @shared false the cache's own plans are neither used nor made,
+    // and the plan lives in @kept alone.
+    QueryRewrite *lookup(const Shape &shape, const SchemaInfo &schema,
+                         std::shared_ptr<Plan> *kept = NULL,
+                         bool shared = true) const;
+    // @a must have traced its constants
+    void learn(const Shape &shape, const SchemaInfo &schema,
+               const Analysis &a, const QueryRewrite &qr,
+               std::shared_ptr<Plan> *kept = NULL,
+               bool shared = true) const;
+    // one call of Rewriter::rewrite, served from a plan or not
+    void countRewrite(bool hit, uint64_t usec) const;
+
+    Stats getStats() const;
+
+    // shapes kept per proxy; 0 turns the cache off
+    static void setCapacity(size_t entries);
+    static size_t capacity();
+
+private:
+    RewriteCache(const RewriteCache &other);
+    RewriteCache &operator=(const RewriteCache &rhs);
+
+    struct Entry {
+        std::shared_ptr<Plan> plan;
+        std::list<std::string>::iterator used;
+        // the lookup the plan was made at
+        uint64_t made;
+    };
+
+    // the plan of @key, marked as used; the lock is held
+    std::shared_ptr<Plan> find(const std::string &key) const;
+    void insert(const std::string &key,
+                const std::shared_ptr<Plan> &plan) const;
+    void erase(const std::string &key) const;
+
+    mutable pthread_mutex_t lock;
+    // plans for the schema of this version; guarded by the lock
+    mutable uint64_t schema_version;
+    mutable std::map<std::string, Entry> plans;
+    // the keys of the plans, most recently used first
+    mutable std::list<std::string> used;
+    // lookups of the plans, which unverified ones age by
+    mutable uint64_t clock;
+    mutable Stats stats;
+};
@@ -33,7 +33,11 @@ encrypt_item(const Item &i, const OLK &olk, Analysis &a)
     FieldMeta * const fm = olk.key;
     // HACK + BROKEN.
     if (!fm && oPLAIN == olk.o) {
-        return RiboldMYSQL::clone_item(i);
+        Item *const ret_i = RiboldMYSQL::clone_item(i);
+        if (a.trace_constants) {
+            a.constants.push_back(Analysis::Constant({&i, ret_i, {}, 0}));
+        }
+        return ret_i;
     }
     assert(fm);
 
@@ -44,6 +48,10 @@ encrypt_item(const Item &i, const OLK &olk, Analysis &a)
     const salt_type IV = (it == a.salts.end()) ? 0 : it->second;
     OnionMeta * const om = fm->getOnionMeta(o);
     Item * const ret_i = encrypt_item_layers(i, o, *om, a, IV);
+    if (a.trace_constants) {
+        a.constants.push_back(Analysis::Constant({&i, ret_i,
+                                                  a.getEncLayers(*om), IV}));
+    }
 
     return ret_i;
 }
@@ -150,6 +150,10 @@ class ANON : public CItemSubtypeIT<Item_field, Item::Type::FIELD_ITEM> {
 
         Item_field *new_field = NULL;
         for (auto it : fm.orderedOnionMetas()) {
+            // packed HOM columns are added per table by InsertHandler
+            if (it.second->getPackedHOM()) {
+                continue;
+            }
             const std::string anon_field_name =
                 it.second->getAnonOnionName();
             new_field =
@@ -364,12 +364,13 @@ enum class QueryStatus {UNKNOWN_ERROR, MALFORMED_QUERY, SUCCESS,
 static QueryStatus
 retryQuery(const std::unique_ptr<Connect> &c, const std::string &query)
 {
-    if (true == c->execute(query)) {
+    Connect::Outcome outcome;
+    if (true == c->execute(query, &outcome)) {
         return QueryStatus::SUCCESS;
     }
 
     // the query failed again
-    const unsigned int err = c->get_mysql_errno();
+    const unsigned int err = outcome.err;
     if (true == recoverableDeltaError(err)) {
         // the query possibly succeeded initially and failed immediately
         // afterwards; or the query just failed originally for the same
@@ -599,18 +600,12 @@ loadSchemaInfo(const std::unique_ptr<Connect> &conn,
     assert(deltaSanityCheck(conn, e_conn));
 
     std::unique_ptr<SchemaInfo>schema(new SchemaInfo());
-    // Recursively rebuild the AbstractMeta<Whatever> and it's children.
-    std::function<DBMeta *(DBMeta *const)> loadChildren =
-        [&loadChildren, &e_conn](DBMeta *const parent) {
-            auto kids = parent->fetchChildren(e_conn);
-            for (auto it : kids) {
-                loadChildren(it);
-            }
-
-            return parent;  /* lambda */
-        };
-
-    loadChildren(schema.get());
+    // Read the whole table at once, then rebuild the
+    // AbstractMeta<Whatever> and it's children from memory.
+    MetaRows rows;
+    TEST_TextMessageError(rows.read(e_conn, ""),
+                          "failed to read the metadata table");
+    rows.build(schema.get());
 
     assert(sanityCheck(*schema.get()));
     assert(metaSanityCheck(e_conn));
@@ -1369,9 +1364,10 @@ const std::unique_ptr<SQLDispatcher> Rewriter::ddl_dispatcher =
 
 // NOTE : This will probably choke on multidatabase queries.
 AbstractQueryExecutor *
-Rewriter::dispatchOnLex(Analysis &a, const std::string &query)
+Rewriter::dispatchOnLex(Analysis &a, const std::string &query,
+                        std::unique_ptr<query_parse> *const parse)
 {
-    std::unique_ptr<query_parse> p;
+    std::unique_ptr<query_parse> &p = *parse;
     try {
         p = std::unique_ptr<query_parse>(
                 new query_parse(a.getDatabaseName(), query));
@@ -1435,24 +1431,51 @@ Rewriter::dispatchOnLex(Analysis &a, const std::string &query)
 
 QueryRewrite
 Rewriter::rewrite(const std::string &q, const SchemaInfo &schema,
-                  const std::string &default_db, const ProxyState &ps)
+                  const std::string &default_db, const ProxyState &ps,
+                  std::shared_ptr<RewriteCache::Plan> *kept, bool shared)
 {
     LOG(cdb_v) << "q " << q;
     assert(0 == mysql_thread_init());
 
+    Timer t;
+    const RewriteCache &cache = ps.getRewriteCache();
+    const RewriteCache::Shape shape(q, default_db);
+    {
+        const std::unique_ptr<QueryRewrite>
+            cached(cache.lookup(shape, schema, kept, shared));
+        if (cached) {
+            if (shared) {
+                cache.countRewrite(true, t.lap());
+            }
+            return std::move(*cached.get());
+        }
+    }
+
     Analysis analysis(default_db, schema, ps.getMasterKey(),
                       ps.defaultSecurityRating());
+    analysis.trace_constants = shape.cacheable();
 
     // NOTE: Care what data you try to read from Analysis
     // at this height.
+    // > the traced constants are Items of the parse, so it stays
+    //   until the plan is learned
+    std::unique_ptr<query_parse> parse;
     AbstractQueryExecutor *const executor =
-        Rewriter::dispatchOnLex(analysis, q);
+        Rewriter::dispatchOnLex(analysis, q, &parse);
     if (!executor) {
+        if (shared) {
+            cache.countRewrite(false, t.lap());
+        }
         return QueryRewrite(true, analysis.rmeta, analysis.kill_zone,
                             new NoOpExecutor());
     }
 
-    return QueryRewrite(true, analysis.rmeta, analysis.kill_zone, executor);
+    QueryRewrite qr(true, analysis.rmeta, analysis.kill_zone, executor);
+    cache.learn(shape, schema, analysis, qr, kept, shared);
+    if (shared) {
+        cache.countRewrite(false, t.lap());
+    }
+    return qr;
 }
 
 //TODO: replace stringify with <<
@@ -1462,6 +1485,7 @@ std::string ReturnField::stringify() {
     res << " is_salt: " << is_salt << " filed_called " << field_called;
     res << " fm  " << olk.key << " onion " << olk.o;
     res << " salt_pos " << salt_pos;
+    res << " value_pos " << value_pos;
 
     return res.str();
 }
@@ -1475,7 +1499,9 @@ std::string ReturnMeta::stringify() {
 }
 
 ResType
-Rewriter::decryptResults(const ResType &dbres, const ReturnMeta &rmeta)
+Rewriter::decryptResults(const ResType &dbres, const ReturnMeta &rmeta,
+                         std::list<std::unique_ptr<CryptoPool::Arena> >
+                             *arenas)
 {
     assert(dbres.success());
 
@@ -1503,34 +1529,60 @@ Rewriter::decryptResults(const ResType &dbres, const ReturnMeta &rmeta)
         dec_rows[i] = std::vector<Item *>(real_cols);
     }
 
-    // decrypt rows
-    unsigned int col_index = 0;
+    // output column of every returned field
+    std::vector<std::pair<unsigned int, unsigned int> > out_cols;
+    unsigned int enc_cols = 0;
     for (unsigned int c = 0; c < cols; c++) {
         const ReturnField &rf = rmeta.rfmeta.at(c);
         if (rf.getIsSalt()) {
             continue;
         }
 
-        FieldMeta *const fm = rf.getOLK().key;
-        for (unsigned int r = 0; r < rows; r++) {
-            if (!fm || dbres.rows[r][c]->is_null()) {
-                dec_rows[r][col_index] = dbres.rows[r][c];
-            } else {
-                uint64_t salt = 0;
-                const int salt_pos = rf.getSaltPosition();
-                if (salt_pos >= 0) {
-                    Item_int *const salt_item =
-                        static_cast<Item_int *>(dbres.rows[r][salt_pos]);
-                    assert_s(!salt_item->null_value, "salt item is null");
-                    salt = salt_item->value;
-                }
+        out_cols.push_back(std::make_pair(c, out_cols.size()));
+        if (rf.getOLK().key) {
+            enc_cols++;
+        }
+    }
 
-                dec_rows[r][col_index] = 
-                    decrypt_item_layers(*dbres.rows[r][c],
-                                        fm, rf.getOLK().o, salt);
+    // decrypt rows; every shard is a range of rows, done column by column
+    auto decryptRows = [&](size_t begin, size_t end) {
+        for (const auto &it : out_cols) {
+            const unsigned int c = it.first;
+            const unsigned int col_index = it.second;
+            const ReturnField &rf = rmeta.rfmeta.at(c);
+            FieldMeta *const fm = rf.getOLK().key;
+            const unsigned int v = rf.getValuePosition() >= 0
+                                   ? rf.getValuePosition() : c;
+            for (size_t r = begin; r < end; r++) {
+                if (!fm || dbres.rows[r][v]->is_null()) {
+                    dec_rows[r][col_index] = dbres.rows[r][v];
+                } else {
+                    uint64_t salt = 0;
+                    const int salt_pos = rf.getSaltPosition();
+                    if (salt_pos >= 0) {
+                        Item_int *const salt_item =
+                            static_cast<Item_int *>(dbres.rows[r][salt_pos]);
+                        assert_s(!salt_item->null_value,
+                                 "salt item is null");
+                        salt = salt_item->value;
+                    }
+
+                    dec_rows[r][col_index] =
+                        decrypt_item_layers(*dbres.rows[r][v],
+                                            fm, rf.getOLK().o, salt);
+                }
             }
         }
-        col_index++;
+    };
+
+    // forEachShard() keeps small results on this thread by itself, and
+    // all of them when NTL was built without NTL_THREADS
+    if (!arenas || 0 == enc_cols) {
+        decryptRows(0, rows);
+    } else {
+        const size_t min_rows =
+            (CryptoPool::min_shard + enc_cols - 1) / enc_cols;
+        CryptoPool::forEachShard(rows, decryptRows, arenas, min_rows);
     }
 
     return ResType(dbres.ok, dbres.affected_rows, dbres.insert_id,
@@ -1675,6 +1727,7 @@ nextImpl(const ResType &res, const NextParams &nparams)
         TEST_ErrPkt(deltaOutputAfterQuery(nparams.ps.getEConn(), this->deltas,
                                           this->embedded_completion_id.get()),
                     "deltaOutputAfterQuery failed for onion adjustment");
+        this->publishDeltas(nparams, this->deltas);
 
         // if the client was in the middle of a transaction we must alert
         // him that we had to rollback his queries
@@ -13,6 +13,7 @@
 #include <main/Translator.hh>
 #include <main/Connect.hh>
 #include <main/dispatcher.hh>
+#include <main/crypto_pool.hh>
 
 #include <sql_select.h>
 #include <sql_delete.h>
@@ -73,17 +74,30 @@ class Rewriter {
     ~Rewriter();
 
 public:
+    // @kept holds the RewriteCache plan of a prepared statement; with
+    // @shared false the plan stays out of the cache and its stats
     static QueryRewrite
         rewrite(const std::string &q, SchemaInfo const &schema,
                 const std::string &default_db,
-                const ProxyState &ps);
-
+                const ProxyState &ps,
+                std::shared_ptr<RewriteCache::Plan> *kept = NULL,
+                bool shared = true);
+
+    /*
+     * Large results are decrypted on the CryptoPool when @arenas is
+     * given; it then keeps the decrypted Items, so it must outlive the
+     * returned ResType.
+     */
     static ResType
-        decryptResults(const ResType &dbres, const ReturnMeta &rm);
+        decryptResults(const ResType &dbres, const ReturnMeta &rm,
+                       std::list<std::unique_ptr<CryptoPool::Arena> >
+                           *arenas = NULL);
 
 private:
+    // @parse keeps the Items of the rewrite; they go with it
     static AbstractQueryExecutor *
-        dispatchOnLex(Analysis &a, const std::string &query);
+        dispatchOnLex(Analysis &a, const std::string &query,
+                      std::unique_ptr<query_parse> *const parse);
 
     static const bool translator_dummy;
     static const std::unique_ptr<SQLDispatcher> dml_dispatcher;
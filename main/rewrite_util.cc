@@ -5,6 +5,7 @@
 #include <main/macro_util.hh>
 #include <main/metadata_tables.hh>
 #include <main/schema.hh>
+#include <main/crypto_pool.hh>
 #include <parser/lex_util.hh>
 #include <parser/stringify.hh>
 #include <util/enum_text.hh>
@@ -245,6 +246,11 @@ rewrite_create_field(const FieldMeta * const fm,
     // create each onion column
     for (auto oit : fm->orderedOnionMetas()) {
         OnionMeta * const om = oit.second;
+        // a packed HOM column is created once, by the field in slot 0
+        const HOMPacked *const packed = om->getPackedHOM();
+        if (packed && 0 != packed->getSlot()) {
+            continue;
+        }
         Create_field * const new_cf = get_create_field(a, f, *om);
 
         output_cfields.push_back(new_cf);
@@ -416,16 +422,23 @@ createAndRewriteField(Analysis &a, Create_field * const cf,
                       const std::vector<std::tuple<std::vector<std::string>,
                                         Key::Keytype> >
                           &key_data,
-                      List<Create_field> &rewritten_cfield_list)
+                      List<Create_field> &rewritten_cfield_list,
+                      HOMPacker *packer)
 {
     // we only support the creation of UNSIGNED fields
     cf->flags = cf->flags | UNSIGNED_FLAG;
 
+    // an existing table is shared; the count is leased from the
+    // query's copy, and the cache's copy leases it again
+    const std::function<void(DBMeta *)> lease =
+        [] (DBMeta *const meta) {static_cast<TableMeta *>(meta)->leaseCount();};
+    TableMeta &counted = new_table ? *tm : a.writable(*tm);
+
     const std::string &name = std::string(cf->field_name);
     std::unique_ptr<FieldMeta>
         fm(new FieldMeta(*cf, a.getMasterKey().get(),
-                         a.getDefaultSecurityRating(), tm->leaseCount(),
-                         isUnique(name, key_data)));
+                         a.getDefaultSecurityRating(), counted.leaseCount(),
+                         isUnique(name, key_data), packer));
 
     // -----------------------------
     //         Rewrite FIELD
@@ -447,7 +460,8 @@ createAndRewriteField(Analysis &a, Create_field * const cf,
                                                 IdentityMetaKey(name))));
         a.deltas.push_back(std::unique_ptr<Delta>(
                new ReplaceDelta(*tm,
-                                a.getDatabaseMeta(a.getDatabaseName()))));
+                                a.getDatabaseMeta(a.getDatabaseName()),
+                                counted, lease)));
     }
 
     return rewritten_cfield_list;
@@ -477,6 +491,31 @@ encrypt_item_layers(const Item &i, onion o, const OnionMeta &om,
     return new_enc;
 }
 
+// encrypt_item_layers() for a column of values, one layer at a time
+std::vector<Item *>
+encrypt_items_layers(const std::vector<const Item *> &items, onion o,
+                     const OnionMeta &om, const Analysis &a,
+                     const std::vector<uint64_t> &IVs)
+{
+    assert(items.size() == IVs.size());
+
+    const auto &enc_layers = a.getEncLayers(om);
+    assert_s(enc_layers.size() > 0, "onion must have at least one layer");
+    std::vector<const Item *> encs(items);
+    std::vector<Item *> new_encs;
+
+    for (const auto &it : enc_layers) {
+        LOG(encl) << "encrypt layer "
+                  << TypeText<SECLEVEL>::toText(it->level()) << " for "
+                  << items.size() << " values\n";
+        new_encs = it->encryptBatch(encs, IVs);
+        assert(new_encs.size() == items.size());
+        encs.assign(new_encs.begin(), new_encs.end());
+    }
+
+    return new_encs;
+}
+
 std::string
 escapeString(const std::unique_ptr<Connect> &c,
              const std::string &escape_me)
@@ -497,6 +536,10 @@ encrypt_item_all_onions(const Item &i, const FieldMeta &fm,
     for (auto it : fm.orderedOnionMetas()) {
         const onion o = it.first->getValue();
         OnionMeta * const om = it.second;
+        // filled in per row; see InsertHandler
+        if (om->getPackedHOM()) {
+            continue;
+        }
         l->push_back(encrypt_item_layers(i, o, *om, a, IV));
     }
 }
@@ -514,6 +557,97 @@ typical_rewrite_insert_type(const Item &i, const FieldMeta &fm,
     }
 }
 
+bool
+is_typical_insert_constant(const Item &i)
+{
+    switch (i.type()) {
+    case Item::Type::STRING_ITEM:
+    case Item::Type::INT_ITEM:
+    case Item::Type::REAL_ITEM:
+    case Item::Type::DECIMAL_ITEM:
+        return !RiboldMYSQL::is_null(i);
+    default:
+        return false;
+    }
+}
+
+void
+typical_rewrite_insert_column(const std::vector<const Item *> &items,
+                              const FieldMeta &fm, Analysis &a,
+                              std::vector<std::vector<Item *> > *rows)
+{
+    std::vector<uint64_t> salts(items.size(), 0);
+    if (fm.getHasSalt()) {
+        for (auto &it : salts) {
+            it = randomValue();
+        }
+    }
+
+    std::vector<std::pair<onion, const OnionMeta *> > onions;
+    for (auto it : fm.orderedOnionMetas()) {
+        // filled in per row; see InsertHandler
+        if (it.second->getPackedHOM()) {
+            continue;
+        }
+        onions.push_back(std::make_pair(it.first->getValue(), it.second));
+    }
+
+    // onions with a layer that must encrypt on this thread are done
+    // whole before the others are sharded
+    std::vector<std::vector<Item *> > serial(onions.size());
+    for (size_t j = 0; j < onions.size(); j++) {
+        const auto &enc_layers = a.getEncLayers(*onions[j].second);
+        for (const auto &it : enc_layers) {
+            if (!it->concurrentEncrypt()) {
+                serial[j] = encrypt_items_layers(items, onions[j].first,
+                                                 *onions[j].second, a,
+                                                 salts);
+                break;
+            }
+        }
+    }
+
+    // large columns are split across the CryptoPool; every shard writes
+    // only its own rows, so the result is the same as a serial run
+    rows->assign(items.size(), std::vector<Item *>());
+    CryptoPool::forEachShard(items.size(),
+        [&](size_t begin, size_t end) {
+            const std::vector<const Item *> shard(items.begin() + begin,
+                                                  items.begin() + end);
+            const std::vector<uint64_t> shard_salts(salts.begin() + begin,
+                                                    salts.begin() + end);
+            for (size_t j = 0; j < onions.size(); j++) {
+                const std::vector<Item *> &encs =
+                    serial[j].size() > 0
+                        ? std::vector<Item *>(serial[j].begin() + begin,
+                                              serial[j].begin() + end)
+                        : encrypt_items_layers(shard, onions[j].first,
+                                               *onions[j].second, a,
+                                               shard_salts);
+                for (size_t i = 0; i < shard.size(); i++) {
+                    (*rows)[begin + i].push_back(encs[i]);
+                }
+            }
+        }, &a.arenas);
+
+    if (a.trace_constants) {
+        for (size_t i = 0; i < items.size(); i++) {
+            for (size_t j = 0; j < onions.size(); j++) {
+                a.constants.push_back(Analysis::Constant({items[i],
+                    (*rows)[i][j], a.getEncLayers(*onions[j].second),
+                    salts[i]}));
+            }
+        }
+    }
+
+    if (fm.getHasSalt()) {
+        for (size_t i = 0; i < items.size(); i++) {
+            (*rows)[i].push_back(
+                new Item_int(static_cast<ulonglong>(salts[i])));
+        }
+    }
+}
+
 /*
  * connection ids can be longer than 32 bits
  * http://dev.mysql.com/doc/refman/5.1/en/mysql-thread-id.html
@@ -637,6 +771,17 @@ determineSecurityRating()
     return SECURITY_RATING::SENSITIVE;
 }
 
+/*
+ * Opt-in: numeric fields of tables created while HOM_PACK is TRUE share
+ * packed HOM columns.
+ */
+bool
+determinePackedHOM()
+{
+    const char *const pack = getenv("HOM_PACK");
+    return pack && equalsIgnoreCase("TRUE", pack);
+}
+
 bool
 handleActiveTransactionPResults(const ResType &res)
 {
@@ -64,12 +64,18 @@ createAndRewriteField(Analysis &a, Create_field * const cf,
                       const std::vector<std::tuple<std::vector<std::string>,
                                         Key::Keytype> >
                           &key_data,
-                      List<Create_field> &rewritten_cfield_list);
+                      List<Create_field> &rewritten_cfield_list,
+                      HOMPacker *packer = NULL);
 
 Item *
 encrypt_item_layers(const Item &i, onion o, const OnionMeta &om,
                     const Analysis &a, uint64_t IV = 0);
 
+std::vector<Item *>
+encrypt_items_layers(const std::vector<const Item *> &items, onion o,
+                     const OnionMeta &om, const Analysis &a,
+                     const std::vector<uint64_t> &IVs);
+
 // FIXME(burrows): Generalize to support any container with next AND end
 // semantics.
 template <typename T>
@@ -116,6 +122,21 @@ void
 typical_rewrite_insert_type(const Item &i, const FieldMeta &fm,
                             Analysis &a, std::vector<Item *> *l);
 
+// the constants whose INSERT rewrite is typical_rewrite_insert_type()
+bool
+is_typical_insert_constant(const Item &i);
+
+/*
+ * typical_rewrite_insert_type() for a column of such constants:
+ * (*rows)[i] gets what @l would for @items[i], but every layer
+ * encrypts the whole column in one encryptBatch() call, or a few
+ * contiguous shards of it in parallel on the CryptoPool.
+ */
+void
+typical_rewrite_insert_column(const std::vector<const Item *> &items,
+                              const FieldMeta &fm, Analysis &a,
+                              std::vector<std::vector<Item *> > *rows);
+
 void
 process_select_lex(const st_select_lex &select_lex, Analysis &a);
 
@@ -141,6 +162,9 @@ prettyPrintQuery(const std::string &query);
 SECURITY_RATING
 determineSecurityRating();
 
+bool
+determinePackedHOM();
+
 bool
 handleActiveTransactionPResults(const ResType &res);
 
@@ -1,6 +1,9 @@
 #include <algorithm>
+#include <atomic>
 #include <functional>
+#include <list>
 #include <memory>
+#include <sys/time.h>
 
 #include <parser/lex_util.hh>
 #include <parser/stringify.hh>
@@ -11,51 +14,146 @@
 #include <main/dbobject.hh>
 #include <main/metadata_tables.hh>
 #include <main/macro_util.hh>
+#include <main/crypto_pool.hh>
+#include <util/scoped_lock.hh>
 
 std::vector<DBMeta *>
-DBMeta::doFetchChildren(const std::unique_ptr<Connect> &e_conn,
+DBMeta::doFetchChildren(const MetaRows &rows,
                         std::function<DBMeta *(const std::string &,
                                                const std::string &,
-                                               const std::string &)>
+                                               unsigned int)>
                             deserialHandler)
+{
+    std::vector<DBMeta *> out_vec;
+    for (const auto &it : rows.children(this->getDatabaseID())) {
+        DBMeta *const new_old_meta =
+            deserialHandler(it.serial_key, it.serial_object, it.id);
+        out_vec.push_back(new_old_meta);
+    }
+
+    return out_vec;
+}
+
+bool
+MetaRows::read(const std::unique_ptr<Connect> &e_conn,
+               const std::string &where)
 {
     const std::string table_name = MetaData::Table::metaObject();
 
-    // Now that we know the table exists, SELECT the data we want.
-    std::vector<DBMeta *> out_vec;
     std::unique_ptr<DBResult> db_res;
-    const std::string parent_id = std::to_string(this->getDatabaseID());
     const std::string serials_query =
         " SELECT " + table_name + ".serial_object,"
         "        " + table_name + ".serial_key,"
-        "        " + table_name + ".id"
+        "        " + table_name + ".id,"
+        "        " + table_name + ".parent_id"
         " FROM " + table_name +
-        " WHERE " + table_name + ".parent_id"
-        "   = " + parent_id + ";";
-    TEST_TextMessageError(e_conn->execute(serials_query, &db_res),
-                          "doFetchChildren query failed");
+        (where.empty() ? std::string() : " WHERE " + where) + ";";
+    RFIF(e_conn->execute(serials_query, &db_res));
+
     MYSQL_ROW row;
     while ((row = mysql_fetch_row(db_res->n))) {
         unsigned long * const l = mysql_fetch_lengths(db_res->n);
         assert(l != NULL);
 
-        const std::string child_serial_object(row[0], l[0]);
-        const std::string child_key(row[1], l[1]);
-        const std::string child_id(row[2], l[2]);
+        const unsigned int parent_id = strtoul(row[3], NULL, 10);
+        rows[parent_id].push_back(Row({std::string(row[0], l[0]),
+                                       std::string(row[1], l[1]),
+                                       static_cast<unsigned int>(
+                                           strtoul(row[2], NULL, 10))}));
+    }
 
-        DBMeta *const new_old_meta =
-            deserialHandler(child_key, child_serial_object, child_id);
-        out_vec.push_back(new_old_meta);
+    return true;
+}
+
+bool
+MetaRows::readBelow(const std::unique_ptr<Connect> &e_conn,
+                    std::vector<unsigned int> ids)
+{
+    while (false == ids.empty()) {
+        std::string in;
+        for (auto id : ids) {
+            in += (in.empty() ? "" : ", ") + std::to_string(id);
+        }
+        RFIF(read(e_conn, "parent_id IN (" + in + ")"));
+
+        std::vector<unsigned int> next;
+        for (auto id : ids) {
+            for (const auto &it : children(id)) {
+                next.push_back(it.id);
+            }
+        }
+        ids = std::move(next);
     }
 
-    return out_vec;
+    return true;
+}
+
+const std::vector<MetaRows::Row> &
+MetaRows::children(unsigned int parent_id) const
+{
+    static const std::vector<Row> none;
+
+    const auto it = rows.find(parent_id);
+    return rows.end() == it ? none : it->second;
+}
+
+void
+MetaRows::build(DBMeta *const parent)
+{
+    buildChildren(parent);
+    finish();
+}
+
+void
+MetaRows::buildChildren(DBMeta *const parent)
+{
+    for (auto it : parent->fetchChildren(this)) {
+        buildChildren(it);
+    }
+}
+
+void
+MetaRows::deferLayer(std::function<void()> deserialize)
+{
+    deferred.push_back(std::move(deserialize));
 }
 
+void
+MetaRows::finish()
+{
+    // layers hold no Items, so the arenas stay empty; without
+    // NTL_THREADS the pool leaves every shard to this thread
+    std::list<std::unique_ptr<CryptoPool::Arena> > arenas;
+    CryptoPool::forEachShard(deferred.size(),
+        [this] (size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i) {
+                deferred[i]();
+            }
+        },
+        &arenas, min_layer_shard);
+
+    deferred.clear();
+}
+
+HOMPackSlot
+HOMPacker::lease()
+{
+    if (HOMPacked::pack_slots == next) {
+        onionname = getpRandomName() + TypeText<onion>::toText(oAGG);
+        next = 0;
+    }
+
+    return HOMPackSlot({onionname, next++});
+}
+
+// Members of a pack share the onion name, and so the HOM key.
 OnionMeta::OnionMeta(onion o, std::vector<SECLEVEL> levels,
                      const AES_KEY * const m_key,
                      const Create_field &cf, unsigned long uniq_count,
-                     SECLEVEL minimum_seclevel)
-    : onionname(getpRandomName() + TypeText<onion>::toText(o)),
+                     SECLEVEL minimum_seclevel, const HOMPackSlot *pack)
+    : onionname(pack ? pack->onionname
+                     : getpRandomName() + TypeText<onion>::toText(o)),
       uniq_count(uniq_count), minimum_seclevel(minimum_seclevel)
 {
     assert(levels.size() >= 1);
@@ -68,7 +166,9 @@ OnionMeta::OnionMeta(onion o, std::vector<SECLEVEL> levels,
             m_key ? getLayerKey(m_key, uniqueFieldName, l)
                   : "plainkey";
         std::unique_ptr<EncLayer>
-            el(EncLayerFactory::encLayer(o, l, *newcf, key));
+            el(pack && SECLEVEL::HOM == l
+                 ? EncLayerFactory::packedHOMLayer(*newcf, key, pack->slot)
+                 : EncLayerFactory::encLayer(o, l, *newcf, key));
 
         const Create_field &oldcf = *newcf;
         newcf = el->newCreateField(oldcf);
@@ -109,33 +209,37 @@ std::string OnionMeta::getAnonOnionName() const
     return onionname;
 }
 
+// Layers are leaves; they are deserialized once the tree is built, so
+// none is returned.
 std::vector<DBMeta *>
-OnionMeta::fetchChildren(const std::unique_ptr<Connect> &e_conn)
-{
-    std::function<DBMeta *(const std::string &,
-                           const std::string &,
-                           const std::string &)>
-        deserialHelper =
-    [this] (const std::string &key, const std::string &serial,
-            const std::string &id) -> EncLayer *
-    {
+OnionMeta::fetchChildren(MetaRows *const rows)
+{
+    const std::vector<MetaRows::Row> &children =
+        rows->children(this->getDatabaseID());
+    std::vector<unsigned int> indexes;
+    for (const auto &it : children) {
         // > Probably going to want to use indexes in AbstractMetaKey
         // for now, otherwise you will need to abstract and rederive
         // a keyed and nonkeyed version of Delta.
         const std::unique_ptr<UIntMetaKey>
-            meta_key(AbstractMetaKey::factory<UIntMetaKey>(key));
-        const unsigned int index = meta_key->getValue();
-        if (index >= this->layers.size()) {
-            this->layers.resize(index + 1);
+            meta_key(AbstractMetaKey::factory<UIntMetaKey>(it.serial_key));
+        indexes.push_back(meta_key->getValue());
+        if (indexes.back() >= this->layers.size()) {
+            this->layers.resize(indexes.back() + 1);
         }
-        std::unique_ptr<EncLayer>
-            layer(EncLayerFactory::deserializeLayer(atoi(id.c_str()),
-                                                    serial));
-        this->layers[index] = std::move(layer);
-        return this->layers[index].get();
-    };
+    }
+
+    // each task fills its own slot, so the tasks can run at once
+    for (size_t i = 0; i < children.size(); ++i) {
+        std::shared_ptr<EncLayer> *const slot = &this->layers[indexes[i]];
+        const MetaRows::Row *const row = &children[i];
+        rows->deferLayer([slot, row] () {
+            *slot = EncLayerFactory::deserializeLayer(row->id,
+                                                      row->serial_object);
+        });
+    }
 
-    return DBMeta::doFetchChildren(e_conn, deserialHelper);
+    return std::vector<DBMeta *>();
 }
 
 bool
@@ -151,6 +255,9 @@ OnionMeta::applyToChildren(std::function<bool(const DBMeta &)>
     return true;
 }
 
+// clients building Deltas share the OnionMetas of the cached schema
+static pthread_mutex_t generated_keys_lock = PTHREAD_MUTEX_INITIALIZER;
+
 UIntMetaKey const &OnionMeta::getKey(const DBMeta &child) const
 {
     for (std::vector<EncLayer *>::size_type i = 0; i< layers.size(); ++i) {
@@ -158,6 +265,7 @@ UIntMetaKey const &OnionMeta::getKey(const DBMeta &child) const
             UIntMetaKey *const key = new UIntMetaKey(i);
             // Hold onto the key so we can destroy it when OnionMeta is
             // destructed.
+            scoped_lock l(&generated_keys_lock);
             generated_keys.push_back(std::unique_ptr<UIntMetaKey>(key));
             return *key;
         }
@@ -166,6 +274,18 @@ UIntMetaKey const &OnionMeta::getKey(const DBMeta &child) const
     assert(false);
 }
 
+bool OnionMeta::dropChild(const DBMeta &child)
+{
+    for (auto it = layers.begin(); it != layers.end(); ++it) {
+        if (it->get() == &child) {
+            layers.erase(it);
+            return true;
+        }
+    }
+
+    return false;
+}
+
 EncLayer *OnionMeta::getLayerBack() const
 {
     TEST_TextMessageError(layers.size() != 0,
@@ -201,6 +321,16 @@ EncLayer *OnionMeta::getLayer(const SECLEVEL &sl) const
     return out.get();
 }
 
+const HOMPacked *OnionMeta::getPackedHOM() const
+{
+    if (layers.size() != 1 || SECLEVEL::HOM != layers.back()->level()
+        || "HOM_packed" != layers.back()->name()) {
+        return NULL;
+    }
+
+    return static_cast<const HOMPacked *>(layers.back().get());
+}
+
 SECLEVEL OnionMeta::getSecLevel() const
 {
     assert(layers.size() > 0);
@@ -266,7 +396,8 @@ determineSecLevelData(onion o, std::vector<SECLEVEL> levels, bool unique)
 // If mkey == NULL, the field is not encrypted
 static bool
 init_onions_layout(const AES_KEY *const m_key, FieldMeta *const fm,
-                   const Create_field &cf, bool unique)
+                   const Create_field &cf, bool unique,
+                   HOMPacker *const packer)
 {
     const onionlayout onion_layout = fm->getOnionLayout();
     if (fm->getHasSalt() != (static_cast<bool>(m_key)
@@ -287,11 +418,17 @@ init_onions_layout(const AES_KEY *const m_key, FieldMeta *const fm,
             determineSecLevelData(o, levels, unique);
         assert(level_data.first.size() >= 1);
 
+        std::unique_ptr<HOMPackSlot> pack;
+        if (packer && m_key && oAGG == o) {
+            pack.reset(new HOMPackSlot(packer->lease()));
+        }
+
         // A new OnionMeta will only occur with a new FieldMeta so
         // we never have to build Deltaz for our OnionMetaz.
         std::unique_ptr<OnionMeta>
             om(new OnionMeta(o, std::get<0>(level_data), m_key, cf,
-                             fm->leaseCount(), std::get<1>(level_data)));
+                             fm->leaseCount(), std::get<1>(level_data),
+                             pack.get()));
         const std::string &onion_name = om->getAnonOnionName();
         fm->addChild(OnionMetaKey(o), std::move(om));
 
@@ -306,7 +443,7 @@ FieldMeta::FieldMeta(const Create_field &field,
                      const AES_KEY * const m_key,
                      SECURITY_RATING sec_rating,
                      unsigned long uniq_count,
-                     bool unique)
+                     bool unique, HOMPacker *packer)
     : fname(std::string(field.field_name)),
       salt_name(BASE_SALT_NAME + getpRandomName()),
       onion_layout(determineOnionLayout(m_key, field, sec_rating)),
@@ -316,7 +453,8 @@ FieldMeta::FieldMeta(const Create_field &field,
       has_default(determineHasDefault(field)),
       default_value(determineDefaultValue(has_default, field))
 {
-    TEST_TextMessageError(init_onions_layout(m_key, this, field, unique),
+    TEST_TextMessageError(init_onions_layout(m_key, this, field, unique,
+                                             packer),
                           "Failed to build onions for new FieldMeta!");
 }
 
@@ -559,6 +697,35 @@ DatabaseMeta::serialize(const DBObject &parent) const
     return serial;
 }
 
+uint64_t
+SchemaInfo::nextVersion()
+{
+    static std::atomic<uint64_t> versions(0);
+    return ++versions;
+}
+
+std::vector<const HOM *>
+SchemaInfo::getHOMLayers() const
+{
+    std::vector<const HOM *> layers;
+    for (const auto &db : this->getChildren()) {
+        for (const auto &table : db.second->getChildren()) {
+            for (const auto &field : table.second->getChildren()) {
+                for (const auto &om : field.second->getChildren()) {
+                    for (const auto &layer : om.second->getLayers()) {
+                        if (SECLEVEL::HOM == layer->level()) {
+                            layers.push_back(
+                                static_cast<const HOM *>(layer.get()));
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return layers;
+}
+
 static bool
 lowLevelGetCurrentStaleness(const std::unique_ptr<Connect> &e_conn,
                             unsigned int cache_id)
@@ -577,36 +744,106 @@ lowLevelGetCurrentStaleness(const std::unique_ptr<Connect> &e_conn,
     return string_to_bool(std::string(row[0], l[0]));
 }
 
-std::shared_ptr<const SchemaInfo>
-SchemaCache::getSchema(const std::unique_ptr<Connect> &conn,
-                       const std::unique_ptr<Connect> &e_conn) const
+/*
+ * Bumped once the Deltas of a schema change are committed, when a
+ * failed change leaves the schema unknown, and when a poll finds that
+ * another process marked the caches stale; each cache reloads once its
+ * schema is older.
+ */
+static std::atomic<uint64_t> schema_epoch(1);
+
+static std::atomic<unsigned int> poll_interval_ms(1000);
+
+void
+SchemaCache::setPollInterval(unsigned int ms)
+{
+    poll_interval_ms = ms;
+}
+
+static uint64_t
+nowUsec()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return ((uint64_t)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+SchemaCache::~SchemaCache()
 {
-    if (true == this->no_loads) {
-        // Use this cleanup if we can't maintain consistent states.
-        /*
-        TEST_TextMessageError(cleanupStaleness(e_conn),
-                              "Failed to cleanup staleness for first"
-                              " usage!");
-        */
-        TEST_SchemaFailure(initialStaleness(e_conn));
-        this->no_loads = false;
+    pthread_mutex_destroy(&load_lock);
+}
+
+void
+SchemaCache::pollStaleness(const std::unique_ptr<Connect> &e_conn) const
+{
+    // our staleness row is written by the first load
+    if (0 == this->loaded_epoch) {
+        return;
+    }
+
+    const uint64_t now = nowUsec();
+    uint64_t due = this->next_poll;
+    if (now < due) {
+        return;
+    }
+    // one thread polls; the others go on with the schema they have
+    const uint64_t next = now + 1000 * (uint64_t)poll_interval_ms;
+    if (!this->next_poll.compare_exchange_strong(due, next)) {
+        return;
     }
 
     if (true == lowLevelGetCurrentStaleness(e_conn, this->id)) {
-        this->schema =
-            std::shared_ptr<SchemaInfo>(loadSchemaInfo(conn, e_conn));
+        ++schema_epoch;
+    }
+}
+
+std::shared_ptr<const SchemaInfo>
+SchemaCache::getSchema(const std::unique_ptr<Connect> &conn,
+                       const std::unique_ptr<Connect> &e_conn) const
+{
+    this->pollStaleness(e_conn);
+
+    if (this->loaded_epoch != schema_epoch) {
+        scoped_lock l(&load_lock);
+        const uint64_t epoch = schema_epoch;
+        if (this->loaded_epoch != epoch) {
+            if (true == this->no_loads) {
+                // Use this cleanup if we can't maintain consistent states.
+                /*
+                TEST_TextMessageError(cleanupStaleness(e_conn),
+                                      "Failed to cleanup staleness for first"
+                                      " usage!");
+                */
+                TEST_SchemaFailure(initialStaleness(e_conn));
+                this->no_loads = false;
+            }
+            // before loading, so a process that stales us meanwhile is
+            // caught by the next poll
+            this->lowLevelCurrentUnstale(e_conn);
+
+            const std::shared_ptr<const SchemaInfo>
+                fresh(loadSchemaInfo(conn, e_conn));
+            std::atomic_store(&this->schema, fresh);
+            this->loaded_epoch = epoch;
+            ++this->loads;
+        }
     }
 
-    assert(this->schema);
-    return this->schema;
+    const std::shared_ptr<const SchemaInfo> schema =
+        std::atomic_load(&this->schema);
+    assert(schema);
+    return schema;
 }
 
+// we keep ourselves current through updateSchema()
 static void
-lowLevelAllStale(const std::unique_ptr<Connect> &e_conn)
+lowLevelOthersStale(const std::unique_ptr<Connect> &e_conn,
+                    unsigned int cache_id)
 {
     const std::string &query =
         " UPDATE " + MetaData::Table::staleness() +
-        "    SET stale = TRUE;";
+        "    SET stale = TRUE"
+        "  WHERE cache_id <> " + std::to_string(cache_id) + ";";
     TEST_SchemaFailure(e_conn->execute(query));
 }
 
@@ -615,12 +852,128 @@ SchemaCache::updateStaleness(const std::unique_ptr<Connect> &e_conn,
                              bool staleness) const
 {
     if (true == staleness) {
-        // Make everyone stale.
-        return lowLevelAllStale(e_conn);
+        // Make everyone else stale; they notice on their next poll.
+        return lowLevelOthersStale(e_conn, this->id);
     }
 
-    // We are no longer stale.
-    return this->lowLevelCurrentUnstale(e_conn);
+    // Our own row is cleared when we reload, not on every query.
+}
+
+DBMeta *
+SchemaUpdate::writable(const DBMeta &meta)
+{
+    if (&meta == &this->original) {
+        return this->copy.get();
+    }
+    const auto &cached = this->copies.find(&meta);
+    if (this->copies.end() != cached) {
+        return cached->second;
+    }
+
+    // the path to @meta in the original, @meta first
+    std::vector<const DBMeta *> path;
+    std::function<bool(const DBMeta &)> find =
+        [&find, &path, &meta] (const DBMeta &object)
+        {
+            if (&object == &meta
+                || false == object.applyToChildren(find)) {
+                path.push_back(&object);
+                return false;           // shortcircuit
+            }
+
+            return true;
+        };
+    if (true == this->original.applyToChildren(find)) {
+        return NULL;
+    }
+
+    DBMeta *parent = this->copy.get();
+    for (auto it = path.rbegin(); it != path.rend(); ++it) {
+        auto object_copy = this->copies.find(*it);
+        if (this->copies.end() == object_copy) {
+            DBMeta *const fresh = parent->copyChild(**it);
+            if (NULL == fresh) {
+                return NULL;
+            }
+            object_copy =
+                this->copies.insert(std::make_pair(*it, fresh)).first;
+        }
+        parent = object_copy->second;
+    }
+
+    return parent;
+}
+
+bool
+SchemaUpdate::drop(const DBMeta &meta, const DBMeta &parent)
+{
+    DBMeta *const parent_copy = this->writable(parent);
+    RFIF(parent_copy);
+
+    // @meta may have been copied by an earlier Delta
+    const auto &cached = this->copies.find(&meta);
+    if (this->copies.end() == cached) {
+        return parent_copy->dropChild(meta);
+    }
+    const DBMeta *const meta_copy = cached->second;
+    this->copies.erase(cached);
+
+    return parent_copy->dropChild(*meta_copy);
+}
+
+static std::unique_ptr<SchemaInfo>
+applyDeltas(const SchemaInfo &schema,
+            const std::vector<std::unique_ptr<Delta> > &deltas,
+            const std::unique_ptr<Connect> &e_conn)
+{
+    SchemaUpdate update(schema);
+    for (const auto &it : deltas) {
+        if (false == it->update(&update, e_conn)) {
+            return std::unique_ptr<SchemaInfo>();
+        }
+    }
+
+    return update.finish();
+}
+
+void
+SchemaCache::updateSchema(const std::unique_ptr<Connect> &e_conn,
+                          const std::vector<std::unique_ptr<Delta> > &deltas,
+                          uint64_t loads_before) const
+{
+    scoped_lock l(&load_lock);
+
+    // everyone else must see the Deltas too, now that they are written;
+    // a schema loaded before this point is older than the epoch
+    lowLevelOthersStale(e_conn, this->id);
+    const uint64_t epoch = ++schema_epoch;
+
+    const std::shared_ptr<const SchemaInfo> current =
+        std::atomic_load(&this->schema);
+    if (!current || this->loaded_epoch + 1 != epoch
+        || this->loads != loads_before) {
+        return;                         // reloads
+    }
+
+    std::unique_ptr<SchemaInfo> updated;
+    try {
+        updated = applyDeltas(*current.get(), deltas, e_conn);
+    } catch (const AbstractException &e) {
+        LOG(warn) << "schema update failed: " << e.to_string();
+    }
+    if (!updated) {
+        return;
+    }
+
+    std::atomic_store(&this->schema,
+                      std::shared_ptr<const SchemaInfo>(updated.release()));
+    this->loaded_epoch = epoch;
+}
+
+void
+SchemaCache::invalidate() const
+{
+    ++schema_epoch;
 }
 
 bool
@@ -14,6 +14,28 @@
 #include <iostream>
 #include <sstream>
 #include <functional>
+#include <atomic>
+#include <pthread.h>
+
+// where a field's oAGG onion lives in a packed HOM column
+struct HOMPackSlot {
+    std::string onionname;
+    uint slot;
+};
+
+/*
+ * Hands out the slots of packed HOM columns to the numeric fields of a
+ * new table, HOMPacked::pack_slots fields to a column.
+ */
+class HOMPacker {
+public:
+    HOMPacker() : next(HOMPacked::pack_slots) {}
+    HOMPackSlot lease();
+
+private:
+    std::string onionname;
+    uint next;
+};
 
 /*
  * The name must be unique as it is used as a unique identifier when
@@ -33,7 +55,8 @@ public:
     // New.
     OnionMeta(onion o, std::vector<SECLEVEL> levels,
               const AES_KEY * const m_key, const Create_field &cf,
-              unsigned long uniq_count, SECLEVEL minimum_seclevel);
+              unsigned long uniq_count, SECLEVEL minimum_seclevel,
+              const HOMPackSlot *pack = NULL);
 
     // Restore.
     static std::unique_ptr<OnionMeta>
@@ -42,27 +65,41 @@ public:
               unsigned long uniq_count, SECLEVEL minimum_seclevel)
         : DBMeta(id), onionname(onionname), uniq_count(uniq_count),
           minimum_seclevel(minimum_seclevel) {}
+    // Copy for a schema update; shares the EncLayers.
+    OnionMeta(const OnionMeta &other)
+        : DBMeta(other), layers(other.layers), onionname(other.onionname),
+          uniq_count(other.uniq_count),
+          minimum_seclevel(other.minimum_seclevel) {}
 
     std::string serialize(const DBObject &parent) const;
     std::string getAnonOnionName() const;
     TYPENAME("onionMeta")
-    std::vector<DBMeta *>
-        fetchChildren(const std::unique_ptr<Connect> &e_conn);
+    std::vector<DBMeta *> fetchChildren(MetaRows *const rows);
     bool applyToChildren(std::function<bool(const DBMeta &)>) const;
     UIntMetaKey const &getKey(const DBMeta &child) const;
+    // EncLayers are never changed, only dropped
+    DBMeta *copyChild(const DBMeta &child) {return NULL;}
+    bool dropChild(const DBMeta &child);
+    DBMeta *fetchChild(const std::unique_ptr<Connect> &e_conn,
+                       unsigned int id)
+    {
+        return NULL;
+    }
     EncLayer *getLayerBack() const;
     EncLayer *getLayer(const SECLEVEL &sl) const;
     bool hasEncLayer(const SECLEVEL &sl) const;
+    // the layer of a packed HOM onion, NULL for other onions
+    const HOMPacked *getPackedHOM() const;
     SECLEVEL getSecLevel() const;
     unsigned long getUniq() const {return uniq_count;}
-    const std::vector<std::unique_ptr<EncLayer> > &getLayers() const
+    const std::vector<std::shared_ptr<EncLayer> > &getLayers() const
         {return layers;}
     SECLEVEL getMinimumSecLevel() const {return minimum_seclevel;}
     void setMinimumSecLevel(SECLEVEL seclevel) {this->minimum_seclevel = seclevel;}
 
 private:
     // first in list is lowest layer
-    std::vector<std::unique_ptr<EncLayer> > layers;
+    std::vector<std::shared_ptr<EncLayer> > layers;
     const std::string onionname;
     const unsigned long uniq_count;
     SECLEVEL minimum_seclevel;
@@ -84,7 +121,7 @@ public:
     // New.
     FieldMeta(const Create_field &field, const AES_KEY * const mKey,
               SECURITY_RATING sec_rating, unsigned long uniq_count,
-              bool unique);
+              bool unique, HOMPacker *packer = NULL);
     // Restore (WARN: Creates an incomplete type as it will not have it's
     // OnionMetas until they are added by the caller).
     static std::unique_ptr<FieldMeta>
@@ -197,43 +234,120 @@ public:
 // this level or below. Use Analysis::* if you need aliasing.
 class SchemaInfo : public MappedDBMeta<DatabaseMeta, IdentityMetaKey> {
 public:
-    SchemaInfo() : MappedDBMeta(0) {}
+    SchemaInfo() : MappedDBMeta(0), version(nextVersion()) {}
+    SchemaInfo(const SchemaInfo &other)
+        : MappedDBMeta(other), version(nextVersion()) {}
     ~SchemaInfo() {}
 
     TYPENAME("schemaInfo")
 
+    // unique to this schema, and higher than those of older ones
+    uint64_t getVersion() const {return version;}
+
+    // every HOM layer in the schema; see HOM::warmKeys
+    std::vector<const HOM *> getHOMLayers() const;
+
 private:
     std::string serialize(const DBObject &parent) const
     {
         FAIL_TextMessageError("SchemaInfo can not be serialized!");
     }
+
+    static uint64_t nextVersion();
+
+    const uint64_t version;
 };
 
+/*
+ * A copy of a schema that Deltas are applied to.  The objects on the
+ * path to a change are copied the first time they are needed;
+ * everything else is shared with the original, which is left alone.
+ */
+class SchemaUpdate {
+public:
+    SchemaUpdate(const SchemaInfo &original)
+        : original(original), copy(new SchemaInfo(original)) {}
+
+    // the copy of @meta, an object of the original; NULL if there is
+    // no such object
+    DBMeta *writable(const DBMeta &meta);
+    bool drop(const DBMeta &meta, const DBMeta &parent);
+    std::unique_ptr<SchemaInfo> finish() {return std::move(copy);}
+
+private:
+    const SchemaInfo &original;
+    std::unique_ptr<SchemaInfo> copy;
+    // objects of the original that were copied already
+    std::map<const DBMeta *, DBMeta *> copies;
+};
+
+class Delta;
+
 class SchemaCache {
     SchemaCache(const SchemaCache &cache) = delete;
     SchemaCache &operator=(const SchemaCache &cache) = delete;
     SchemaCache &operator=(SchemaCache &&cache) = delete;
 
 public:
-    SchemaCache() : no_loads(true), id(randomValue() % UINT_MAX) {}
+    SchemaCache() : no_loads(true), id(randomValue() % UINT_MAX),
+                    loaded_epoch(0), loads(0), next_poll(0)
+        {pthread_mutex_init(&load_lock, NULL);}
     SchemaCache(SchemaCache &&cache)
         : schema(std::move(cache.schema)), no_loads(cache.no_loads),
-          id(cache.id) {}
+          id(cache.id), loaded_epoch(cache.loaded_epoch.load()),
+          loads(cache.loads.load()), next_poll(cache.next_poll.load())
+        {pthread_mutex_init(&load_lock, NULL);}
+    ~SchemaCache();
 
+    /*
+     * Reloads only when the schema epoch moved past the loaded schema;
+     * otherwise returns it without a query or a lock.  The staleness
+     * table, where other processes mark DDL, is read at most once per
+     * poll interval.
+     */
     std::shared_ptr<const SchemaInfo>
         getSchema(const std::unique_ptr<Connect> &conn,
                   const std::unique_ptr<Connect> &e_conn) const;
     void updateStaleness(const std::unique_ptr<Connect> &e_conn,
                          bool staleness) const;
+    /*
+     * Applies Deltas that are in the REGULAR_TABLE to a copy-on-write
+     * copy of the schema, instead of reloading all of it, and moves the
+     * epoch on so the other caches of the process reload.  Falls back
+     * to a reload when they don't apply to the current schema, or when
+     * it was loaded after @loads_before, as it may have them already.
+     */
+    void updateSchema(const std::unique_ptr<Connect> &e_conn,
+                      const std::vector<std::unique_ptr<Delta> > &deltas,
+                      uint64_t loads_before) const;
+    // reloads so far
+    uint64_t loadCount() const {return loads;}
+    // the next getSchema() reloads
+    void invalidate() const;
     bool initialStaleness(const std::unique_ptr<Connect> &e_conn) const;
     bool cleanupStaleness(const std::unique_ptr<Connect> &e_conn) const;
     void lowLevelCurrentStale(const std::unique_ptr<Connect> &e_conn) const;
     void lowLevelCurrentUnstale(const std::unique_ptr<Connect> &e_conn) const;
 
+    // 0 reads the staleness table on every getSchema()
+    static void setPollInterval(unsigned int ms);
+
 private:
+    void pollStaleness(const std::unique_ptr<Connect> &e_conn) const;
+
+    // readers copy the pointer atomically; the SchemaInfo itself is
+    // never changed
     mutable std::shared_ptr<const SchemaInfo> schema;
+    // one load at a time; loading may recover DDL through the remote
+    // connection.  Also guards no_loads
+    mutable pthread_mutex_t load_lock;
     mutable bool no_loads;
     const unsigned int id;
+    // the schema epoch that schema reflects; 0 before the first load
+    mutable std::atomic<uint64_t> loaded_epoch;
+    mutable std::atomic<uint64_t> loads;
+    // microseconds; when the staleness table is due to be read again
+    mutable std::atomic<uint64_t> next_poll;
 };
 
 typedef std::shared_ptr<const SchemaInfo> SchemaInfoRef;
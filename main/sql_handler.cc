@@ -3,7 +3,12 @@
 
 AbstractAnything::~AbstractAnything() {}
 
-AbstractQueryExecutor::~AbstractQueryExecutor() {}
+// If we never got to publishDeltas(), the schema is rebuilt from
+// whatever made it into the database.
+AbstractQueryExecutor::~AbstractQueryExecutor()
+{
+    this->invalidateSchema();
+}
 
 std::pair<AbstractQueryExecutor::ResultType, AbstractAnything *>
 AbstractQueryExecutor::
@@ -11,7 +16,38 @@ next(const ResType &res, const NextParams &nparams)
 {
     genericPreamble(nparams);
 
-    return this->nextImpl(res, nparams);
+    try {
+        return this->nextImpl(res, nparams);
+    } catch (...) {
+        this->invalidateSchema();
+        throw;
+    }
+}
+
+void AbstractQueryExecutor::
+publishDeltas(const NextParams &nparams,
+              const std::vector<std::unique_ptr<Delta> > &deltas)
+{
+    assert(this->stales());
+
+    this->staled = NULL;
+    this->published = true;
+    try {
+        nparams.ps.getSchemaCache().updateSchema(nparams.ps.getEConn(),
+                                                 deltas, this->staled_loads);
+    } catch (const SchemaFailure &e) {
+        nparams.ps.getSchemaCache().invalidate();
+        FAIL_GenericPacketException("failed updating the schema");
+    }
+}
+
+void AbstractQueryExecutor::
+invalidateSchema()
+{
+    if (this->staled) {
+        this->staled->invalidate();
+        this->staled = NULL;
+    }
 }
 
 void AbstractQueryExecutor::
@@ -20,11 +56,17 @@ genericPreamble(const NextParams &nparams)
     // We handle before any queries because a failed query
     // may stale the database during recovery and then
     // we'd have to handle there as well.
-    try {
-        nparams.ps.getSchemaCache().updateStaleness(
-            nparams.ps.getEConn(), this->stales());
-    } catch (const SchemaFailure &e) {
-        FAIL_GenericPacketException("failed updating staleness");
+    if (true == this->stales() && false == this->published) {
+        try {
+            nparams.ps.getSchemaCache().updateStaleness(
+                nparams.ps.getEConn(), true);
+        } catch (const SchemaFailure &e) {
+            FAIL_GenericPacketException("failed updating staleness");
+        }
+        if (NULL == this->staled) {
+            this->staled_loads = nparams.ps.getSchemaCache().loadCount();
+        }
+        this->staled = &nparams.ps.getSchemaCache();
     }
 
     if (this->usesEmbedded()) {
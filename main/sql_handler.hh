@@ -67,7 +67,8 @@ protected:
 public:
     enum class ResultType {RESULTS, QUERY_COME_AGAIN, QUERY_USE_RESULTS};
 
-    AbstractQueryExecutor() {}
+    AbstractQueryExecutor()
+        : staled(NULL), staled_loads(0), published(false) {}
     virtual ~AbstractQueryExecutor();
     std::pair<ResultType, AbstractAnything *>
         next(const ResType &res, const NextParams &nparams);
@@ -76,9 +77,25 @@ public:
         nextImpl(const ResType &res, const NextParams &nparams) = 0;
     virtual bool stales() const {return false;}
     virtual bool usesEmbedded() const {return false;}
+    // the query of executors that only send it and decrypt its
+    // results; RewriteCache keeps plans for those alone
+    virtual const std::string *cacheableQuery() const {return NULL;}
+
+protected:
+    // for stales() executors, once their Deltas are in the REGULAR_TABLE
+    void publishDeltas(const NextParams &nparams,
+                       const std::vector<std::unique_ptr<Delta> > &deltas);
 
 private:
     void genericPreamble(const NextParams &nparams);
+    void invalidateSchema();
+
+    // set while the Deltas of a stales() executor may be in the
+    // database but not yet in the schema cache
+    const SchemaCache *staled;
+    // the reloads of that cache before our Deltas were written
+    uint64_t staled_loads;
+    bool published;
 };
 
 class SimpleExecutor : public AbstractQueryExecutor {
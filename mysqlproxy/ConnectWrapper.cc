@@ -1,6 +1,7 @@
 #include <sstream>
 #include <fstream>
 #include <assert.h>
+#include <stdio.h>
 #include <lua5.1/lua.hpp>
 
 #include <util/ctr.hh>
@@ -8,14 +9,21 @@
 #include <util/scoped_lock.hh>
 #include <util/util.hh>
 
+#include <crypto/ope_cache.hh>
+#include <crypto/paillier_pool.hh>
+
 #include <main/rewrite_main.hh>
 #include <main/rewrite_util.hh>
 #include <main/schema.hh>
 #include <main/Analysis.hh>
+#include <main/crypto_pool.hh>
+#include <main/rewrite_cache.hh>
 
 #include <parser/sql_utils.hh>
 #include <parser/mysql_type_metadata.hh>
 
+#include <mysqlproxy/prepared_stmt.hh>
+
 __thread ProxyState *thread_ps = NULL;
 
 class WrapperState {
@@ -29,8 +37,14 @@ public:
     std::string default_db;
     std::ofstream * PLAIN_LOG;
 
-    WrapperState() {}
-    ~WrapperState() {}
+    // held through each call for this client
+    pthread_mutex_t lock;
+
+    WrapperState() : next_statement_id(1), executions(0),
+                     executing(false) {
+        pthread_mutex_init(&lock, NULL);
+    }
+    ~WrapperState() {pthread_mutex_destroy(&lock);}
 
     const std::unique_ptr<QueryRewrite> &getQueryRewrite() const {
         assert(this->qr);
@@ -47,43 +61,62 @@ public:
     }
 
     std::unique_ptr<ProxyState> ps;
-    // we are running cryptdb in a threaded environment without proper
-    // locking; this leads to crashes during onion adjustment unless we
-    // take some minimal precautions
+    // clients run concurrently, and another one may reload the schema
+    // while this one still rewrites against the old SchemaInfo.
     // > everytime we process a query we take a reference to the SchemaInfo
     //   so that we know the same SchemaInfo (and it's children) will be
-    //   available on the backend for Deltaz; this handles the following
-    //   known bad cases.
-    //   a. thread A marks the cache as stale; thread B sees that it is
-    //      stale and updates the cache; thread A crashes while
-    //      trying to do onion adjustment
-    //   b. we must take the reference at the same time we get the schema
-    //      from the cache, otherwise ...
-    //      + thread A takes the reference to SchemaInfo when the cache is
-    //        already stale, now he ``gets'' his SchemaInfo; because the
-    //        cache is stale the second SchemaInfo is a new object and the
-    //        reference doesn't protect it. now when thread B gets his
-    //        SchemaInfo the cache is still stale so he deletes the only
-    //        reference to the SchemaInfo thread A is using
-    //      + this case only applies if we aren't using the lock on each
-    //        function (connect, disonnect, rewrite, envoi); thread A
-    //        takes a reference to SchemaInfo then before he can ``get''
-    //        the SchemaInfo thread B stales the cache. now thread A
-    //        gets the SchemaInfo and his reference doesn't protect it.
-    //        when thread C gets his SchemaInfo the cache is stale so
-    //        he deletes the only reference to the SchemaInfo thread A
-    //        is using
+    //   available on the backend for Deltaz; thread A marks the cache as
+    //   stale, thread B sees that it is stale and updates the cache, and
+    //   thread A still does its onion adjustment against the old objects.
+    // > the reference is taken at the same time we get the schema from
+    //   the cache: SchemaCache copies the pointer atomically, so
+    //   a reload can't drop the last reference in between.
     std::vector<SchemaInfoRef> schema_info_refs;
+    // the client's COM_STMT_PREPAREd statements, by id
+    std::map<uint32_t, std::unique_ptr<PreparedStatement> > statements;
+    uint32_t next_statement_id;
+    uint64_t executions;
+    // the current query is a COM_STMT_EXECUTE; its results go out in
+    // the binary protocol, which wants their types
+    bool executing;
 
 private:
     std::unique_ptr<QueryRewrite> qr;
 };
 
-static Timer t;
+#ifndef NTL_THREADS
+// NTL keeps its scratch space and its random stream in globals unless
+// it was built with NTL_THREADS, so clients take turns
+static pthread_mutex_t ntl_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// held through each call for a client
+class ClientLock {
+public:
+    explicit ClientLock(WrapperState *const ws) : ws(ws) {
+#ifndef NTL_THREADS
+        pthread_mutex_lock(&ntl_lock);
+#endif
+        pthread_mutex_lock(&ws->lock);
+    }
+    ~ClientLock() {
+        pthread_mutex_unlock(&ws->lock);
+#ifndef NTL_THREADS
+        pthread_mutex_unlock(&ntl_lock);
+#endif
+    }
+
+private:
+    ClientLock(const ClientLock &other);
+    ClientLock &operator=(const ClientLock &rhs);
+
+    WrapperState *const ws;
+};
 
 //static EDBProxy * cl = NULL;
 static SharedProxyState * shared_ps = NULL;
-static pthread_mutex_t big_lock;
+// connect() sets up the state shared by all clients
+static pthread_mutex_t connect_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static bool EXECUTE_QUERIES = true;
 
@@ -92,13 +125,31 @@ static std::string TRAIN_QUERY ="";
 static bool LOG_PLAIN_QUERIES = false;
 static std::string PLAIN_BASELOG = "";
 
+// the HOM keys were pruned, and warmed if asked, on the first connect
+static bool hom_keys_loaded = false;
+
 
 static int counter = 0;
 
-static std::map<std::string, WrapperState*> clients;
+// each client's calls take its own lock, so clients run side by side
+// when NTL was built with NTL_THREADS
+static std::map<std::string, std::shared_ptr<WrapperState> > clients;
+static pthread_rwlock_t clients_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// a reference keeps the state alive if the client disconnects meanwhile
+static std::shared_ptr<WrapperState>
+findClient(const std::string &client)
+{
+    scoped_rdlock l(&clients_lock);
+    auto it = clients.find(client);
+    if (it == clients.end()) {
+        return std::shared_ptr<WrapperState>();
+    }
+    return it->second;
+}
 
 static void
-returnResultSet(lua_State *L, const ResType &res);
+returnResultSet(lua_State *L, const ResType &res, bool with_types);
 
 static Item_null *
 make_null(const std::string &name = "")
@@ -127,7 +178,10 @@ connect(lua_State *const L)
     assert(test64bitZZConversions());
 
     ANON_REGION(__func__, &perf_cg);
-    scoped_lock l(&big_lock);
+    scoped_lock l(&connect_lock);
+#ifndef NTL_THREADS
+    scoped_lock n(&ntl_lock);
+#endif
     assert(0 == mysql_thread_init());
 
     const std::string client = xlua_tolstring(L, 1);
@@ -139,8 +193,8 @@ connect(lua_State *const L)
 
     ConnectionInfo const ci = ConnectionInfo(server, user, psswd, port);
 
-    assert(clients.end() == clients.find(client));
-    clients[client] = new WrapperState();
+    assert(!findClient(client));
+    const std::shared_ptr<WrapperState> ws(new WrapperState());
 
     // Is it the first connection?
     if (!shared_ps) {
@@ -155,6 +209,85 @@ connect(lua_State *const L)
         const std::string &false_str = "FALSE";
         const std::string &mkey      = "113341234";  // XXX do not change as
                                                      // it's used for tpcc exps
+
+        // must be set before the schema (and its OPE layers) is loaded
+        const char *const ope_cache_ev = getenv("OPE_CACHE_BYTES");
+        if (ope_cache_ev) {
+            ope_cache::set_global_budget(strtoull(ope_cache_ev, NULL, 10));
+            LOG(wrapper) << "OPE cache budget "
+                         << ope_cache::global_budget() << " bytes";
+        }
+
+        // SCHEMA_POLL_MS=<ms> bounds how long DDL from another process
+        // goes unnoticed; DDL through this proxy is seen at once
+        const char *const schema_poll_ev = getenv("SCHEMA_POLL_MS");
+        if (schema_poll_ev) {
+            SchemaCache::setPollInterval(atoi(schema_poll_ev));
+        }
+
+        // REWRITE_CACHE=<shapes> bounds the rewrite plans kept; 0
+        // rewrites every query in full
+        const char *const rewrite_cache_ev = getenv("REWRITE_CACHE");
+        if (rewrite_cache_ev) {
+            RewriteCache::setCapacity(strtoull(rewrite_cache_ev, NULL, 10));
+            LOG(wrapper) << "rewrite cache of "
+                         << RewriteCache::capacity() << " shapes";
+        }
+
+        // PARSE_THDS=<n> keeps <n> idle parser THDs per thread; 0
+        // makes a THD for every query
+        const char *const parse_thds_ev = getenv("PARSE_THDS");
+        if (parse_thds_ev) {
+            query_parse::setPoolSize(strtoull(parse_thds_ev, NULL, 10));
+            LOG(wrapper) << query_parse::poolSize()
+                         << " idle parser THDs per thread";
+        }
+
+        // HOM_POOL=<low>,<high>,<threads>; a high watermark of 0
+        // turns the HOM randomness pools off, as does an NTL built
+        // without NTL_THREADS
+        const char *const hom_pool_ev = getenv("HOM_POOL");
+#ifndef NTL_THREADS
+        if (hom_pool_ev) {
+            LOG(wrapper) << "ignoring HOM_POOL; NTL built without "
+                         << "NTL_THREADS";
+        }
+#else
+        if (hom_pool_ev) {
+            size_t low, high;
+            uint nthreads;
+            if (3 == sscanf(hom_pool_ev, "%zu,%zu,%u",
+                            &low, &high, &nthreads)) {
+                paillier_pool::configure(low, high, nthreads);
+                LOG(wrapper) << "HOM randomness pool " << low << "-"
+                             << high << ", " << nthreads << " threads";
+            } else {
+                LOG(wrapper) << "ignoring malformed HOM_POOL "
+                             << hom_pool_ev;
+            }
+        }
+#endif
+
+        // INSERT_THREADS=<n>; 0 keeps every INSERT, result and schema
+        // load on its own thread, as does an NTL built without
+        // NTL_THREADS
+        const char *const insert_threads_ev = getenv("INSERT_THREADS");
+        if (insert_threads_ev) {
+            uint nthreads;
+            if (1 == sscanf(insert_threads_ev, "%u", &nthreads)) {
+                CryptoPool::configure(nthreads);
+            } else {
+                LOG(wrapper) << "ignoring malformed INSERT_THREADS "
+                             << insert_threads_ev;
+            }
+        }
+        LOG(wrapper) << "crypto pool of " << CryptoPool::threads()
+                     << " threads";
+
+        // keys that HOM layers derive from their seeds are kept next
+        // to the embedded database across restarts
+        HOM::setKeyStore(embed_dir + "/hom_keys");
+
         shared_ps =
             new SharedProxyState(ci, embed_dir, mkey,
                                  determineSecurityRating());
@@ -195,7 +328,7 @@ connect(lua_State *const L)
                     new std::ofstream(logPlainQueries, std::ios_base::app);
                 LOG(wrapper) << "proxy logs plain queries at " << logPlainQueries;
                 assert_s(PLAIN_LOG != NULL, "could not create file " + logPlainQueries);
-                clients[client]->PLAIN_LOG = PLAIN_LOG;
+                ws->PLAIN_LOG = PLAIN_LOG;
             } else {
                 LOG_PLAIN_QUERIES = false;
             }
@@ -210,14 +343,41 @@ connect(lua_State *const L)
             std::ofstream * const PLAIN_LOG =
                 new std::ofstream(logPlainQueries, std::ios_base::app);
             assert_s(PLAIN_LOG != NULL, "could not create file " + logPlainQueries);
-            clients[client]->PLAIN_LOG = PLAIN_LOG;
+            ws->PLAIN_LOG = PLAIN_LOG;
         }
     }
-    clients[client]->ps =
+    ws->ps =
         std::unique_ptr<ProxyState>(new ProxyState(*shared_ps));
     // We don't want to use the THD from the previous connection
     // if such is even possible...
-    clients[client]->ps->safeCreateEmbeddedTHD();
+    ws->ps->safeCreateEmbeddedTHD();
+
+    if (!hom_keys_loaded) {
+        hom_keys_loaded = true;
+
+        const std::shared_ptr<const SchemaInfo> &schema =
+            ws->ps->getSchemaInfo();
+        const std::vector<const HOM *> &layers = schema->getHOMLayers();
+        // forget the stored keys of dropped columns
+        HOM::pruneKeyStore(layers);
+
+        // HOM_WARMUP=<threads> loads or generates every HOM key up
+        // front instead of on the first use of each column
+        const char *const warmup_ev = getenv("HOM_WARMUP");
+        if (warmup_ev) {
+            const uint nthreads = std::max(1, atoi(warmup_ev));
+            Timer warm_timer;
+            HOM::warmKeys(layers, nthreads);
+            LOG(wrapper) << "HOM warm-up: " << layers.size() << " keys, "
+                         << nthreads << " threads, "
+                         << warm_timer.lap_ms() << " ms";
+        }
+    }
+
+    {
+        scoped_wrlock w(&clients_lock);
+        clients[client] = ws;
+    }
 
     return 0;
 }
@@ -226,91 +386,445 @@ static int
 disconnect(lua_State *const L)
 {
     ANON_REGION(__func__, &perf_cg);
-    scoped_lock l(&big_lock);
     assert(0 == mysql_thread_init());
 
     const std::string client = xlua_tolstring(L, 1);
-    if (clients.find(client) == clients.end()) {
-        return 0;
+    std::shared_ptr<WrapperState> ws;
+    bool last_client;
+    {
+        scoped_wrlock w(&clients_lock);
+        auto it = clients.find(client);
+        if (it == clients.end()) {
+            return 0;
+        }
+        ws = it->second;
+        clients.erase(it);
+        last_client = clients.empty();
     }
 
     LOG(wrapper) << "disconnect " << client;
 
-    auto ws = clients[client];
-    clients[client] = NULL;
+    // the pools are shared by all clients; report them once the proxy
+    // goes idle
+    if (last_client) {
+        const paillier_pool::stats hps = paillier_pool::global_stats();
+        LOG(wrapper) << "HOM randomness pools: depth " << hps.depth
+                     << ", taken " << hps.taken << ", stalls "
+                     << hps.stalls;
+
+        const ope_cache::stats ocs = ope_cache::global_stats();
+        LOG(wrapper) << "OPE caches: " << ocs.hits << " hits, "
+                     << ocs.misses << " misses, " << ocs.evictions
+                     << " evictions; " << ocs.entries << " entries, "
+                     << ocs.bytes << " bytes";
+    }
 
-    thread_ps = NULL;
-    delete ws;
-    clients.erase(client);
+    const RewriteCache::Stats rcs = ws->ps->getRewriteCache().getStats();
+    LOG(wrapper) << "rewrite cache: " << rcs.hits << "/" << rcs.lookups
+                 << " hits, " << rcs.uncacheable << " uncacheable, "
+                 << rcs.entries << " shapes, " << rcs.evicted
+                 << " evicted, " << rcs.expired << " expired; "
+                 << (rcs.hits ? rcs.hit_usec / rcs.hits : 0)
+                 << " us per hit, "
+                 << (rcs.lookups > rcs.hits
+                     ? rcs.miss_usec / (rcs.lookups - rcs.hits) : 0)
+                 << " us per miss";
+
+    const query_parse::Stats qps = query_parse::getStats();
+    LOG(wrapper) << "parser: " << qps.parses << " parses, "
+                 << qps.thds_made << " THDs made; "
+                 << (qps.parses ? qps.usec / qps.parses : 0)
+                 << " us and "
+                 << (qps.parses ? static_cast<double>(qps.blocks)
+                                  / qps.parses : 0)
+                 << " mem_root blocks per parse";
+
+    {
+        // let a call that is still running for this client finish
+        const ClientLock l(ws.get());
+        thread_ps = NULL;
+        if (ws->next_statement_id > 1) {
+            LOG(wrapper) << "prepared statements: "
+                         << ws->next_statement_id - 1 << " prepared, "
+                         << ws->executions << " executions";
+        }
+    }
+    // frees the state, unless such a call still holds a reference
+    ws.reset();
 
     mysql_thread_end();
     return 0;
 }
 
+// the caller holds the client's lock; throws if the rewrite fails.
+// @kept is the plan of the prepared statement @query executes
+static void
+rewriteQuery(WrapperState *const c_wrapper, const std::string &query,
+             unsigned long long thread_id,
+             std::shared_ptr<RewriteCache::Plan> *kept = NULL)
+{
+    ProxyState *const ps = thread_ps = c_wrapper->ps.get();
+    assert(ps);
+
+    c_wrapper->last_query = query;
+    if (EXECUTE_QUERIES) {
+        TEST_Text(retrieveDefaultDatabase(thread_id, ps->getConn(),
+                                          &c_wrapper->default_db),
+                  "proxy failed to retrieve default database!");
+        // save a reference so a second thread won't eat objects
+        // that DeltaOuput wants later
+        const std::shared_ptr<const SchemaInfo> &schema =
+            ps->getSchemaInfo();
+        c_wrapper->schema_info_refs.push_back(schema);
+
+        std::unique_ptr<QueryRewrite> qr =
+            std::unique_ptr<QueryRewrite>(new QueryRewrite(
+                Rewriter::rewrite(query, *schema.get(),
+                                  c_wrapper->default_db, *ps, kept)));
+        assert(qr);
+
+        c_wrapper->setQueryRewrite(std::move(qr));
+    }
+
+    if (LOG_PLAIN_QUERIES) {
+        *(c_wrapper->PLAIN_LOG) << query << std::endl;
+    }
+}
+
 static int
 rewrite(lua_State *const L)
 {
     ANON_REGION(__func__, &perf_cg);
-    scoped_lock l(&big_lock);
     assert(0 == mysql_thread_init());
 
     const std::string client = xlua_tolstring(L, 1);
-    if (clients.find(client) == clients.end()) {
+    const std::shared_ptr<WrapperState> c_wrapper = findClient(client);
+    if (!c_wrapper) {
         lua_pushnil(L);
         xlua_pushlstring(L, "failed to recognize client");     
         return 2;
     }
-    WrapperState *const c_wrapper = clients[client];
-    ProxyState *const ps = thread_ps = c_wrapper->ps.get();
-    assert(ps);
+    const ClientLock l(c_wrapper.get());
 
     const std::string &query = xlua_tolstring(L, 2);
     const unsigned long long _thread_id =
         strtoull(xlua_tolstring(L, 3).c_str(), NULL, 10);
 
-    std::list<std::string> new_queries;
+    c_wrapper->executing = false;
+    try {
+        rewriteQuery(c_wrapper.get(), query, _thread_id);
+    } catch (const AbstractException &e) {
+        lua_pushboolean(L, false);              // status
+        xlua_pushlstring(L, e.to_string());     // error message
+        return 2;
+    } catch (const CryptDBError &e) {
+        lua_pushboolean(L, false);              // status
+        xlua_pushlstring(L, e.msg);             // error message
+        return 2;
+    }
 
-    c_wrapper->last_query = query;
-    t.lap_ms();
-    if (EXECUTE_QUERIES) {
+    lua_pushboolean(L, true);                       // status
+    lua_pushnil(L);                                 // error message
+
+    return 2;
+}
+
+static void
+pushPackets(lua_State *const L, const std::vector<std::string> &packets)
+{
+    lua_createtable(L, static_cast<int>(packets.size()), 0);
+    int const t_packets = lua_gettop(L);
+    for (uint i = 0; i < packets.size(); i++) {
+        xlua_pushlstring(L, packets[i]);
+        lua_rawseti(L, t_packets, i+1);
+    }
+}
+
+/*
+ * Prepared statements: prepare() rewrites the statement, keeps it and
+ * returns the packets that answer COM_STMT_PREPARE; execute() binds the
+ * parameters of a COM_STMT_EXECUTE and rewrites the query, after which
+ * Lua carries on with next() as for COM_QUERY and hands any result set
+ * to binaryResults().
+ */
+
+// rewrites @stmt with made up values, for the errors and the columns
+// of the statement; false, with the error of the first try, if none of
+// them rewrites.  The rewrite is the statement's own: the client's
+// current query and the RewriteCache do not see it.
+static bool
+rewriteStatement(WrapperState *const c_wrapper,
+                 PreparedStatement *const stmt,
+                 unsigned long long thread_id,
+                 std::vector<std::string> *const columns,
+                 std::string *const error)
+{
+    if (!EXECUTE_QUERIES) {
+        return true;
+    }
+
+    ProxyState *const ps = thread_ps = c_wrapper->ps.get();
+    assert(ps);
+    if (!retrieveDefaultDatabase(thread_id, ps->getConn(),
+                                 &c_wrapper->default_db)) {
+        *error = "proxy failed to retrieve default database!";
+        return false;
+    }
+    // held through the rewrite; nothing runs against it later
+    const std::shared_ptr<const SchemaInfo> &schema = ps->getSchemaInfo();
+
+    for (unsigned int nth = 0; ; ++nth) {
+        const std::string &query = stmt->bindDummies(nth);
+        if (query.empty()) {
+            return false;
+        }
+
+        std::unique_ptr<QueryRewrite> qr;
         try {
-            TEST_Text(retrieveDefaultDatabase(_thread_id, ps->getConn(),
-                                              &c_wrapper->default_db),
-                      "proxy failed to retrieve default database!");
-            // save a reference so a second thread won't eat objects
-            // that DeltaOuput wants later
-            const std::shared_ptr<const SchemaInfo> &schema =
-                ps->getSchemaInfo();
-            c_wrapper->schema_info_refs.push_back(schema);
-
-            std::unique_ptr<QueryRewrite> qr =
-                std::unique_ptr<QueryRewrite>(new QueryRewrite(
-                    Rewriter::rewrite(query, *schema.get(),
-                                      c_wrapper->default_db, *ps)));
-            assert(qr);
-
-            c_wrapper->setQueryRewrite(std::move(qr));
+            qr.reset(new QueryRewrite(
+                Rewriter::rewrite(query, *schema.get(),
+                                  c_wrapper->default_db, *ps,
+                                  stmt->keptPlan(), false)));
         } catch (const AbstractException &e) {
-            lua_pushboolean(L, false);              // status
-            xlua_pushlstring(L, e.to_string());     // error message
-            return 2;
+            if (0 == nth) {
+                *error = e.to_string();
+            }
+            continue;
         } catch (const CryptDBError &e) {
-            lua_pushboolean(L, false);              // status
-            xlua_pushlstring(L, e.msg);             // error message
-            return 2;
+            if (0 == nth) {
+                *error = e.msg;
+            }
+            continue;
+        }
+
+        for (const auto &it : qr->rmeta.rfmeta) {
+            if (!it.second.getIsSalt()) {
+                columns->push_back(it.second.fieldCalled());
+            }
         }
+        return true;
     }
+}
 
-    if (LOG_PLAIN_QUERIES) {
-        *(c_wrapper->PLAIN_LOG) << query << std::endl;
+static int
+prepare(lua_State *const L)
+{
+    ANON_REGION(__func__, &perf_cg);
+    assert(0 == mysql_thread_init());
+
+    const std::string client = xlua_tolstring(L, 1);
+    const std::shared_ptr<WrapperState> c_wrapper = findClient(client);
+    if (!c_wrapper) {
+        lua_pushboolean(L, false);
+        xlua_pushlstring(L, "failed to recognize client");
+        return 2;
     }
+    const ClientLock l(c_wrapper.get());
 
-    lua_pushboolean(L, true);                       // status
-    lua_pushnil(L);                                 // error message
+    std::unique_ptr<PreparedStatement>
+        stmt(new PreparedStatement(xlua_tolstring(L, 2)));
+    const unsigned long long _thread_id =
+        strtoull(xlua_tolstring(L, 3).c_str(), NULL, 10);
+    if (stmt->paramCount() > 0xffff) {
+        lua_pushboolean(L, false);
+        xlua_pushlstring(L, "too many placeholders in statement");
+        return 2;
+    }
+
+    std::vector<std::string> columns;
+    std::string error;
+    if (!rewriteStatement(c_wrapper.get(), stmt.get(), _thread_id,
+                          &columns, &error)) {
+        lua_pushboolean(L, false);
+        xlua_pushlstring(L, error);
+        return 2;
+    }
+    if (columns.size() > 0xffff) {
+        lua_pushboolean(L, false);
+        xlua_pushlstring(L, "too many columns in statement");
+        return 2;
+    }
+
+    const uint32_t id = c_wrapper->next_statement_id++;
+    const uint16_t params = stmt->paramCount();
+    c_wrapper->statements[id] = std::move(stmt);
 
+    lua_pushboolean(L, true);
+    pushPackets(L, stmtPrepareOK(id, params, columns));
     return 2;
 }
 
+static int
+execute(lua_State *const L)
+{
+    ANON_REGION(__func__, &perf_cg);
+    assert(0 == mysql_thread_init());
+
+    const std::string client = xlua_tolstring(L, 1);
+    const std::shared_ptr<WrapperState> c_wrapper = findClient(client);
+    if (!c_wrapper) {
+        lua_pushboolean(L, false);
+        xlua_pushlstring(L, "failed to recognize client");
+        return 2;
+    }
+    const ClientLock l(c_wrapper.get());
+
+    const std::string packet = xlua_tolstring(L, 2);
+    const unsigned long long _thread_id =
+        strtoull(xlua_tolstring(L, 3).c_str(), NULL, 10);
+
+    try {
+        const auto it =
+            c_wrapper->statements.find(
+                PreparedStatement::packetStatementId(packet));
+        TEST_Text(c_wrapper->statements.end() != it,
+                  "unknown prepared statement");
+
+        const std::string &query = it->second->bind(packet);
+        c_wrapper->executions++;
+        c_wrapper->executing = true;
+        rewriteQuery(c_wrapper.get(), query, _thread_id,
+                     it->second->keptPlan());
+    } catch (const AbstractException &e) {
+        lua_pushboolean(L, false);
+        xlua_pushlstring(L, e.to_string());
+        return 2;
+    } catch (const CryptDBError &e) {
+        lua_pushboolean(L, false);
+        xlua_pushlstring(L, e.msg);
+        return 2;
+    }
+
+    lua_pushboolean(L, true);
+    lua_pushnil(L);
+    return 2;
+}
+
+static int
+closeStatement(lua_State *const L)
+{
+    ANON_REGION(__func__, &perf_cg);
+
+    const std::string client = xlua_tolstring(L, 1);
+    const std::shared_ptr<WrapperState> c_wrapper = findClient(client);
+    if (!c_wrapper) {
+        return 0;
+    }
+    const ClientLock l(c_wrapper.get());
+
+    try {
+        c_wrapper->statements.erase(
+            PreparedStatement::packetStatementId(xlua_tolstring(L, 2)));
+    } catch (const AbstractException &e) {
+        LOG(warn) << "bad COM_STMT_CLOSE: " << e.to_string();
+    }
+    return 0;
+}
+
+static int
+longData(lua_State *const L)
+{
+    ANON_REGION(__func__, &perf_cg);
+
+    const std::string client = xlua_tolstring(L, 1);
+    const std::shared_ptr<WrapperState> c_wrapper = findClient(client);
+    if (!c_wrapper) {
+        return 0;
+    }
+    const ClientLock l(c_wrapper.get());
+
+    // as the server does, errors wait for the COM_STMT_EXECUTE; that
+    // reports a statement it does not know, and bad long data is lost
+    const std::string packet = xlua_tolstring(L, 2);
+    try {
+        const auto it =
+            c_wrapper->statements.find(
+                PreparedStatement::packetStatementId(packet));
+        if (c_wrapper->statements.end() != it) {
+            it->second->addLongData(packet);
+        }
+    } catch (const AbstractException &e) {
+        LOG(warn) << "bad COM_STMT_SEND_LONG_DATA: " << e.to_string();
+    }
+    return 0;
+}
+
+static int
+resetStatement(lua_State *const L)
+{
+    ANON_REGION(__func__, &perf_cg);
+
+    const std::string client = xlua_tolstring(L, 1);
+    const std::shared_ptr<WrapperState> c_wrapper = findClient(client);
+    if (!c_wrapper) {
+        lua_pushboolean(L, false);
+        xlua_pushlstring(L, "failed to recognize client");
+        return 2;
+    }
+    const ClientLock l(c_wrapper.get());
+
+    try {
+        const auto it =
+            c_wrapper->statements.find(
+                PreparedStatement::packetStatementId(xlua_tolstring(L, 2)));
+        TEST_Text(c_wrapper->statements.end() != it,
+                  "unknown prepared statement");
+        it->second->reset();
+    } catch (const AbstractException &e) {
+        lua_pushboolean(L, false);
+        xlua_pushlstring(L, e.to_string());
+        return 2;
+    }
+
+    lua_pushboolean(L, true);
+    lua_pushnil(L);
+    return 2;
+}
+
+// the fields and rows of a decrypted result as the binary protocol
+// sends them
+static int
+binaryResults(lua_State *const L)
+{
+    ANON_REGION(__func__, &perf_cg);
+
+    // next() gives the fields the types of their plaintexts, the
+    // backend those of the results it passes through
+    std::vector<std::string> names;
+    std::vector<uint16_t> types;
+    lua_pushnil(L);
+    while (lua_next(L, 1)) {
+        lua_getfield(L, -1, "name");
+        names.push_back(xlua_tolstring(L, -1));
+        lua_pop(L, 1);
+        lua_getfield(L, -1, "type");
+        types.push_back(lua_isnumber(L, -1) ? lua_tointeger(L, -1)
+                                            : MYSQL_TYPE_VAR_STRING);
+        lua_pop(L, 2);
+    }
+
+    // a column Lua skips is NULL
+    std::list<std::string> values;
+    std::vector<std::vector<const std::string *> > rows;
+    lua_pushnil(L);
+    while (lua_next(L, 2)) {
+        rows.push_back(std::vector<const std::string *>(names.size(), NULL));
+
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+            const int key = luaL_checkint(L, -2) - 1;
+            assert(key >= 0 && static_cast<uint>(key) < names.size());
+            values.push_back(xlua_tolstring(L, -1));
+            rows.back()[key] = &values.back();
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+
+    pushPackets(L, binaryResultSet(names, types, rows));
+    return 1;
+}
+
 inline std::vector<Item *>
 itemNullVector(unsigned int count)
 {
@@ -408,11 +922,11 @@ static int
 next(lua_State *const L)
 {
     ANON_REGION(__func__, &perf_cg);
-    scoped_lock l(&big_lock);
     assert(0 == mysql_thread_init());
 
     const std::string client = xlua_tolstring(L, 1);
-    if (clients.find(client) == clients.end()) {
+    const std::shared_ptr<WrapperState> c_wrapper = findClient(client);
+    if (!c_wrapper) {
         xlua_pushlstring(L, "error");
         xlua_pushlstring(L, "unknown client");
          lua_pushinteger(L,  100);
@@ -421,7 +935,7 @@ next(lua_State *const L)
         nilBuffer(L, 1);
         return 5;
     }
-    WrapperState *const c_wrapper = clients[client];
+    const ClientLock l(c_wrapper.get());
 
     assert(EXECUTE_QUERIES);
 
@@ -477,7 +991,8 @@ next(lua_State *const L)
             xlua_pushlstring(L, "results");
 
             const auto &res = new_results.second->extract<ResType>();
-            returnResultSet(L, res);        // pushes 4 items on stack
+            // pushes 4 items on stack
+            returnResultSet(L, res, c_wrapper->executing);
             return 5;
         }
         default:
@@ -495,8 +1010,36 @@ next(lua_State *const L)
     }
 }
 
+// the type of the plaintexts in column @col of @rows, as
+// COM_STMT_EXECUTE gives parameter types
+static uint16_t
+plainColumnType(const std::vector<std::vector<Item *> > &rows,
+                unsigned int col)
+{
+    for (const auto &it : rows) {
+        Item *const i = it[col];
+        if (NULL == i || i->is_null()) {
+            continue;
+        }
+
+        switch (i->result_type()) {
+        case INT_RESULT:
+            return MYSQL_TYPE_LONGLONG | (i->unsigned_flag ? 0x8000 : 0);
+        case REAL_RESULT:
+            return MYSQL_TYPE_DOUBLE;
+        case DECIMAL_RESULT:
+            return MYSQL_TYPE_NEWDECIMAL;
+        default:
+            return MYSQL_TYPE_VAR_STRING;
+        }
+    }
+
+    return MYSQL_TYPE_VAR_STRING;
+}
+
+// @with_types gives the fields the types of the decrypted values
 static void
-returnResultSet(lua_State *const L, const ResType &rd)
+returnResultSet(lua_State *const L, const ResType &rd, bool with_types)
 {
     TEST_GenericPacketException(true == rd.ok, "something bad happened");
 
@@ -520,6 +1063,10 @@ returnResultSet(lua_State *const L, const ResType &rd)
         lua_pushinteger(L, rd.types[i]);
         lua_setfield(L, t_field, "type");
 */
+        if (with_types) {
+            lua_pushinteger(L, plainColumnType(rd.rows, i));
+            lua_setfield(L, t_field, "type");
+        }
 
         /* insert field element into fields table at i+1 */
         lua_rawseti(L, t_fields, i+1);
@@ -554,6 +1101,12 @@ cryptdb_lib[] = {
     F(disconnect),
     F(rewrite),
     F(next),
+    F(prepare),
+    F(execute),
+    F(closeStatement),
+    F(longData),
+    F(resetStatement),
+    F(binaryResults),
     { 0, 0 },
 };
 
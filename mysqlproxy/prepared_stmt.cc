@@ -0,0 +1,589 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mysql.h>
+
+#include <mysqlproxy/prepared_stmt.hh>
+#include <main/macro_util.hh>
+
+namespace {
+
+// reads the fields of a client packet in order
+class PacketReader {
+public:
+    explicit PacketReader(const std::string &packet)
+        : packet(packet), pos(0) {}
+
+    uint64_t fixed(size_t bytes) {
+        TEST_Text(pos + bytes <= packet.size(), "short statement packet");
+        uint64_t out = 0;
+        for (size_t i = 0; i < bytes; ++i) {
+            out |= static_cast<uint64_t>(
+                       static_cast<unsigned char>(packet[pos + i])) << (8 * i);
+        }
+        pos += bytes;
+        return out;
+    }
+
+    uint64_t lenenc() {
+        const uint64_t first = fixed(1);
+        switch (first) {
+        case 0xfc:  return fixed(2);
+        case 0xfd:  return fixed(3);
+        case 0xfe:  return fixed(8);
+        default:
+            TEST_Text(first < 0xfb, "bad length in statement packet");
+            return first;
+        }
+    }
+
+    std::string bytes(uint64_t n) {
+        TEST_Text(n <= packet.size() - pos, "short statement packet");
+        const std::string out = packet.substr(pos, n);
+        pos += n;
+        return out;
+    }
+
+private:
+    const std::string &packet;
+    size_t pos;
+};
+
+void
+putFixed(std::string *const out, uint64_t v, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; ++i) {
+        out->push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+    }
+}
+
+void
+putLenenc(std::string *const out, uint64_t v)
+{
+    if (v < 0xfb) {
+        putFixed(out, v, 1);
+    } else if (v <= 0xffff) {
+        putFixed(out, 0xfc, 1);
+        putFixed(out, v, 2);
+    } else if (v <= 0xffffff) {
+        putFixed(out, 0xfd, 1);
+        putFixed(out, v, 3);
+    } else {
+        putFixed(out, 0xfe, 1);
+        putFixed(out, v, 8);
+    }
+}
+
+void
+putLenencString(std::string *const out, const std::string &s)
+{
+    putLenenc(out, s.size());
+    out->append(s);
+}
+
+const unsigned int binary_charset = 63;
+const unsigned int utf8_charset = 33;
+
+std::string
+columnDefinition(const std::string &name, unsigned int charset,
+                 uint32_t length,
+                 enum_field_types type = MYSQL_TYPE_VAR_STRING,
+                 unsigned int flags = 0, unsigned int decimals = 0)
+{
+    std::string out;
+    putLenencString(&out, "def");
+    putLenencString(&out, "");          // schema
+    putLenencString(&out, "");          // table
+    putLenencString(&out, "");          // original table
+    putLenencString(&out, name);
+    putLenencString(&out, name);        // original name
+    putFixed(&out, 0x0c, 1);
+    putFixed(&out, charset, 2);
+    putFixed(&out, length, 4);
+    putFixed(&out, type, 1);
+    putFixed(&out, flags, 2);
+    putFixed(&out, decimals, 1);
+    putFixed(&out, 0, 2);
+    return out;
+}
+
+// how a result column of @type goes out; the client library converts
+// a string to the type the application binds
+enum_field_types
+resultType(uint16_t type)
+{
+    switch (static_cast<enum_field_types>(type & 0xff)) {
+    case MYSQL_TYPE_TINY:
+    case MYSQL_TYPE_SHORT:
+    case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_INT24:
+    case MYSQL_TYPE_LONGLONG:
+        return MYSQL_TYPE_LONGLONG;
+    case MYSQL_TYPE_FLOAT:
+    case MYSQL_TYPE_DOUBLE:
+        return MYSQL_TYPE_DOUBLE;
+    case MYSQL_TYPE_DECIMAL:
+    case MYSQL_TYPE_NEWDECIMAL:
+        return MYSQL_TYPE_NEWDECIMAL;
+    default:
+        return MYSQL_TYPE_VAR_STRING;
+    }
+}
+
+bool
+parseInteger(const std::string &s, bool is_unsigned, uint64_t *const out)
+{
+    if (s.empty() || !(isdigit(static_cast<unsigned char>(s[0]))
+                       || (!is_unsigned && '-' == s[0]))) {
+        return false;
+    }
+
+    char *end;
+    errno = 0;
+    *out = is_unsigned ? strtoull(s.c_str(), &end, 10)
+                       : static_cast<uint64_t>(strtoll(s.c_str(), &end, 10));
+    return 0 == errno && s.c_str() + s.size() == end;
+}
+
+bool
+parseDouble(const std::string &s, double *const out)
+{
+    if (s.empty() || isspace(static_cast<unsigned char>(s[0]))) {
+        return false;
+    }
+
+    char *end;
+    errno = 0;
+    *out = strtod(s.c_str(), &end);
+    return 0 == errno && s.c_str() + s.size() == end;
+}
+
+// the digits after the point, or -1 if @s is no decimal
+int
+decimalScale(const std::string &s)
+{
+    if (s.empty()
+        || std::string::npos != s.find_first_not_of("-.0123456789")) {
+        return -1;
+    }
+
+    const size_t point = s.find('.');
+    return std::string::npos == point ? 0 : s.size() - point - 1;
+}
+
+std::string
+eofPacket()
+{
+    std::string out;
+    putFixed(&out, 0xfe, 1);
+    putFixed(&out, 0, 2);               // warnings
+    putFixed(&out, SERVER_STATUS_AUTOCOMMIT, 2);
+    return out;
+}
+
+std::string
+quoteString(const std::string &s)
+{
+    std::string out = "'";
+    for (const char c : s) {
+        switch (c) {
+        case '\0':      out += "\\0";   break;
+        case '\n':      out += "\\n";   break;
+        case '\r':      out += "\\r";   break;
+        case '\032':    out += "\\Z";   break;
+        case '\\':      out += "\\\\";  break;
+        case '\'':      out += "\\'";   break;
+        default:        out += c;       break;
+        }
+    }
+    return out + "'";
+}
+
+std::string
+formatInteger(uint64_t v, size_t bytes, bool is_unsigned)
+{
+    if (is_unsigned) {
+        return std::to_string(static_cast<unsigned long long>(v));
+    }
+
+    // sign extend
+    const unsigned int shift = 64 - 8 * bytes;
+    const int64_t sv = static_cast<int64_t>(v << shift) >> shift;
+    return std::to_string(static_cast<long long>(sv));
+}
+
+// DATE, DATETIME and TIMESTAMP come as a length and the fields it covers
+std::string
+formatDateTime(PacketReader *const r)
+{
+    const uint64_t len = r->fixed(1);
+    TEST_Text(0 == len || 4 == len || 7 == len || 11 == len,
+              "bad date in statement packet");
+
+    unsigned int year = 0, month = 0, day = 0, hour = 0, minute = 0,
+                 second = 0;
+    unsigned long usec = 0;
+    if (len >= 4) {
+        year = r->fixed(2);
+        month = r->fixed(1);
+        day = r->fixed(1);
+    }
+    if (len >= 7) {
+        hour = r->fixed(1);
+        minute = r->fixed(1);
+        second = r->fixed(1);
+    }
+    if (len >= 11) {
+        usec = r->fixed(4);
+    }
+
+    char buf[64];
+    if (usec) {
+        snprintf(buf, sizeof(buf), "%04u-%02u-%02u %02u:%02u:%02u.%06lu",
+                 year, month, day, hour, minute, second, usec);
+    } else {
+        snprintf(buf, sizeof(buf), "%04u-%02u-%02u %02u:%02u:%02u",
+                 year, month, day, hour, minute, second);
+    }
+    return quoteString(buf);
+}
+
+std::string
+formatTime(PacketReader *const r)
+{
+    const uint64_t len = r->fixed(1);
+    TEST_Text(0 == len || 8 == len || 12 == len,
+              "bad time in statement packet");
+    if (0 == len) {
+        return "'00:00:00'";
+    }
+
+    const bool negative = r->fixed(1);
+    const unsigned long days = r->fixed(4);
+    const unsigned long hours = days * 24 + r->fixed(1);
+    const unsigned int minute = r->fixed(1);
+    const unsigned int second = r->fixed(1);
+    const unsigned long usec = 12 == len ? r->fixed(4) : 0;
+
+    char buf[64];
+    if (usec) {
+        snprintf(buf, sizeof(buf), "%s%02lu:%02u:%02u.%06lu",
+                 negative ? "-" : "", hours, minute, second, usec);
+    } else {
+        snprintf(buf, sizeof(buf), "%s%02lu:%02u:%02u",
+                 negative ? "-" : "", hours, minute, second);
+    }
+    return quoteString(buf);
+}
+
+std::string
+formatDouble(double d)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.17g", d);
+    return buf;
+}
+
+// the SQL literal of one bound value
+std::string
+paramLiteral(uint16_t type, PacketReader *const r)
+{
+    const bool is_unsigned = type & 0x8000;
+    switch (static_cast<enum_field_types>(type & 0xff)) {
+    case MYSQL_TYPE_NULL:
+        return "NULL";
+    case MYSQL_TYPE_TINY:
+        return formatInteger(r->fixed(1), 1, is_unsigned);
+    case MYSQL_TYPE_SHORT:
+    case MYSQL_TYPE_YEAR:
+        return formatInteger(r->fixed(2), 2, is_unsigned);
+    case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_INT24:
+        return formatInteger(r->fixed(4), 4, is_unsigned);
+    case MYSQL_TYPE_LONGLONG:
+        return formatInteger(r->fixed(8), 8, is_unsigned);
+    case MYSQL_TYPE_FLOAT: {
+        const uint32_t bits = r->fixed(4);
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        return formatDouble(f);
+    }
+    case MYSQL_TYPE_DOUBLE: {
+        const uint64_t bits = r->fixed(8);
+        double d;
+        memcpy(&d, &bits, sizeof(d));
+        return formatDouble(d);
+    }
+    case MYSQL_TYPE_DATE:
+    case MYSQL_TYPE_DATETIME:
+    case MYSQL_TYPE_TIMESTAMP:
+        return formatDateTime(r);
+    case MYSQL_TYPE_TIME:
+        return formatTime(r);
+    case MYSQL_TYPE_DECIMAL:
+    case MYSQL_TYPE_NEWDECIMAL: {
+        const std::string text = r->bytes(r->lenenc());
+        TEST_Text(!text.empty()
+                  && std::string::npos
+                     == text.find_first_not_of("+-.0123456789eE"),
+                  "bad decimal in statement packet");
+        return text;
+    }
+    case MYSQL_TYPE_VARCHAR:
+    case MYSQL_TYPE_VAR_STRING:
+    case MYSQL_TYPE_STRING:
+    case MYSQL_TYPE_ENUM:
+    case MYSQL_TYPE_SET:
+    case MYSQL_TYPE_BIT:
+    case MYSQL_TYPE_TINY_BLOB:
+    case MYSQL_TYPE_MEDIUM_BLOB:
+    case MYSQL_TYPE_LONG_BLOB:
+    case MYSQL_TYPE_BLOB:
+        return quoteString(r->bytes(r->lenenc()));
+    default:
+        FAIL_TextMessageError("unsupported parameter type "
+                              + std::to_string(type & 0xff));
+    }
+}
+
+}
+
+PreparedStatement::PreparedStatement(const std::string &query)
+    : pieces(1)
+{
+    // placeholders in strings, quoted names and comments do not count
+    size_t i = 0;
+    while (i < query.size()) {
+        const char c = query[i];
+        const char next = i + 1 < query.size() ? query[i + 1] : '\0';
+        size_t end = i + 1;
+        if ('\'' == c || '"' == c || '`' == c) {
+            while (end < query.size()) {
+                if ('\\' == query[end] && '`' != c) {
+                    end += 2;
+                } else if (c == query[end++]) {
+                    break;
+                }
+            }
+        } else if ('#' == c || ('-' == c && '-' == next)) {
+            end = query.find('\n', i);
+        } else if ('/' == c && '*' == next) {
+            end = query.find("*/", i + 2);
+            end = std::string::npos == end ? end : end + 2;
+        } else if ('?' == c) {
+            pieces.push_back("");
+            ++i;
+            continue;
+        }
+
+        end = std::min(end, query.size());
+        pieces.back().append(query, i, end - i);
+        i = end;
+    }
+}
+
+std::string
+PreparedStatement::bind(const std::string &packet)
+{
+    PacketReader r(packet);
+    r.fixed(4);                         // statement id
+    r.fixed(1);                         // cursor flags
+    r.fixed(4);                         // iteration count
+
+    const size_t n = paramCount();
+    std::string query = pieces[0];
+    if (0 == n) {
+        return query;
+    }
+
+    const std::string nulls = r.bytes((n + 7) / 8);
+    if (r.fixed(1)) {
+        types.clear();
+        for (size_t i = 0; i < n; ++i) {
+            types.push_back(r.fixed(2));
+        }
+    }
+    TEST_Text(types.size() == n, "statement parameters were never bound");
+
+    // the values of parameters with long data are left out
+    for (size_t i = 0; i < n; ++i) {
+        const auto it = long_data.find(i);
+        if (long_data.end() != it) {
+            query += quoteString(it->second);
+        } else if (nulls[i / 8] & (1 << (i % 8))) {
+            query += "NULL";
+        } else {
+            query += paramLiteral(types[i], &r);
+        }
+        query += pieces[i + 1];
+    }
+    long_data.clear();
+
+    return query;
+}
+
+void
+PreparedStatement::addLongData(const std::string &packet)
+{
+    PacketReader r(packet);
+    r.fixed(4);                         // statement id
+    const uint16_t param = r.fixed(2);
+    TEST_Text(param < paramCount(), "long data for no parameter");
+
+    long_data[param] += r.bytes(packet.size() - 6);
+}
+
+std::string
+PreparedStatement::bindDummies(unsigned int nth) const
+{
+    if (nth > 1 || (nth > 0 && 0 == paramCount())) {
+        return "";
+    }
+
+    // values that differ, so the RewriteCache can tell them apart
+    std::string query = pieces[0];
+    for (size_t i = 0; i < paramCount(); ++i) {
+        const std::string &value = std::to_string(i + 1);
+        query += 0 == nth ? value : quoteString(value);
+        query += pieces[i + 1];
+    }
+
+    return query;
+}
+
+uint32_t
+PreparedStatement::packetStatementId(const std::string &packet)
+{
+    return PacketReader(packet).fixed(4);
+}
+
+std::vector<std::string>
+stmtPrepareOK(uint32_t id, uint16_t params,
+              const std::vector<std::string> &columns)
+{
+    std::string ok;
+    putFixed(&ok, 0x00, 1);
+    putFixed(&ok, id, 4);
+    putFixed(&ok, columns.size(), 2);
+    putFixed(&ok, params, 2);
+    putFixed(&ok, 0, 1);
+    putFixed(&ok, 0, 2);                // warnings
+
+    std::vector<std::string> out(1, ok);
+    if (params > 0) {
+        for (uint16_t i = 0; i < params; ++i) {
+            out.push_back(columnDefinition("?", binary_charset, 0));
+        }
+        out.push_back(eofPacket());
+    }
+    // lengths are not known until there are rows
+    if (columns.size() > 0) {
+        for (const auto &it : columns) {
+            out.push_back(columnDefinition(it, utf8_charset, 0));
+        }
+        out.push_back(eofPacket());
+    }
+
+    return out;
+}
+
+std::vector<std::string>
+binaryResultSet(const std::vector<std::string> &names,
+                const std::vector<uint16_t> &types,
+                const std::vector<std::vector<const std::string *> > &rows)
+{
+    std::vector<enum_field_types> wire;
+    std::vector<bool> is_unsigned;
+    for (size_t i = 0; i < names.size(); ++i) {
+        const uint16_t type = i < types.size() ? types[i]
+                                               : MYSQL_TYPE_VAR_STRING;
+        wire.push_back(resultType(type));
+        is_unsigned.push_back(type & 0x8000);
+    }
+
+    // a column with a value that does not parse goes out as a string
+    std::vector<uint32_t> lengths(names.size(), 0);
+    std::vector<int> scales(names.size(), 0);
+    for (const auto &row : rows) {
+        for (size_t i = 0; i < row.size(); ++i) {
+            if (!row[i]) {
+                continue;
+            }
+
+            lengths[i] = std::max<uint32_t>(lengths[i], row[i]->size());
+            uint64_t v;
+            double d;
+            if ((MYSQL_TYPE_LONGLONG == wire[i]
+                 && !parseInteger(*row[i], is_unsigned[i], &v))
+                || (MYSQL_TYPE_DOUBLE == wire[i]
+                    && !parseDouble(*row[i], &d))
+                || (MYSQL_TYPE_NEWDECIMAL == wire[i]
+                    && decimalScale(*row[i]) < 0)) {
+                wire[i] = MYSQL_TYPE_VAR_STRING;
+            } else if (MYSQL_TYPE_NEWDECIMAL == wire[i]) {
+                scales[i] = std::max(scales[i], decimalScale(*row[i]));
+            }
+        }
+    }
+
+    std::vector<std::string> out;
+    std::string count;
+    putLenenc(&count, names.size());
+    out.push_back(count);
+    for (size_t i = 0; i < names.size(); ++i) {
+        switch (wire[i]) {
+        case MYSQL_TYPE_LONGLONG:
+            out.push_back(columnDefinition(names[i], binary_charset, 20,
+                              wire[i],
+                              NUM_FLAG | BINARY_FLAG
+                              | (is_unsigned[i] ? UNSIGNED_FLAG : 0)));
+            break;
+        case MYSQL_TYPE_DOUBLE:
+            out.push_back(columnDefinition(names[i], binary_charset, 22,
+                                           wire[i], NUM_FLAG | BINARY_FLAG,
+                                           NOT_FIXED_DEC));
+            break;
+        case MYSQL_TYPE_NEWDECIMAL:
+            out.push_back(columnDefinition(names[i], binary_charset,
+                                           lengths[i], wire[i],
+                                           NUM_FLAG | BINARY_FLAG,
+                                           scales[i]));
+            break;
+        default:
+            out.push_back(columnDefinition(names[i], utf8_charset,
+                                           lengths[i]));
+            break;
+        }
+    }
+    out.push_back(eofPacket());
+
+    for (const auto &row : rows) {
+        // the NULL bitmap of a result row starts at bit 2
+        std::string nulls((row.size() + 7 + 2) / 8, '\0');
+        std::string values;
+        for (size_t i = 0; i < row.size(); ++i) {
+            if (!row[i]) {
+                nulls[(i + 2) / 8] |= 1 << ((i + 2) % 8);
+            } else if (MYSQL_TYPE_LONGLONG == wire[i]) {
+                uint64_t v;
+                parseInteger(*row[i], is_unsigned[i], &v);
+                putFixed(&values, v, 8);
+            } else if (MYSQL_TYPE_DOUBLE == wire[i]) {
+                double d;
+                parseDouble(*row[i], &d);
+                uint64_t bits;
+                memcpy(&bits, &d, sizeof(bits));
+                putFixed(&values, bits, 8);
+            } else {
+                putLenencString(&values, *row[i]);
+            }
+        }
+        out.push_back(std::string(1, '\0') + nulls + values);
+    }
+    out.push_back(eofPacket());
+
+    return out;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include <main/rewrite_cache.hh>
+
+/*
+ * A statement of the binary protocol (COM_STMT_PREPARE and friends).
+ *
+ * The proxy keeps the statement text cut at its placeholders; an
+ * execution puts the bound values in as literals and hands the text to
+ * the rewriter.  COM_STMT_PREPARE rewrites the statement once with
+ * made up values, which reports its errors and its columns, and leaves
+ * the statement holding a RewriteCache plan of its own.  The first
+ * execution with values of those types checks the plan, and the later
+ * ones are served from it: only the parameters are encrypted, and
+ * nothing is parsed.
+ * The backend gets each execution as a text query; the encrypted
+ * parameters differ by onion, so there is no one statement to prepare
+ * there.
+ *
+ * The packets built here go to the client as they are; mysql-proxy adds
+ * the headers.
+ */
+class PreparedStatement {
+public:
+    explicit PreparedStatement(const std::string &query);
+
+    size_t paramCount() const {return pieces.size() - 1;}
+
+    // the query that a COM_STMT_EXECUTE @packet, command byte
+    // stripped, asks for; throws on packets we cannot read.  Uses up
+    // the long data.
+    std::string bind(const std::string &packet);
+    // a COM_STMT_SEND_LONG_DATA @packet, appended to the parameter's
+    // long data
+    void addLongData(const std::string &packet);
+    // COM_STMT_RESET
+    void reset() {long_data.clear();}
+    // the query with the @nth set of made up values bound, "" when
+    // there are no more; integers first, then strings
+    std::string bindDummies(unsigned int nth) const;
+
+    // the plan of the latest executions, for Rewriter::rewrite()
+    std::shared_ptr<RewriteCache::Plan> *keptPlan() {return &plan;}
+
+    // the id a COM_STMT_EXECUTE, COM_STMT_SEND_LONG_DATA,
+    // COM_STMT_CLOSE or COM_STMT_RESET @packet is for
+    static uint32_t packetStatementId(const std::string &packet);
+
+private:
+    PreparedStatement(const PreparedStatement &other);
+    PreparedStatement &operator=(const PreparedStatement &rhs);
+
+    // the query is pieces[0], then the first parameter, then
+    // pieces[1] and so on
+    std::vector<std::string> pieces;
+    // as last sent; executions that do not rebind reuse them
+    std::vector<uint16_t> types;
+    // by parameter; these go without a value in COM_STMT_EXECUTE
+    std::map<uint16_t, std::string> long_data;
+    std::shared_ptr<RewriteCache::Plan> plan;
+};
+
+// the reply to COM_STMT_PREPARE, for a statement whose results have
+// the @columns named
+std::vector<std::string>
+stmtPrepareOK(uint32_t id, uint16_t params,
+              const std::vector<std::string> &columns);
+
+// the binary protocol's result set; NULL values are NULL pointers.
+// Integer, floating point and decimal @types, 0x8000 set if unsigned
+// as in COM_STMT_EXECUTE, go out as such when all their values parse;
+// any other column goes out as a string.
+std::vector<std::string>
+binaryResultSet(const std::vector<std::string> &names,
+                const std::vector<uint16_t> &types,
+                const std::vector<std::vector<const std::string *> > &rows);
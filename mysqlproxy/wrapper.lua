@@ -3,6 +3,8 @@ assert(package.loadlib(os.getenv("EDBDIR").."/obj/libexecute.so",
 local proto = assert(require("mysql.proto"))
 
 local g_want_interim    = nil
+-- the results go to a COM_STMT_EXECUTE
+local g_binary          = false
 local skip              = false
 local client            = nil
 --
@@ -138,9 +140,19 @@ function read_query_real(packet)
     end
 
     if string.byte(packet) == proxy.COM_INIT_DB or
-       string.byte(packet) == proxy.COM_QUERY then
-        status, error_msg =
-            CryptDB.rewrite(client, query, proxy.connection.server.thread_id)
+       string.byte(packet) == proxy.COM_QUERY or
+       string.byte(packet) == proxy.COM_STMT_EXECUTE then
+        if string.byte(packet) == proxy.COM_STMT_EXECUTE then
+            g_binary = true
+            status, error_msg =
+                CryptDB.execute(client, query,
+                                proxy.connection.server.thread_id)
+        else
+            g_binary = false
+            status, error_msg =
+                CryptDB.rewrite(client, query,
+                                proxy.connection.server.thread_id)
+        end
 
         if false == status then
             proxy.response.type = proxy.MYSQLD_PACKET_ERR
@@ -149,6 +161,34 @@ function read_query_real(packet)
         end
 
         return next_handler("query", true, client, {}, {}, nil, nil)
+    elseif string.byte(packet) == proxy.COM_STMT_PREPARE then
+        local status, packets =
+            CryptDB.prepare(client, query,
+                            proxy.connection.server.thread_id)
+        if false == status then
+            proxy.response.type = proxy.MYSQLD_PACKET_ERR
+            proxy.response.errmsg = packets
+            return proxy.PROXY_SEND_RESULT
+        end
+
+        proxy.response = { type = proxy.MYSQLD_PACKET_RAW, packets = packets }
+        return proxy.PROXY_SEND_RESULT
+    elseif string.byte(packet) == proxy.COM_STMT_CLOSE then
+        -- no reply; the server ignores the id, which it never gave out
+        CryptDB.closeStatement(client, query)
+    elseif string.byte(packet) == proxy.COM_STMT_SEND_LONG_DATA then
+        -- no reply either
+        CryptDB.longData(client, query)
+    elseif string.byte(packet) == proxy.COM_STMT_RESET then
+        local status, error_msg = CryptDB.resetStatement(client, query)
+        if false == status then
+            proxy.response.type = proxy.MYSQLD_PACKET_ERR
+            proxy.response.errmsg = error_msg
+            return proxy.PROXY_SEND_RESULT
+        end
+
+        proxy.response.type = proxy.MYSQLD_PACKET_OK
+        return proxy.PROXY_SEND_RESULT
     elseif string.byte(packet) == proxy.COM_QUIT then
         -- do nothing
     else
@@ -160,14 +200,18 @@ function read_query_result_real(inj)
     local query = inj.query:sub(2)
     prettyNewQuery(query)
 
+    local resultset = inj.resultset
+
     if skip == true then
         skip = false
+        if true == g_binary and resultset.fields and
+           #resultset.fields > 0 then
+            return binary_results(resultset.fields, resultset.rows)
+        end
         return
     end
     skip = false
 
-    local resultset = inj.resultset
-
     if resultset.query_status == proxy.MYSQLD_PACKET_ERR then
         return next_handler("results", false, client, {}, {}, 0, 0)
     end
@@ -217,6 +261,24 @@ function read_query_result_real(inj)
                         resultset.affected_rows, resultset.insert_id)
 end
 
+-- the result set of a COM_STMT_EXECUTE, in the binary protocol
+function binary_results(fields, rows)
+    local names = {}
+    for i = 1, #fields do
+        names[i] = { name = fields[i].name, type = fields[i].type }
+    end
+    local rrows = {}
+    if rows then
+        for row in rows do
+            table.insert(rrows, row)
+        end
+    end
+
+    proxy.response = { type = proxy.MYSQLD_PACKET_RAW,
+                       packets = CryptDB.binaryResults(names, rrows) }
+    return proxy.PROXY_SEND_RESULT
+end
+
 local q_index = 0
 function get_index()
     i = q_index
@@ -259,6 +321,12 @@ function next_handler(from, status, client, fields, rows, affected_rows,
         local rrows             = param3
 
         if #rfields > 0 then
+            if true == g_binary then
+                proxy.response = { type = proxy.MYSQLD_PACKET_RAW,
+                                   packets = CryptDB.binaryResults(rfields,
+                                                                   rrows) }
+                return proxy.PROXY_SEND_RESULT
+            end
             proxy.response.resultset = { fields = rfields, rows = rrows }
         end
 
@@ -1,5 +1,7 @@
 #include <assert.h>
+#include <atomic>
 #include <sstream>
+#include <vector>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -17,13 +19,128 @@
 
 #include <util/errstream.hh>
 #include <util/rob.hh>
+#include <util/util.hh>
 
 using namespace std;
 
 extern "C" void *create_embedded_thd(int client_flag);
 
+THD *
+createEmbeddedTHD()
+{
+    mysql_mutex_lock(&LOCK_thread_count);
+    THD *const thd = static_cast<THD *>(create_embedded_thd(0));
+    mysql_mutex_unlock(&LOCK_thread_count);
+
+    return thd;
+}
+
+void
+deleteEmbeddedTHD(THD *thd)
+{
+    mysql_mutex_lock(&LOCK_thread_count);
+    --thread_count;
+    // unlinks the THD from the thread list
+    delete thd;
+    mysql_mutex_unlock(&LOCK_thread_count);
+}
+
+static size_t pool_size = 2;
+
+// the THDs of this thread that no parse holds; the threads that parse
+// live as long as the proxy, and so do their THDs
+static __thread std::vector<THD *> *idle_thds = NULL;
+
+static struct {
+    std::atomic<uint64_t> parses;
+    std::atomic<uint64_t> thds_made;
+    std::atomic<uint64_t> blocks;
+    std::atomic<uint64_t> usec;
+} parse_stats;
+
+namespace {
+// counts a parse however it ends
+struct ParseTimer {
+    ~ParseTimer() {
+        parse_stats.parses++;
+        parse_stats.usec += timer.lap();
+    }
+
+    Timer timer;
+};
+}
+
+// the mem_root's prealloc grows to what a parse needed, up to this
+static const size_t max_prealloc = 256 * 1024;
+
+static plugin_ref getInnoDBPlugin();
+
+static THD *
+takeParseTHD()
+{
+    if (idle_thds && !idle_thds->empty()) {
+        THD *const thd = idle_thds->back();
+        idle_thds->pop_back();
+
+        thd->thread_stack = reinterpret_cast<char *>(&thd);
+        if (thd->store_globals()) {
+            deleteEmbeddedTHD(thd);
+        } else {
+            return thd;
+        }
+    }
+
+    THD *const thd = createEmbeddedTHD();
+    if (thd) {
+        parse_stats.thds_made++;
+        // default engine should always be InnoDB
+        thd->variables.table_plugin = getInnoDBPlugin();
+        assert(thd->variables.table_plugin);
+    }
+    return thd;
+}
+
+static size_t
+blockBytes(const USED_MEM *block, size_t *const count)
+{
+    size_t bytes = 0;
+    for (; block; block = block->next) {
+        bytes += block->size;
+        ++*count;
+    }
+    return bytes;
+}
+
+// @thd has ended its statement; false deletes it
+static void
+returnParseTHD(THD *const thd, bool reuse)
+{
+    MEM_ROOT *const root = thd->mem_root;
+    size_t blocks = 0;
+    const size_t bytes =
+        blockBytes(root->free, &blocks) + blockBytes(root->used, &blocks);
+    parse_stats.blocks += blocks - (root->pre_alloc ? 1 : 0);
+
+    if (!idle_thds) {
+        idle_thds = new std::vector<THD *>();
+    }
+    if (!reuse || idle_thds->size() >= pool_size) {
+        deleteEmbeddedTHD(thd);
+        return;
+    }
+
+    const size_t prealloc = root->pre_alloc ? root->pre_alloc->size : 0;
+    free_root(root, MYF(MY_KEEP_PREALLOC));
+    if (bytes > prealloc && bytes <= max_prealloc) {
+        reset_root_defaults(root, thd->variables.query_alloc_block_size,
+                            bytes);
+    }
+
+    idle_thds->push_back(thd);
+}
+
 void
-query_parse::cleanup()
+query_parse::cleanup(bool reuse_thd)
 {
     if (annot) {
         delete annot;
@@ -32,13 +149,38 @@ query_parse::cleanup()
         t->end_statement();
         t->cleanup_after_query();
         close_thread_tables(t);
-        --thread_count;
+        // the tables were opened for metadata only; nothing else may
+        // wait on this THD for them
+        t->mdl_context.release_transactional_locks();
         // t->clear_data_list();
-        delete t;
+        returnParseTHD(t, reuse_thd);
         t = 0;
     }
 }
 
+query_parse::Stats
+query_parse::getStats()
+{
+    Stats out;
+    out.parses = parse_stats.parses;
+    out.thds_made = parse_stats.thds_made;
+    out.blocks = parse_stats.blocks;
+    out.usec = parse_stats.usec;
+    return out;
+}
+
+void
+query_parse::setPoolSize(size_t thds)
+{
+    pool_size = thds;
+}
+
+size_t
+query_parse::poolSize()
+{
+    return pool_size;
+}
+
 query_parse::~query_parse()
 {
     cleanup();
@@ -94,8 +236,8 @@ getInnoDBPlugin()
 
 query_parse::query_parse(const std::string &db, const std::string &q)
 {
-    assert(create_embedded_thd(0));
-    t = current_thd;
+    ParseTimer timer;
+    t = takeParseTHD();
     assert(t != NULL);
 
     //if first word of query is CRYPTDB, we can't use the embedded db
@@ -110,13 +252,10 @@ query_parse::query_parse(const std::string &db, const std::string &q)
 
     try {
         t->set_db(db.data(), db.length());
+        lex_start(t);
         mysql_reset_thd_for_next_command(t);
         t->stmt_arena->state = Query_arena::STMT_INITIALIZED;
 
-        // default engine should always be InnoDB
-        t->variables.table_plugin = getInnoDBPlugin();
-        assert(t->variables.table_plugin);
-
         char buf[q.size() + 1];
         memcpy(buf, q.c_str(), q.size());
         buf[q.size()] = '\0';
@@ -309,7 +448,7 @@ query_parse::query_parse(const std::string &db, const std::string &q)
                       << lex->sql_command;
         }
     } catch (...) {
-        cleanup();
+        cleanup(false);
         throw;
     }
 }
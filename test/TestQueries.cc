@@ -246,6 +246,42 @@ static QueryList HOM = QueryList("HOMAdd",
       Query("SELECT SUM(address) FROM test_HOM"),
       Query("DROP TABLE test_HOM") });
 
+// RunTest creates these tables with HOM_PACK=TRUE, so the SUMs read
+// slots of shared packed HOM columns.
+static QueryList HOMPack = QueryList("HOMPacked",
+    { Query("CREATE TABLE test_HOMPacked (id integer, age integer, salary integer, bonus integer, name text)"),
+      Query("INSERT INTO test_HOMPacked VALUES (1, 10, 0, 5, 'Peter Pan')"),
+      Query("INSERT INTO test_HOMPacked VALUES (2, 16, 1000, 7, 'Anne Shirley')"),
+      Query("INSERT INTO test_HOMPacked (id, age, salary, bonus, name) VALUES (3, 8, 0, 1, 'Lucy')"),
+      Query("INSERT INTO test_HOMPacked (name, bonus, id, salary, age) VALUES ('Edmund', 2, 4, 30, 10)"),
+      Query("INSERT INTO test_HOMPacked (id, age) VALUES (5, 30)"),
+      Query("INSERT INTO test_HOMPacked VALUES (6, NULL, 2000, NULL, 'Elizabeth')"),
+      Query("INSERT INTO test_HOMPacked VALUES (7, 10000, 1, 3, 'Sauron'), (8, 25, 100, 4, 'Eustacia Vye')"),
+      Query("SELECT * FROM test_HOMPacked"),
+      Query("SELECT SUM(age) FROM test_HOMPacked"),
+      Query("SELECT SUM(salary) FROM test_HOMPacked"),
+      Query("SELECT SUM(age), SUM(salary), SUM(bonus) FROM test_HOMPacked"),
+      Query("SELECT SUM(bonus), SUM(age) FROM test_HOMPacked"),
+      Query("SELECT SUM(age), SUM(age) FROM test_HOMPacked"),
+      Query("SELECT SUM(age) AS a, SUM(bonus) AS b FROM test_HOMPacked"),
+      Query("SELECT SUM(age), SUM(salary) FROM test_HOMPacked WHERE id > 2"),
+      Query("SELECT name, SUM(age), SUM(bonus) FROM test_HOMPacked GROUP BY name ORDER BY name"),
+      Query("UPDATE test_HOMPacked SET age = age + 1"),
+      Query("SELECT SUM(age), SUM(salary), SUM(bonus) FROM test_HOMPacked"),
+      Query("UPDATE test_HOMPacked SET salary = 500 WHERE id = 3"),
+      Query("SELECT SUM(age), SUM(salary), SUM(bonus) FROM test_HOMPacked"),
+      Query("SELECT * FROM test_HOMPacked WHERE id = 3"),
+      Query("DELETE FROM test_HOMPacked WHERE id = 7"),
+      Query("SELECT SUM(age), SUM(salary), SUM(bonus) FROM test_HOMPacked"),
+      Query("ALTER TABLE test_HOMPacked ADD COLUMN extra integer"),
+      Query("UPDATE test_HOMPacked SET extra = id"),
+      Query("SELECT SUM(age), SUM(extra), SUM(bonus) FROM test_HOMPacked"),
+      Query("ALTER TABLE test_HOMPacked DROP COLUMN salary"),
+      Query("SELECT SUM(age), SUM(bonus) FROM test_HOMPacked"),
+      Query("INSERT INTO test_HOMPacked VALUES (9, 1, 1, 'Lucy', 9)"),
+      Query("SELECT SUM(age), SUM(bonus), SUM(extra) FROM test_HOMPacked"),
+      Query("DROP TABLE test_HOMPacked") });
+
 static QueryList Delete = QueryList("SingleDelete",
     { Query("CREATE TABLE test_delete (id integer, age integer, salary integer, address text, name text)"),
       Query("INSERT INTO test_delete VALUES (1, 10, 0, 'first star to the right and straight on till morning','Peter Pan')"),
@@ -1293,6 +1329,11 @@ RunTest(const TestConfig &tc) {
     // Pass 28/28
     scores.push_back(CheckQueryList(tc, HOM));
 
+    // Pass ?/?
+    setenv("HOM_PACK", "TRUE", 1);
+    scores.push_back(CheckQueryList(tc, HOMPack));
+    unsetenv("HOM_PACK");
+
     // Pass 17/17
     scores.push_back(CheckQueryList(tc, Insert));
 
@@ -0,0 +1,98 @@
+/*
+ * Counts the heap allocations of a process, for the 'rewrite' test of
+ * test/test.  Counted at malloc() and friends so that the mem_root
+ * blocks of mysql count too; nothing links with it, run
+ *
+ *   LD_PRELOAD=obj/test/libmalloc_count.so obj/test/test rewrite ...
+ *
+ * to have the test report allocations per query.
+ */
+
+#include <atomic>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+
+static std::atomic<uint64_t> heap_allocs(0);
+
+extern "C" {
+void *__libc_malloc(size_t n);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t n);
+void *__libc_memalign(size_t alignment, size_t n);
+void *__libc_valloc(size_t n);
+void *__libc_pvalloc(size_t n);
+
+uint64_t
+cryptdb_heap_allocs()
+{
+    return heap_allocs.load(std::memory_order_relaxed);
+}
+
+void *
+malloc(size_t n)
+{
+    heap_allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(n);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+    heap_allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *p, size_t n)
+{
+    heap_allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(p, n);
+}
+
+void *
+memalign(size_t alignment, size_t n)
+{
+    heap_allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, n);
+}
+
+void *
+aligned_alloc(size_t alignment, size_t n)
+{
+    heap_allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, n);
+}
+
+int
+posix_memalign(void **out, size_t alignment, size_t n)
+{
+    // a power of two, and a multiple of sizeof(void *)
+    if (0 == alignment || 0 != (alignment & (alignment - 1))
+        || 0 != alignment % sizeof(void *)) {
+        return EINVAL;
+    }
+
+    heap_allocs.fetch_add(1, std::memory_order_relaxed);
+    void *const p = __libc_memalign(alignment, n);
+    if (!p) {
+        return ENOMEM;
+    }
+    *out = p;
+    return 0;
+}
+
+void *
+valloc(size_t n)
+{
+    heap_allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_valloc(n);
+}
+
+void *
+pvalloc(size_t n)
+{
+    heap_allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_pvalloc(n);
+}
+}
@@ -13,8 +13,12 @@
 #include <sys/time.h>
 #include <time.h>
 #include <sys/wait.h>
+#include <dlfcn.h>
 
 #include <main/Connect.hh>
+#include <main/dml_handler.hh>
+#include <main/rewrite_cache.hh>
+#include <parser/embedmysql.hh>
 
 #include <util/util.hh>
 #include <util/params.hh>
@@ -3023,6 +3027,825 @@ test_PKCS(const TestConfig &tc, int ac, char **av)
     std::cerr << "msg" << dec << "\n";
 }
 
+struct ConcurrencyWorker {
+    const TestConfig *tc;
+    uint proxy_port;
+    uint id;
+    double ms;
+    uint64_t queries;
+    bool failed;
+};
+
+static void *
+concurrencyWorker(void *arg)
+{
+    ConcurrencyWorker *const w = static_cast<ConcurrencyWorker *>(arg);
+    Connect conn(w->tc->host, w->tc->user, w->tc->pass, w->proxy_port);
+    if (!conn.execute("USE " + w->tc->db + ";")) {
+        w->failed = true;
+        return NULL;
+    }
+
+    // a table of its own, so that schema changes run next to the
+    // other clients' queries
+    const std::string own = "conc_w" + strFromVal((uint32_t)w->id);
+    if (!conn.execute("CREATE TABLE " + own + " (x integer);")) {
+        LOG(warn) << "client " << w->id << " cannot create " << own;
+        w->failed = true;
+        return NULL;
+    }
+
+    // lookups, a range, a sum and an insert: every one goes through the
+    // rewriter, and the results through decryption
+    Timer t;
+    double elapsed = 0;
+    while (elapsed < w->ms) {
+        const std::string k = strFromVal((uint32_t)(w->queries % 100));
+        const std::string row =
+            strFromVal((uint64_t)(w->id + 1) * 1000000 + w->queries);
+        const std::string queries[] = {
+            "SELECT name FROM conc_t WHERE id = " + k + ";",
+            "SELECT id FROM conc_t WHERE age > " + k + ";",
+            "SELECT SUM(age) FROM conc_t;",
+            "INSERT INTO conc_t VALUES (" + row + ", " + k + ", 'w');",
+        };
+        for (const std::string &q : queries) {
+            if (!conn.execute(q)) {
+                LOG(warn) << "client " << w->id << " failed: " << q;
+                w->failed = true;
+                return NULL;
+            }
+            w->queries++;
+        }
+
+        // a client must read its own row, and the row of the lookup,
+        // whatever the other clients run meanwhile
+        std::unique_ptr<DBResult> dbres;
+        if (!conn.execute("SELECT name FROM conc_t WHERE id = " + k + ";",
+                          &dbres)) {
+            w->failed = true;
+            return NULL;
+        }
+        const ResType &res = dbres->unpack();
+        if (!res.ok || res.rows.size() != 1
+            || ItemToString(*res.rows[0][0]) != "n" + k) {
+            LOG(warn) << "client " << w->id << " got a wrong row for " << k;
+            w->failed = true;
+            return NULL;
+        }
+        if (!conn.execute("INSERT INTO " + own + " VALUES (" + k + ");")) {
+            w->failed = true;
+            return NULL;
+        }
+        w->queries += 2;
+        elapsed += t.lap_ms();
+    }
+    w->ms = elapsed;
+
+    if (!conn.execute("DROP TABLE " + own + ";")) {
+        w->failed = true;
+    }
+    return NULL;
+}
+
+/*
+ * Runs the same query mix from 1, 2, 4, ... clients against a running
+ * proxy and reports the throughput of each round; the rewrites of
+ * different clients should overlap, so it ought to grow with the
+ * clients until the CPUs run out.  Each client also checks the rows it
+ * reads back, and each round that no insert went missing.
+ */
+static void
+testConcurrency(const TestConfig &tc, int ac, char **av)
+{
+    if (ac < 2) {
+        std::cerr << "usage: concurrency proxyport [seconds] [maxclients]\n";
+        return;
+    }
+    const uint proxy_port = atoi(av[1]);
+    const double seconds = ac > 2 ? atof(av[2]) : 10;
+    const uint max_clients = ac > 3 ? atoi(av[3]) : 8;
+
+    Connect setup(tc.host, tc.user, tc.pass, proxy_port);
+    assert_s(setup.execute("USE " + tc.db + ";"), "cannot use " + tc.db);
+    setup.execute("DROP TABLE IF EXISTS conc_t;");
+    assert_s(setup.execute("CREATE TABLE conc_t "
+                           "(id integer, age integer, name text);"),
+             "cannot create conc_t");
+    for (uint i = 0; i < 100; ++i) {
+        assert_s(setup.execute("INSERT INTO conc_t VALUES (" +
+                               strFromVal((uint32_t)i) + ", " +
+                               strFromVal((uint32_t)(i % 50)) + ", 'n" +
+                               strFromVal((uint32_t)i) + "');"),
+                 "cannot fill conc_t");
+    }
+
+    double base = 0;
+    uint64_t rows = 100;
+    for (uint n = 1; n <= max_clients; n *= 2) {
+        std::vector<ConcurrencyWorker> workers(n);
+        std::vector<pthread_t> threads(n);
+        for (uint i = 0; i < n; ++i) {
+            workers[i] = {&tc, proxy_port, i, seconds * 1000, 0, false};
+            assert_s(0 == pthread_create(&threads[i], NULL,
+                                         concurrencyWorker, &workers[i]),
+                     "cannot start client");
+        }
+
+        double qps = 0;
+        uint64_t inserts = 0;
+        for (uint i = 0; i < n; ++i) {
+            pthread_join(threads[i], NULL);
+            assert_s(!workers[i].failed, "client query failed");
+            qps += workers[i].queries * 1000.0 / workers[i].ms;
+            inserts += workers[i].queries / 6;
+        }
+
+        // every insert of every client landed, and only once
+        std::unique_ptr<DBResult> dbres;
+        assert_s(setup.execute("SELECT COUNT(*) FROM conc_t;", &dbres),
+                 "cannot count conc_t");
+        const ResType &count = dbres->unpack();
+        assert_s(count.ok && 1 == count.rows.size()
+                 && ItemToString(*count.rows[0][0])
+                    == strFromVal(rows + inserts),
+                 "conc_t lost or duplicated inserts");
+        rows += inserts;
+        if (1 == n) {
+            base = qps;
+        }
+
+        std::cerr << std::setw(3) << n << " clients: "
+                  << std::fixed << std::setprecision(1) << qps
+                  << " queries/s, " << std::setprecision(2) << qps / base
+                  << "x\n";
+    }
+
+    setup.execute("DROP TABLE conc_t;");
+}
+
+static uint64_t
+countMeta(const DBMeta &meta)
+{
+    uint64_t n = 1;
+    meta.applyToChildren([&n] (const DBMeta &child) {
+        n += countMeta(child);
+        return true;
+    });
+    return n;
+}
+
+/*
+ * Startup cost of a large schema.  'create' makes the tables through a
+ * running proxy; once the proxy is stopped, 'load' reads the schema
+ * back from its embedded database (-e) the way a starting proxy does.
+ */
+static void
+testSchemaLoad(const TestConfig &tc, int ac, char **av)
+{
+    if (ac < 2 || (std::string(av[1]) != "create"
+                   && std::string(av[1]) != "load")) {
+        std::cerr << "usage: schemaload create proxyport [tables]\n"
+                  << "       schemaload load [runs]\n";
+        return;
+    }
+
+    if (std::string(av[1]) == "create") {
+        assert_s(ac > 2, "schemaload create needs the proxy port");
+        const uint proxy_port = atoi(av[2]);
+        const uint ntables = ac > 3 ? atoi(av[3]) : 5000;
+
+        Connect conn(tc.host, tc.user, tc.pass, proxy_port);
+        conn.execute("DROP DATABASE IF EXISTS schemaload_db;");
+        assert_s(conn.execute("CREATE DATABASE schemaload_db;")
+                 && conn.execute("USE schemaload_db;"),
+                 "cannot create schemaload_db");
+
+        Timer t;
+        for (uint i = 0; i < ntables; ++i) {
+            assert_s(conn.execute("CREATE TABLE t" +
+                                  strFromVal((uint32_t)i) +
+                                  " (id integer, age integer, name text);"),
+                     "cannot create table");
+        }
+        std::cerr << ntables << " tables created in "
+                  << std::fixed << std::setprecision(1) << t.lap_ms()
+                  << " ms\n";
+        return;
+    }
+
+    const uint runs = ac > 2 ? atoi(av[2]) : 5;
+    ConnectionInfo ci(tc.host, tc.user, tc.pass);
+    SharedProxyState shared_ps(ci, tc.shadowdb_dir, "2392834",
+                               determineSecurityRating());
+    ProxyState ps(shared_ps);
+
+    for (uint i = 0; i < runs; ++i) {
+        Timer t;
+        const std::unique_ptr<SchemaInfo> schema =
+            loadSchemaInfo(ps.getConn(), ps.getEConn());
+        const double ms = t.lap_ms();
+        std::cerr << "run " << i << ": " << countMeta(*schema.get())
+                  << " objects loaded in " << std::fixed
+                  << std::setprecision(1) << ms << " ms\n";
+    }
+}
+
+/*
+ * Latency of a hot point lookup through a running proxy, sent as text
+ * queries and then as executions of one prepared statement.
+ */
+static void
+testPrepared(const TestConfig &tc, int ac, char **av)
+{
+    if (ac < 2) {
+        std::cerr << "usage: prepared proxyport [lookups]\n";
+        return;
+    }
+    const uint proxy_port = atoi(av[1]);
+    const uint lookups = ac > 2 ? atoi(av[2]) : 10000;
+
+    Connect conn(tc.host, tc.user, tc.pass, proxy_port);
+    assert_s(conn.execute("USE " + tc.db + ";"), "cannot use " + tc.db);
+    conn.execute("DROP TABLE IF EXISTS prep_t;");
+    assert_s(conn.execute("CREATE TABLE prep_t (id integer, name text);"),
+             "cannot create prep_t");
+    for (uint i = 0; i < 100; ++i) {
+        assert_s(conn.execute("INSERT INTO prep_t VALUES (" +
+                              strFromVal((uint32_t)i) + ", 'n" +
+                              strFromVal((uint32_t)i) + "');"),
+                 "cannot fill prep_t");
+    }
+
+    Timer t;
+    for (uint i = 0; i < lookups; ++i) {
+        assert_s(conn.execute("SELECT name FROM prep_t WHERE id = " +
+                              strFromVal((uint32_t)(i % 100)) + ";"),
+                 "text lookup failed");
+    }
+    const double text_us = t.lap_ms() * 1000 / lookups;
+
+    MYSQL *const m = mysql_init(NULL);
+    assert_s(mysql_real_connect(m, tc.host.c_str(), tc.user.c_str(),
+                                tc.pass.c_str(), tc.db.c_str(), proxy_port,
+                                NULL, 0),
+             "cannot connect to the proxy");
+    // what can not be rewritten fails at COM_STMT_PREPARE
+    {
+        MYSQL_STMT *const bad = mysql_stmt_init(m);
+        const std::string b = "SELECT name FROM prep_t WHERE nosuch = ?";
+        assert_s(0 != mysql_stmt_prepare(bad, b.c_str(), b.size()),
+                 "statement on a missing column prepared");
+        mysql_stmt_close(bad);
+    }
+
+    // INSERTs, each under a salt of its own, go through a plan too
+    {
+        MYSQL_STMT *const ins = mysql_stmt_init(m);
+        const std::string i = "INSERT INTO prep_t VALUES (?, ?)";
+        assert_s(0 == mysql_stmt_prepare(ins, i.c_str(), i.size())
+                 && 0 == mysql_stmt_field_count(ins),
+                 mysql_stmt_error(ins));
+
+        int32_t id;
+        char name[16];
+        unsigned long name_len;
+        MYSQL_BIND params[2];
+        memset(params, 0, sizeof(params));
+        params[0].buffer_type = MYSQL_TYPE_LONG;
+        params[0].buffer = &id;
+        params[1].buffer_type = MYSQL_TYPE_STRING;
+        params[1].buffer = name;
+        params[1].length = &name_len;
+        assert_s(0 == mysql_stmt_bind_param(ins, params),
+                 mysql_stmt_error(ins));
+        for (id = 100; id < 110; ++id) {
+            name_len = snprintf(name, sizeof(name), "n%d", id);
+            assert_s(0 == mysql_stmt_execute(ins), mysql_stmt_error(ins));
+        }
+        mysql_stmt_close(ins);
+
+        std::unique_ptr<DBResult> dbres;
+        assert_s(conn.execute("SELECT name FROM prep_t WHERE id = 105;",
+                              &dbres),
+                 "lookup of a prepared INSERT failed");
+        const ResType &res = dbres->unpack();
+        assert_s(1 == res.rows.size()
+                 && "n105" == ItemToString(*res.rows[0][0]),
+                 "prepared INSERT stored the wrong row");
+        assert_s(conn.execute("DELETE FROM prep_t WHERE id >= 100;"),
+                 "cannot clean up prep_t");
+    }
+
+    MYSQL_STMT *const stmt = mysql_stmt_init(m);
+    const std::string q = "SELECT name FROM prep_t WHERE id = ?";
+    assert_s(0 == mysql_stmt_prepare(stmt, q.c_str(), q.size()),
+             mysql_stmt_error(stmt));
+    {
+        MYSQL_RES *const meta = mysql_stmt_result_metadata(stmt);
+        assert_s(meta && 1 == mysql_num_fields(meta)
+                 && std::string("name") == mysql_fetch_field(meta)->name,
+                 "prepared statement without its columns");
+        mysql_free_result(meta);
+    }
+
+    int32_t id;
+    MYSQL_BIND param;
+    memset(&param, 0, sizeof(param));
+    param.buffer_type = MYSQL_TYPE_LONG;
+    param.buffer = &id;
+    assert_s(0 == mysql_stmt_bind_param(stmt, &param),
+             mysql_stmt_error(stmt));
+
+    char name[64];
+    unsigned long name_len;
+    my_bool is_null;
+    MYSQL_BIND result;
+    memset(&result, 0, sizeof(result));
+    result.buffer_type = MYSQL_TYPE_STRING;
+    result.buffer = name;
+    result.buffer_length = sizeof(name);
+    result.length = &name_len;
+    result.is_null = &is_null;
+
+    t.lap();
+    for (uint i = 0; i < lookups; ++i) {
+        id = i % 100;
+        assert_s(0 == mysql_stmt_execute(stmt), mysql_stmt_error(stmt));
+        assert_s(0 == mysql_stmt_bind_result(stmt, &result),
+                 mysql_stmt_error(stmt));
+        assert_s(0 == mysql_stmt_fetch(stmt)
+                 && "n" + strFromVal((uint32_t)id)
+                    == std::string(name, name_len),
+                 "prepared lookup returned the wrong row");
+        assert_s(MYSQL_NO_DATA == mysql_stmt_fetch(stmt),
+                 "prepared lookup returned more than one row");
+        mysql_stmt_free_result(stmt);
+    }
+    const double prepared_us = t.lap_ms() * 1000 / lookups;
+
+    mysql_stmt_close(stmt);
+    mysql_close(m);
+    conn.execute("DROP TABLE prep_t;");
+
+    std::cerr << lookups << " lookups: " << std::fixed
+              << std::setprecision(1) << text_us << " us as text, "
+              << prepared_us << " us prepared, "
+              << std::setprecision(2) << text_us / prepared_us << "x\n";
+}
+
+/*
+ * Parse time of the TPC-C statements, on the embedded database (-e),
+ * with a THD made for every parse and with the THDs kept per thread.
+ */
+static void
+testParse(const TestConfig &tc, int ac, char **av)
+{
+    const uint runs = ac > 1 ? atoi(av[1]) : 10000;
+
+    ConnectionInfo ci(tc.host, tc.user, tc.pass);
+    SharedProxyState shared_ps(ci, tc.shadowdb_dir, "2392834",
+                               determineSecurityRating());
+    ProxyState ps(shared_ps);
+    const std::unique_ptr<Connect> &e_conn = ps.getEConn();
+    e_conn->execute("DROP DATABASE IF EXISTS parse_db;");
+    assert_s(e_conn->execute("CREATE DATABASE parse_db;")
+             && e_conn->execute("CREATE TABLE parse_db.stock"
+                                " (s_i_id integer, s_w_id integer,"
+                                "  s_quantity integer, s_data text);")
+             && e_conn->execute("CREATE TABLE parse_db.orders"
+                                " (o_id integer, o_d_id integer,"
+                                "  o_w_id integer, o_c_id integer,"
+                                "  o_ol_cnt integer);"),
+             "cannot create parse_db");
+
+    const std::string queries[] = {
+        "SELECT s_quantity, s_data FROM stock"
+        " WHERE s_i_id = 1234 AND s_w_id = 1",
+        "UPDATE stock SET s_quantity = 42"
+        " WHERE s_i_id = 1234 AND s_w_id = 1",
+        "INSERT INTO orders VALUES (3001, 1, 1, 17, 5)",
+        "SELECT COUNT(DISTINCT s_i_id) FROM stock"
+        " WHERE s_w_id = 1 AND s_quantity < 15",
+        "DELETE FROM orders WHERE o_id = 3001 AND o_w_id = 1",
+    };
+
+    const size_t pool = query_parse::poolSize();
+    for (const size_t size : {(size_t)0, std::max<size_t>(pool, 1)}) {
+        query_parse::setPoolSize(size);
+        const query_parse::Stats before = query_parse::getStats();
+        for (uint i = 0; i < runs; ++i) {
+            for (const std::string &q : queries) {
+                query_parse p("parse_db", q);
+            }
+        }
+        const query_parse::Stats after = query_parse::getStats();
+
+        const double n = after.parses - before.parses;
+        std::cerr << (0 == size ? "THD per parse: " : "THDs reused:   ")
+                  << std::fixed << std::setprecision(1)
+                  << (after.usec - before.usec) / n << " us, "
+                  << std::setprecision(3)
+                  << (after.thds_made - before.thds_made) / n
+                  << " THDs and "
+                  << (after.blocks - before.blocks) / n
+                  << " mem_root blocks per parse\n";
+    }
+    query_parse::setPoolSize(pool);
+
+    e_conn->execute("DROP DATABASE parse_db;");
+}
+
+// the heap allocations of the process so far, if test/malloc_count.cc
+// was preloaded to count them
+static bool
+heapAllocs(uint64_t *const out)
+{
+    typedef uint64_t (*Count)();
+    static const Count count =
+        reinterpret_cast<Count>(dlsym(RTLD_DEFAULT, "cryptdb_heap_allocs"));
+    if (!count) {
+        return false;
+    }
+
+    *out = count();
+    return true;
+}
+
+/*
+ * Rewrite latency and heap allocations per query of the TPC-C
+ * statements, with the rewrite cache off so that every query goes
+ * through the parser and the rewrite passes.  'create' makes the tables
+ * through a running proxy and lets it adjust the onions; once the proxy
+ * is stopped, 'run' rewrites on its embedded database (-e).  The
+ * allocations are only counted with libmalloc_count.so preloaded.
+ */
+static void
+testRewrite(const TestConfig &tc, int ac, char **av)
+{
+    if (ac < 2 || (std::string(av[1]) != "create"
+                   && std::string(av[1]) != "run")) {
+        std::cerr << "usage: rewrite create proxyport\n"
+                  << "       rewrite run [runs]\n";
+        return;
+    }
+
+    // %1 is replaced by a literal that changes with every run
+    const std::string queries[] = {
+        "SELECT s_quantity, s_data FROM stock"
+        " WHERE s_i_id = %1 AND s_w_id = 1",
+        "UPDATE stock SET s_quantity = %1"
+        " WHERE s_i_id = 1234 AND s_w_id = 1",
+        "INSERT INTO orders VALUES (%1, 1, 1, 17, 5)",
+        "SELECT COUNT(DISTINCT s_i_id) FROM stock"
+        " WHERE s_w_id = 1 AND s_quantity < %1",
+        "DELETE FROM orders WHERE o_id = %1 AND o_w_id = 1",
+    };
+    const auto bind = [](std::string q, uint32_t v) {
+        return q.replace(q.find("%1"), 2, strFromVal(v));
+    };
+
+    if (std::string(av[1]) == "create") {
+        assert_s(ac > 2, "rewrite create needs the proxy port");
+        Connect conn(tc.host, tc.user, tc.pass, atoi(av[2]));
+        conn.execute("DROP DATABASE IF EXISTS rewrite_db;");
+        assert_s(conn.execute("CREATE DATABASE rewrite_db;")
+                 && conn.execute("USE rewrite_db;")
+                 && conn.execute("CREATE TABLE stock"
+                                 " (s_i_id integer, s_w_id integer,"
+                                 "  s_quantity integer, s_data text);")
+                 && conn.execute("CREATE TABLE orders"
+                                 " (o_id integer, o_d_id integer,"
+                                 "  o_w_id integer, o_c_id integer,"
+                                 "  o_ol_cnt integer);"),
+                 "cannot create rewrite_db");
+        for (const std::string &q : queries) {
+            assert_s(conn.execute(bind(q, 15)), "cannot run " + q);
+        }
+        return;
+    }
+
+    const uint runs = ac > 2 ? atoi(av[2]) : 2000;
+    ConnectionInfo ci(tc.host, tc.user, tc.pass);
+    SharedProxyState shared_ps(ci, tc.shadowdb_dir, "2392834",
+                               determineSecurityRating());
+    ProxyState ps(shared_ps);
+    ps.safeCreateEmbeddedTHD();
+    const std::shared_ptr<const SchemaInfo> schema = ps.getSchemaInfo();
+
+    const size_t capacity = RewriteCache::capacity();
+    RewriteCache::setCapacity(0);
+
+    std::vector<uint64_t> usecs;
+    uint64_t allocs = 0;
+    uint64_t before = 0, after = 0;
+    const bool counted = heapAllocs(&before);
+    for (uint i = 0; i < runs; ++i) {
+        for (const std::string &q : queries) {
+            const std::string query = bind(q, 1000 + i);
+            Timer t;
+            heapAllocs(&before);
+            try {
+                const QueryRewrite qr =
+                    Rewriter::rewrite(query, *schema.get(), "rewrite_db",
+                                      ps);
+            } catch (const AbstractException &e) {
+                std::cerr << "cannot rewrite " << query << ": "
+                          << e.to_string() << std::endl;
+                RewriteCache::setCapacity(capacity);
+                return;
+            }
+            heapAllocs(&after);
+            allocs += after - before;
+            usecs.push_back(t.lap());
+        }
+    }
+    RewriteCache::setCapacity(capacity);
+
+    std::sort(usecs.begin(), usecs.end());
+    uint64_t total = 0;
+    for (const uint64_t u : usecs) {
+        total += u;
+    }
+    const double n = usecs.size();
+    std::cerr << usecs.size() << " rewrites: " << std::fixed
+              << std::setprecision(1) << total / n << " us mean, "
+              << usecs[usecs.size() / 2] << " us p50, "
+              << usecs[usecs.size() * 99 / 100] << " us p99";
+    if (counted) {
+        std::cerr << ", " << allocs / n << " heap allocations per query";
+    } else {
+        std::cerr << "; preload libmalloc_count.so to count allocations";
+    }
+    std::cerr << std::endl;
+}
+
+static std::string
+shapeOf(const std::string &query, const std::string &db = "cache_db")
+{
+    const RewriteCache::Shape shape(query, db);
+    return shape.cacheable() ? shape.getKey() : "";
+}
+
+static void
+testShapes()
+{
+    typedef RewriteCache::Shape Shape;
+
+    // literals are taken out, whatever their values
+    const std::string key = shapeOf("SELECT a FROM t WHERE b = 5 AND c = 'x'");
+    assert_s(!key.empty(), "plain query is not cacheable");
+    assert_s(key == shapeOf("SELECT a FROM t WHERE b = 17 AND c = 'yz'"),
+             "other literals give another shape");
+    assert_s(key != shapeOf("SELECT a FROM t WHERE b = 5 OR c = 'x'"),
+             "another query gives the same shape");
+    assert_s(key != shapeOf("SELECT a FROM t WHERE b = 5 AND c = 'x'", "db2"),
+             "the default database is not part of the shape");
+    assert_s(shapeOf("SELECT a FROM t WHERE b = 5 AND c = 'x'")
+             != shapeOf("SELECT a FROM t WHERE b = 5 AND c = 5"),
+             "string and number literals give the same shape");
+
+    // quotes and escapes
+    {
+        const Shape shape("SELECT a FROM t WHERE c = 'it''s' AND d = \"a\\nb\""
+                          " AND e = 'x\\'y' AND f = 'p\\%'", "cache_db");
+        assert_s(shape.cacheable(), "escaped strings are not cacheable");
+        const auto &l = shape.getLiterals();
+        assert_s(4 == l.size(), "wrong number of string literals");
+        assert_s("'it''s'" == l[0].text && "it's" == l[0].value,
+                 "doubled quote");
+        assert_s("a\nb" == l[1].value, "double quoted escape");
+        assert_s("x'y" == l[2].value, "escaped quote");
+        assert_s("p\\%" == l[3].value, "LIKE escape must stay");
+    }
+    assert_s(shapeOf("SELECT a FROM t WHERE c = 'open").empty(),
+             "unterminated string");
+    assert_s(shapeOf("SELECT a FROM t WHERE c = X'1f'").empty()
+             && shapeOf("SELECT a FROM t WHERE c = _utf8'x'").empty()
+             && shapeOf("SELECT a FROM t WHERE c = N'x'").empty(),
+             "introduced strings are not plain literals");
+
+    // backticks quote names, not literals
+    {
+        const Shape shape("SELECT `a'5` FROM `t` WHERE b = 5", "cache_db");
+        assert_s(shape.cacheable() && 1 == shape.getLiterals().size(),
+                 "quoted name taken for a literal");
+        assert_s(std::string::npos != shape.getKey().find("`a'5`"),
+                 "quoted name left out of the shape");
+    }
+    assert_s(shapeOf("SELECT `a FROM t").empty(), "unterminated name");
+
+    // comments and placeholders
+    assert_s(shapeOf("SELECT a FROM t -- 5").empty()
+             && shapeOf("SELECT a FROM t # 5").empty()
+             && shapeOf("SELECT /* 5 */ a FROM t").empty()
+             && shapeOf("SELECT a FROM t WHERE b = ?").empty(),
+             "comments and placeholders are not cacheable");
+
+    // numbers
+    {
+        const Shape shape("SELECT a FROM t WHERE b = -3 AND c = 1.50"
+                          " AND d = 12.", "cache_db");
+        assert_s(shape.cacheable(), "numbers are not cacheable");
+        const auto &l = shape.getLiterals();
+        assert_s(3 == l.size()
+                 && Shape::Kind::INT == l[0].kind && "3" == l[0].text
+                 && Shape::Kind::DECIMAL == l[1].kind && "1.50" == l[1].text
+                 && Shape::Kind::DECIMAL == l[2].kind && "12." == l[2].text,
+                 "wrong number literals");
+    }
+    assert_s(!shapeOf("SELECT a1, b_2 FROM t2").empty()
+             && shapeOf("SELECT a1, b_2 FROM t2")
+                != shapeOf("SELECT a1, b_3 FROM t2"),
+             "digits in names taken for literals");
+    assert_s(shapeOf("SELECT a FROM t WHERE b = 1e5").empty()
+             && shapeOf("SELECT a FROM t WHERE b = 0x1f").empty()
+             && shapeOf("SELECT a FROM t WHERE b = .5").empty()
+             && shapeOf("SELECT a FROM t WHERE b = 1.2.3").empty()
+             && shapeOf("SELECT a FROM t WHERE b = 1234567890123456789")
+                .empty(),
+             "numbers the parser reads otherwise are cacheable");
+    assert_s(!shapeOf("SELECT a FROM t WHERE b = 123456789012345678").empty(),
+             "18 digits are not cacheable");
+}
+
+// what the rewrite of @query gives, as if it encrypted @constants
+static void
+learnRewrite(const RewriteCache &cache, const SchemaInfo &schema,
+             const std::string &query, const std::string &rewritten,
+             const std::vector<std::pair<Item *, Item *> > &constants,
+             uint64_t IV = 0)
+{
+    const std::unique_ptr<AES_KEY> no_key;
+    Analysis a("cache_db", schema, no_key, SECURITY_RATING::BEST_EFFORT);
+    for (const auto &it : constants) {
+        a.constants.push_back(
+            Analysis::Constant({it.first, it.second, {}, IV}));
+    }
+    const QueryRewrite qr(true, a.rmeta, KillZone(),
+                          new DMLQueryExecutor(rewritten, a.rmeta));
+
+    const RewriteCache::Shape shape(query, "cache_db");
+    assert_s(NULL == cache.lookup(shape, schema),
+             "hit before the plan was checked: " + query);
+    cache.learn(shape, schema, a, qr);
+}
+
+// the query a hit rewrites @query to, "" on a miss
+static std::string
+cachedRewrite(const RewriteCache &cache, const SchemaInfo &schema,
+              const std::string &query)
+{
+    const std::unique_ptr<QueryRewrite>
+        qr(cache.lookup(RewriteCache::Shape(query, "cache_db"), schema));
+    return qr ? *qr->executor->cacheableQuery() : "";
+}
+
+/*
+ * Shape::normalize() on its own, then plans learned from rewrites made
+ * up here: their splicing, their promotion from PENDING, their end
+ * when the schema changes, and the eviction and aging of shapes.  Needs
+ * the embedded database (-e) for THDs.
+ */
+static void
+testRewriteCache(const TestConfig &tc, int ac, char **av)
+{
+    const size_t capacity = RewriteCache::capacity();
+    RewriteCache::setCapacity(16);
+
+    testShapes();
+
+    const std::unique_ptr<Connect>
+        e_conn(Connect::getEmbedded(tc.shadowdb_dir));
+    assert_s(createEmbeddedTHD(), "no THD");
+
+    const std::unique_ptr<SchemaInfo> schema(new SchemaInfo());
+    const RewriteCache cache;
+
+    // a plan is only used once a rewrite with other literals agrees
+    const std::string q = "SELECT a FROM t WHERE b = 5 AND c = 1.50";
+    learnRewrite(cache, *schema, q, q, {});
+    assert_s(1 == cache.getStats().entries, "no plan made");
+    learnRewrite(cache, *schema, q, q, {});
+    assert_s(cachedRewrite(cache, *schema, q).empty(),
+             "the same literals made the plan ACTIVE");
+    learnRewrite(cache, *schema, "SELECT a FROM t WHERE b = 6 AND c = 2.25",
+                 "SELECT a FROM t WHERE b = 6 AND c = 2.25", {});
+    assert_s("SELECT a FROM t WHERE b = 70 AND c = 0.125"
+             == cachedRewrite(cache, *schema,
+                              "SELECT a FROM t WHERE b = 70 AND c = 0.125"),
+             "ACTIVE plan spliced wrong");
+
+    // literals spliced where the rewrite put them, repeats included
+    const std::string r = "SELECT a FROM t WHERE b = 9 AND c = 8";
+    const std::string rr =
+        "SELECT x FROM u WHERE y = 8 AND z = 9 OR w = 8";
+    learnRewrite(cache, *schema, r, rr, {});
+    learnRewrite(cache, *schema, "SELECT a FROM t WHERE b = 3 AND c = 4",
+                 "SELECT x FROM u WHERE y = 4 AND z = 3 OR w = 4", {});
+    assert_s("SELECT x FROM u WHERE y = 11 AND z = 10 OR w = 11"
+             == cachedRewrite(cache, *schema,
+                              "SELECT a FROM t WHERE b = 10 AND c = 11"),
+             "moved and repeated literals spliced wrong");
+
+    // equal literals can not be told apart
+    const size_t entries = cache.getStats().entries;
+    learnRewrite(cache, *schema, "SELECT a FROM t WHERE b = 1 OR c = 1",
+                 "SELECT a FROM t WHERE b = 1 OR c = 1", {});
+    assert_s(entries == cache.getStats().entries,
+             "plan made of equal literals");
+
+    // a plan that does not give what the rewrite gave is dropped: here
+    // the rewrite "encrypts" the literal in a way the plan can't repeat
+    const std::string u = "SELECT a FROM t WHERE b = 21";
+    learnRewrite(cache, *schema, u, "SELECT a FROM t WHERE b = 1021",
+                 {{new Item_int(21), new Item_int(1021)}});
+    learnRewrite(cache, *schema, "SELECT a FROM t WHERE b = 22",
+                 "SELECT a FROM t WHERE b = 1022",
+                 {{new Item_int(22), new Item_int(1022)}});
+    const uint64_t uncacheable = cache.getStats().uncacheable;
+    assert_s(cachedRewrite(cache, *schema, "SELECT a FROM t WHERE b = 23")
+                 .empty()
+             && uncacheable + 1 == cache.getStats().uncacheable,
+             "disagreeing plan not UNCACHEABLE");
+
+    // a hit makes up a salt of its own, so the rewrite must carry the
+    // salt where the plan can put the new one
+    learnRewrite(cache, *schema, "SELECT a FROM t WHERE e = 31",
+                 "SELECT a FROM t WHERE e = 31",
+                 {{new Item_int(31), new Item_int(31)}}, 77);
+    learnRewrite(cache, *schema, "SELECT a FROM t WHERE e = 32",
+                 "SELECT a FROM t WHERE e = 32",
+                 {{new Item_int(32), new Item_int(32)}}, 78);
+    assert_s(cachedRewrite(cache, *schema, "SELECT a FROM t WHERE e = 33")
+                 .empty(),
+             "plan cached without the salt it encrypted under");
+
+    learnRewrite(cache, *schema, "INSERT INTO t VALUES (41)",
+                 "INSERT INTO t VALUES (41, 77)",
+                 {{new Item_int(41), new Item_int(41)}}, 77);
+    learnRewrite(cache, *schema, "INSERT INTO t VALUES (42)",
+                 "INSERT INTO t VALUES (42, 78)",
+                 {{new Item_int(42), new Item_int(42)}}, 78);
+    {
+        const std::string prefix = "INSERT INTO t VALUES (43, ";
+        const std::string &first =
+            cachedRewrite(cache, *schema, "INSERT INTO t VALUES (43)");
+        const std::string &second =
+            cachedRewrite(cache, *schema, "INSERT INTO t VALUES (43)");
+        // a new salt each time, where the old one went
+        assert_s(0 == first.compare(0, prefix.size(), prefix)
+                 && first.size() > prefix.size() + 1
+                 && first.size() - 1
+                    == first.find_first_not_of("0123456789",
+                                               prefix.size())
+                 && ')' == first.back()
+                 && first != second,
+                 "salted plan spliced wrong: " + first);
+    }
+
+    // a newer schema drops the plans; an older one is not cached for
+    assert_s(!cachedRewrite(cache, *schema, q).empty(), "plan lost");
+    const std::unique_ptr<SchemaInfo> newer(new SchemaInfo());
+    assert_s(cachedRewrite(cache, *newer, q).empty()
+             && 0 == cache.getStats().entries,
+             "plans kept across a schema change");
+    learnRewrite(cache, *schema, q, q, {});
+    assert_s(0 == cache.getStats().entries, "plan learned for an old schema");
+
+    // a full cache drops the shape used least recently
+    RewriteCache::setCapacity(2);
+    learnRewrite(cache, *newer, q, q, {});
+    learnRewrite(cache, *newer, "SELECT a FROM t WHERE b = 6 AND c = 2.25",
+                 "SELECT a FROM t WHERE b = 6 AND c = 2.25", {});
+    learnRewrite(cache, *newer, r, r, {});
+    assert_s(!cachedRewrite(cache, *newer, q).empty(), "plan lost");
+    learnRewrite(cache, *newer, u, u, {});
+    assert_s(2 == cache.getStats().entries
+             && 1 == cache.getStats().evicted
+             && !cachedRewrite(cache, *newer, q).empty(),
+             "recently used plan evicted");
+
+    // shapes without a verified plan age out
+    learnRewrite(cache, *newer, u, "SELECT a FROM t WHERE b = 1021",
+                 {{new Item_int(21), new Item_int(1021)}});
+    learnRewrite(cache, *newer, "SELECT a FROM t WHERE b = 22",
+                 "SELECT a FROM t WHERE b = 1022",
+                 {{new Item_int(22), new Item_int(1022)}});
+    for (uint i = 0; i < 8; ++i) {
+        assert_s(!cachedRewrite(cache, *newer, q).empty(), "plan lost");
+    }
+    const uint64_t still_uncacheable = cache.getStats().uncacheable;
+    assert_s(cachedRewrite(cache, *newer, "SELECT a FROM t WHERE b = 23")
+                 .empty()
+             && still_uncacheable == cache.getStats().uncacheable
+             && 1 == cache.getStats().expired,
+             "UNCACHEABLE plan kept past its age");
+
+    RewriteCache::setCapacity(capacity);
+    std::cerr << "rewritecache: ok\n";
+}
+
 static void help(const TestConfig &tc, int ac, char **av);
 
 static struct {
@@ -3044,6 +3867,12 @@ static struct {
     { "test_enc_tables","",                             &testEncTables },
     { "trace",          "trace eval",                   &testTrace },
     { "bench",          "TPC-C benchmark eval",         &testBench },
+    { "concurrency",    "proxy throughput per client thread", &testConcurrency },
+    { "schemaload",     "schema load time of many tables", &testSchemaLoad },
+    { "prepared",       "point lookups, text vs prepared", &testPrepared },
+    { "parse",          "parse time of the TPC-C statements", &testParse },
+    { "rewrite",        "rewrite latency and allocations per query", &testRewrite },
+    { "rewritecache",   "query shapes and rewrite plans", &testRewriteCache },
     //{ "utils",          "",                             &testUtils },
         { "train",          "",                             &testTrain },
     
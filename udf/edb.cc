@@ -8,11 +8,13 @@
 #define DEBUG 1
 
 #include <memory>
+#include <gmp.h>
 
 #include <crypto/BasicCrypto.hh>
 #include <crypto/blowfish.hh>
 #include <crypto/SWPSearch.hh>
 #include <crypto/paillier.hh>
+#include <crypto/mont.hh>
 #include <util/params.hh>
 #include <util/util.hh>
 #include <util/version.hh>
@@ -30,6 +32,7 @@ typedef long long longlong;
 my_bool   cryptdb_decrypt_int_sem_init(UDF_INIT *const initid,
                                        UDF_ARGS *const args,
                                        char *const message);
+void      cryptdb_decrypt_int_sem_deinit(UDF_INIT *const initid);
 ulonglong cryptdb_decrypt_int_sem(UDF_INIT *const initid,
                                   UDF_ARGS *const args,
                                   char *const is_null, char *const error);
@@ -37,6 +40,7 @@ ulonglong cryptdb_decrypt_int_sem(UDF_INIT *const initid,
 my_bool   cryptdb_decrypt_int_det_init(UDF_INIT *const initid,
                                        UDF_ARGS *const args,
                                        char *const message);
+void      cryptdb_decrypt_int_det_deinit(UDF_INIT *const initid);
 ulonglong cryptdb_decrypt_int_det(UDF_INIT *const initid, UDF_ARGS *const args,
                                   char *const is_null, char *const error);
 
@@ -81,7 +85,6 @@ char *    cryptdb_func_add_set(UDF_INIT *const initid, UDF_ARGS *const args,
 
 my_bool   cryptdb_version_init(UDF_INIT *const initid, UDF_ARGS *const args,
                                char *const message);
-void      cryptdb_version_deinit(UDF_INIT *const initid);
 char *    cryptdb_version(UDF_INIT *const initid, UDF_ARGS *const args,
                           char *const result, unsigned long *const length,
                           char *const is_null, char *const error);
@@ -96,50 +99,18 @@ log(const std::string &s)
 }
 
 
-static std::string
+static size_t
 decrypt_SEM(const unsigned char *const eValueBytes, uint64_t eValueLen,
-            AES_KEY *const aesKey, uint64_t salt)
+            const AES &aes, uint64_t salt,
+            unsigned char *const out)
 {
-    std::string c(reinterpret_cast<const char *>(eValueBytes),
-                  static_cast<unsigned int>(eValueLen));
-    return decrypt_AES_CBC(c, aesKey, BytesFromInt(salt, SALT_LEN_BYTES),
-                           true);
-}
-
-
-static std::unique_ptr<std::list<std::string>>
-split(const std::string &s, unsigned int plen)
-{
-    const unsigned int len = s.length();
-    if (len % plen != 0) {
-        thrower() << "split receives invalid input";
+    // the IV is BytesFromInt(salt, SALT_LEN_BYTES), zero padded
+    unsigned char iv[AES_BLOCK_BYTES] = { 0 };
+    for (unsigned int i = 0; i < SALT_LEN_BYTES; i++) {
+        iv[SALT_LEN_BYTES-i-1] = static_cast<unsigned char>(salt);
+        salt >>= 8;
     }
-
-    const unsigned int num = len / plen;
-    std::unique_ptr<std::list<std::string>>
-        res(new std::list<std::string>());
-
-    for (unsigned int i = 0; i < num; i++) {
-        res.get()->push_back(s.substr(i*plen, plen));
-    }
-
-    return res;
-}
-
-
-static bool
-searchExists(const Token &token, const std::string &overall_ciph)
-{
-    const std::unique_ptr<std::list<std::string>>
-        l(split(overall_ciph, SWPCiphSize));
-    return SWP::searchExists(token, *l.get());
-}
-
-
-static bool
-search(const Token &token, const std::string &overall_ciph)
-{
-   return searchExists(token, overall_ciph);
+    return decrypt_AES_CBC(eValueBytes, eValueLen, aes, iv, true, out);
 }
 
 
@@ -156,6 +127,105 @@ getba(UDF_ARGS *const args, int i, uint64_t &len)
     return args->args[i];
 }
 
+static AES *
+expand_key(const std::string &key, AES *)
+{
+    if (key.size() != AES_KEY_BYTES)
+        throw CryptoError("AES key is the wrong size!");
+    return new AES(key);
+}
+
+static blowfish *
+expand_key(const std::string &key, blowfish *)
+{
+    return new blowfish(key);
+}
+
+/*
+ * Expanded key of a decryption UDF.  A constant key argument (MySQL
+ * passes constants to _init already) is expanded once for the whole
+ * statement; otherwise the schedule is rebuilt only when a row brings
+ * a key different from the previous row's.
+ */
+template<class K>
+struct key_cache {
+    key_cache() : fixed(false) {}
+
+    void init(UDF_ARGS *const args, int i) {
+        if (NULL == args->args[i])
+            return;
+
+        try {
+            get(args, i);
+            fixed = true;
+        } catch (const CryptoError &) {
+            // leave it to the rows to report the bad key
+        }
+    }
+
+    const K *get(UDF_ARGS *const args, int i) {
+        if (fixed)
+            return k.get();
+
+        // a NULL key is an empty one, as it always was
+        const char *const bytes = args->args[i] ? args->args[i] : "";
+        const unsigned long len = args->args[i] ? args->lengths[i] : 0;
+        if (!k || key.size() != len || memcmp(key.data(), bytes, len)) {
+            const std::string nkey(bytes, len);
+            k.reset(expand_key(nkey, static_cast<K *>(NULL)));
+            key = nkey;
+        }
+        return k.get();
+    }
+
+ private:
+    std::string key;                /* bytes k was expanded from */
+    std::unique_ptr<K> k;
+    bool fixed;
+};
+
+struct decrypt_int_state {
+    key_cache<blowfish> bf;
+};
+
+/*
+ * Where a string UDF puts its result: the buffer the server passes in
+ * when the value fits, else a buffer owned by the UDF that only ever
+ * grows, so a statement allocates at most a few times.
+ */
+static const unsigned long mysql_result_bytes = 255;
+
+struct result_buf {
+    result_buf() : buf(NULL), cap(0) {}
+    ~result_buf() { free(buf); }
+
+    char *get(char *const result, unsigned long len) {
+        if (len <= mysql_result_bytes)
+            return result;
+
+        if (len > cap) {
+            char *const nbuf = static_cast<char *>(realloc(buf, len));
+            if (NULL == nbuf)
+                throw CryptoError("out of memory for UDF result");
+            buf = nbuf;
+            cap = len;
+        }
+        return buf;
+    }
+
+ private:
+    result_buf(const result_buf &other);
+    result_buf &operator=(const result_buf &rhs);
+
+    char *buf;
+    unsigned long cap;
+};
+
+struct decrypt_text_state {
+    key_cache<AES> aes;
+    result_buf res;
+};
+
 my_bool
 cryptdb_decrypt_int_sem_init(UDF_INIT *const initid, UDF_ARGS *const args,
                              char *const message)
@@ -169,10 +239,19 @@ cryptdb_decrypt_int_sem_init(UDF_INIT *const initid, UDF_ARGS *const args,
         return 1;
     }
 
+    decrypt_int_state *const st = new decrypt_int_state();
+    st->bf.init(args, 1);
+    initid->ptr = reinterpret_cast<char *>(st);
     initid->maybe_null = 1;
     return 0;
 }
 
+void
+cryptdb_decrypt_int_sem_deinit(UDF_INIT *const initid)
+{
+    delete reinterpret_cast<decrypt_int_state *>(initid->ptr);
+}
+
 ulonglong
 cryptdb_decrypt_int_sem(UDF_INIT *const initid, UDF_ARGS *const args,
                         char *const is_null, char *const error)
@@ -183,16 +262,12 @@ cryptdb_decrypt_int_sem(UDF_INIT *const initid, UDF_ARGS *const args,
         *is_null = 1;
     } else {
         try {
+            decrypt_int_state *const st =
+                reinterpret_cast<decrypt_int_state *>(initid->ptr);
             const uint64_t eValue = getui(args, 0);
-
-            uint64_t keyLen;
-            char *const keyBytes = getba(args, 1, keyLen);
-            const std::string key = std::string(keyBytes, keyLen);
-
             const uint64_t salt = getui(args, 2);
 
-            blowfish bf(key);
-            value = bf.decrypt(eValue) ^ salt;
+            value = st->bf.get(args, 1)->decrypt(eValue) ^ salt;
         } catch (const CryptoError &e) {
             std::cerr << e.msg << std::endl;
             value = 0;
@@ -219,10 +294,19 @@ cryptdb_decrypt_int_det_init(UDF_INIT *const initid, UDF_ARGS *const args,
         return 1;
     }
 
+    decrypt_int_state *const st = new decrypt_int_state();
+    st->bf.init(args, 1);
+    initid->ptr = reinterpret_cast<char *>(st);
     initid->maybe_null = 1;
     return 0;
 }
 
+void
+cryptdb_decrypt_int_det_deinit(UDF_INIT *const initid)
+{
+    delete reinterpret_cast<decrypt_int_state *>(initid->ptr);
+}
+
 ulonglong
 cryptdb_decrypt_int_det(UDF_INIT *const initid, UDF_ARGS *const args,
                         char *const is_null, char *const error)
@@ -233,14 +317,11 @@ cryptdb_decrypt_int_det(UDF_INIT *const initid, UDF_ARGS *const args,
         *is_null = 1;
     } else {
         try {
+            decrypt_int_state *const st =
+                reinterpret_cast<decrypt_int_state *>(initid->ptr);
             const uint64_t eValue = getui(args, 0);
 
-            uint64_t keyLen;
-            char *const keyBytes = getba(args, 1, keyLen);
-            const std::string key = std::string(keyBytes, keyLen);
-
-            blowfish bf(key);
-            value = bf.decrypt(eValue);
+            value = st->bf.get(args, 1)->decrypt(eValue);
         } catch (const CryptoError &e) {
             std::cerr << e.msg << std::endl;
             value = 0;
@@ -265,6 +346,9 @@ cryptdb_decrypt_text_sem_init(UDF_INIT *const initid, UDF_ARGS *const args,
         return 1;
     }
 
+    decrypt_text_state *const st = new decrypt_text_state();
+    st->aes.init(args, 1);
+    initid->ptr = reinterpret_cast<char *>(st);
     initid->maybe_null = 1;
     return 0;
 }
@@ -272,12 +356,7 @@ cryptdb_decrypt_text_sem_init(UDF_INIT *const initid, UDF_ARGS *const args,
 void
 cryptdb_decrypt_text_sem_deinit(UDF_INIT *const initid)
 {
-    /*
-     * in mysql-server/sql/item_func.cc, udf_handler::fix_fields
-     * initializes initid.ptr=0 for us.
-     */
-    if (initid->ptr)
-        delete[] initid->ptr;
+    delete reinterpret_cast<decrypt_text_state *>(initid->ptr);
 }
 
 char *
@@ -285,39 +364,32 @@ cryptdb_decrypt_text_sem(UDF_INIT *const initid, UDF_ARGS *const args,
                          char *const result, unsigned long *const length,
                          char *const is_null, char *const error)
 {
-    AssignFirst<std::string> value;
+    decrypt_text_state *const st =
+        reinterpret_cast<decrypt_text_state *>(initid->ptr);
     if (NULL == args->args[0]) {
-        value = "";
+        *length = 0;
         *is_null = 1;
-    } else {
-        try {
-            uint64_t eValueLen;
-            char *const eValueBytes = getba(args, 0, eValueLen);
-
-            uint64_t keyLen;
-            char *const keyBytes = getba(args, 1, keyLen);
-            const std::string &key = std::string(keyBytes, keyLen);
-
-            const uint64_t salt = getui(args, 2);
-
-            const std::unique_ptr<AES_KEY> aesKey(get_AES_dec_key(key));
-            value =
-                decrypt_SEM(reinterpret_cast<unsigned char *>(eValueBytes),
-                            eValueLen, aesKey.get(), salt);
-        } catch (const CryptoError &e) {
-            std::cerr << e.msg << std::endl;
-            value = "";
-        }
+        return NULL;
     }
 
-    // NOTE: This is not creating a proper C string, no guarentee of NUL
-    // termination.
-    char *const res = new char[value.get().length()];
-    initid->ptr = res;
-    memcpy(res, value.get().data(), value.get().length());
-    *length = value.get().length();
-
-    return static_cast<char*>(initid->ptr);
+    try {
+        uint64_t eValueLen;
+        char *const eValueBytes = getba(args, 0, eValueLen);
+
+        const uint64_t salt = getui(args, 2);
+
+        // the plaintext is never longer than the ciphertext
+        char *const out = st->res.get(result, eValueLen);
+        *length =
+            decrypt_SEM(reinterpret_cast<unsigned char *>(eValueBytes),
+                        eValueLen, *st->aes.get(args, 1), salt,
+                        reinterpret_cast<unsigned char *>(out));
+        return out;
+    } catch (const CryptoError &e) {
+        std::cerr << e.msg << std::endl;
+        *length = 0;
+        return result;
+    }
 }
 
 
@@ -333,6 +405,9 @@ cryptdb_decrypt_text_det_init(UDF_INIT *const initid, UDF_ARGS *const args,
         return 1;
     }
 
+    decrypt_text_state *const st = new decrypt_text_state();
+    st->aes.init(args, 1);
+    initid->ptr = reinterpret_cast<char *>(st);
     initid->maybe_null = 1;
     return 0;
 }
@@ -340,12 +415,7 @@ cryptdb_decrypt_text_det_init(UDF_INIT *const initid, UDF_ARGS *const args,
 void
 cryptdb_decrypt_text_det_deinit(UDF_INIT *const initid)
 {
-    /*
-     * in mysql-server/sql/item_func.cc, udf_handler::fix_fields
-     * initializes initid.ptr=0 for us.
-     */
-    if (initid->ptr)
-        delete[] initid->ptr;
+    delete reinterpret_cast<decrypt_text_state *>(initid->ptr);
 }
 
 char *
@@ -353,35 +423,29 @@ cryptdb_decrypt_text_det(UDF_INIT *const initid, UDF_ARGS *const args,
                          char *const result, unsigned long *const length,
                          char *const is_null, char *const error)
 {
-    AssignFirst<std::string> value;
+    decrypt_text_state *const st =
+        reinterpret_cast<decrypt_text_state *>(initid->ptr);
     if (NULL == args->args[0]) {
-        value = "";
+        *length = 0;
         *is_null = 1;
-    } else {
-        try {
-            uint64_t eValueLen;
-            char *const eValueBytes = getba(args, 0, eValueLen);
-
-            uint64_t keyLen;
-            char *const keyBytes = getba(args, 1, keyLen);
-            const std::string key = std::string(keyBytes, keyLen);
-
-            const std::unique_ptr<AES_KEY> aesKey(get_AES_dec_key(key));
-            value =
-                decrypt_AES_CMC(std::string(eValueBytes,
-                                    static_cast<unsigned int>(eValueLen)),
-                                aesKey.get(), true);
-        } catch (const CryptoError &e) {
-            std::cerr << e.msg << std::endl;
-            value = "";
-        }
+        return NULL;
     }
 
-    char *const res = new char[value.get().length()];
-    initid->ptr = res;
-    memcpy(res, value.get().data(), value.get().length());
-    *length = value.get().length();
-    return initid->ptr;
+    try {
+        uint64_t eValueLen;
+        char *const eValueBytes = getba(args, 0, eValueLen);
+
+        char *const out = st->res.get(result, eValueLen);
+        *length =
+            decrypt_AES_CMC(reinterpret_cast<unsigned char *>(eValueBytes),
+                            eValueLen, *st->aes.get(args, 1), true,
+                            reinterpret_cast<unsigned char *>(out));
+        return out;
+    } catch (const CryptoError &e) {
+        std::cerr << e.msg << std::endl;
+        *length = 0;
+        return result;
+    }
 }
 
 /*
@@ -405,7 +469,10 @@ cryptdb_searchSWP_init(UDF_INIT *const initid, UDF_ARGS *const args,
         return 1;
     }
 
-    Token *const t = new Token();
+    if (NULL == args->args[1] || NULL == args->args[2]) {
+        strcpy(message, "cryptdb_searchSWP: the token must be constant");
+        return 1;
+    }
 
     uint64_t ciphLen;
     char *const ciph = getba(args, 1, ciphLen);
@@ -413,10 +480,17 @@ cryptdb_searchSWP_init(UDF_INIT *const initid, UDF_ARGS *const args,
     uint64_t wordKeyLen;
     char *const wordKey = getba(args, 2, wordKeyLen);
 
-    t->ciph = std::string(ciph, ciphLen);
-    t->wordKey = std::string(wordKey, wordKeyLen);
+    Token t;
+    t.ciph = std::string(ciph, ciphLen);
+    t.wordKey = std::string(wordKey, wordKeyLen);
 
-    initid->ptr = reinterpret_cast<char *>(t);
+    try {
+        initid->ptr = reinterpret_cast<char *>(new SWPMatcher(t));
+    } catch (const CryptoError &e) {
+        snprintf(message, MYSQL_ERRMSG_SIZE, "cryptdb_searchSWP: %s",
+                 e.msg.c_str());
+        return 1;
+    }
 
     return 0;
 }
@@ -424,27 +498,44 @@ cryptdb_searchSWP_init(UDF_INIT *const initid, UDF_ARGS *const args,
 void
 cryptdb_searchSWP_deinit(UDF_INIT *const initid)
 {
-    Token *const t = reinterpret_cast<Token *>(initid->ptr);
-    delete t;
+    delete reinterpret_cast<SWPMatcher *>(initid->ptr);
 }
 
+/*
+ * The words of the field are matched where they lie in the row buffer,
+ * so a search costs about as much as reading the column.
+ */
 ulonglong
 cryptdb_searchSWP(UDF_INIT *const initid, UDF_ARGS *const args,
                   char *const is_null, char *const error)
 {
+    if (NULL == args->args[0])
+        return 0;
+
     uint64_t allciphLen;
     char *const allciph = getba(args, 0, allciphLen);
-    const std::string overallciph = std::string(allciph, allciphLen);
 
-    Token *const t = reinterpret_cast<Token *>(initid->ptr);
-
-    return search(*t, overallciph);
+    SWPMatcher *const m = reinterpret_cast<SWPMatcher *>(initid->ptr);
+    try {
+        return m->exists(reinterpret_cast<const uint8_t *>(allciph),
+                         allciphLen);
+    } catch (const CryptoError &e) {
+        std::cerr << e.msg << std::endl;
+        return 0;
+    }
 }
 
 
+/*
+ * The running product lives in Montgomery form in a fixed limb buffer,
+ * so adding a row allocates nothing; the modulus context is rebuilt only
+ * when a group brings a different N^2.
+ */
 struct agg_state {
-    ZZ sum;
-    ZZ n2;
+    std::unique_ptr<mont_mpn> mont;
+    std::string n2;                 /* bytes mont was built from */
+    std::vector<mp_limb_t> sum;
+    uint64_t nmul;                  /* ciphertexts folded into sum */
     bool n2_set;
     void *rbuf;
 };
@@ -462,6 +553,8 @@ cryptdb_agg_init(UDF_INIT *const initid, UDF_ARGS *const args,
     }
 
     agg_state *const as = new agg_state();
+    as->nmul = 0;
+    as->n2_set = 0;
     as->rbuf = malloc(Paillier_len_bytes);
     initid->ptr = reinterpret_cast<char *>(as);
     initid->maybe_null = 1;
@@ -482,7 +575,7 @@ void
 cryptdb_agg_clear(UDF_INIT *const initid, char *const is_null, char *const error)
 {
     agg_state *const as = reinterpret_cast<agg_state *>(initid->ptr);
-    as->sum = to_ZZ(1);
+    as->nmul = 0;
     as->n2_set = 0;
 }
 
@@ -491,29 +584,39 @@ my_bool
 cryptdb_agg_add(UDF_INIT *const initid, UDF_ARGS *const args,
                 char *const is_null, char *const error)
 {
-    //cerr << "in agg_add \n";
     agg_state *const as = reinterpret_cast<agg_state *>(initid->ptr);
-    if (!as->n2_set) {
-        //cerr << "n2 length is " << args->lengths[1] << "\n";
-        //cerr << "n2 first byte is " << (int)args->args[1][0] << "\n";
-        ZZFromBytes(as->n2,
-                    reinterpret_cast<const uint8_t *>(args->args[1]),
-                    args->lengths[1]);
-        //cerr << "n2 is " << as->n2 << "\n";
-        as->n2_set = 1;
-    }
+    try {
+        if (!as->n2_set) {
+            if (NULL == args->args[1]) {
+                *error = 1;
+                return true;
+            }
+
+            if (!as->mont
+                || as->n2.size() != args->lengths[1]
+                || memcmp(as->n2.data(), args->args[1], args->lengths[1])) {
+                as->n2.assign(args->args[1], args->lengths[1]);
+                as->mont.reset(new mont_mpn(
+                    reinterpret_cast<const uint8_t *>(as->n2.data()),
+                    as->n2.size()));
+                as->sum.resize(as->mont->nlimbs());
+            }
+            as->mont->one(as->sum.data());
+            as->n2_set = 1;
+        }
 
-    ZZ e;
-    if (NULL == args->args[0]) {
-        e = to_ZZ(1);
-    } else {
-        ZZFromBytes(e, reinterpret_cast<const uint8_t *>(args->args[0]),
-                    args->lengths[0]);
+        // a NULL element multiplies by 1
+        if (NULL != args->args[0]) {
+            as->mont->mul_bytes(as->sum.data(),
+                reinterpret_cast<const uint8_t *>(args->args[0]),
+                args->lengths[0]);
+            as->nmul++;
+        }
+    } catch (const CryptoError &e) {
+        std::cerr << e.msg << std::endl;
+        *error = 1;
     }
 
-    //cerr << "element to add " << e << "\n";
-    MulMod(as->sum, as->sum, e, as->n2);
-    //cerr << "sum so far " << as->sum << "\n";
     return true;
 }
 
@@ -522,8 +625,15 @@ cryptdb_agg(UDF_INIT *const initid, UDF_ARGS *const args, char *const result,
             unsigned long *const length, char *const is_null, char *const error)
 {
     agg_state *const as = reinterpret_cast<agg_state *>(initid->ptr);
-    BytesFromZZ(static_cast<uint8_t *>(as->rbuf), as->sum,
-                Paillier_len_bytes);
+    uint8_t *const rbuf = static_cast<uint8_t *>(as->rbuf);
+    if (!as->n2_set) {
+        // empty group: the encryption of 0 with r = 1
+        memset(rbuf, 0, Paillier_len_bytes);
+        rbuf[0] = 1;
+    } else {
+        as->mont->from_mont(as->sum.data(), as->nmul);
+        as->mont->to_bytes(as->sum.data(), rbuf, Paillier_len_bytes);
+    }
     *length = Paillier_len_bytes;
     return static_cast<char *>(as->rbuf);
 }
@@ -531,6 +641,35 @@ cryptdb_agg(UDF_INIT *const initid, UDF_ARGS *const args, char *const result,
 // for update with increment
 // > UNUSED
 
+/*
+ * GMP integers keep their limbs between rows, so once they have grown
+ * to the size of N^2 a row allocates nothing.  The byte order is that
+ * of ZZFromBytes/BytesFromZZ.
+ */
+struct add_set_state {
+    add_set_state() {
+        mpz_init(field);
+        mpz_init(val);
+        mpz_init(n2);
+        mpz_init(res);
+    }
+    ~add_set_state() {
+        mpz_clear(field);
+        mpz_clear(val);
+        mpz_clear(n2);
+        mpz_clear(res);
+    }
+
+    mpz_t field, val, n2, res;
+    result_buf out;
+};
+
+static void
+mpz_from_bytes(mpz_t z, const char *const bytes, unsigned long len)
+{
+    mpz_import(z, len, -1, 1, 0, 0, bytes);
+}
+
 my_bool
 cryptdb_func_add_set_init(UDF_INIT *const initid, UDF_ARGS *const args,
                           char *const message)
@@ -544,16 +683,14 @@ cryptdb_func_add_set_init(UDF_INIT *const initid, UDF_ARGS *const args,
         return 1;
     }
 
+    initid->ptr = reinterpret_cast<char *>(new add_set_state());
     return 0;
 }
 
 void
 cryptdb_func_add_set_deinit(UDF_INIT *const initid)
 {
-    if (initid->ptr) {
-        free(initid->ptr);
-        initid->ptr = NULL;
-    }
+    delete reinterpret_cast<add_set_state *>(initid->ptr);
 }
 
 char *
@@ -561,39 +698,36 @@ cryptdb_func_add_set(UDF_INIT *const initid, UDF_ARGS *const args,
                      char *const result, unsigned long *const length,
                      char *const is_null, char *const error)
 {
-    if (initid->ptr) {
-        free(initid->ptr);
-        initid->ptr = NULL;
-    }
-
-    AssignOnce<uint64_t> out_len;
-    ZZ res;
+    add_set_state *const st = reinterpret_cast<add_set_state *>(initid->ptr);
     if (NULL == args->args[0] || NULL == args->args[1]) {
-        out_len = 0;
+        *length = 0;
         *is_null = 1;
-        res = 0;
-    } else {
-        out_len = args->lengths[2];
-
-        ZZ field, val, n2;
-        ZZFromBytes(field,
-                    reinterpret_cast<const uint8_t *>(args->args[0]),
-                    args->lengths[0]);
-        ZZFromBytes(val, reinterpret_cast<const uint8_t *>(args->args[1]),
-                    args->lengths[1]);
-        ZZFromBytes(n2, reinterpret_cast<const uint8_t *>(args->args[2]),
-                    args->lengths[2]);
-
-        MulMod(res, field, val, n2);
+        return NULL;
+    }
+
+    const unsigned long out_len = args->lengths[2];
+    char *out;
+    try {
+        out = st->out.get(result, out_len);
+    } catch (const CryptoError &e) {
+        std::cerr << e.msg << std::endl;
+        *error = 1;
+        return NULL;
     }
 
-    void *const rbuf = malloc(static_cast<size_t>(out_len.get()));
-    initid->ptr = static_cast<char *>(rbuf);
-    BytesFromZZ(static_cast<uint8_t *>(rbuf), res,
-                static_cast<size_t>(out_len.get()));
+    mpz_from_bytes(st->field, args->args[0], args->lengths[0]);
+    mpz_from_bytes(st->val, args->args[1], args->lengths[1]);
+    mpz_from_bytes(st->n2, args->args[2], args->lengths[2]);
+
+    mpz_mul(st->res, st->field, st->val);
+    mpz_mod(st->res, st->res, st->n2);
 
-    *length = static_cast<long unsigned int>(out_len.get());
-    return initid->ptr;
+    // the product is below N^2, so it fits in out_len bytes
+    memset(out, 0, out_len);
+    mpz_export(out, NULL, -1, 1, 0, 0, st->res);
+
+    *length = out_len;
+    return out;
 }
 
 my_bool
@@ -608,23 +742,15 @@ cryptdb_version_init(UDF_INIT *const initid, UDF_ARGS *const args,
     return 0;
 }
 
-void
-cryptdb_version_deinit(UDF_INIT *const initid)
-{
-    if (initid->ptr)
-        delete[] initid->ptr;
-}
-
 char *
 cryptdb_version(UDF_INIT *const initid, UDF_ARGS *const args,
                 char *const result, unsigned long *const length,
                 char *const is_null, char *const error)
 {
-    const std::string value(cryptdb_version_string);
-    char *const res = new char[value.length()];
-    initid->ptr = res;
-    memcpy(res, value.data(), value.length());
-    *length = value.length();
+    const unsigned long len =
+        std::min(strlen(cryptdb_version_string), mysql_result_bytes);
+    memcpy(result, cryptdb_version_string, len);
+    *length = len;
 
-    return static_cast<char*>(initid->ptr);
+    return result;
 }
@@ -0,0 +1,461 @@
+/*
+ * Drives the UDFs in edb.cc the way the server does: _init with the
+ * constant arguments filled in, one call per row, then _deinit.  It
+ * checks that the per-row paths do not allocate, then times the
+ * decryption UDFs over the given number of rows.
+ *
+ * Usage: udftest [rows]
+ */
+
+#include <iostream>
+#include <memory>
+#include <stdlib.h>
+#include <string.h>
+
+#include <crypto/BasicCrypto.hh>
+#include <crypto/blowfish.hh>
+#include <crypto/prng.hh>
+#include <util/timer.hh>
+#include <util/util.hh>
+
+using namespace std;
+
+extern "C" {
+
+typedef unsigned long long ulonglong;
+typedef long long longlong;
+#include <mysql/mysql.h>
+
+my_bool   cryptdb_decrypt_int_sem_init(UDF_INIT *const initid,
+                                       UDF_ARGS *const args,
+                                       char *const message);
+void      cryptdb_decrypt_int_sem_deinit(UDF_INIT *const initid);
+ulonglong cryptdb_decrypt_int_sem(UDF_INIT *const initid,
+                                  UDF_ARGS *const args,
+                                  char *const is_null, char *const error);
+
+my_bool   cryptdb_decrypt_int_det_init(UDF_INIT *const initid,
+                                       UDF_ARGS *const args,
+                                       char *const message);
+void      cryptdb_decrypt_int_det_deinit(UDF_INIT *const initid);
+ulonglong cryptdb_decrypt_int_det(UDF_INIT *const initid, UDF_ARGS *const args,
+                                  char *const is_null, char *const error);
+
+my_bool   cryptdb_decrypt_text_sem_init(UDF_INIT *const initid,
+                                        UDF_ARGS *const args, char *const message);
+void      cryptdb_decrypt_text_sem_deinit(UDF_INIT *const initid);
+char *    cryptdb_decrypt_text_sem(UDF_INIT *const initid, UDF_ARGS *const args,
+                                   char *const result, unsigned long *const length,
+                                   char *const is_null, char *const error);
+
+my_bool   cryptdb_decrypt_text_det_init(UDF_INIT *const initid,
+                                        UDF_ARGS *const args,
+                                        char *const message);
+void      cryptdb_decrypt_text_det_deinit(UDF_INIT *const initid);
+char *    cryptdb_decrypt_text_det(UDF_INIT *const initid, UDF_ARGS *const args,
+                                   char *const result, unsigned long *const length,
+                                   char *const is_null, char *const error);
+
+my_bool   cryptdb_func_add_set_init(UDF_INIT *const initid, UDF_ARGS *const args,
+                                    char *const message);
+void      cryptdb_func_add_set_deinit(UDF_INIT *const initid);
+char *    cryptdb_func_add_set(UDF_INIT *const initid, UDF_ARGS *const args,
+                               char *const result, unsigned long *const length,
+                               char *const is_null, char *const error);
+
+my_bool   cryptdb_version_init(UDF_INIT *const initid, UDF_ARGS *const args,
+                               char *const message);
+char *    cryptdb_version(UDF_INIT *const initid, UDF_ARGS *const args,
+                          char *const result, unsigned long *const length,
+                          char *const is_null, char *const error);
+
+void *__libc_malloc(size_t n);
+void *__libc_calloc(size_t nmemb, size_t n);
+void *__libc_realloc(void *p, size_t n);
+} /* extern "C" */
+
+/*
+ * Every allocation of the process, including those of libstdc++,
+ * OpenSSL, NTL and GMP, ends up in one of these; they are counted while
+ * counting is set.
+ */
+static bool counting;
+static uint64_t nallocs;
+
+void *
+malloc(size_t n) throw()
+{
+    if (counting)
+        nallocs++;
+    return __libc_malloc(n);
+}
+
+void *
+calloc(size_t nmemb, size_t n) throw()
+{
+    if (counting)
+        nallocs++;
+    return __libc_calloc(nmemb, n);
+}
+
+void *
+realloc(void *p, size_t n) throw()
+{
+    if (counting)
+        nallocs++;
+    return __libc_realloc(p, n);
+}
+
+/*
+ * Argument block of one UDF invocation.  set() points an argument at
+ * caller-owned storage, which must outlive the calls.
+ */
+struct udf_call {
+    static const unsigned int maxargs = 4;
+
+    udf_call(unsigned int nargs) {
+        memset(&initid, 0, sizeof(initid));
+        memset(&args, 0, sizeof(args));
+        args.arg_count = nargs;
+        args.arg_type = types;
+        args.args = ptrs;
+        args.lengths = lengths;
+        args.maybe_null = maybe_null;
+        for (unsigned int i = 0; i < maxargs; i++) {
+            ptrs[i] = NULL;
+            lengths[i] = 0;
+            maybe_null[i] = 0;
+        }
+    }
+
+    void set(unsigned int i, const string &s) {
+        types[i] = STRING_RESULT;
+        ptrs[i] = const_cast<char *>(s.data());
+        lengths[i] = s.size();
+    }
+
+    void set(unsigned int i, const ulonglong *v) {
+        types[i] = INT_RESULT;
+        ptrs[i] = reinterpret_cast<char *>(const_cast<ulonglong *>(v));
+        lengths[i] = sizeof(*v);
+    }
+
+    UDF_INIT initid;
+    UDF_ARGS args;
+    Item_result types[maxargs];
+    char *ptrs[maxargs];
+    unsigned long lengths[maxargs];
+    char maybe_null[maxargs];
+    char message[512];
+    char result[255];
+    char is_null;
+    char error;
+};
+
+/*
+ * Runs one row to let the UDF size its buffers, then fails if any of
+ * the following rows allocates.
+ */
+template<class F>
+static void
+check_no_allocs(const string &name, F row)
+{
+    row();
+
+    const uint64_t nrows = 1000;
+    nallocs = 0;
+    counting = true;
+    for (uint64_t i = 0; i < nrows; i++)
+        row();
+    counting = false;
+
+    if (nallocs) {
+        cerr << name << ": " << nallocs << " allocations in " << nrows
+             << " rows" << endl;
+        throw_c(false);
+    }
+    cout << name << " allocation-free ok" << endl;
+}
+
+static void
+test_alloc_int(const string &key)
+{
+    const ulonglong pt = 0x1234567890abcdefULL;
+    const ulonglong salt = 0x5555aaaa5555aaaaULL;
+    const ulonglong det = blowfish(key).encrypt(pt);
+    const ulonglong sem = blowfish(key).encrypt(pt ^ salt);
+
+    udf_call d(2);
+    d.set(0, &det);
+    d.set(1, key);
+    throw_c(!cryptdb_decrypt_int_det_init(&d.initid, &d.args, d.message));
+    check_no_allocs("cryptdb_decrypt_int_det", [&]() {
+        throw_c(pt == cryptdb_decrypt_int_det(&d.initid, &d.args,
+                                              &d.is_null, &d.error));
+    });
+    cryptdb_decrypt_int_det_deinit(&d.initid);
+
+    udf_call s(3);
+    s.set(0, &sem);
+    s.set(1, key);
+    s.set(2, &salt);
+    throw_c(!cryptdb_decrypt_int_sem_init(&s.initid, &s.args, s.message));
+    check_no_allocs("cryptdb_decrypt_int_sem", [&]() {
+        throw_c(pt == cryptdb_decrypt_int_sem(&s.initid, &s.args,
+                                              &s.is_null, &s.error));
+    });
+    cryptdb_decrypt_int_sem_deinit(&s.initid);
+}
+
+/*
+ * A short plaintext is returned in the server's result buffer, a long
+ * one in the UDF's own buffer.
+ */
+static void
+test_alloc_text(const string &key, const string &pt)
+{
+    const unique_ptr<AES_KEY> ek(get_AES_enc_key(key));
+    const ulonglong salt = 0x5555aaaa5555aaaaULL;
+    const string det = encrypt_AES_CMC(pt, ek.get(), true);
+    const string sem = encrypt_AES_CBC(pt, ek.get(),
+                                       BytesFromInt(salt, SALT_LEN_BYTES),
+                                       true);
+    const string size = " (" + to_string(pt.size()) + " bytes)";
+
+    udf_call d(2);
+    d.set(0, det);
+    d.set(1, key);
+    throw_c(!cryptdb_decrypt_text_det_init(&d.initid, &d.args, d.message));
+    check_no_allocs("cryptdb_decrypt_text_det" + size, [&]() {
+        unsigned long len;
+        const char *const r =
+            cryptdb_decrypt_text_det(&d.initid, &d.args, d.result, &len,
+                                     &d.is_null, &d.error);
+        throw_c(len == pt.size() && !memcmp(r, pt.data(), len));
+    });
+    cryptdb_decrypt_text_det_deinit(&d.initid);
+
+    udf_call s(3);
+    s.set(0, sem);
+    s.set(1, key);
+    s.set(2, &salt);
+    throw_c(!cryptdb_decrypt_text_sem_init(&s.initid, &s.args, s.message));
+    check_no_allocs("cryptdb_decrypt_text_sem" + size, [&]() {
+        unsigned long len;
+        const char *const r =
+            cryptdb_decrypt_text_sem(&s.initid, &s.args, s.result, &len,
+                                     &s.is_null, &s.error);
+        throw_c(len == pt.size() && !memcmp(r, pt.data(), len));
+    });
+    cryptdb_decrypt_text_sem_deinit(&s.initid);
+}
+
+static void
+test_alloc_add_set(urandom *u)
+{
+    // a 2048-bit N^2 does not fit the server's result buffer
+    string n2 = u->rand_string(256);
+    n2[n2.size() - 1] |= 0x80;
+    const string a("\x02", 1), b("\x03", 1);
+
+    udf_call c(3);
+    c.set(0, a);
+    c.set(1, b);
+    c.set(2, n2);
+    throw_c(!cryptdb_func_add_set_init(&c.initid, &c.args, c.message));
+    check_no_allocs("cryptdb_func_add_set", [&]() {
+        unsigned long len;
+        const char *const r =
+            cryptdb_func_add_set(&c.initid, &c.args, c.result, &len,
+                                 &c.is_null, &c.error);
+        throw_c(len == n2.size() && 6 == r[0]);
+    });
+    cryptdb_func_add_set_deinit(&c.initid);
+}
+
+static void
+test_alloc_version()
+{
+    udf_call c(0);
+    throw_c(!cryptdb_version_init(&c.initid, &c.args, c.message));
+    check_no_allocs("cryptdb_version", [&]() {
+        unsigned long len;
+        cryptdb_version(&c.initid, &c.args, c.result, &len,
+                        &c.is_null, &c.error);
+        throw_c(len > 0);
+    });
+}
+
+static void
+report(const string &name, const string &mode, uint64_t usec, uint64_t rows)
+{
+    cout << name << " (" << mode << " key): " << usec << " usec for "
+         << rows << " rows, " << (usec * 1000.0 / rows) << " ns/row" << endl;
+}
+
+/*
+ * The key is either a constant (visible to _init) or a column whose
+ * value changes on every row, which was the cost of every row before
+ * key schedules were cached.
+ */
+static void
+bench_int_det(const string keys[2], uint64_t rows, bool constant)
+{
+    const ulonglong pt = 0x1234567890abcdefULL;
+    ulonglong ct[2];
+    for (int k = 0; k < 2; k++)
+        ct[k] = blowfish(keys[k]).encrypt(pt);
+
+    udf_call c(2);
+    c.set(0, &ct[0]);
+    if (constant)
+        c.set(1, keys[0]);
+    else
+        c.args.arg_type[1] = STRING_RESULT;
+    throw_c(!cryptdb_decrypt_int_det_init(&c.initid, &c.args, c.message));
+
+    timer t;
+    for (uint64_t i = 0; i < rows; i++) {
+        const int k = constant ? 0 : (i & 1);
+        c.set(0, &ct[k]);
+        c.set(1, keys[k]);
+        c.is_null = c.error = 0;
+        throw_c(pt == cryptdb_decrypt_int_det(&c.initid, &c.args,
+                                              &c.is_null, &c.error));
+    }
+    report("cryptdb_decrypt_int_det", constant ? "constant" : "varying",
+           t.lap(), rows);
+
+    cryptdb_decrypt_int_det_deinit(&c.initid);
+}
+
+static void
+bench_int_sem(const string keys[2], uint64_t rows, bool constant)
+{
+    const ulonglong pt = 0x1234567890abcdefULL;
+    const ulonglong salt = 0x5555aaaa5555aaaaULL;
+    ulonglong ct[2];
+    for (int k = 0; k < 2; k++)
+        ct[k] = blowfish(keys[k]).encrypt(pt ^ salt);
+
+    udf_call c(3);
+    c.set(0, &ct[0]);
+    if (constant)
+        c.set(1, keys[0]);
+    else
+        c.args.arg_type[1] = STRING_RESULT;
+    c.set(2, &salt);
+    throw_c(!cryptdb_decrypt_int_sem_init(&c.initid, &c.args, c.message));
+
+    timer t;
+    for (uint64_t i = 0; i < rows; i++) {
+        const int k = constant ? 0 : (i & 1);
+        c.set(0, &ct[k]);
+        c.set(1, keys[k]);
+        c.is_null = c.error = 0;
+        throw_c(pt == cryptdb_decrypt_int_sem(&c.initid, &c.args,
+                                              &c.is_null, &c.error));
+    }
+    report("cryptdb_decrypt_int_sem", constant ? "constant" : "varying",
+           t.lap(), rows);
+
+    cryptdb_decrypt_int_sem_deinit(&c.initid);
+}
+
+static void
+bench_text_det(const string keys[2], uint64_t rows, bool constant)
+{
+    const string pt = "the quick brown fox jumps over the lazy dog";
+    string ct[2];
+    for (int k = 0; k < 2; k++) {
+        const unique_ptr<AES_KEY> ek(get_AES_enc_key(keys[k]));
+        ct[k] = encrypt_AES_CMC(pt, ek.get(), true);
+    }
+
+    udf_call c(2);
+    c.set(0, ct[0]);
+    if (constant)
+        c.set(1, keys[0]);
+    else
+        c.args.arg_type[1] = STRING_RESULT;
+    throw_c(!cryptdb_decrypt_text_det_init(&c.initid, &c.args, c.message));
+
+    timer t;
+    for (uint64_t i = 0; i < rows; i++) {
+        const int k = constant ? 0 : (i & 1);
+        c.set(0, ct[k]);
+        c.set(1, keys[k]);
+        c.is_null = c.error = 0;
+        unsigned long len;
+        const char *const r =
+            cryptdb_decrypt_text_det(&c.initid, &c.args, c.result, &len,
+                                     &c.is_null, &c.error);
+        throw_c(len == pt.size() && !memcmp(r, pt.data(), len));
+    }
+    report("cryptdb_decrypt_text_det", constant ? "constant" : "varying",
+           t.lap(), rows);
+
+    cryptdb_decrypt_text_det_deinit(&c.initid);
+}
+
+static void
+bench_text_sem(const string keys[2], uint64_t rows, bool constant)
+{
+    const string pt = "the quick brown fox jumps over the lazy dog";
+    const ulonglong salt = 0x5555aaaa5555aaaaULL;
+    string ct[2];
+    for (int k = 0; k < 2; k++) {
+        const unique_ptr<AES_KEY> ek(get_AES_enc_key(keys[k]));
+        ct[k] = encrypt_AES_CBC(pt, ek.get(),
+                                BytesFromInt(salt, SALT_LEN_BYTES), true);
+    }
+
+    udf_call c(3);
+    c.set(0, ct[0]);
+    if (constant)
+        c.set(1, keys[0]);
+    else
+        c.args.arg_type[1] = STRING_RESULT;
+    c.set(2, &salt);
+    throw_c(!cryptdb_decrypt_text_sem_init(&c.initid, &c.args, c.message));
+
+    timer t;
+    for (uint64_t i = 0; i < rows; i++) {
+        const int k = constant ? 0 : (i & 1);
+        c.set(0, ct[k]);
+        c.set(1, keys[k]);
+        c.is_null = c.error = 0;
+        unsigned long len;
+        const char *const r =
+            cryptdb_decrypt_text_sem(&c.initid, &c.args, c.result, &len,
+                                     &c.is_null, &c.error);
+        throw_c(len == pt.size() && !memcmp(r, pt.data(), len));
+    }
+    report("cryptdb_decrypt_text_sem", constant ? "constant" : "varying",
+           t.lap(), rows);
+
+    cryptdb_decrypt_text_sem_deinit(&c.initid);
+}
+
+int
+main(int ac, char **av)
+{
+    const uint64_t rows = ac > 1 ? strtoull(av[1], NULL, 10) : 10000000;
+
+    urandom u;
+    const string keys[2] = { u.rand_string(AES_KEY_BYTES),
+                             u.rand_string(AES_KEY_BYTES) };
+
+    test_alloc_int(keys[0]);
+    test_alloc_text(keys[0], "the quick brown fox jumps over the lazy dog");
+    test_alloc_text(keys[0], u.rand_string(1000));
+    test_alloc_add_set(&u);
+    test_alloc_version();
+
+    for (int constant = 1; constant >= 0; constant--) {
+        bench_int_det(keys, rows, constant);
+        bench_int_sem(keys, rows, constant);
+        bench_text_det(keys, rows, constant);
+        bench_text_sem(keys, rows, constant);
+    }
+}
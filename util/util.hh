@@ -296,9 +296,11 @@ roll(typename std::list<T>::iterator & it,  int count)
     }
 }
 
-template<typename A, typename B>
-const B &constGetAssert(const std::map<A, B> &m, const A &x,
-                        const std::string &str = "")
+// for std::map and the like
+template<typename M>
+const typename M::mapped_type &
+constGetAssert(const M &m, const typename M::key_type &x,
+               const std::string &str = "")
 {
     auto it = m.find(x);
     if (m.end() == it) {
@@ -309,11 +311,12 @@ const B &constGetAssert(const std::map<A, B> &m, const A &x,
     return it->second;
 }
 
-template<typename A, typename B>
-B &getAssert(std::map<A, B> &m, const A &x,
-             const std::string &str = "")
+template<typename M>
+typename M::mapped_type &
+getAssert(M &m, const typename M::key_type &x,
+          const std::string &str = "")
 {
-    return const_cast<B &>(constGetAssert(m, x, str));
+    return const_cast<typename M::mapped_type &>(constGetAssert(m, x, str));
 }
 
 //returns true if x is in m and sets y=m[x] in that case